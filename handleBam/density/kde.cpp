@@ -13,6 +13,7 @@
 #include <fstream>
 #include <functional>
 #include <iostream>
+#include <mutex>
 #include <stdint.h>
 #include <stdlib.h>
 #include <string>  // can delete
@@ -33,20 +34,58 @@ void KDE::initialization()
 
 void KDE::readData()
 {
-    string fname;
-    int    data;
+    string           fname;
+    int              data;
+    vector< double > values;
     fname = "testdata.csv";
     ifstream readfile(fname);
     while (readfile >> data)
     {  // assume the input has been preprocessed to eliminate NA or infinite items
-        data_array.push_back(log10(
-            data));  // we log10-transform the data (detransform would only take place after this module to save time)
+        values.push_back(data);
     }
     readfile.close();
-    N = data_array.size();
+    // we log10-transform the data (detransform would only take place after this module to save time)
+    N = 0;
+    for (auto& [v, c] : histogram(values))
+    {
+        data_hist.emplace_back(log10(v), c);
+        N += c;
+    }
     filter();
 }
 
+// The transforms are of the same size in every run, so the plans and their buffers
+// are made once and shared. The planner of fftw is not thread safe, and the buffers
+// are shared, so a transform holds the lock.
+struct FftPlans
+{
+    int           size;
+    fftw_complex *in, *out;
+    fftw_plan     forward, backward;
+};
+static std::mutex fft_mutex;
+
+static FftPlans& fftPlans(int size)
+{
+    static FftPlans plans = { 0, nullptr, nullptr, nullptr, nullptr };
+    if (plans.size != size)
+    {
+        if (plans.size != 0)
+        {
+            fftw_destroy_plan(plans.forward);
+            fftw_destroy_plan(plans.backward);
+            fftw_free(plans.in);
+            fftw_free(plans.out);
+        }
+        plans.size     = size;
+        plans.in       = ( fftw_complex* )fftw_malloc(sizeof(fftw_complex) * size);
+        plans.out      = ( fftw_complex* )fftw_malloc(sizeof(fftw_complex) * size);
+        plans.forward  = fftw_plan_dft_1d(size, plans.in, plans.out, FFTW_FORWARD, FFTW_ESTIMATE);
+        plans.backward = fftw_plan_dft_1d(size, plans.in, plans.out, FFTW_BACKWARD, FFTW_ESTIMATE);
+    }
+    return plans;
+}
+
 void KDE::fft()
 {
     int           i, Num = 2 * n;
@@ -54,19 +93,16 @@ void KDE::fft()
     double        xhi  = max + 4 * bw;
     double        diff = 2 * (xhi - xlo) / (Num - 1);
     double        Temp;
-    fftw_complex* in;
-    fftw_complex *temp_out, *y_fft, *kords_fft;
-    fftw_plan     p;
-    // in        = ( fftw_complex* )fftw_malloc(sizeof(fftw_complex) * Num);
-    y_fft     = ( fftw_complex* )fftw_malloc(sizeof(fftw_complex) * Num);
-    kords_fft = ( fftw_complex* )fftw_malloc(sizeof(fftw_complex) * Num);
-    temp_out  = ( fftw_complex* )fftw_malloc(sizeof(fftw_complex) * Num);
+    fftw_complex *in, *temp_out, *y_fft;
 
-    in = bindist();  // "in" is actually in_y here.
+    std::lock_guard< std::mutex > lock(fft_mutex);
+    FftPlans&                     plans = fftPlans(Num);
+    in                                  = plans.in;
+    temp_out                            = plans.out;
+    y_fft                               = ( fftw_complex* )fftw_malloc(sizeof(fftw_complex) * Num);
 
-    p = fftw_plan_dft_1d(Num, in, temp_out, FFTW_FORWARD,
-                         FFTW_ESTIMATE);  // I cannot put it before "in = bindist()" but anyway.
-    fftw_execute(p);                      // Calculate fft(y).
+    bindist(in);  // "in" is actually in_y here.
+    fftw_execute(plans.forward);  // Calculate fft(y).
 
     memcpy(y_fft, temp_out, sizeof(fftw_complex) * Num);
 
@@ -81,18 +117,16 @@ void KDE::fft()
         in[i][0] = in[Num - i][0];
         in[i][1] = 0;
     }
-    fftw_execute_dft(p, in, temp_out);  // calculate fft(kords)
+    fftw_execute(plans.forward);  // calculate fft(kords)
 
     for (i = 0; i < Num; i++)
     {
-        kords_fft[i][0] = temp_out[i][0] * y_fft[i][0] + temp_out[i][1] * y_fft[i][1];
-        kords_fft[i][1] = temp_out[i][0] * y_fft[i][1]
-                          - temp_out[i][1] * y_fft[i][0];  // let kords_fft equals to "fft(y)*Conj(fft(kords))"
+        in[i][0] = temp_out[i][0] * y_fft[i][0] + temp_out[i][1] * y_fft[i][1];
+        in[i][1] = temp_out[i][0] * y_fft[i][1]
+                   - temp_out[i][1] * y_fft[i][0];  // let in equals to "fft(y)*Conj(fft(kords))"
     }
 
-    p = fftw_plan_dft_1d(Num, kords_fft, temp_out, FFTW_BACKWARD, FFTW_ESTIMATE);
-
-    fftw_execute(p);
+    fftw_execute(plans.backward);
 
     double diff_new = (xhi - xlo) / (n - 1);
     for (i = 0; i < n; i++)
@@ -108,11 +142,7 @@ void KDE::fft()
     }
     saveFile.close();
     */
-    fftw_destroy_plan(p);
-    fftw_free(in);
     fftw_free(y_fft);
-    fftw_free(temp_out);
-    fftw_free(kords_fft);
 }
 
 void KDE::writeData()
@@ -173,19 +203,12 @@ pair< double, double > KDE::get_density_threshold(string type)
 void KDE::filter()
 {
     double threshold = get_min_mode() - 3;  // we have initially done the log10 transform, so '* 0.001' becomes '- 3'.
-    while (!data_array.empty())
-    {
-        if (data_array.back() <= threshold)
-        {
-            data_array.pop_back();
-        }
-        else
-        {
-            break;
-        }
-    }
-    min = data_array.back();
-    max = data_array.front();
+    size_t skip      = 0;
+    while (skip < data_hist.size() && data_hist[skip].first <= threshold)
+        ++skip;
+    data_hist.erase(data_hist.begin(), data_hist.begin() + skip);
+    min = data_hist.front().first;
+    max = data_hist.back().first;
     //	cout << threshold << ' ' << min << ' ' << max << endl;
 }
 
@@ -197,40 +220,27 @@ int compare(const void * a, const void * b) {
 }
 */
 
+// The most frequent value, the largest one if tied. The smallest value if every
+// value occurs once.
 double KDE::get_min_mode()
 {
-    std::sort(data_array.begin(), data_array.end(), std::greater< double >());
-    // cout << N << ' ' << data_array.size() << endl;
-    int    count    = 1;
-    int    maxcount = 1;
-    double min_mode = data_array.back();
-    double temp_var = min_mode;
-    for (int i = data_array.size() - 2; i >= 0; i--)
+    uint64_t maxcount = 1;
+    double   min_mode = data_hist.front().first;
+    for (auto& [value, count] : data_hist)
     {
-        double curr_var = data_array[i];
-        if (curr_var == temp_var)
+        if (count >= 2 && count >= maxcount)
         {
-            count += 1;
-            if (maxcount <= count)
-            {
-                maxcount = count;
-                min_mode = curr_var;
-            }
+            maxcount = count;
+            min_mode = value;
         }
-        else
-            count = 1;
-        temp_var = curr_var;
     }
     //	cout << min_mode << endl;
     return min_mode;
 }
 
-fftw_complex* KDE::bindist()
+void KDE::bindist(fftw_complex* bindens)
 {
-    double           w = 1.0 / N;
-    vector< double > x = data_array;
-    fftw_complex*    bindens;
-    bindens      = ( fftw_complex* )fftw_malloc(sizeof(fftw_complex) * 2 * n);
+    double w     = 1.0 / N;
     double xlo   = min - 4 * bw;
     double xhi   = max + 4 * bw;
     int    ixmin = 0, ixmax = n - 2;
@@ -240,22 +250,22 @@ fftw_complex* KDE::bindist()
         bindens[i][0] = 0;
         bindens[i][1] = 0;
     }
-    for (int i = 0; i < N; i++)
+    // The values equal are put into the same bins, weighted by their count
+    for (auto& [value, count] : data_hist)
     {
-        double xpos = (x[i] - xlo) / xdelta;
+        double xpos = (value - xlo) / xdelta;
         int    ix   = ( int )floor(xpos);
         double fx   = xpos - ix;
+        double wi   = count * w;
         if (ixmin <= ix && ix <= ixmax)
         {
-            bindens[ix][0] += (1 - fx) * w;
-            bindens[ix + 1][0] += fx * w;
+            bindens[ix][0] += (1 - fx) * wi;
+            bindens[ix + 1][0] += fx * wi;
         }
         //		else if (ix == -1) bindens[0] += fx * wi;  // since xlo < ixmin we don't need this now
         else if (ix == ixmax + 1)
-            bindens[ix][0] += (1 - fx) * w;
+            bindens[ix][0] += (1 - fx) * wi;
     }
-
-    return bindens;
 }
 
 double KDE::gauss_pdf(double x)
@@ -307,14 +317,39 @@ vector< int > KDE::find_local_minima()
     return minima;
 }
 
+vector< pair< double, uint64_t > > KDE::histogram(vector< double > values)
+{
+    std::sort(values.begin(), values.end());
+    vector< pair< double, uint64_t > > hist;
+    for (auto v : values)
+    {
+        if (!hist.empty() && hist.back().first == v)
+            ++hist.back().second;
+        else
+            hist.emplace_back(v, 1);
+    }
+    return hist;
+}
+
 pair< double, double > KDE::run(vector< double >& input, string type)
+{
+    return run(histogram(input), type);
+}
+
+pair< double, double > KDE::run(const vector< pair< double, uint64_t > >& histogram, string type)
 {
     // Prepare data and filter
     initialization();
 
-    data_array.resize(input.size());
-    std::transform(input.begin(), input.end(), data_array.begin(), [](double d) { return log10(d); });
-    N = data_array.size();
+    data_hist.clear();
+    N = 0;
+    for (auto& [v, c] : histogram)
+    {
+        if (c == 0)
+            continue;
+        data_hist.emplace_back(log10(v), c);
+        N += c;
+    }
 
     filter();
 
@@ -25,24 +25,33 @@ public:
     void                   fft();
     pair< double, double > get_density_threshold(string type);
     pair< double, double > run(vector< double >& input, string type);
+    // Same as above, with the histogram of input: the distinct values ascending and
+    // the number of each. It's exact for integer counts, and takes time by the
+    // distinct values instead of the input size.
+    pair< double, double > run(const vector< pair< double, uint64_t > >& histogram, string type);
+
+    // Histogram of values for run()
+    static vector< pair< double, uint64_t > > histogram(vector< double > values);
 
 private:
     double        gauss_pdf(double x);
     void          filter();
-    fftw_complex* bindist();
+    void          bindist(fftw_complex* bindens);
     vector< int > find_local_minima();
     double        pdf_linear_interpol(double v);
     double        get_min_mode();
 
 private:
-    double           min, max;
-    vector< double > data_array;
-    vector< double > kords, xords;
-    vector< double > density, vec_x;
-    double           bw;
-    int              Count;
-    int              N, n_user, n;
-    unsigned int     extension, curr_var;
+    double min, max;
+    // The log10 transformed values ascending, with the number of each
+    vector< pair< double, uint64_t > > data_hist;
+    vector< double >                   kords, xords;
+    vector< double >                   density, vec_x;
+    double                             bw;
+    int                                Count;
+    uint64_t                           N;
+    int                                n_user, n;
+    unsigned int                       extension, curr_var;
 };
 
 #endif
\ No newline at end of file
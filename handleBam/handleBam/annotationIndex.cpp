@@ -0,0 +1,518 @@
+/*
+ * File: annotationIndex.cpp
+ * Created Data: 2026-10-18
+ * Author: fxzhao
+ * Contact: <zhaofuxiang@genomics.cn>
+ *
+ * Copyright (c) 2026 BGI-Research
+ */
+
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <map>
+
+#include <spdlog/spdlog.h>
+
+#include "annotationIndex.h"
+
+static inline bool inRange(int start, int end, int locus)
+{
+    return locus >= start && locus <= end;
+}
+
+void TranscriptView::assignLocusFunction(int start, LocusFunction& l, int len) const
+{
+    int begin = std::max(start, transcript->transcription_start);
+    int end   = std::min(int(start + len - 1), transcript->transcription_end);
+    for (int i = begin; i <= end; ++i)
+    {
+        LocusFunction locusFunction;
+        if (inExon(i))
+        {
+            if (!inRange(transcript->coding_start, transcript->coding_end, i))
+                locusFunction = LocusFunction::UTR;
+            else
+                locusFunction = LocusFunction::CODING;
+        }
+        else
+            locusFunction = LocusFunction::INTRONIC;
+        if (locusFunction > l)
+            l = locusFunction;
+        // Exit early to reduce unnecessary calculations
+        if (l == LocusFunction::CODING)
+            break;
+    }
+}
+
+void TranscriptView::assignLocusFunction(int start, int len, pair< int, int >& max_cnts) const
+{
+    int begin     = std::max(start, transcript->transcription_start);
+    int end       = std::min(int(start + len - 1), transcript->transcription_end);
+    int exon_cnts = 0, intro_cnts = 0;
+    for (int i = begin; i <= end; ++i)
+    {
+        if (inExon(i))
+            ++exon_cnts;
+        else
+            ++intro_cnts;
+    }
+    if (exon_cnts > max_cnts.first)
+        max_cnts = { exon_cnts, intro_cnts };
+    else if (exon_cnts == max_cnts.first)
+        max_cnts.second = max(max_cnts.second, intro_cnts);
+}
+
+bool TranscriptView::inExon(int locus) const
+{
+    for (const IdxExon* exon = exonsBegin(); exon != exonsEnd(); ++exon)
+    {
+        if (exon->start > locus)
+            return false;
+        if (inRange(exon->start, exon->end, locus))
+            return true;
+    }
+    return false;
+}
+
+std::string_view GeneView::getName() const
+{
+    return index->str(gene->name_offset, gene->name_length);
+}
+
+std::string_view GeneView::getContig() const
+{
+    const IdxContig& c = index->contigs[gene->contig];
+    return index->str(c.name_offset, c.name_length);
+}
+
+size_t GeneView::transcriptNum() const
+{
+    return gene->transcript_end - gene->transcript_begin;
+}
+
+TranscriptView GeneView::getTranscript(size_t i) const
+{
+    return TranscriptView(index->transcripts + gene->transcript_begin + i, index->exons);
+}
+
+// The sorted genes form an implicit binary tree as in cgranges: the genes at even indexes
+// are leaves, and the one at index i of level k has children at i - 2^(k-1) and i + 2^(k-1).
+// Fill max_end of each gene with the maximum end of its subtree, bottom up level by level.
+// A subtree partly beyond the last gene takes the maximum end of the genes it does cover.
+static void indexSubtrees(IdxGene* genes, size_t n)
+{
+    if (n == 0)
+        return;
+    size_t last_i = 0;
+    int    last   = 0;
+    for (size_t i = 0; i < n; i += 2)
+    {
+        last_i = i;
+        last = genes[i].max_end = genes[i].end;
+    }
+    for (int k = 1; (size_t(1) << k) <= n; ++k)
+    {
+        size_t x = size_t(1) << (k - 1), step = x << 2;
+        for (size_t i = (x << 1) - 1; i < n; i += step)
+        {
+            int left  = genes[i - x].max_end;
+            int right = i + x < n ? genes[i + x].max_end : last;
+            genes[i].max_end = std::max({ genes[i].end, left, right });
+        }
+        last_i = (last_i >> k & 1) ? last_i - x : last_i + x;
+        if (last_i < n && genes[last_i].max_end > last)
+            last = genes[last_i].max_end;
+    }
+}
+
+// Visit the genes in [first, bound) ending at or after begin in sorted order, bound is the
+// upper bound of the query end among the gene starts. Subtrees ending before begin are
+// skipped as a whole, so a long gene doesn't turn the later queries into linear scans.
+template < typename Visit >
+static void overlapGenes(const IdxGene* first, const IdxGene* bound, int begin, Visit visit)
+{
+    size_t n = bound - first;
+    if (n == 0)
+        return;
+
+    // The tree of the whole contig is the same over its prefix [first, bound), except
+    // the subtrees partly beyond the bound, whose max_end only gets larger
+    struct Node
+    {
+        size_t x;
+        int    k;
+        bool   left_done;
+    };
+    Node stack[64];
+    int  t   = 0;
+    int  top = 63 - __builtin_clzll(n);
+    stack[t++] = { (size_t(1) << top) - 1, top, false };
+    while (t != 0)
+    {
+        Node z = stack[--t];
+        if (z.k <= 3)
+        {
+            // A small subtree, scan it directly
+            size_t i0 = z.x >> z.k << z.k, i1 = std::min(n, i0 + (size_t(1) << (z.k + 1)) - 1);
+            for (size_t i = i0; i < i1; ++i)
+                if (first[i].end >= begin)
+                    visit(first + i);
+        }
+        else if (!z.left_done)
+        {
+            // Come back for this gene and its right subtree after the left subtree
+            size_t y   = z.x - (size_t(1) << (z.k - 1));
+            stack[t++] = { z.x, z.k, true };
+            if (y >= n || first[y].max_end >= begin)
+                stack[t++] = { y, z.k - 1, false };
+        }
+        else if (z.x < n)
+        {
+            if (first[z.x].end >= begin)
+                visit(first + z.x);
+            stack[t++] = { z.x + (size_t(1) << (z.k - 1)), z.k - 1, false };
+        }
+    }
+}
+
+static const size_t SECTION_ITEM_SIZE[SECTION_NUM] = { sizeof(char), sizeof(IdxContig), sizeof(IdxGene),
+                                                       sizeof(IdxTranscript), sizeof(IdxExon) };
+
+AnnotationIndex::AnnotationIndex()
+    : image(nullptr), image_size(0), header(nullptr), strings(nullptr), contigs(nullptr), genes(nullptr),
+      transcripts(nullptr), exons(nullptr)
+{
+}
+
+void AnnotationIndex::build(std::vector< GeneFromGTF >& gene_models)
+{
+    std::string                  pool;
+    std::vector< IdxContig >     idx_contigs;
+    std::vector< IdxGene >       idx_genes;
+    std::vector< IdxTranscript > idx_transcripts;
+    std::vector< IdxExon >       idx_exons;
+
+    // Contigs are ordered by name and genes by position, so the same
+    // annotation always compiles to the same image
+    std::map< std::string, std::vector< GeneFromGTF* > > by_contig;
+    for (auto& gene : gene_models)
+        by_contig[gene.getContig()].push_back(&gene);
+
+    using TranscriptItem = const std::pair< const std::string, TranscriptFromGTF >*;
+    for (auto& [contig, contig_genes] : by_contig)
+    {
+        std::sort(contig_genes.begin(), contig_genes.end(), [](GeneFromGTF* a, GeneFromGTF* b) {
+            if (a->getStart() != b->getStart())
+                return a->getStart() < b->getStart();
+            if (a->getEnd() != b->getEnd())
+                return a->getEnd() < b->getEnd();
+            return a->getName() < b->getName();
+        });
+
+        IdxContig c;
+        c.name_offset = pool.size();
+        c.name_length = contig.size();
+        c.gene_begin  = idx_genes.size();
+        pool += contig;
+
+        for (auto gene : contig_genes)
+        {
+            IdxGene g;
+            g.start           = gene->getStart();
+            g.end             = gene->getEnd();
+            g.contig          = idx_contigs.size();
+            g.name_offset     = pool.size();
+            g.name_length     = gene->getName().size();
+            g.negative_strand = gene->isNegativeStrand() ? 1 : 0;
+            pool += gene->getName();
+
+            std::vector< TranscriptItem > items;
+            for (auto& p : gene->getTranscripts())
+                items.push_back(&p);
+            std::sort(items.begin(), items.end(),
+                      [](TranscriptItem a, TranscriptItem b) { return a->first < b->first; });
+
+            g.transcript_begin = idx_transcripts.size();
+            for (auto p : items)
+            {
+                const TranscriptFromGTF& t = p->second;
+                IdxTranscript            it;
+                it.transcription_start = t.getTranscriptionStart();
+                it.transcription_end   = t.getTranscriptionEnd();
+                it.coding_start        = t.getCodingStart();
+                it.coding_end          = t.getCodingEnd();
+                it.exon_begin          = idx_exons.size();
+                for (auto& e : t.getExons())
+                    idx_exons.push_back({ e.start, e.end });
+                it.exon_end = idx_exons.size();
+                idx_transcripts.push_back(it);
+            }
+            g.transcript_end = idx_transcripts.size();
+            idx_genes.push_back(g);
+        }
+        c.gene_end = idx_genes.size();
+        indexSubtrees(idx_genes.data() + c.gene_begin, c.gene_end - c.gene_begin);
+        idx_contigs.push_back(c);
+    }
+
+    AnnoIndexHeader h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, ANNO_INDEX_MAGIC, sizeof(h.magic));
+    h.version = ANNO_INDEX_VERSION;
+
+    const void* data[SECTION_NUM] = { pool.data(), idx_contigs.data(), idx_genes.data(), idx_transcripts.data(),
+                                      idx_exons.data() };
+    h.section_count[SECTION_STRINGS]     = pool.size();
+    h.section_count[SECTION_CONTIGS]     = idx_contigs.size();
+    h.section_count[SECTION_GENES]       = idx_genes.size();
+    h.section_count[SECTION_TRANSCRIPTS] = idx_transcripts.size();
+    h.section_count[SECTION_EXONS]       = idx_exons.size();
+
+    size_t offset = sizeof(h);
+    for (int s = 0; s < SECTION_NUM; ++s)
+    {
+        offset              = align8(offset);
+        h.section_offset[s] = offset;
+        offset += h.section_count[s] * SECTION_ITEM_SIZE[s];
+    }
+    h.file_size = align8(offset);
+
+    buffer.assign(h.file_size, 0);
+    for (int s = 0; s < SECTION_NUM; ++s)
+        if (h.section_count[s] != 0)
+            memcpy(buffer.data() + h.section_offset[s], data[s], h.section_count[s] * SECTION_ITEM_SIZE[s]);
+    h.checksum = checksum(buffer.data() + sizeof(h), buffer.size() - sizeof(h));
+    memcpy(buffer.data(), &h, sizeof(h));
+
+    mapped.close();
+    attach(buffer.data(), buffer.size(), false);
+}
+
+int AnnotationIndex::load(const std::string& filename, bool verify)
+{
+    buffer.clear();
+    if (!mapped.open(filename))
+        return -1;
+    if (attach(mapped.data(), mapped.size(), verify) != 0)
+    {
+        spdlog::error("Invalid annotation index: {}", filename);
+        mapped.close();
+        return -1;
+    }
+    return 0;
+}
+
+int AnnotationIndex::save(const std::string& filename) const
+{
+    if (header == nullptr)
+    {
+        spdlog::error("Annotation index is empty");
+        return -1;
+    }
+
+    return writeFileAtomic(filename, image, image_size);
+}
+
+bool AnnotationIndex::isIndexFile(const std::string& filename)
+{
+    std::ifstream ifs(filename, std::ios::binary);
+    char          magic[sizeof(ANNO_INDEX_MAGIC)];
+    if (!ifs.read(magic, sizeof(magic)))
+        return false;
+    return memcmp(magic, ANNO_INDEX_MAGIC, sizeof(magic)) == 0;
+}
+
+int AnnotationIndex::attach(const char* base, size_t size, bool verify)
+{
+    header = nullptr;
+    contig_ids.clear();
+
+    if (size < sizeof(AnnoIndexHeader))
+    {
+        spdlog::error("Annotation index is truncated");
+        return -1;
+    }
+    const AnnoIndexHeader* h = reinterpret_cast< const AnnoIndexHeader* >(base);
+    if (memcmp(h->magic, ANNO_INDEX_MAGIC, sizeof(h->magic)) != 0)
+    {
+        spdlog::error("Annotation index has wrong magic number");
+        return -1;
+    }
+    if (h->version != ANNO_INDEX_VERSION)
+    {
+        spdlog::error("Annotation index version {} is not supported, expect {}. Please rebuild it with index-gtf",
+                      h->version, ANNO_INDEX_VERSION);
+        return -1;
+    }
+    if (h->file_size != size)
+    {
+        spdlog::error("Annotation index size mismatch, expect {} but got {}", h->file_size, size);
+        return -1;
+    }
+    if (verify && checksum(base + sizeof(AnnoIndexHeader), size - sizeof(AnnoIndexHeader)) != h->checksum)
+    {
+        spdlog::error("Annotation index checksum mismatch");
+        return -1;
+    }
+    for (int s = 0; s < SECTION_NUM; ++s)
+    {
+        if (h->section_offset[s] % 8 != 0 || h->section_offset[s] > size
+            || h->section_count[s] > (size - h->section_offset[s]) / SECTION_ITEM_SIZE[s])
+        {
+            spdlog::error("Annotation index section {} out of range", s);
+            return -1;
+        }
+    }
+
+    image       = base;
+    image_size  = size;
+    header      = h;
+    strings     = section< char >(SECTION_STRINGS);
+    contigs     = section< IdxContig >(SECTION_CONTIGS);
+    genes       = section< IdxGene >(SECTION_GENES);
+    transcripts = section< IdxTranscript >(SECTION_TRANSCRIPTS);
+    exons       = section< IdxExon >(SECTION_EXONS);
+
+    // Check the cross references once, then queries need no bound checking
+    size_t n_strings = count(SECTION_STRINGS), n_contigs = count(SECTION_CONTIGS), n_genes = count(SECTION_GENES),
+           n_transcripts = count(SECTION_TRANSCRIPTS), n_exons = count(SECTION_EXONS);
+    bool valid = true;
+    for (size_t i = 0; i < n_contigs && valid; ++i)
+    {
+        const IdxContig& c = contigs[i];
+        valid              = uint64(c.name_offset) + c.name_length <= n_strings && c.gene_begin <= c.gene_end
+                && c.gene_end <= n_genes;
+    }
+    for (size_t i = 0; i < n_genes && valid; ++i)
+    {
+        const IdxGene& g = genes[i];
+        valid = g.contig < n_contigs && uint64(g.name_offset) + g.name_length <= n_strings
+                && g.transcript_begin <= g.transcript_end && g.transcript_end <= n_transcripts;
+    }
+    for (size_t i = 0; i < n_transcripts && valid; ++i)
+    {
+        const IdxTranscript& t = transcripts[i];
+        valid                  = t.exon_begin <= t.exon_end && t.exon_end <= n_exons;
+    }
+    if (!valid)
+    {
+        spdlog::error("Annotation index has broken references");
+        header = nullptr;
+        return -1;
+    }
+
+    for (size_t i = 0; i < n_contigs; ++i)
+        contig_ids[std::string(str(contigs[i].name_offset, contigs[i].name_length))] = i;
+
+    return 0;
+}
+
+void AnnotationIndex::query(const std::string& contig, int begin, int end, std::vector< GeneView >& result) const
+{
+    result.clear();
+    auto iter = contig_ids.find(contig);
+    if (iter == contig_ids.end() || end < begin)
+        return;
+
+    const IdxContig& c     = contigs[iter->second];
+    const IdxGene*   first = genes + c.gene_begin;
+    const IdxGene*   last  = genes + c.gene_end;
+
+    // Genes after this one start beyond the query
+    const IdxGene* bound =
+        std::upper_bound(first, last, end, [](int pos, const IdxGene& g) { return pos < g.start; });
+    overlapGenes(first, bound, begin, [&](const IdxGene* g) { result.emplace_back(this, g); });
+}
+
+// Upper bound of pos among the genes sorted by start. Search outward from hint with
+// doubling steps, so a bound close to hint costs only a few comparisons.
+static const IdxGene* gallopUpperBound(const IdxGene* first, const IdxGene* last, const IdxGene* hint, int pos)
+{
+    auto   cmp  = [](int pos, const IdxGene& g) { return pos < g.start; };
+    size_t step = 1;
+    if (hint == last || pos < hint->start)
+    {
+        // The bound is in [first, hint]
+        const IdxGene* hi = hint;
+        const IdxGene* lo = hint;
+        while (lo != first)
+        {
+            lo = size_t(lo - first) > step ? lo - step : first;
+            if (!(pos < lo->start))
+                break;
+            hi = lo;
+            step <<= 1;
+        }
+        return std::upper_bound(lo, hi, pos, cmp);
+    }
+
+    // The bound is in (hint, last]
+    const IdxGene* lo = hint;
+    const IdxGene* hi = hint;
+    while (hi != last)
+    {
+        hi = size_t(last - hi) > step ? hi + step : last;
+        if (hi == last || pos < hi->start)
+            break;
+        lo = hi;
+        step <<= 1;
+    }
+    return std::upper_bound(lo, hi, pos, cmp);
+}
+
+// How many reads ahead to prefetch the genes of
+static const size_t QUERY_PREFETCH_DISTANCE = 8;
+
+void AnnotationIndex::queryBatch(const std::string& contig, const std::vector< std::pair< int, int > >& intervals,
+                                 std::vector< std::vector< GeneView > >& results) const
+{
+    size_t n = intervals.size();
+    results.resize(n);
+    for (auto& result : results)
+        result.clear();
+    auto iter = contig_ids.find(contig);
+    if (iter == contig_ids.end())
+        return;
+
+    const IdxContig& c     = contigs[iter->second];
+    const IdxGene*   first = genes + c.gene_begin;
+    const IdxGene*   last  = genes + c.gene_end;
+
+    // Locate the bounds of all intervals first, they only touch the starts of genes
+    std::vector< const IdxGene* > bounds(n);
+    const IdxGene*                hint = first;
+    for (size_t i = 0; i < n; ++i)
+    {
+        hint      = gallopUpperBound(first, last, hint, intervals[i].second);
+        bounds[i] = hint;
+    }
+
+    for (size_t i = 0; i < n; ++i)
+    {
+        // Bring the genes of a later interval into cache while scanning this one
+        if (i + QUERY_PREFETCH_DISTANCE < n && bounds[i + QUERY_PREFETCH_DISTANCE] != first)
+            __builtin_prefetch(bounds[i + QUERY_PREFETCH_DISTANCE] - 1);
+
+        int                      begin  = intervals[i].first;
+        std::vector< GeneView >& result = results[i];
+        // An empty interval overlaps nothing
+        if (intervals[i].second < begin)
+            continue;
+        if (i > 0 && bounds[i] == bounds[i - 1] && begin >= intervals[i - 1].first
+            && intervals[i - 1].second >= intervals[i - 1].first)
+        {
+            // The scan of the previous interval covered all the candidates of this one
+            for (auto& g : results[i - 1])
+                if (g.getEnd() >= begin)
+                    result.push_back(g);
+            continue;
+        }
+
+        overlapGenes(first, bounds[i], begin, [&](const IdxGene* g) {
+            // Transcripts are needed next for resolving the locus function
+            __builtin_prefetch(transcripts + g->transcript_begin);
+            result.emplace_back(this, g);
+        });
+    }
+}
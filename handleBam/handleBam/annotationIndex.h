@@ -0,0 +1,207 @@
+/*
+ * File: annotationIndex.h
+ * Created Data: 2026-10-18
+ * Author: fxzhao
+ * Contact: <zhaofuxiang@genomics.cn>
+ *
+ * Copyright (c) 2026 BGI-Research
+ */
+
+#pragma once
+
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "geneFromGTF.h"
+#include "locusFunction.h"
+#include "mappedFile.h"
+#include "types.h"
+
+// Layout of the compiled annotation. Every section is addressed by the offset
+// from the beginning of the image, so the file can be mapped at any address
+// and shared between processes without relocation.
+static const char   ANNO_INDEX_MAGIC[8] = { 'H', 'B', 'A', 'N', 'N', 'I', 'D', 'X' };
+static const uint32 ANNO_INDEX_VERSION  = 2;
+
+enum AnnoIndexSection
+{
+    SECTION_STRINGS,
+    SECTION_CONTIGS,
+    SECTION_GENES,
+    SECTION_TRANSCRIPTS,
+    SECTION_EXONS,
+    SECTION_NUM,
+};
+
+struct AnnoIndexHeader
+{
+    char   magic[8];
+    uint32 version;
+    uint32 checksum;  // crc32 of all the bytes after the header
+    uint64 file_size;
+    uint64 section_offset[SECTION_NUM];
+    uint64 section_count[SECTION_NUM];
+};
+
+struct IdxContig
+{
+    uint32 name_offset;
+    uint32 name_length;
+    // Genes of this contig are [gene_begin, gene_end), sorted by start
+    uint32 gene_begin;
+    uint32 gene_end;
+};
+
+struct IdxGene
+{
+    int32  start;
+    int32  end;
+    // The genes of a contig form an implicit binary tree in their sorted order, this is the
+    // maximum end of the genes in the subtree rooted at this one
+    int32  max_end;
+    uint32 contig;
+    uint32 name_offset;
+    uint32 name_length;
+    uint32 transcript_begin;
+    uint32 transcript_end;
+    uint32 negative_strand;
+};
+
+struct IdxTranscript
+{
+    int32  transcription_start;
+    int32  transcription_end;
+    int32  coding_start;
+    int32  coding_end;
+    uint32 exon_begin;
+    uint32 exon_end;
+};
+
+struct IdxExon
+{
+    int32 start;
+    int32 end;
+};
+
+class TranscriptView
+{
+public:
+    TranscriptView(const IdxTranscript* transcript_, const IdxExon* exons_)
+        : transcript(transcript_), exons(exons_)
+    {
+    }
+
+    const IdxExon* exonsBegin() const
+    {
+        return exons + transcript->exon_begin;
+    }
+    const IdxExon* exonsEnd() const
+    {
+        return exons + transcript->exon_end;
+    }
+
+    void assignLocusFunction(int start, LocusFunction& l, int len) const;
+    void assignLocusFunction(int start, int len, pair< int, int >& max_cnts) const;
+    bool inExon(int locus) const;
+
+private:
+    const IdxTranscript* transcript;
+    const IdxExon*       exons;
+};
+
+class AnnotationIndex;
+class GeneView
+{
+public:
+    GeneView(const AnnotationIndex* index_, const IdxGene* gene_) : index(index_), gene(gene_) {}
+
+    bool isNegativeStrand() const
+    {
+        return gene->negative_strand != 0;
+    }
+    int getStart() const
+    {
+        return gene->start;
+    }
+    int getEnd() const
+    {
+        return gene->end;
+    }
+    std::string_view getName() const;
+    std::string_view getContig() const;
+
+    size_t         transcriptNum() const;
+    TranscriptView getTranscript(size_t i) const;
+
+private:
+    const AnnotationIndex* index;
+    const IdxGene*         gene;
+};
+
+class AnnotationIndex
+{
+public:
+    AnnotationIndex();
+
+    // Compile the gene models into an in-memory image
+    void build(std::vector< GeneFromGTF >& genes);
+    // Map a compiled index file, return 0 if success. The sections and references are
+    // always checked, the checksum only if required, which reads the whole file.
+    int load(const std::string& filename, bool verify = false);
+    // Write the image to disk, return 0 if success
+    int save(const std::string& filename) const;
+
+    // Check the magic number without mapping the whole file
+    static bool isIndexFile(const std::string& filename);
+
+    // Find genes overlapping the closed interval [begin, end], ordered by start. The
+    // interval is empty if end < begin.
+    void query(const std::string& contig, int begin, int end, std::vector< GeneView >& result) const;
+    // Same as query() for a batch of intervals on one contig. The intervals are
+    // expected sorted by begin, then the lookups start from the position of the
+    // previous interval and neighbours with the same candidates share the scan.
+    void queryBatch(const std::string& contig, const std::vector< std::pair< int, int > >& intervals,
+                    std::vector< std::vector< GeneView > >& results) const;
+
+    size_t geneNum() const
+    {
+        return count(SECTION_GENES);
+    }
+
+private:
+    friend class GeneView;
+
+    int attach(const char* base, size_t size, bool verify);
+
+    template < typename T > const T* section(AnnoIndexSection s) const
+    {
+        return reinterpret_cast< const T* >(image + header->section_offset[s]);
+    }
+    size_t count(AnnoIndexSection s) const
+    {
+        return header == nullptr ? 0 : header->section_count[s];
+    }
+    std::string_view str(uint32 offset, uint32 length) const
+    {
+        return std::string_view(strings + offset, length);
+    }
+
+private:
+    // The image is either compiled in memory or mapped from file
+    std::vector< char > buffer;
+    MappedFile          mapped;
+
+    const char*            image;
+    size_t                 image_size;
+    const AnnoIndexHeader* header;
+    const char*            strings;
+    const IdxContig*       contigs;
+    const IdxGene*         genes;
+    const IdxTranscript*   transcripts;
+    const IdxExon*         exons;
+
+    std::unordered_map< std::string, uint32 > contig_ids;
+};
@@ -7,9 +7,16 @@
  * Copyright (c) 2020 BGI-Research
  */
 
+#include <algorithm>
+
+#include <errno.h>
+#include <fcntl.h>
 #include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 #include "bamCat.h"
+#include "htslib/hfile.h"
 #include "spdlog/spdlog.h"
 
 /*
@@ -23,152 +30,396 @@
 
 #define BGZF_EMPTY_BLOCK_SIZE 28
 
+// The empty block at the end of every bgzf file
+static const uint8_t BGZF_EOF[BGZF_EMPTY_BLOCK_SIZE] = { 31, 139, 8, 4, 0, 0, 0, 0, 0, 255, 6, 0, 66, 67,
+                                                         2,  0,   27, 0, 3, 0, 0, 0, 0, 0,   0, 0, 0, 0 };
+
+// Compressed size of the bgzf block at offset, -1 if it is not a bgzf block
+static int64_t bgzfBlockSize(int fd, int64_t offset)
+{
+    uint8_t head[18];
+    if (pread(fd, head, sizeof(head), offset) != sizeof(head))
+        return -1;
+    // The 'BC' subfield holds the block size minus 1
+    if (head[0] != GZIPID1 || head[1] != GZIPID2 || (head[3] & 4) == 0 || head[12] != 'B' || head[13] != 'C')
+        return -1;
+    return (head[16] | (head[17] << 8)) + 1;
+}
+
+// Copy length bytes from offset of in_fd to the current position of out_fd. Use
+// copy_file_range() so the kernel can clone or copy the range without passing
+// the data through user space, fall back to pread/write where it is not supported.
+static int copyRange(int in_fd, int64_t offset, int64_t length, int out_fd, uint8_t* buf)
+{
+    bool   splice = true;
+    loff_t off_in = offset;
+    while (length > 0)
+    {
+        ssize_t n;
+        if (splice)
+        {
+            n = copy_file_range(in_fd, &off_in, out_fd, NULL, length, 0);
+            if (n < 0 && (errno == EXDEV || errno == EINVAL || errno == ENOSYS || errno == EOPNOTSUPP))
+            {
+                splice = false;
+                continue;
+            }
+        }
+        else
+        {
+            n = pread(in_fd, buf, std::min< int64_t >(length, BUF_SIZE), off_in);
+            for (ssize_t written = 0; n > 0 && written < n;)
+            {
+                ssize_t ret = write(out_fd, buf + written, n - written);
+                if (ret < 0)
+                    return -1;
+                written += ret;
+            }
+            if (n > 0)
+                off_in += n;
+        }
+        if (n <= 0)
+            return -1;
+        length -= n;
+    }
+    return 0;
+}
+
 int bam_cat(std::vector< std::string > fn, bam_hdr_t* h, const char* outbam, [[maybe_unused]] char* arg_list,
             [[maybe_unused]] int no_pg)
 {
-    BGZF *              fp, *in = NULL;
-    uint8_t*            buf = NULL;
-    uint8_t             ebuf[BGZF_EMPTY_BLOCK_SIZE];
-    const int           es = BGZF_EMPTY_BLOCK_SIZE;
-    decltype(fn.size()) i;
+    // if (!no_pg && sam_hdr_add_pg(h, "samtools",
+    //                              "VN", samtools_version(),
+    //                              arg_list ? "CL": NULL,
+    //                              arg_list ? arg_list : NULL,
+    //                              NULL))
+    //     goto fail;
+    BamCat bamCat(outbam, h);
+    if (bamCat.open() != 0)
+        return -1;
+    for (auto& f : fn)
+    {
+        if (bamCat.append(f) != 0)
+            return -1;
+    }
+    return bamCat.close();
+}
+
+BamCat::BamCat(const std::string& outbam_, bam_hdr_t* h_, bool write_index_, bool write_tag_index, int threads_)
+    : outbam(outbam_), h(h_), write_index(write_index_), threads(threads_), fp(NULL), out_fd(-1), buf(NULL), parts(0)
+{
+    // The tag index needs no header, the records are keyed by their tags only
+    if (write_tag_index)
+        tag_index = std::make_unique< TagIndex >();
+}
 
-    fp = strcmp(outbam, "-") ? bgzf_open(outbam, "w") : bgzf_fdopen(fileno(stdout), "w");
+BamCat::~BamCat()
+{
+    if (fp)
+        close();
+    free(buf);
+}
+
+int BamCat::open()
+{
+    out_fd = strcmp(outbam.c_str(), "-") ? ::open(outbam.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666)
+                                         : dup(fileno(stdout));
+    if (out_fd < 0)
+    {
+        spdlog::error("bam_cat fail to open output file:{}", outbam);
+        return -1;
+    }
+    // The bgzf handle shares the file offset with out_fd, so the blocks written by
+    // bgzf and the ones copied through out_fd stay in order
+    int bgzf_fd = dup(out_fd);
+    fp          = bgzf_fd < 0 ? NULL : bgzf_fdopen(bgzf_fd, "w");
     if (fp == 0)
     {
+        if (bgzf_fd >= 0)
+            ::close(bgzf_fd);
         spdlog::error("bam_cat fail to open output file:{}", outbam);
         return -1;
     }
     if (h)
     {
-        // if (!no_pg && sam_hdr_add_pg(h, "samtools",
-        //                              "VN", samtools_version(),
-        //                              arg_list ? "CL": NULL,
-        //                              arg_list ? arg_list : NULL,
-        //                              NULL))
-        //     goto fail;
-
         if (bam_hdr_write(fp, h) < 0)
         {
             spdlog::error("bam_cat couldn't write header");
-            goto fail;
+            return -1;
         }
+        if (write_index)
+            index = std::make_unique< BamIndex >(h);
     }
 
     buf = ( uint8_t* )malloc(BUF_SIZE);
     if (!buf)
     {
         fprintf(stderr, "[%s] Couldn't allocate buffer\n", __func__);
-        goto fail;
+        return -1;
     }
-    for (i = 0; i < fn.size(); ++i)
+    return 0;
+}
+
+int BamCat::append(const std::string& part, const BamIndex* part_index, const TagIndex* part_tag_index)
+{
+    int64_t delta = 0;
+    bool    kept  = false;
+    int     ret   = strcmp(part.c_str(), "-") != 0 ? appendRange(part, delta, kept) : 1;
+    if (ret > 0)
+        ret = appendBlocks(part);
+    if (ret == 0 && index)
     {
-        bam_hdr_t* old;
-        int        len, j;
+        if (part_index != nullptr && kept)
+            index->merge(*part_index, delta);
+        else
+            index->invalidate();
+    }
+    if (ret == 0 && tag_index)
+    {
+        if (part_tag_index != nullptr && kept)
+            tag_index->merge(*part_tag_index, delta);
+        else
+            tag_index->invalidate();
+    }
+    return ret;
+}
 
-        in = strcmp(fn[i].c_str(), "-") ? bgzf_open(fn[i].c_str(), "r") : bgzf_fdopen(fileno(stdin), "r");
-        if (in == 0)
-        {
-            spdlog::error("bam_cat fail to open file: {}", fn[i]);
-            goto fail;
-        }
-        if (in->is_write)
-            return -1;
+int BamCat::appendRange(const std::string& part, int64_t& delta, bool& kept)
+{
+    const int es    = BGZF_EMPTY_BLOCK_SIZE;
+    int       in_fd = ::open(part.c_str(), O_RDONLY);
+    if (in_fd < 0)
+        return 1;
+    // Only the parts ending with the standard EOF block are spliced
+    struct stat st;
+    uint8_t     ebuf[BGZF_EMPTY_BLOCK_SIZE];
+    if (fstat(in_fd, &st) != 0 || st.st_size < es || pread(in_fd, ebuf, es, st.st_size - es) != es
+        || memcmp(ebuf, BGZF_EOF, es) != 0)
+    {
+        ::close(in_fd);
+        return 1;
+    }
 
-        old = bam_hdr_read(in);
-        if (old == NULL)
+    BGZF*      in  = bgzf_open(part.c_str(), "r");
+    bam_hdr_t* old = in ? bam_hdr_read(in) : NULL;
+    if (old == NULL)
+    {
+        if (in)
+            bgzf_close(in);
+        ::close(in_fd);
+        return 1;
+    }
+    // Records start in the block after the header, unless the last block of the
+    // header is shared with them, then its remaining data is recompressed
+    int64_t data_start = in->block_address;
+    if (in->block_length != 0)
+    {
+        int64_t size = bgzfBlockSize(in_fd, data_start);
+        if (size < 0)
         {
-            fprintf(stderr, "[%s] ERROR: couldn't read header for '%s'.\n", __func__, fn[i].c_str());
-            goto fail;
+            bam_hdr_destroy(old);
+            bgzf_close(in);
+            ::close(in_fd);
+            return 1;
         }
-        if (h == 0 && i == 0)
+        data_start += size;
+    }
+
+    int ret = 0;
+    if (h == 0 && parts == 0)
+    {
+        if (bam_hdr_write(fp, old) < 0)
         {
-            // if (!no_pg && sam_hdr_add_pg(old, "samtools",
-            //                              "VN", samtools_version(),
-            //                              arg_list ? "CL": NULL,
-            //                              arg_list ? arg_list : NULL,
-            //                              NULL))
-            //     goto fail;
-
-            if (bam_hdr_write(fp, old) < 0)
-            {
-                spdlog::error("bam_cat couldn't write header");
-                goto fail;
-            }
+            spdlog::error("bam_cat couldn't write header");
+            ret = -1;
         }
+        if (write_index)
+            index = std::make_unique< BamIndex >(old);
+    }
+    // The offsets of the records recompressed here are changed
+    kept = in->block_offset >= in->block_length;
+    if (ret == 0 && in->block_offset < in->block_length)
+    {
+        if (bgzf_write(fp, ( char* )in->uncompressed_block + in->block_offset, in->block_length - in->block_offset)
+            < 0)
+            ret = -1;
+    }
+    bam_hdr_destroy(old);
+    bgzf_close(in);
 
-        if (in->block_offset < in->block_length)
+    // Everything buffered by bgzf must reach the file before the copied blocks
+    if (ret == 0 && (bgzf_flush(fp) != 0 || hflush(fp->fp) != 0))
+        ret = -1;
+    if (ret == 0)
+    {
+        off_t out_pos = lseek(out_fd, 0, SEEK_CUR);
+        if (out_pos < 0)
+            kept = false;
+        delta = out_pos - data_start;
+    }
+    if (ret == 0 && data_start < st.st_size - es)
+        ret = copyRange(in_fd, data_start, st.st_size - es - data_start, out_fd, buf);
+    ::close(in_fd);
+
+    if (ret != 0)
+    {
+        fprintf(stderr, "[%s] Error writing to '%s'.\n", __func__, outbam.c_str());
+        return -1;
+    }
+    ++parts;
+    return 0;
+}
+
+int BamCat::appendBlocks(const std::string& part)
+{
+    BGZF*      in = NULL;
+    bam_hdr_t* old = NULL;
+    int        len, j;
+    uint8_t    ebuf[BGZF_EMPTY_BLOCK_SIZE];
+    const int  es = BGZF_EMPTY_BLOCK_SIZE;
+
+    in = strcmp(part.c_str(), "-") ? bgzf_open(part.c_str(), "r") : bgzf_fdopen(fileno(stdin), "r");
+    if (in == 0)
+    {
+        spdlog::error("bam_cat fail to open file: {}", part);
+        return -1;
+    }
+    if (in->is_write)
+    {
+        bgzf_close(in);
+        return -1;
+    }
+
+    old = bam_hdr_read(in);
+    if (old == NULL)
+    {
+        fprintf(stderr, "[%s] ERROR: couldn't read header for '%s'.\n", __func__, part.c_str());
+        goto fail;
+    }
+    if (h == 0 && parts == 0)
+    {
+        if (bam_hdr_write(fp, old) < 0)
         {
-            if (bgzf_write(fp, ( char* )in->uncompressed_block + in->block_offset, in->block_length - in->block_offset)
-                < 0)
-                goto write_fail;
-            if (bgzf_flush(fp) != 0)
-                goto write_fail;
+            spdlog::error("bam_cat couldn't write header");
+            goto fail;
         }
+        if (write_index)
+            index = std::make_unique< BamIndex >(old);
+    }
 
-        j = 0;
-        while ((len = bgzf_raw_read(in, buf, BUF_SIZE)) > 0)
-        {
-            if (len < es)
-            {
-                int diff = es - len;
-                if (j == 0)
-                {
-                    fprintf(stderr, "[%s] ERROR: truncated file?: '%s'.\n", __func__, fn[i].c_str());
-                    goto fail;
-                }
-                if (bgzf_raw_write(fp, ebuf, len) < 0)
-                    goto write_fail;
+    if (in->block_offset < in->block_length)
+    {
+        if (bgzf_write(fp, ( char* )in->uncompressed_block + in->block_offset, in->block_length - in->block_offset)
+            < 0)
+            goto write_fail;
+        if (bgzf_flush(fp) != 0)
+            goto write_fail;
+    }
 
-                memcpy(ebuf, ebuf + len, diff);
-                memcpy(ebuf + diff, buf, len);
-            }
-            else
+    j = 0;
+    while ((len = bgzf_raw_read(in, buf, BUF_SIZE)) > 0)
+    {
+        if (len < es)
+        {
+            int diff = es - len;
+            if (j == 0)
             {
-                if (j != 0)
-                {
-                    if (bgzf_raw_write(fp, ebuf, es) < 0)
-                        goto write_fail;
-                }
-                len -= es;
-                memcpy(ebuf, buf + len, es);
-                if (bgzf_raw_write(fp, buf, len) < 0)
-                    goto write_fail;
+                fprintf(stderr, "[%s] ERROR: truncated file?: '%s'.\n", __func__, part.c_str());
+                goto fail;
             }
-            j = 1;
-        }
+            if (bgzf_raw_write(fp, ebuf, len) < 0)
+                goto write_fail;
 
-        /* check final gzip block */
+            memcpy(ebuf, ebuf + len, diff);
+            memcpy(ebuf + diff, buf, len);
+        }
+        else
         {
-            const uint8_t  gzip1 = ebuf[0];
-            const uint8_t  gzip2 = ebuf[1];
-            const uint32_t isize = *(( uint32_t* )(ebuf + es - 4));
-            if (((gzip1 != GZIPID1) || (gzip2 != GZIPID2)) || (isize != 0))
+            if (j != 0)
             {
-                fprintf(stderr, "[%s] WARNING: Unexpected block structure in file '%s'.", __func__, fn[i].c_str());
-                fprintf(stderr, " Possible output corruption.\n");
                 if (bgzf_raw_write(fp, ebuf, es) < 0)
                     goto write_fail;
             }
+            len -= es;
+            memcpy(ebuf, buf + len, es);
+            if (bgzf_raw_write(fp, buf, len) < 0)
+                goto write_fail;
         }
-        bam_hdr_destroy(old);
-        bgzf_close(in);
-        in = NULL;
+        j = 1;
     }
-    free(buf);
-    if (bgzf_close(fp) < 0)
+
+    /* check final gzip block */
     {
-        fprintf(stderr, "[%s] Error on closing '%s'.\n", __func__, outbam);
-        return -1;
+        const uint8_t  gzip1 = ebuf[0];
+        const uint8_t  gzip2 = ebuf[1];
+        const uint32_t isize = *(( uint32_t* )(ebuf + es - 4));
+        if (((gzip1 != GZIPID1) || (gzip2 != GZIPID2)) || (isize != 0))
+        {
+            fprintf(stderr, "[%s] WARNING: Unexpected block structure in file '%s'.", __func__, part.c_str());
+            fprintf(stderr, " Possible output corruption.\n");
+            if (bgzf_raw_write(fp, ebuf, es) < 0)
+                goto write_fail;
+        }
     }
+    bam_hdr_destroy(old);
+    bgzf_close(in);
+    ++parts;
     return 0;
 
 write_fail:
-    fprintf(stderr, "[%s] Error writing to '%s'.\n", __func__, outbam);
+    fprintf(stderr, "[%s] Error writing to '%s'.\n", __func__, outbam.c_str());
 fail:
-    if (in)
-        bgzf_close(in);
-    if (fp)
-        bgzf_close(fp);
-    free(buf);
+    if (old)
+        bam_hdr_destroy(old);
+    bgzf_close(in);
     return -1;
-}
\ No newline at end of file
+}
+
+int BamCat::close()
+{
+    if (!fp)
+        return 0;
+    int ret = bgzf_close(fp);
+    fp      = NULL;
+    if (::close(out_fd) != 0)
+        ret = -1;
+    out_fd = -1;
+    if (ret < 0)
+    {
+        fprintf(stderr, "[%s] Error on closing '%s'.\n", __func__, outbam.c_str());
+        return -1;
+    }
+
+    if (index && strcmp(outbam.c_str(), "-") != 0)
+    {
+        // Remove the index left by an earlier run, it doesn't match the new file
+        std::string bai = outbam + ".bai", csi = outbam + ".csi";
+        unlink(bai.c_str());
+        unlink(csi.c_str());
+        std::string index_file = outbam + index->suffix();
+        if (index->isValid() && index->save(index_file) == 0)
+            spdlog::info("Write bam index:{}", index_file);
+        else
+        {
+            // A part was unsorted or rewritten, index the finished file instead
+            spdlog::info("Build index of bam:{} from the merged file", outbam);
+            if (sam_index_build3(outbam.c_str(), nullptr, index->isCSI() ? 14 : 0, threads) != 0)
+            {
+                spdlog::error("Failed build index of bam:{}", outbam);
+                return -1;
+            }
+        }
+    }
+    if (tag_index && strcmp(outbam.c_str(), "-") != 0)
+    {
+        std::string tag_index_file = outbam + TAG_INDEX_SUFFIX;
+        unlink(tag_index_file.c_str());
+        if (!tag_index->isValid())
+            spdlog::info("Skip tag index of bam:{}, the reads are rewritten", outbam);
+        else if (tag_index->save(tag_index_file) != 0)
+            spdlog::warn("Failed write bam tag index:{}", tag_index_file);
+        else
+            spdlog::info("Write bam tag index:{}", tag_index_file);
+    }
+    return 0;
+}
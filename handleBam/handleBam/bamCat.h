@@ -9,10 +9,55 @@
 
 #pragma once
 
+#include <memory>
 #include <string>
 #include <vector>
 
+#include "bamIndex.h"
 #include "htslib/bgzf.h"
 #include "htslib/sam.h"
+#include "tagIndex.h"
 
-int bam_cat(std::vector< std::string > fn, bam_hdr_t* h, const char* outbam, char* arg_list, int no_pg);
\ No newline at end of file
+int bam_cat(std::vector< std::string > fn, bam_hdr_t* h, const char* outbam, char* arg_list, int no_pg);
+
+// Concatenate bam files part by part, so a part can be appended as soon as it is
+// finished while the later ones are still being produced. The header is taken
+// from the first part if not given.
+// With write_index the index of each part is rebased to the position where its
+// data lands, and the merged index is written beside outbam on close(). If the
+// index of a part is not usable, the finished file is indexed with threads.
+// With write_tag_index the sidecar index of barcodes and genes is merged the same way.
+class BamCat
+{
+public:
+    BamCat(const std::string& outbam_, bam_hdr_t* h_ = nullptr, bool write_index_ = false,
+           bool write_tag_index = false, int threads_ = 1);
+    ~BamCat();
+
+    // Return 0 if success
+    int open();
+    int append(const std::string& part, const BamIndex* part_index = nullptr,
+               const TagIndex* part_tag_index = nullptr);
+    int close();
+
+private:
+    // Copy the compressed data of part as one byte range, return 1 if the layout
+    // of part is not supported and nothing has been written. The records are
+    // moved by delta bytes if kept is true, else their blocks are rewritten.
+    int appendRange(const std::string& part, int64_t& delta, bool& kept);
+    // Copy the compressed blocks of part one by one
+    int appendBlocks(const std::string& part);
+
+private:
+    std::string outbam;
+    bam_hdr_t*  h;
+    bool        write_index;
+    int         threads;
+    BGZF*       fp;
+    int         out_fd;
+    uint8_t*    buf;
+    size_t      parts;
+
+    std::unique_ptr< BamIndex > index;
+    std::unique_ptr< TagIndex > tag_index;
+};
\ No newline at end of file
@@ -0,0 +1,248 @@
+/*
+ * File: bamIndex.cpp
+ * Created Data: 2026-10-18
+ * Author: fxzhao
+ * Contact: <zhaofuxiang@genomics.cn>
+ *
+ * Copyright (c) 2026 BGI-Research
+ */
+
+#include "bamIndex.h"
+
+#include <algorithm>
+#include <fstream>
+
+#include "htslib/bgzf.h"
+
+BamIndex::BamIndex(const bam_hdr_t* h)
+    : csi(false), min_shift(14), n_lvls(5), valid(h != nullptr), n_no_coor(0), last_tid(-1), last_pos(0)
+{
+    if (h == nullptr)
+        return;
+    refs.resize(h->n_targets);
+
+    int64 max_len = 0;
+    for (int i = 0; i < h->n_targets; ++i)
+        max_len = std::max(max_len, int64(h->target_len[i]));
+    // Bai addresses the positions below 2^29 only, use the levels of csi
+    // enough to cover the longest reference as sam_index_build3()
+    if (max_len >= (1LL << 29))
+    {
+        csi     = true;
+        max_len += 256;
+        n_lvls  = 0;
+        for (int64 s = 1LL << min_shift; max_len > s; s <<= 3)
+            ++n_lvls;
+    }
+}
+
+uint32 BamIndex::reg2bin(int64 beg, int64 end) const
+{
+    int   s = min_shift;
+    int64 t = ((1LL << (3 * n_lvls)) - 1) / 7;
+    --end;
+    for (int l = n_lvls; l > 0; --l, s += 3, t -= 1LL << (3 * l))
+        if (beg >> s == end >> s)
+            return t + (beg >> s);
+    return 0;
+}
+
+uint32 BamIndex::binBottom(uint32 bin) const
+{
+    int l = 0;
+    for (uint32 b = bin; b != 0; b = (b - 1) >> 3)
+        ++l;
+    uint32 first = ((1u << (3 * l)) - 1) / 7;
+    return (bin - first) << (3 * (n_lvls - l));
+}
+
+void BamIndex::push(const bam1_t* b, uint64 voff_beg, uint64 voff_end)
+{
+    if (!valid)
+        return;
+
+    int tid = b->core.tid;
+    if (tid < 0)
+    {
+        ++n_no_coor;
+        return;
+    }
+    int64 beg = b->core.pos;
+    // The unplaced reads have to be the last ones
+    if (n_no_coor != 0 || beg < 0 || tid >= int(refs.size()) || tid < last_tid || (tid == last_tid && beg < last_pos))
+    {
+        valid = false;
+        return;
+    }
+    last_tid = tid;
+    last_pos = beg;
+
+    bool  mapped = (b->core.flag & BAM_FUNMAP) == 0;
+    int64 end    = mapped ? bam_endpos(b) : beg + 1;
+    if (end <= beg)
+        end = beg + 1;
+
+    RefIndex& ref = refs[tid];
+
+    // Extend the last chunk of the bin if the record starts in the block where
+    // the chunk ends, the block has to be decompressed anyway
+    std::vector< Chunk >& chunks = ref.bins[reg2bin(beg, end)];
+    if (!chunks.empty() && (chunks.back().end >> 16) >= (voff_beg >> 16))
+        chunks.back().end = voff_end;
+    else
+        chunks.push_back({ voff_beg, voff_end });
+
+    size_t w_end = (end - 1) >> min_shift;
+    if (ref.linear.size() <= w_end)
+        ref.linear.resize(w_end + 1, UNSET_OFFSET);
+    for (size_t w = beg >> min_shift; w <= w_end; ++w)
+        if (ref.linear[w] == UNSET_OFFSET)
+            ref.linear[w] = voff_beg;
+
+    if (ref.n_mapped + ref.n_unmapped == 0)
+        ref.off_beg = voff_beg;
+    ref.off_end = voff_end;
+    if (mapped)
+        ++ref.n_mapped;
+    else
+        ++ref.n_unmapped;
+}
+
+void BamIndex::merge(const BamIndex& part, int64 delta)
+{
+    if (!valid)
+        return;
+    if (!part.valid || part.refs.size() != refs.size() || part.csi != csi || part.n_lvls != n_lvls)
+    {
+        valid = false;
+        return;
+    }
+
+    // Only the compressed offset is moved, the offset inside the block is kept
+    const uint64 shift = uint64(delta) << 16;
+    for (size_t tid = 0; tid < refs.size(); ++tid)
+    {
+        const RefIndex& src = part.refs[tid];
+        if (src.n_mapped + src.n_unmapped == 0)
+            continue;
+        // The records of a reference can't be split into several parts, and the
+        // unplaced reads of the earlier parts must not precede them
+        RefIndex& dst = refs[tid];
+        if (dst.n_mapped + dst.n_unmapped != 0 || n_no_coor != 0)
+        {
+            valid = false;
+            return;
+        }
+
+        dst = src;
+        for (auto& [_, chunks] : dst.bins)
+        {
+            for (auto& c : chunks)
+            {
+                c.beg += shift;
+                c.end += shift;
+            }
+        }
+        for (auto& off : dst.linear)
+            if (off != UNSET_OFFSET)
+                off += shift;
+        dst.off_beg += shift;
+        dst.off_end += shift;
+    }
+    n_no_coor += part.n_no_coor;
+}
+
+std::vector< uint64 > BamIndex::fillLinear(const RefIndex& ref) const
+{
+    std::vector< uint64 > linear = ref.linear;
+    size_t                l      = 0;
+    for (; l < linear.size() && linear[l] == UNSET_OFFSET; ++l)
+        linear[l] = ref.off_beg;
+    for (; l < linear.size(); ++l)
+        if (linear[l] == UNSET_OFFSET)
+            linear[l] = linear[l - 1];
+    return linear;
+}
+
+void BamIndex::serialize(std::string& out) const
+{
+    auto put = [&out](auto v) { out.append(reinterpret_cast< const char* >(&v), sizeof(v)); };
+
+    out.append(csi ? "CSI\1" : "BAI\1", 4);
+    if (csi)
+    {
+        put(int32(min_shift));
+        put(int32(n_lvls));
+        put(int32(0));  // no auxiliary data for bam
+    }
+    put(int32(refs.size()));
+    for (const auto& ref : refs)
+    {
+        bool has_reads = ref.n_mapped + ref.n_unmapped != 0;
+        put(int32(ref.bins.size() + (has_reads ? 1 : 0)));
+
+        std::vector< uint64 > linear = fillLinear(ref);
+        for (const auto& [bin, chunks] : ref.bins)
+        {
+            put(uint32(bin));
+            if (csi)
+            {
+                // Csi keeps the linear offset of the first window of each bin
+                uint32 bottom = binBottom(bin);
+                put(uint64(bottom < linear.size() ? linear[bottom] : 0));
+            }
+            put(int32(chunks.size()));
+            for (const auto& c : chunks)
+            {
+                put(c.beg);
+                put(c.end);
+            }
+        }
+        if (has_reads)
+        {
+            put(uint32(metaBin()));
+            if (csi)
+                put(uint64(0));
+            put(int32(2));
+            put(ref.off_beg);
+            put(ref.off_end);
+            put(ref.n_mapped);
+            put(ref.n_unmapped);
+        }
+
+        if (!csi)
+        {
+            put(int32(linear.size()));
+            for (auto off : linear)
+                put(off);
+        }
+    }
+    put(n_no_coor);
+}
+
+int BamIndex::save(const std::string& filename) const
+{
+    if (!valid)
+        return -1;
+
+    std::string data;
+    serialize(data);
+
+    // Csi is bgzf compressed, bai is not
+    if (csi)
+    {
+        BGZF* fp = bgzf_open(filename.c_str(), "w");
+        if (fp == NULL)
+            return -1;
+        int ret = bgzf_write(fp, data.data(), data.size()) < 0 ? -1 : 0;
+        if (bgzf_close(fp) != 0)
+            ret = -1;
+        return ret;
+    }
+
+    std::ofstream ofs(filename, std::ios::binary | std::ios::trunc);
+    if (!ofs.is_open())
+        return -1;
+    ofs.write(data.data(), data.size());
+    return ofs.good() ? 0 : -1;
+}
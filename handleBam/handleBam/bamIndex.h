@@ -0,0 +1,99 @@
+/*
+ * File: bamIndex.h
+ * Created Data: 2026-10-18
+ * Author: fxzhao
+ * Contact: <zhaofuxiang@genomics.cn>
+ *
+ * Copyright (c) 2026 BGI-Research
+ */
+
+#pragma once
+
+#include <map>
+#include <string>
+#include <vector>
+
+#include "htslib/sam.h"
+#include "types.h"
+
+// Build the BAI/CSI index of a bam while it is written, instead of reading the
+// file again after it is finished. The layout follows hts_idx_t of htslib: each
+// reference has the chunks of virtual offsets binned by the UCSC binning scheme,
+// the linear index of 16kbp windows, and the pseudo bin with the offset range
+// and the number of mapped/unmapped reads.
+// The index of a part can be merged into the one of the concatenated file by
+// shifting the compressed offsets, see BamCat.
+class BamIndex
+{
+public:
+    // Use csi if any reference is too long for bai
+    explicit BamIndex(const bam_hdr_t* h);
+
+    // Add the record stored in [voff_beg, voff_end) of the bam. The index turns
+    // invalid if the records are not sorted by coordinate.
+    void push(const bam1_t* b, uint64 voff_beg, uint64 voff_end);
+    // Append the index of a part whose compressed data are moved by delta bytes
+    void merge(const BamIndex& part, int64 delta);
+
+    void invalidate()
+    {
+        valid = false;
+    }
+    bool isValid() const
+    {
+        return valid;
+    }
+    bool isCSI() const
+    {
+        return csi;
+    }
+    // ".bai" or ".csi"
+    const char* suffix() const
+    {
+        return csi ? ".csi" : ".bai";
+    }
+
+    // Write the index to file, return 0 if success
+    int save(const std::string& filename) const;
+
+private:
+    struct Chunk
+    {
+        uint64 beg;
+        uint64 end;
+    };
+
+    struct RefIndex
+    {
+        RefIndex() : off_beg(0), off_end(0), n_mapped(0), n_unmapped(0) {}
+        std::map< uint32, std::vector< Chunk > > bins;
+        std::vector< uint64 >                    linear;  // UNSET_OFFSET for the windows without reads
+        uint64                                   off_beg, off_end;
+        uint64                                   n_mapped, n_unmapped;
+    };
+
+    static constexpr uint64 UNSET_OFFSET = uint64(-1);
+
+    uint32 reg2bin(int64 beg, int64 end) const;
+    uint32 binBottom(uint32 bin) const;
+    uint32 metaBin() const
+    {
+        return ((1u << (3 * n_lvls + 3)) - 1) / 7 + 1;
+    }
+    // Fill the windows without reads, as update_loff() of htslib
+    std::vector< uint64 > fillLinear(const RefIndex& ref) const;
+    void                  serialize(std::string& out) const;
+
+private:
+    bool csi;
+    int  min_shift;
+    int  n_lvls;
+    bool valid;
+
+    std::vector< RefIndex > refs;
+    uint64                  n_no_coor;
+
+    // The last placed record, for checking the order
+    int   last_tid;
+    int64 last_pos;
+};
@@ -0,0 +1,132 @@
+/*
+ * File: cellLabels.cpp
+ * Created Data: 2026-10-18
+ * Author: fxzhao
+ * Contact: <zhaofuxiang@genomics.cn>
+ *
+ * Copyright (c) 2026 BGI-Research
+ */
+
+#include <cstdio>
+#include <cstring>
+#include <string_view>
+
+#include <spdlog/spdlog.h>
+
+#include "cellLabels.h"
+
+static const char NPY_MAGIC[6] = { '\x93', 'N', 'U', 'M', 'P', 'Y' };
+
+// Value of key in the dict of .npy header, e.g. 'descr': '<u4'
+static std::string_view npyValue(std::string_view dict, std::string_view key)
+{
+    size_t pos = dict.find(key);
+    if (pos == std::string_view::npos)
+        return {};
+    pos = dict.find(':', pos + key.size());
+    if (pos == std::string_view::npos)
+        return {};
+    pos = dict.find_first_not_of(' ', pos + 1);
+    if (pos == std::string_view::npos)
+        return {};
+    size_t end = dict[pos] == '(' ? dict.find(')', pos) + 1 : dict.find_first_of(",}", pos);
+    if (end == std::string_view::npos || end == 0)
+        return {};
+    return dict.substr(pos, end - pos);
+}
+
+int CellLabels::parseNpy(const std::string& filename, size_t& offset)
+{
+    const char* base = mapped.data();
+    size_t      size = mapped.size();
+    if (size < 10)
+    {
+        spdlog::error("Label image npy header is truncated: {}", filename);
+        return -1;
+    }
+    // Version 1 takes 2 bytes of header length, the later ones 4 bytes
+    uint8  major      = uint8(base[6]);
+    size_t len_bytes  = major == 1 ? 2 : 4;
+    size_t header_len = 0;
+    for (size_t i = 0; i < len_bytes && 8 + i < size; ++i)
+        header_len |= size_t(uint8(base[8 + i])) << (8 * i);
+    offset = 8 + len_bytes + header_len;
+    if (offset > size)
+    {
+        spdlog::error("Label image npy header is truncated: {}", filename);
+        return -1;
+    }
+
+    std::string_view dict(base + 8 + len_bytes, header_len);
+    std::string_view descr = npyValue(dict, "'descr'");
+    std::string_view order = npyValue(dict, "'fortran_order'");
+    std::string_view shape = npyValue(dict, "'shape'");
+    if (descr == "'|u1'" || descr == "'<u1'")
+        item_size = 1;
+    else if (descr == "'<u2'")
+        item_size = 2;
+    else if (descr == "'<u4'" || descr == "'<i4'")
+        item_size = 4;
+    else
+    {
+        spdlog::error("Label image dtype {} is not supported, expect uint8/uint16/uint32/int32: {}", descr, filename);
+        return -1;
+    }
+    if (order != "False")
+    {
+        spdlog::error("Label image must be in C order: {}", filename);
+        return -1;
+    }
+    long long h = 0, w = 0;
+    if (sscanf(std::string(shape).c_str(), "(%lld, %lld)", &h, &w) != 2 || h <= 0 || w <= 0)
+    {
+        spdlog::error("Label image shape {} is not 2 dimensions: {}", shape, filename);
+        return -1;
+    }
+    height = h;
+    width  = w;
+    return 0;
+}
+
+int CellLabels::load(const std::string& filename, int _x0, int _y0, int raw_width)
+{
+    data = nullptr;
+    if (!mapped.open(filename))
+    {
+        spdlog::error("Failed map label image: {}", filename);
+        return -1;
+    }
+
+    // The npy is known by magic, the other files are raw
+    size_t offset = 0;
+    bool   npy    = mapped.size() >= sizeof(NPY_MAGIC) && memcmp(mapped.data(), NPY_MAGIC, sizeof(NPY_MAGIC)) == 0;
+    if (!npy)
+    {
+        if (raw_width <= 0)
+        {
+            spdlog::error("Width is required by the raw label image: {}", filename);
+            return -1;
+        }
+        item_size = 4;
+        width     = raw_width;
+        height    = mapped.size() / item_size / width;
+        if (height == 0 || mapped.size() != uint64(width * height * item_size))
+        {
+            spdlog::error("Raw label image size {} is not a multiple of width {}: {}", mapped.size(), width, filename);
+            return -1;
+        }
+    }
+    else if (parseNpy(filename, offset) != 0)
+        return -1;
+
+    if ((mapped.size() - offset) / item_size / width < uint64(height))
+    {
+        spdlog::error("Label image is truncated: {}", filename);
+        return -1;
+    }
+    data = reinterpret_cast< const uint8* >(mapped.data()) + offset;
+    x0   = _x0;
+    y0   = _y0;
+    spdlog::info("Label image {}x{} from ({},{}) item size:{}", width, height, x0, y0, item_size);
+    return 0;
+}
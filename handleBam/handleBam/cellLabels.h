@@ -0,0 +1,58 @@
+/*
+ * File: cellLabels.h
+ * Created Data: 2026-10-18
+ * Author: fxzhao
+ * Contact: <zhaofuxiang@genomics.cn>
+ *
+ * Copyright (c) 2026 BGI-Research
+ */
+
+#pragma once
+
+#include <string>
+
+#include "mappedFile.h"
+#include "types.h"
+
+// Cell segmentation label image mapped as a dense array, the pixel (col, row)
+// holds the cell id of the coordinate (x0 + col, y0 + row), 0 is background. The
+// image is a .npy array of 2 dimensions in C order with unsigned 8/16/32 bits or
+// signed 32 bits little endian integers, or a raw array of uint32 with the width
+// given.
+class CellLabels
+{
+public:
+    CellLabels() : data(nullptr), item_size(0), width(0), height(0), x0(0), y0(0) {}
+
+    // Map the image, the raw array needs raw_width, .npy is known by its magic.
+    // Return 0 if success.
+    int load(const std::string& filename, int x0, int y0, int raw_width = 0);
+
+    uint32 label(int x, int y) const
+    {
+        int64 col = int64(x) - x0, row = int64(y) - y0;
+        if (col < 0 || row < 0 || col >= width || row >= height)
+            return 0;
+        const uint8* p = data + (uint64(row) * uint64(width) + uint64(col)) * item_size;
+        switch (item_size)
+        {
+        case 1:
+            return p[0];
+        case 2:
+            return uint32(p[0]) | uint32(p[1]) << 8;
+        default:
+            return uint32(p[0]) | uint32(p[1]) << 8 | uint32(p[2]) << 16 | uint32(p[3]) << 24;
+        }
+    }
+
+private:
+    // Parse the header of .npy, set the data offset. Return 0 if success.
+    int parseNpy(const std::string& filename, size_t& offset);
+
+private:
+    MappedFile   mapped;
+    const uint8* data;
+    int          item_size;
+    int64        width, height;
+    int          x0, y0;
+};
@@ -0,0 +1,331 @@
+/*
+ * File: coordMask.cpp
+ * Created Data: 2026-10-18
+ * Author: fxzhao
+ * Contact: <zhaofuxiang@genomics.cn>
+ *
+ * Copyright (c) 2026 BGI-Research
+ */
+
+#include <algorithm>
+#include <cctype>
+#include <charconv>
+#include <cstring>
+#include <fstream>
+#include <limits>
+
+#include <spdlog/spdlog.h>
+
+#include "coordMask.h"
+
+static inline bool parseInt(std::string_view sv, int& v)
+{
+    auto r = std::from_chars(sv.data(), sv.data() + sv.size(), v);
+    return r.ec == std::errc() && r.ptr == sv.data() + sv.size();
+}
+
+// Coordinate of a line, x_y or the last two columns split by spaces or tabs
+static bool parseLine(std::string_view line, int& x, int& y)
+{
+    const char* ws  = " \t\r";
+    size_t      end = line.find_last_not_of(ws);
+    if (end == std::string_view::npos)
+        return false;
+    line = line.substr(0, end + 1);
+
+    size_t pos_y = line.find_last_of(ws);
+    if (pos_y == std::string_view::npos)
+        return parse_coordinate(line, x, y);
+    std::string_view head  = line.substr(0, line.find_last_not_of(ws, pos_y) + 1);
+    size_t           pos_x = head.find_last_of(ws);
+    pos_x                  = pos_x == std::string_view::npos ? 0 : pos_x + 1;
+    return parseInt(head.substr(pos_x), x) && parseInt(line.substr(pos_y + 1), y);
+}
+
+int CoordMask::build(const std::string& filename)
+{
+    // Two passes over the file, the first finds the rectangle, then the bits are
+    // set without keeping the coordinates which may be billions
+    CoordMaskHeader h;
+    memset(&h, 0, sizeof(h));
+    h.cell = 1;
+
+    int    min_x = std::numeric_limits< int >::max(), min_y = min_x;
+    int    max_x = std::numeric_limits< int >::min(), max_y = max_x;
+    uint64 skipped = 0;
+    for (int pass = 0; pass < 2; ++pass)
+    {
+        std::ifstream ifs(filename);
+        if (!ifs.is_open())
+        {
+            spdlog::error("Failed open file: {}", filename);
+            return -1;
+        }
+        std::vector< uint64 > words;
+        if (pass == 1)
+        {
+            if (max_x < min_x)
+            {
+                spdlog::error("No coordinate found in mask: {}", filename);
+                return -1;
+            }
+            h.x0     = min_x;
+            h.y0     = min_y;
+            h.width  = int32(int64(max_x) - min_x + 1);
+            h.height = int32(int64(max_y) - min_y + 1);
+            words.assign((uint64(h.width) * uint64(h.height) + 63) / 64, 0);
+        }
+
+        std::string line;
+        int         x, y;
+        while (std::getline(ifs, line))
+        {
+            if (line.empty() || line[0] == '#')
+                continue;
+            if (!parseLine(line, x, y))
+            {
+                // Header line or barcode without coordinate
+                if (pass == 0)
+                    ++skipped;
+                continue;
+            }
+            if (pass == 0)
+            {
+                min_x = std::min(min_x, x);
+                max_x = std::max(max_x, x);
+                min_y = std::min(min_y, y);
+                max_y = std::max(max_y, y);
+            }
+            else
+            {
+                uint64 i = uint64(y - h.y0) * uint64(h.width) + uint64(x - h.x0);
+                words[i >> 6] |= uint64(1) << (i & 63);
+            }
+        }
+        if (pass == 1)
+        {
+            for (uint64 w : words)
+                h.cells_set += __builtin_popcountll(w);
+            assign(h, words);
+        }
+    }
+    if (skipped != 0)
+        spdlog::warn("Skip {} lines without coordinate in mask: {}", skipped, filename);
+    spdlog::info("Coordinate mask x:[{},{}] y:[{},{}] coordinates:{}", min_x, max_x, min_y, max_y, header->cells_set);
+    return 0;
+}
+
+// Next number of the Netpbm header or the plain data, comments begin with '#'
+static bool readNumber(std::istream& is, int64& v)
+{
+    int c;
+    while ((c = is.get()) != EOF)
+    {
+        if (c == '#')
+        {
+            while ((c = is.get()) != EOF && c != '\n')
+                ;
+        }
+        else if (!isspace(c))
+            break;
+    }
+    if (c == EOF || !isdigit(c))
+        return false;
+    v = 0;
+    for (; c != EOF && isdigit(c); c = is.get())
+    {
+        v = v * 10 + (c - '0');
+        if (v > std::numeric_limits< int32 >::max())
+            return false;
+    }
+    // One whitespace ends the number, the binary data follows the header directly
+    return c == EOF || isspace(c);
+}
+
+int CoordMask::buildImage(const std::string& filename, int x0, int y0, int cell)
+{
+    std::ifstream ifs(filename, std::ios::binary);
+    if (!ifs.is_open())
+    {
+        spdlog::error("Failed open file: {}", filename);
+        return -1;
+    }
+    char  magic[2];
+    int64 width = 0, height = 0, maxval = 1;
+    if (!ifs.read(magic, 2) || magic[0] != 'P' || magic[1] < '1' || magic[1] == '3' || magic[1] > '5'
+        || !readNumber(ifs, width) || !readNumber(ifs, height) || width <= 0 || height <= 0
+        || (magic[1] != '1' && magic[1] != '4' && (!readNumber(ifs, maxval) || maxval <= 0 || maxval > 65535)))
+    {
+        spdlog::error("Invalid PBM/PGM image: {}", filename);
+        return -1;
+    }
+    if (cell <= 0 || int64(x0) + width * cell - 1 > std::numeric_limits< int >::max()
+        || int64(y0) + height * cell - 1 > std::numeric_limits< int >::max())
+    {
+        spdlog::error("Image of {}x{} with cell {} is out of coordinates: {}", width, height, cell, filename);
+        return -1;
+    }
+
+    CoordMaskHeader h;
+    memset(&h, 0, sizeof(h));
+    h.x0     = x0;
+    h.y0     = y0;
+    h.width  = int32(width);
+    h.height = int32(height);
+    h.cell   = cell;
+    std::vector< uint64 > words((uint64(width) * uint64(height) + 63) / 64, 0);
+
+    // One row of the binary formats at a time
+    size_t              row_bytes = magic[1] == '4' ? (width + 7) / 8 : width * (maxval > 255 ? 2 : 1);
+    std::vector< char > row(row_bytes);
+    bool                plain = magic[1] == '1' || magic[1] == '2';
+    for (int64 r = 0; r < height; ++r)
+    {
+        if (!plain && !ifs.read(row.data(), row_bytes))
+        {
+            spdlog::error("Image is truncated: {}", filename);
+            return -1;
+        }
+        const uint8* p = reinterpret_cast< const uint8* >(row.data());
+        for (int64 c = 0; c < width; ++c)
+        {
+            bool set;
+            if (magic[1] == '4')
+                set = (p[c >> 3] >> (7 - (c & 7))) & 1;
+            else if (magic[1] == '5')
+                set = maxval > 255 ? (p[2 * c] | p[2 * c + 1]) != 0 : p[c] != 0;
+            else if (magic[1] == '1')
+            {
+                // The plain PBM digits may be written without spaces
+                int ch;
+                while ((ch = ifs.get()) != EOF && ch != '0' && ch != '1')
+                    ;
+                if (ch == EOF)
+                {
+                    spdlog::error("Image is truncated: {}", filename);
+                    return -1;
+                }
+                set = ch == '1';
+            }
+            else
+            {
+                int64 v;
+                if (!readNumber(ifs, v))
+                {
+                    spdlog::error("Image is truncated: {}", filename);
+                    return -1;
+                }
+                set = v != 0;
+            }
+            if (set)
+            {
+                uint64 i = uint64(r) * uint64(width) + uint64(c);
+                words[i >> 6] |= uint64(1) << (i & 63);
+                ++h.cells_set;
+            }
+        }
+    }
+    assign(h, words);
+    spdlog::info("Image mask {}x{} from ({},{}) cell:{} set:{}", width, height, x0, y0, cell, h.cells_set);
+    return 0;
+}
+
+bool CoordMask::isImageFile(const std::string& filename)
+{
+    std::ifstream ifs(filename, std::ios::binary);
+    char          magic[3];
+    if (!ifs.read(magic, sizeof(magic)))
+        return false;
+    return magic[0] == 'P' && (magic[1] == '1' || magic[1] == '2' || magic[1] == '4' || magic[1] == '5')
+           && isspace(magic[2]);
+}
+
+void CoordMask::assign(CoordMaskHeader h, const std::vector< uint64 >& words)
+{
+    memcpy(h.magic, COORD_MASK_MAGIC, sizeof(h.magic));
+    h.version     = COORD_MASK_VERSION;
+    h.bits_offset = align8(sizeof(h));
+    h.file_size   = h.bits_offset + words.size() * sizeof(uint64);
+    h.checksum    = checksum(words.data(), words.size() * sizeof(uint64));
+
+    buffer.assign(h.file_size / sizeof(uint64), 0);
+    char* base = reinterpret_cast< char* >(buffer.data());
+    memcpy(base, &h, sizeof(h));
+    if (!words.empty())
+        memcpy(base + h.bits_offset, words.data(), words.size() * sizeof(uint64));
+
+    mapped.close();
+    attach(base, h.file_size, false);
+}
+
+int CoordMask::load(const std::string& filename, bool verify)
+{
+    if (!isMaskFile(filename))
+        return build(filename);
+
+    buffer.clear();
+    if (!mapped.open(filename))
+        return -1;
+    if (attach(mapped.data(), mapped.size(), verify) != 0)
+    {
+        spdlog::error("Invalid coordinate mask: {}", filename);
+        mapped.close();
+        return -1;
+    }
+    return 0;
+}
+
+int CoordMask::save(const std::string& filename) const
+{
+    if (header == nullptr)
+    {
+        spdlog::error("Coordinate mask is empty");
+        return -1;
+    }
+
+    return writeFileAtomic(filename, reinterpret_cast< const char* >(header), header->file_size);
+}
+
+bool CoordMask::isMaskFile(const std::string& filename)
+{
+    std::ifstream ifs(filename, std::ios::binary);
+    char          magic[sizeof(COORD_MASK_MAGIC)];
+    if (!ifs.read(magic, sizeof(magic)))
+        return false;
+    return memcmp(magic, COORD_MASK_MAGIC, sizeof(magic)) == 0;
+}
+
+int CoordMask::attach(const char* base, size_t size, bool verify)
+{
+    header = nullptr;
+    bits   = nullptr;
+
+    const auto* h = reinterpret_cast< const CoordMaskHeader* >(base);
+    if (size < sizeof(CoordMaskHeader) || memcmp(h->magic, COORD_MASK_MAGIC, sizeof(h->magic)) != 0)
+    {
+        spdlog::error("Coordinate mask has wrong magic number");
+        return -1;
+    }
+    if (h->version != COORD_MASK_VERSION)
+    {
+        spdlog::error("Coordinate mask version {} is not supported, expect {}. Please rebuild it with index-mask",
+                      h->version, COORD_MASK_VERSION);
+        return -1;
+    }
+    uint64 words = h->width > 0 && h->height > 0 ? (uint64(h->width) * uint64(h->height) + 63) / 64 : 0;
+    if (h->file_size != size || h->cell <= 0 || words == 0 || h->bits_offset % 8 != 0 || h->bits_offset > size
+        || (size - h->bits_offset) / sizeof(uint64) != words)
+    {
+        spdlog::error("Coordinate mask size mismatch");
+        return -1;
+    }
+    if (verify && checksum(base + h->bits_offset, size - h->bits_offset) != h->checksum)
+    {
+        spdlog::error("Coordinate mask checksum mismatch");
+        return -1;
+    }
+
+    header = h;
+    bits   = reinterpret_cast< const uint64* >(base + h->bits_offset);
+    return 0;
+}
@@ -0,0 +1,92 @@
+/*
+ * File: coordMask.h
+ * Created Data: 2026-10-18
+ * Author: fxzhao
+ * Contact: <zhaofuxiang@genomics.cn>
+ *
+ * Copyright (c) 2026 BGI-Research
+ */
+
+#pragma once
+
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "mappedFile.h"
+#include "types.h"
+#include "utils.h"
+
+// Dense bitmap over the rectangle of chip coordinates, one bit per cell of
+// cell x cell coordinates. Testing a barcode is a bound check and a bit test, and
+// the compiled mask is mapped and shared between processes like the annotation index.
+static const char   COORD_MASK_MAGIC[8] = { 'H', 'B', 'C', 'R', 'D', 'M', 'S', 'K' };
+static const uint32 COORD_MASK_VERSION  = 1;
+
+struct CoordMaskHeader
+{
+    char   magic[8];
+    uint32 version;
+    uint32 checksum;  // crc32 of the bits
+    uint64 file_size;
+    int32  x0, y0;         // coordinate of the first cell
+    int32  width, height;  // in cells
+    int32  cell;           // coordinates per side of a cell
+    uint32 reserved;
+    uint64 cells_set;
+    uint64 bits_offset;  // row major, in 64 bits words
+};
+
+class CoordMask
+{
+public:
+    CoordMask() : header(nullptr), bits(nullptr) {}
+
+    // Map a compiled mask, or compile a text list of coordinates given as x_y, or
+    // as the last two columns of each line. Return 0 if success. The checksum of a
+    // compiled mask is verified only if required, which reads the whole file.
+    int load(const std::string& filename, bool verify = false);
+    // Compile the text list of coordinates, return 0 if success
+    int build(const std::string& filename);
+    // Compile a Netpbm image, PBM(P1/P4) or PGM(P2/P5), the nonzero pixels are set
+    // in PGM and the black ones in PBM. Pixel (col, row) covers the cell x cell
+    // coordinates from (x0 + col * cell, y0 + row * cell). Return 0 if success.
+    int buildImage(const std::string& filename, int x0, int y0, int cell);
+    // Write the compiled mask to file, return 0 if success
+    int save(const std::string& filename) const;
+
+    static bool isMaskFile(const std::string& filename);
+    static bool isImageFile(const std::string& filename);
+
+    bool contains(int x, int y) const
+    {
+        int64 cx = floorDiv(int64(x) - header->x0, header->cell);
+        int64 cy = floorDiv(int64(y) - header->y0, header->cell);
+        if (cx < 0 || cy < 0 || cx >= header->width || cy >= header->height)
+            return false;
+        uint64 i = uint64(cy) * uint64(header->width) + uint64(cx);
+        return (bits[i >> 6] >> (i & 63)) & 1;
+    }
+    // False if the barcode is not a coordinate
+    bool contains(std::string_view barcode) const
+    {
+        int x, y;
+        return parse_coordinate(barcode, x, y) && contains(x, y);
+    }
+
+    uint64 cellsSet() const
+    {
+        return header->cells_set;
+    }
+
+private:
+    // Make the image from the header and the bits, and use it
+    void assign(CoordMaskHeader h, const std::vector< uint64 >& words);
+    int  attach(const char* base, size_t size, bool verify);
+
+private:
+    MappedFile             mapped;
+    std::vector< uint64 >  buffer;  // the image if built in memory
+    const CoordMaskHeader* header;
+    const uint64*          bits;
+};
@@ -0,0 +1,592 @@
+/*
+ * File: expMatrix.cpp
+ * Created Data: 2026-10-18
+ * Author: fxzhao
+ * Contact: <zhaofuxiang@genomics.cn>
+ *
+ * Copyright (c) 2026 BGI-Research
+ */
+
+#include "expMatrix.h"
+
+#include <algorithm>
+#include <filesystem>
+#include <numeric>
+#include <parallel/algorithm>
+namespace fs = std::filesystem;
+
+#include <omp.h>
+#include <spdlog/spdlog.h>
+
+#include "cellLabels.h"
+#include "expStore.h"
+#include "textWriter.h"
+#include "utils.h"
+
+uint32 ExpCounter::localId(std::unordered_map< std::string, uint32 >& ids, const std::string& name)
+{
+    auto it = ids.find(name);
+    if (it != ids.end())
+        return it->second;
+    uint32 id = ids.size();
+    ids.emplace(name, id);
+    return id;
+}
+
+uint32 ExpCounter::barcodeId(const std::string& barcode)
+{
+    auto it = barcode_ids.find(barcode);
+    if (it != barcode_ids.end())
+        return it->second;
+    uint32 id = barcode_ids.size();
+    barcode_ids.emplace(barcode, id);
+
+    Coordinate c{ INVALID_COORD, INVALID_COORD };
+    int        x, y;
+    if (parse_coordinate(barcode, x, y))
+        c = { x, y };
+    coords.push_back(c);
+    return id;
+}
+
+void ExpCounter::add(const std::string& barcode, const std::string& gene, uint32 umi, uint32 reads)
+{
+    uint64    key = (uint64(barcodeId(barcode)) << 32) | localId(gene_ids, gene);
+    ExpCount& c   = counts[key];
+    c.umi += umi;
+    c.reads += reads;
+}
+
+uint32 ExpMatrix::globalId(std::unordered_map< std::string, uint32 >& ids, std::vector< std::string >& names,
+                           const std::string& name)
+{
+    auto it = ids.find(name);
+    if (it != ids.end())
+        return it->second;
+    uint32 id = names.size();
+    ids.emplace(name, id);
+    names.push_back(name);
+    return id;
+}
+
+void ExpMatrix::merge(ExpCounter& counter)
+{
+    // Translate the ids of the task, in the order the names are numbered there
+    // so the global order doesn't depend on the hash table layout
+    auto remap = [](std::unordered_map< std::string, uint32 >& local_ids,
+                    std::unordered_map< std::string, uint32 >& ids, std::vector< std::string >& names) {
+        std::vector< const std::string* > local_names(local_ids.size());
+        for (auto& [name, id] : local_ids)
+            local_names[id] = &name;
+        std::vector< uint32 > mapping(local_names.size());
+        for (size_t i = 0; i < local_names.size(); ++i)
+            mapping[i] = globalId(ids, names, *local_names[i]);
+        return mapping;
+    };
+    std::vector< uint32 > barcode_map = remap(counter.barcode_ids, barcode_ids, barcodes);
+    std::vector< uint32 > gene_map    = remap(counter.gene_ids, gene_ids, genes);
+    coords.resize(barcodes.size());
+    for (size_t i = 0; i < barcode_map.size(); ++i)
+        coords[barcode_map[i]] = counter.coords[i];
+
+    finished = false;
+    entries.reserve(entries.size() + counter.counts.size());
+    for (auto& [key, count] : counter.counts)
+    {
+        uint64 global_key = (uint64(barcode_map[key >> 32]) << 32) | gene_map[key & 0xFFFFFFFF];
+        entries.push_back({ global_key, count });
+    }
+
+    std::unordered_map< std::string, uint32 >().swap(counter.barcode_ids);
+    std::unordered_map< std::string, uint32 >().swap(counter.gene_ids);
+    std::vector< Coordinate >().swap(counter.coords);
+    std::unordered_map< uint64, ExpCount >().swap(counter.counts);
+}
+
+void ExpMatrix::finish()
+{
+    if (finished)
+        return;
+    finished = true;
+    std::sort(entries.begin(), entries.end(), [](const ExpEntry& a, const ExpEntry& b) { return a.key < b.key; });
+
+    // The same gene name may come from several contigs
+    size_t n = 0;
+    for (size_t i = 0; i < entries.size(); ++i)
+    {
+        if (n != 0 && entries[n - 1].key == entries[i].key)
+        {
+            entries[n - 1].count.umi += entries[i].count.umi;
+            entries[n - 1].count.reads += entries[i].count.reads;
+        }
+        else
+            entries[n++] = entries[i];
+    }
+    entries.resize(n);
+}
+
+std::vector< uint64 > ExpMatrix::barcodeCounts() const
+{
+    std::vector< uint64 > cnts(barcodes.size(), 0);
+    for (auto& e : entries)
+        cnts[e.key >> 32] += e.count.umi;
+    return cnts;
+}
+
+int ExpMatrix::writeExp(const std::string& filename, bool with_reads, const std::vector< bool >& discard,
+                        int threads) const
+{
+    TextWriter out(filename, threads);
+    if (!out.isOpen())
+        return -1;
+
+    for (auto& e : entries)
+    {
+        uint32 barcode = e.key >> 32;
+        if (!discard.empty() && discard[barcode])
+            continue;
+        out << barcodes[barcode] << '\t' << genes[e.key & 0xFFFFFFFF] << '\t' << e.count.umi;
+        if (with_reads)
+            out << '\t' << e.count.reads;
+        out << '\n';
+    }
+    return out.close();
+}
+
+int ExpMatrix::writeMtx(const std::string& path, const std::vector< bool >& discard, int threads) const
+{
+    // Number the barcodes and genes of the kept entries in the order they appear
+    const uint32          UNSET = 0;
+    std::vector< uint32 > barcode_rank(barcodes.size(), UNSET), gene_rank(genes.size(), UNSET);
+    std::vector< uint32 > barcode_order, gene_order;
+    size_t                nnz = 0;
+    for (auto& e : entries)
+    {
+        uint32 barcode = e.key >> 32, gene = e.key & 0xFFFFFFFF;
+        if (!discard.empty() && discard[barcode])
+            continue;
+        if (barcode_rank[barcode] == UNSET)
+        {
+            barcode_order.push_back(barcode);
+            barcode_rank[barcode] = barcode_order.size();
+        }
+        if (gene_rank[gene] == UNSET)
+        {
+            gene_order.push_back(gene);
+            gene_rank[gene] = gene_order.size();
+        }
+        ++nnz;
+    }
+
+    fs::path dir(path);
+    {
+        TextWriter out((dir / "barcodes.tsv.gz").string(), threads);
+        for (auto id : barcode_order)
+            out << barcodes[id] << '\n';
+        if (out.close() != 0)
+            return -1;
+    }
+    {
+        TextWriter out((dir / "genes.tsv.gz").string(), threads);
+        for (auto id : gene_order)
+            out << genes[id] << '\n';
+        if (out.close() != 0)
+            return -1;
+    }
+
+    const char sep = ' ';
+    TextWriter out((dir / "matrix.mtx.gz").string(), threads);
+    out << "%%MatrixMarket matrix coordinate real general\n%\n";
+    out << barcode_order.size() << sep << gene_order.size() << sep << nnz << '\n';
+    for (auto& e : entries)
+    {
+        uint32 barcode = e.key >> 32;
+        if (!discard.empty() && discard[barcode])
+            continue;
+        out << barcode_rank[barcode] << sep << gene_rank[e.key & 0xFFFFFFFF] << sep << e.count.umi << '\n';
+    }
+    return out.close();
+}
+
+bool ExpMatrix::boundingBox(int32& min_x, int32& min_y, int32& max_x, int32& max_y) const
+{
+    min_x = min_y = INT32_MAX;
+    max_x = max_y = INT32_MIN;
+    for (auto& c : coords)
+    {
+        if (c.x == INVALID_COORD)
+            return false;
+        min_x = std::min(min_x, c.x);
+        min_y = std::min(min_y, c.y);
+        max_x = std::max(max_x, c.x);
+        max_y = std::max(max_y, c.y);
+    }
+    if (coords.empty())
+        min_x = min_y = max_x = max_y = 0;
+    return true;
+}
+
+int ExpMatrix::writeGem(const std::string& filename, GemOrder order, int threads) const
+{
+    int32 min_x, min_y, max_x, max_y;
+    if (!boundingBox(min_x, min_y, max_x, max_y))
+    {
+        spdlog::warn("Skip gem output, the barcodes are not coordinates");
+        return -1;
+    }
+
+    struct GemRecord
+    {
+        uint32 rank;  // the gene rank or the tile
+        int32  x;
+        int32  y;
+        uint32 gene;
+        uint32 count;
+    };
+    std::vector< GemRecord > records;
+    records.reserve(entries.size());
+    if (order == GEM_BY_GENE)
+    {
+        std::vector< uint32 > by_name(genes.size()), gene_rank(genes.size());
+        for (size_t i = 0; i < genes.size(); ++i)
+            by_name[i] = i;
+        std::sort(by_name.begin(), by_name.end(), [this](uint32 a, uint32 b) { return genes[a] < genes[b]; });
+        for (size_t i = 0; i < by_name.size(); ++i)
+            gene_rank[by_name[i]] = i;
+        for (auto& e : entries)
+        {
+            const Coordinate& c    = coords[e.key >> 32];
+            uint32            gene = e.key & 0xFFFFFFFF;
+            records.push_back({ gene_rank[gene], c.x - min_x, c.y - min_y, gene, e.count.umi });
+        }
+    }
+    else
+    {
+        uint32 tiles_x = (max_x - min_x) / GEM_TILE_SIZE + 1;
+        for (auto& e : entries)
+        {
+            const Coordinate& c = coords[e.key >> 32];
+            int32             x = c.x - min_x, y = c.y - min_y;
+            uint32            tile = order == GEM_BY_TILE ? (y / GEM_TILE_SIZE) * tiles_x + x / GEM_TILE_SIZE : 0;
+            records.push_back({ tile, x, y, uint32(e.key & 0xFFFFFFFF), e.count.umi });
+        }
+    }
+    if (order != GEM_UNSORTED)
+    {
+        omp_set_num_threads(threads);
+        __gnu_parallel::sort(records.begin(), records.end(), [](const GemRecord& a, const GemRecord& b) {
+            if (a.rank != b.rank)
+                return a.rank < b.rank;
+            if (a.y != b.y)
+                return a.y < b.y;
+            if (a.x != b.x)
+                return a.x < b.x;
+            return a.gene < b.gene;
+        });
+    }
+
+    static const char* ORDER_NAMES[] = { "None", "geneID", "tile" };
+    TextWriter         out(filename, threads);
+    if (!out.isOpen())
+        return -1;
+    out << "#FileFormat=GEMv0.1\n#SortedBy=" << ORDER_NAMES[order] << '\n';
+    if (order == GEM_BY_TILE)
+        out << "#TileSize=" << GEM_TILE_SIZE << '\n';
+    out << "#OffsetX=" << min_x << "\n#OffsetY=" << min_y << '\n';
+    out << "#BoundingBox=" << min_x << ',' << min_y << ',' << max_x << ',' << max_y << '\n';
+    out << "geneID\tx\ty\tMIDCount\n";
+    for (auto& r : records)
+        out << genes[r.gene] << '\t' << r.x << '\t' << r.y << '\t' << r.count << '\n';
+    return out.close();
+}
+
+int ExpMatrix::writeBins(const std::string& path, const std::vector< int >& bin_sizes, int threads) const
+{
+    int32 min_x, min_y, max_x, max_y;
+    if (!boundingBox(min_x, min_y, max_x, max_y))
+    {
+        spdlog::warn("Skip bin output, the barcodes are not coordinates");
+        return -1;
+    }
+
+    auto makeTiling = [&](int32 unit) {
+        int32 size = unit * std::max(1, BIN_TILE_SIZE / unit);
+        int32 ox = floorDiv(min_x, size) * size, oy = floorDiv(min_y, size) * size;
+        return BinTiling{ size, ox, oy, uint32((max_x - ox) / size + 1) };
+    };
+
+    // All the sizes share the tiles of their lcm if it's small enough, then the
+    // spots are sorted only once. The tiles of the smallest size must not have too
+    // many bins either, a tile of its own size always has 1000 bins per side at most.
+    int32 lcm = 1, min_size = BIN_TILE_MAX_SIZE;
+    for (int n : bin_sizes)
+    {
+        lcm      = std::lcm(lcm, std::min(n, BIN_TILE_MAX_SIZE + 1));
+        min_size = std::min(min_size, n);
+        if (lcm > BIN_TILE_MAX_SIZE)
+            break;
+    }
+    bool                     shared = lcm <= BIN_TILE_MAX_SIZE;
+    BinTiling                tiling{};
+    std::vector< SpotCount > spots;
+    if (shared)
+    {
+        tiling = makeTiling(lcm);
+        shared = tiling.size / min_size <= BIN_TILE_MAX_BINS;
+    }
+    if (shared)
+        spots = spotsByTile(tiling, threads);
+
+    for (int n : bin_sizes)
+    {
+        fs::path        dir = fs::path(path) / ("bin" + std::to_string(n));
+        std::error_code ec;
+        fs::create_directories(dir, ec);
+        if (ec)
+        {
+            spdlog::error("Error creating directory:{} {}", dir.string(), ec.message());
+            return -1;
+        }
+
+        int ret;
+        if (shared)
+            ret = writeBin(dir.string(), n, tiling, spots, threads);
+        else
+        {
+            BinTiling t = makeTiling(n);
+            ret         = writeBin(dir.string(), n, t, spotsByTile(t, threads), threads);
+        }
+        if (ret != 0)
+            return ret;
+    }
+    return 0;
+}
+
+std::vector< ExpMatrix::SpotCount > ExpMatrix::spotsByTile(const BinTiling& tiling, int threads) const
+{
+    std::vector< SpotCount > spots;
+    spots.reserve(entries.size());
+    for (auto& e : entries)
+    {
+        const Coordinate& c = coords[e.key >> 32];
+        uint32 tile = ((c.y - tiling.origin_y) / tiling.size) * tiling.tiles_x + (c.x - tiling.origin_x) / tiling.size;
+        spots.push_back({ tile, uint32(e.key & 0xFFFFFFFF), c.x, c.y, e.count.umi });
+    }
+
+    omp_set_num_threads(threads);
+    __gnu_parallel::sort(spots.begin(), spots.end(), [](const SpotCount& a, const SpotCount& b) {
+        return a.tile != b.tile ? a.tile < b.tile : a.gene < b.gene;
+    });
+    return spots;
+}
+
+int ExpMatrix::writeBin(const std::string& path, int bin_size, const BinTiling& tiling,
+                        const std::vector< SpotCount >& spots, int threads) const
+{
+    // Ranges of the tiles in spots
+    std::vector< size_t > tile_begs;
+    for (size_t i = 0; i < spots.size(); ++i)
+        if (i == 0 || spots[i].tile != spots[i - 1].tile)
+            tile_begs.push_back(i);
+    size_t tiles = tile_begs.size();
+    tile_begs.push_back(spots.size());
+
+    struct BinCount
+    {
+        uint32 bin;  // the position in tile, then the row in tile
+        uint32 gene;
+        uint32 umi;
+    };
+    std::vector< std::vector< BinCount > > tile_bins(tiles);
+    std::vector< std::vector< uint32 > >   tile_rows(tiles);
+
+    // A bin never crosses tiles, so the bins of a tile are summed in a dense
+    // array indexed by the position, instead of a hash map of all the bins
+    const int32 n = tiling.size / bin_size;
+    omp_set_num_threads(threads);
+#pragma omp parallel
+    {
+        std::vector< uint32 > dense(size_t(n) * n, 0);
+        std::vector< uint32 > touched;
+#pragma omp for schedule(dynamic)
+        for (size_t t = 0; t < tiles; ++t)
+        {
+            size_t                   beg = tile_begs[t], end = tile_begs[t + 1];
+            int32                    x0   = tiling.origin_x + (spots[beg].tile % tiling.tiles_x) * tiling.size;
+            int32                    y0   = tiling.origin_y + (spots[beg].tile / tiling.tiles_x) * tiling.size;
+            std::vector< BinCount >& bins = tile_bins[t];
+            std::vector< uint32 >&   rows = tile_rows[t];
+
+            // Sum the spots of each gene, only the touched bins are reset
+            for (size_t i = beg; i < end;)
+            {
+                uint32 gene = spots[i].gene;
+                for (; i < end && spots[i].gene == gene; ++i)
+                {
+                    uint32 pos = ((spots[i].y - y0) / bin_size) * n + (spots[i].x - x0) / bin_size;
+                    if (dense[pos] == 0)
+                        touched.push_back(pos);
+                    dense[pos] += spots[i].umi;
+                }
+                std::sort(touched.begin(), touched.end());
+                for (auto pos : touched)
+                {
+                    if (dense[pos] != 0)
+                        bins.push_back({ pos, gene, dense[pos] });
+                    dense[pos] = 0;
+                }
+                touched.clear();
+            }
+
+            // Number the bins of the tile by position
+            for (auto& b : bins)
+                rows.push_back(b.bin);
+            std::sort(rows.begin(), rows.end());
+            rows.erase(std::unique(rows.begin(), rows.end()), rows.end());
+            for (size_t r = 0; r < rows.size(); ++r)
+                dense[rows[r]] = r;
+            for (auto& b : bins)
+                b.bin = dense[b.bin];
+            for (auto pos : rows)
+                dense[pos] = 0;
+        }
+    }
+
+    // Rows are the bins tile by tile, columns are all the genes
+    std::vector< size_t > row_offsets(tiles + 1, 0);
+    size_t                nnz = 0;
+    for (size_t t = 0; t < tiles; ++t)
+    {
+        row_offsets[t + 1] = row_offsets[t] + tile_rows[t].size();
+        nnz += tile_bins[t].size();
+    }
+
+    fs::path dir(path);
+    {
+        TextWriter out((dir / "barcodes.tsv.gz").string(), threads);
+        for (size_t t = 0; t < tiles; ++t)
+        {
+            int32 bx0 = (tiling.origin_x + (spots[tile_begs[t]].tile % tiling.tiles_x) * tiling.size) / bin_size;
+            int32 by0 = (tiling.origin_y + (spots[tile_begs[t]].tile / tiling.tiles_x) * tiling.size) / bin_size;
+            for (auto pos : tile_rows[t])
+                out << bx0 + int32(pos % n) << '_' << by0 + int32(pos / n) << '\n';
+        }
+        if (out.close() != 0)
+            return -1;
+    }
+    {
+        TextWriter out((dir / "genes.tsv.gz").string(), threads);
+        for (auto& gene : genes)
+            out << gene << '\n';
+        if (out.close() != 0)
+            return -1;
+    }
+
+    const char sep = ' ';
+    TextWriter out((dir / "matrix.mtx.gz").string(), threads);
+    out << "%%MatrixMarket matrix coordinate real general\n%\n";
+    out << row_offsets[tiles] << sep << genes.size() << sep << nnz << '\n';
+    for (size_t t = 0; t < tiles; ++t)
+        for (auto& b : tile_bins[t])
+            out << row_offsets[t] + b.bin + 1 << sep << b.gene + 1 << sep << b.umi << '\n';
+    return out.close();
+}
+
+int ExpMatrix::writeCells(const std::string& path, const CellLabels& labels, int threads) const
+{
+    int32 min_x, min_y, max_x, max_y;
+    if (!boundingBox(min_x, min_y, max_x, max_y))
+    {
+        spdlog::warn("Skip cell output, the barcodes are not coordinates");
+        return -1;
+    }
+
+    // Look up the cell of each spot once, the entries of a spot are contiguous
+    std::vector< uint32 > cell_of(barcodes.size());
+    omp_set_num_threads(threads);
+#pragma omp parallel for schedule(static)
+    for (size_t i = 0; i < coords.size(); ++i)
+        cell_of[i] = labels.label(coords[i].x, coords[i].y);
+
+    struct CellCount
+    {
+        uint64 key;  // cell << 32 | gene
+        uint32 umi;
+    };
+    std::vector< CellCount > cells;
+    for (auto& e : entries)
+    {
+        uint32 cell = cell_of[e.key >> 32];
+        if (cell != 0)
+            cells.push_back({ uint64(cell) << 32 | (e.key & 0xFFFFFFFF), e.count.umi });
+    }
+    __gnu_parallel::sort(cells.begin(), cells.end(),
+                         [](const CellCount& a, const CellCount& b) { return a.key < b.key; });
+    size_t n = 0;
+    for (size_t i = 0; i < cells.size(); ++i)
+    {
+        if (n != 0 && cells[n - 1].key == cells[i].key)
+            cells[n - 1].umi += cells[i].umi;
+        else
+            cells[n++] = cells[i];
+    }
+    cells.resize(n);
+
+    // Rows are the cells ascending, columns are all the genes
+    fs::path              dir(path);
+    std::vector< uint32 > rows;
+    {
+        TextWriter out((dir / "barcodes.tsv.gz").string(), threads);
+        for (auto& c : cells)
+        {
+            uint32 cell = c.key >> 32;
+            if (rows.empty() || rows.back() != cell)
+            {
+                rows.push_back(cell);
+                out << cell << '\n';
+            }
+        }
+        if (out.close() != 0)
+            return -1;
+    }
+    {
+        TextWriter out((dir / "genes.tsv.gz").string(), threads);
+        for (auto& gene : genes)
+            out << gene << '\n';
+        if (out.close() != 0)
+            return -1;
+    }
+
+    const char sep = ' ';
+    TextWriter out((dir / "matrix.mtx.gz").string(), threads);
+    out << "%%MatrixMarket matrix coordinate real general\n%\n";
+    out << rows.size() << sep << genes.size() << sep << cells.size() << '\n';
+    size_t row = 0;
+    for (size_t i = 0; i < cells.size(); ++i)
+    {
+        if (i != 0 && cells[i].key >> 32 != cells[i - 1].key >> 32)
+            ++row;
+        out << row + 1 << sep << (cells[i].key & 0xFFFFFFFF) + 1 << sep << cells[i].umi << '\n';
+    }
+    spdlog::info("Cell matrix cells:{} entries:{}", rows.size(), cells.size());
+    return out.close();
+}
+
+int ExpMatrix::writeStore(const std::string& filename, int threads) const
+{
+    int32 min_x, min_y, max_x, max_y;
+    if (!boundingBox(min_x, min_y, max_x, max_y))
+    {
+        spdlog::warn("Skip expression store, the barcodes are not coordinates");
+        return -1;
+    }
+
+    std::vector< StoreRecord > records;
+    records.reserve(entries.size());
+    for (auto& e : entries)
+    {
+        const Coordinate& c = coords[e.key >> 32];
+        records.push_back({ c.x, c.y, uint32(e.key & 0xFFFFFFFF), e.count.umi, e.count.reads });
+    }
+    return ExpStore::write(filename, genes, records, threads);
+}
@@ -0,0 +1,172 @@
+/*
+ * File: expMatrix.h
+ * Created Data: 2026-10-18
+ * Author: fxzhao
+ * Contact: <zhaofuxiang@genomics.cn>
+ *
+ * Copyright (c) 2026 BGI-Research
+ */
+
+#pragma once
+
+#include <climits>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "types.h"
+
+class CellLabels;
+
+// Coordinate of the barcode on chip, INVALID_COORD if it is not a coordinate
+struct Coordinate
+{
+    int32 x;
+    int32 y;
+};
+static const int32 INVALID_COORD = INT32_MIN;
+
+// Order of the lines in gem file
+enum GemOrder
+{
+    GEM_UNSORTED,
+    GEM_BY_GENE,  // by gene name, then y and x
+    GEM_BY_TILE,  // by the square tiles of GEM_TILE_SIZE row by row, then y and x
+};
+static const int32 GEM_TILE_SIZE = 1000;
+
+// Spatial bins are aggregated in square tiles of about this size, the tiles are
+// multiples of the bin sizes so a bin never crosses tiles
+static const int32 BIN_TILE_SIZE     = 1000;
+static const int32 BIN_TILE_MAX_SIZE = 4096;
+// At most this many bins per side of a tile, the bins of a tile are summed in a
+// dense array of each thread, 4MB of uint32
+static const int32 BIN_TILE_MAX_BINS = 1024;
+
+struct ExpCount
+{
+    uint32 umi;    // unique reads, or the umis after correction
+    uint32 reads;  // reads supporting the umis, 0 if not counted
+};
+
+// Barcode gene expression of one task. Barcodes and genes are numbered in the
+// task, so a read costs the lookups of two short strings instead of building
+// and hashing a joined key.
+class ExpCounter
+{
+public:
+    void add(const std::string& barcode, const std::string& gene, uint32 umi, uint32 reads);
+
+    bool empty() const
+    {
+        return counts.empty();
+    }
+
+private:
+    friend class ExpMatrix;
+
+    static uint32 localId(std::unordered_map< std::string, uint32 >& ids, const std::string& name);
+    uint32        barcodeId(const std::string& barcode);
+
+private:
+    std::unordered_map< std::string, uint32 > barcode_ids, gene_ids;
+    // The coordinates are parsed once for each barcode, indexed by barcode id
+    std::vector< Coordinate > coords;
+    // Key is barcode id << 32 | gene id
+    std::unordered_map< uint64, ExpCount > counts;
+};
+
+// The sparse barcode x gene matrix gathered from all the tasks. The gene
+// expression file, the barcode filter and the matrix market files are all
+// produced from it, ids are assigned in the order the tasks are merged.
+class ExpMatrix
+{
+public:
+    // Move the counts of a task into the matrix
+    void merge(ExpCounter& counter);
+    // Sort the entries by barcode and gene, and sum the ones of the same pair,
+    // nothing to do if finished after the last merge
+    void finish();
+
+    size_t barcodeNum() const
+    {
+        return barcodes.size();
+    }
+    const std::vector< std::string >& geneNames() const
+    {
+        return genes;
+    }
+    // Call f(coordinate, gene id, count) for each entry
+    template < typename F > void forEachEntry(F f) const
+    {
+        for (auto& e : entries)
+            f(coords[e.key >> 32], uint32(e.key & 0xFFFFFFFF), e.count);
+    }
+
+    // Total umis of each barcode, indexed by barcode id
+    std::vector< uint64 > barcodeCounts() const;
+
+    // Write "barcode gene umi [reads]" per line, gzip compressed if the filename
+    // ends with .gz. The barcodes marked in discard are skipped if not empty.
+    int writeExp(const std::string& filename, bool with_reads, const std::vector< bool >& discard,
+                 int threads = 1) const;
+    // Write barcodes.tsv.gz, genes.tsv.gz and matrix.mtx.gz into path
+    int writeMtx(const std::string& path, const std::vector< bool >& discard, int threads = 1) const;
+    // Write "geneID x y MIDCount" per line, the coordinates are relative to the
+    // offsets in header. Return -1 if the barcodes are not coordinates.
+    int writeGem(const std::string& filename, GemOrder order, int threads = 1) const;
+    // Aggregate the umis of spots into square bins of each size, and write the bins
+    // of size n into path/bin<n>/ in matrix market format. A bin is named "bx_by"
+    // with bx = x / n and by = y / n. Return -1 if the barcodes are not coordinates.
+    int writeBins(const std::string& path, const std::vector< int >& bin_sizes, int threads = 1) const;
+    // Sum the umis of spots into the cells of the label image, and write them into
+    // path in matrix market format, a cell is named by its label. The spots out of
+    // cells are skipped. Return -1 if the barcodes are not coordinates.
+    int writeCells(const std::string& path, const CellLabels& labels, int threads = 1) const;
+    // Write the tile-indexed binary store of the spots, see ExpStore. Return -1 if
+    // the barcodes are not coordinates.
+    int writeStore(const std::string& filename, int threads = 1) const;
+
+private:
+    struct ExpEntry
+    {
+        uint64   key;  // barcode id << 32 | gene id
+        ExpCount count;
+    };
+
+    // Umi of a gene on a spot, grouped by tile for the bin aggregation
+    struct SpotCount
+    {
+        uint32 tile;
+        uint32 gene;
+        int32  x;
+        int32  y;
+        uint32 umi;
+    };
+    // Square tiles from the origin, row by row. The origin and the tile size are
+    // multiples of the bin sizes, so the bins are aligned to the chip coordinates.
+    struct BinTiling
+    {
+        int32  size;
+        int32  origin_x;
+        int32  origin_y;
+        uint32 tiles_x;
+    };
+
+    // Return false if any barcode is not a coordinate
+    bool boundingBox(int32& min_x, int32& min_y, int32& max_x, int32& max_y) const;
+    // Spots sorted by tile and gene
+    std::vector< SpotCount > spotsByTile(const BinTiling& tiling, int threads) const;
+    int writeBin(const std::string& path, int bin_size, const BinTiling& tiling, const std::vector< SpotCount >& spots,
+                 int threads) const;
+
+    static uint32 globalId(std::unordered_map< std::string, uint32 >& ids, std::vector< std::string >& names,
+                           const std::string& name);
+
+private:
+    std::unordered_map< std::string, uint32 > barcode_ids, gene_ids;
+    std::vector< std::string >                barcodes, genes;
+    std::vector< Coordinate >                 coords;
+    std::vector< ExpEntry >                   entries;
+    bool                                      finished = false;
+};
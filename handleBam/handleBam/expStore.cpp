@@ -0,0 +1,369 @@
+/*
+ * File: expStore.cpp
+ * Created Data: 2026-10-18
+ * Author: fxzhao
+ * Contact: <zhaofuxiang@genomics.cn>
+ *
+ * Copyright (c) 2026 BGI-Research
+ */
+
+#include <algorithm>
+#include <climits>
+#include <cstring>
+#include <fstream>
+#include <parallel/algorithm>
+
+#include <omp.h>
+#include <spdlog/spdlog.h>
+
+#include "expStore.h"
+
+static const size_t STORE_ITEM_SIZE[STORE_SECTION_NUM] = {
+    sizeof(char),  sizeof(StoreGene), sizeof(uint64), sizeof(StorePosting), sizeof(int32),
+    sizeof(int32), sizeof(uint32),    sizeof(uint32), sizeof(uint32)
+};
+
+// Records are written column by column through a buffer of this many items
+static const size_t STORE_COLUMN_CHUNK = 1 << 20;
+
+ExpStore::ExpStore()
+    : image(nullptr), header(nullptr), strings(nullptr), genes(nullptr), tiles(nullptr), postings(nullptr),
+      col_x(nullptr), col_y(nullptr), col_gene(nullptr), col_umi(nullptr), col_reads(nullptr)
+{
+}
+
+int ExpStore::write(const std::string& filename, const std::vector< std::string >& gene_names,
+                    std::vector< StoreRecord >& records, int threads)
+{
+    ExpStoreHeader h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, EXP_STORE_MAGIC, sizeof(h.magic));
+    h.version   = EXP_STORE_VERSION;
+    h.tile_size = EXP_STORE_TILE_SIZE;
+
+    if (!records.empty())
+    {
+        h.min_x = h.min_y = INT32_MAX;
+        h.max_x = h.max_y = INT32_MIN;
+    }
+    for (auto& r : records)
+    {
+        h.min_x = std::min(h.min_x, r.x);
+        h.min_y = std::min(h.min_y, r.y);
+        h.max_x = std::max(h.max_x, r.x);
+        h.max_y = std::max(h.max_y, r.y);
+    }
+    h.origin_x = floorDiv(h.min_x, h.tile_size) * h.tile_size;
+    h.origin_y = floorDiv(h.min_y, h.tile_size) * h.tile_size;
+    h.tiles_x  = (int64(h.max_x) - h.origin_x) / h.tile_size + 1;
+    h.tiles_y  = (int64(h.max_y) - h.origin_y) / h.tile_size + 1;
+    if (uint64(h.tiles_x) * h.tiles_y >= UINT32_MAX)
+    {
+        spdlog::error("Too many tiles of expression store, the bounding box is {},{},{},{}", h.min_x, h.min_y,
+                      h.max_x, h.max_y);
+        return -1;
+    }
+    uint32 n_tiles = h.tiles_x * h.tiles_y;
+    auto   tileOf  = [&h](const StoreRecord& r) {
+        return uint32((r.y - h.origin_y) / h.tile_size) * h.tiles_x + uint32((r.x - h.origin_x) / h.tile_size);
+    };
+
+    // Records of a tile are grouped by gene, then ordered by row
+    omp_set_num_threads(threads);
+    __gnu_parallel::sort(records.begin(), records.end(), [&tileOf](const StoreRecord& a, const StoreRecord& b) {
+        uint32 ta = tileOf(a), tb = tileOf(b);
+        if (ta != tb)
+            return ta < tb;
+        if (a.gene != b.gene)
+            return a.gene < b.gene;
+        if (a.y != b.y)
+            return a.y < b.y;
+        return a.x < b.x;
+    });
+
+    // Tile index and the runs of genes in each tile
+    std::vector< uint64 >       tile_offsets(uint64(n_tiles) + 1, 0);
+    std::vector< StorePosting > runs;
+    std::vector< uint32 >       run_genes;
+    uint32                      last_tile = 0;
+    for (size_t i = 0; i < records.size(); ++i)
+    {
+        uint32 tile = tileOf(records[i]);
+        ++tile_offsets[tile + 1];
+        if (i == 0 || tile != last_tile || records[i].gene != records[i - 1].gene)
+        {
+            runs.push_back({ tile, 0, i });
+            run_genes.push_back(records[i].gene);
+        }
+        ++runs.back().count;
+        last_tile = tile;
+    }
+    for (size_t t = 0; t < n_tiles; ++t)
+        tile_offsets[t + 1] += tile_offsets[t];
+
+    // Posting lists are the runs bucketed by gene, still in tile order
+    std::string              pool;
+    std::vector< StoreGene > store_genes(gene_names.size());
+    for (size_t g = 0; g < gene_names.size(); ++g)
+    {
+        store_genes[g].name_offset = pool.size();
+        store_genes[g].name_length = gene_names[g].size();
+        store_genes[g].posting_begin = store_genes[g].posting_end = 0;
+        pool += gene_names[g];
+    }
+    for (auto g : run_genes)
+        ++store_genes[g].posting_end;
+    uint32 n_postings = 0;
+    for (auto& g : store_genes)
+    {
+        g.posting_begin = n_postings;
+        n_postings += g.posting_end;
+        g.posting_end = g.posting_begin;
+    }
+    std::vector< StorePosting > store_postings(runs.size());
+    for (size_t i = 0; i < runs.size(); ++i)
+        store_postings[store_genes[run_genes[i]].posting_end++] = runs[i];
+
+    h.section_count[STORE_STRINGS]  = pool.size();
+    h.section_count[STORE_GENES]    = store_genes.size();
+    h.section_count[STORE_TILES]    = tile_offsets.size();
+    h.section_count[STORE_POSTINGS] = store_postings.size();
+    for (int s = STORE_X; s < STORE_SECTION_NUM; ++s)
+        h.section_count[s] = records.size();
+    size_t offset = sizeof(h);
+    for (int s = 0; s < STORE_SECTION_NUM; ++s)
+    {
+        offset              = align8(offset);
+        h.section_offset[s] = offset;
+        offset += h.section_count[s] * STORE_ITEM_SIZE[s];
+    }
+    h.file_size = align8(offset);
+
+    // The header is written again with the checksum of the sections in the end
+    return writeFileAtomic(filename, [&](std::ofstream& ofs) {
+        uint32 crc     = 0;
+        size_t written = sizeof(h);
+        ofs.write(reinterpret_cast< const char* >(&h), sizeof(h));
+        auto put = [&](const void* data, size_t size) {
+            ofs.write(static_cast< const char* >(data), size);
+            crc = checksum(data, size, crc);
+            written += size;
+        };
+        auto padTo = [&](size_t pos) {
+            static const char zeros[8] = { 0 };
+            put(zeros, pos - written);
+        };
+
+        const void* data[STORE_POSTINGS + 1] = { pool.data(), store_genes.data(), tile_offsets.data(),
+                                                 store_postings.data() };
+        for (int s = 0; s <= STORE_POSTINGS; ++s)
+        {
+            padTo(h.section_offset[s]);
+            put(data[s], h.section_count[s] * STORE_ITEM_SIZE[s]);
+        }
+        std::vector< uint32 > chunk;
+        chunk.reserve(STORE_COLUMN_CHUNK);
+        for (int s = STORE_X; s < STORE_SECTION_NUM; ++s)
+        {
+            padTo(h.section_offset[s]);
+            for (size_t beg = 0; beg < records.size(); beg += STORE_COLUMN_CHUNK)
+            {
+                size_t end = std::min(records.size(), beg + STORE_COLUMN_CHUNK);
+                chunk.clear();
+                for (size_t i = beg; i < end; ++i)
+                {
+                    const StoreRecord& r = records[i];
+                    switch (s)
+                    {
+                    case STORE_X:
+                        chunk.push_back(uint32(r.x));
+                        break;
+                    case STORE_Y:
+                        chunk.push_back(uint32(r.y));
+                        break;
+                    case STORE_GENE:
+                        chunk.push_back(r.gene);
+                        break;
+                    case STORE_UMI:
+                        chunk.push_back(r.umi);
+                        break;
+                    default:
+                        chunk.push_back(r.reads);
+                    }
+                }
+                put(chunk.data(), chunk.size() * sizeof(uint32));
+            }
+        }
+        padTo(h.file_size);
+
+        h.checksum = crc;
+        ofs.seekp(0);
+        ofs.write(reinterpret_cast< const char* >(&h), sizeof(h));
+        return bool(ofs);
+    });
+}
+
+int ExpStore::load(const std::string& filename, bool verify)
+{
+    if (!mapped.open(filename))
+        return -1;
+    if (attach(mapped.data(), mapped.size(), verify) != 0)
+    {
+        spdlog::error("Invalid expression store: {}", filename);
+        mapped.close();
+        return -1;
+    }
+    return 0;
+}
+
+bool ExpStore::isStoreFile(const std::string& filename)
+{
+    std::ifstream ifs(filename, std::ios::binary);
+    char          magic[sizeof(EXP_STORE_MAGIC)];
+    if (!ifs.read(magic, sizeof(magic)))
+        return false;
+    return memcmp(magic, EXP_STORE_MAGIC, sizeof(magic)) == 0;
+}
+
+int ExpStore::attach(const char* base, size_t size, bool verify)
+{
+    header = nullptr;
+    name_ids.clear();
+
+    if (size < sizeof(ExpStoreHeader))
+    {
+        spdlog::error("Expression store is truncated");
+        return -1;
+    }
+    const ExpStoreHeader* h = reinterpret_cast< const ExpStoreHeader* >(base);
+    if (memcmp(h->magic, EXP_STORE_MAGIC, sizeof(h->magic)) != 0)
+    {
+        spdlog::error("Expression store has wrong magic number");
+        return -1;
+    }
+    if (h->version != EXP_STORE_VERSION)
+    {
+        spdlog::error("Expression store version {} is not supported, expect {}", h->version, EXP_STORE_VERSION);
+        return -1;
+    }
+    if (h->file_size != size)
+    {
+        spdlog::error("Expression store size mismatch, expect {} but got {}", h->file_size, size);
+        return -1;
+    }
+    if (verify && checksum(base + sizeof(ExpStoreHeader), size - sizeof(ExpStoreHeader)) != h->checksum)
+    {
+        spdlog::error("Expression store checksum mismatch");
+        return -1;
+    }
+    for (int s = 0; s < STORE_SECTION_NUM; ++s)
+    {
+        if (h->section_offset[s] % 8 != 0 || h->section_offset[s] > size
+            || h->section_count[s] > (size - h->section_offset[s]) / STORE_ITEM_SIZE[s])
+        {
+            spdlog::error("Expression store section {} out of range", s);
+            return -1;
+        }
+    }
+    uint64 n_records = h->section_count[STORE_X];
+    bool   valid     = h->tile_size > 0 && h->section_count[STORE_TILES] == uint64(h->tiles_x) * h->tiles_y + 1;
+    for (int s = STORE_Y; s < STORE_SECTION_NUM; ++s)
+        valid = valid && h->section_count[s] == n_records;
+    if (!valid)
+    {
+        spdlog::error("Expression store has inconsistent sections");
+        return -1;
+    }
+
+    image     = base;
+    header    = h;
+    strings   = section< char >(STORE_STRINGS);
+    genes     = section< StoreGene >(STORE_GENES);
+    tiles     = section< uint64 >(STORE_TILES);
+    postings  = section< StorePosting >(STORE_POSTINGS);
+    col_x     = section< int32 >(STORE_X);
+    col_y     = section< int32 >(STORE_Y);
+    col_gene  = section< uint32 >(STORE_GENE);
+    col_umi   = section< uint32 >(STORE_UMI);
+    col_reads = section< uint32 >(STORE_READS);
+
+    // Check the indexes once, then queries need no bound checking. The columns
+    // are only touched by the queries, they are checked if required.
+    size_t n_strings = count(STORE_STRINGS), n_genes = count(STORE_GENES), n_tiles = count(STORE_TILES) - 1,
+           n_postings = count(STORE_POSTINGS);
+    valid = tiles[0] == 0 && tiles[n_tiles] == n_records;
+    for (size_t t = 0; t < n_tiles && valid; ++t)
+        valid = tiles[t] <= tiles[t + 1];
+    for (size_t g = 0; g < n_genes && valid; ++g)
+    {
+        const StoreGene& sg = genes[g];
+        valid = uint64(sg.name_offset) + sg.name_length <= n_strings && sg.posting_begin <= sg.posting_end
+                && sg.posting_end <= n_postings;
+    }
+    for (size_t i = 0; i < n_postings && valid; ++i)
+    {
+        const StorePosting& p = postings[i];
+        valid = p.tile < n_tiles && p.begin >= tiles[p.tile] && p.begin + p.count <= tiles[p.tile + 1];
+    }
+    for (uint64 i = 0; verify && i < n_records && valid; ++i)
+        valid = col_gene[i] < n_genes;
+    if (!valid)
+    {
+        spdlog::error("Expression store has broken references");
+        header = nullptr;
+        return -1;
+    }
+
+    for (size_t g = 0; g < n_genes; ++g)
+        name_ids[std::string(geneName(g))] = g;
+
+    return 0;
+}
+
+void ExpStore::queryRect(int32 x0, int32 y0, int32 x1, int32 y1, std::vector< uint64 >& rows) const
+{
+    if (header == nullptr || recordNum() == 0)
+        return;
+    const ExpStoreHeader& h = *header;
+    x0                      = std::max(x0, h.min_x);
+    y0                      = std::max(y0, h.min_y);
+    x1                      = std::min(x1, h.max_x);
+    y1                      = std::min(y1, h.max_y);
+    if (x0 > x1 || y0 > y1)
+        return;
+
+    uint32 tx0 = (x0 - h.origin_x) / h.tile_size, tx1 = (x1 - h.origin_x) / h.tile_size;
+    uint32 ty0 = (y0 - h.origin_y) / h.tile_size, ty1 = (y1 - h.origin_y) / h.tile_size;
+    for (uint32 ty = ty0; ty <= ty1; ++ty)
+    {
+        int64 by0 = int64(h.origin_y) + int64(ty) * h.tile_size, by1 = by0 + h.tile_size - 1;
+        for (uint32 tx = tx0; tx <= tx1; ++tx)
+        {
+            int64  bx0 = int64(h.origin_x) + int64(tx) * h.tile_size, bx1 = bx0 + h.tile_size - 1;
+            uint32 t   = ty * h.tiles_x + tx;
+            // Tiles inside the rectangle are taken without looking at the records
+            bool inside = bx0 >= x0 && bx1 <= x1 && by0 >= y0 && by1 <= y1;
+            for (uint64 i = tiles[t]; i < tiles[t + 1]; ++i)
+                if (inside || (col_x[i] >= x0 && col_x[i] <= x1 && col_y[i] >= y0 && col_y[i] <= y1))
+                    rows.push_back(i);
+        }
+    }
+}
+
+void ExpStore::queryGene(uint32 gene, std::vector< uint64 >& rows) const
+{
+    if (header == nullptr || gene >= geneNum())
+        return;
+    for (uint32 p = genes[gene].posting_begin; p < genes[gene].posting_end; ++p)
+        for (uint64 i = 0; i < postings[p].count; ++i)
+            rows.push_back(postings[p].begin + i);
+}
+
+bool ExpStore::queryGene(const std::string& name, std::vector< uint64 >& rows) const
+{
+    auto iter = name_ids.find(name);
+    if (iter == name_ids.end())
+        return false;
+    queryGene(iter->second, rows);
+    return true;
+}
@@ -0,0 +1,183 @@
+/*
+ * File: expStore.h
+ * Created Data: 2026-10-18
+ * Author: fxzhao
+ * Contact: <zhaofuxiang@genomics.cn>
+ *
+ * Copyright (c) 2026 BGI-Research
+ */
+
+#pragma once
+
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include "mappedFile.h"
+#include "types.h"
+
+// Layout of the binary expression store. The spots are cut into square tiles
+// of the chip, the records are stored column by column and grouped by tile, then
+// by gene. The tile index gives the records of each tile, and the posting list
+// of a gene gives its records in every tile, so a rectangle or a gene is read
+// without scanning the file. Sections are addressed by the offset from the
+// beginning of the file, the file is mapped and used in place.
+static const char   EXP_STORE_MAGIC[8]  = { 'H', 'B', 'E', 'X', 'P', 'S', 'T', 'R' };
+static const uint32 EXP_STORE_VERSION   = 1;
+static const int32  EXP_STORE_TILE_SIZE = 1000;
+
+enum ExpStoreSection
+{
+    STORE_STRINGS,   // gene names
+    STORE_GENES,     // StoreGene
+    STORE_TILES,     // uint64, records of tile t are [tiles[t], tiles[t + 1])
+    STORE_POSTINGS,  // StorePosting, the runs of each gene ordered by tile
+    STORE_X,         // int32
+    STORE_Y,         // int32
+    STORE_GENE,      // uint32
+    STORE_UMI,       // uint32
+    STORE_READS,     // uint32
+    STORE_SECTION_NUM,
+};
+
+struct ExpStoreHeader
+{
+    char   magic[8];
+    uint32 version;
+    uint32 checksum;  // crc32 of all the bytes after the header
+    uint64 file_size;
+    // Tiles are row by row from the origin, the origin is a multiple of the tile size
+    int32  tile_size;
+    int32  origin_x;
+    int32  origin_y;
+    uint32 tiles_x;
+    uint32 tiles_y;
+    // Bounding box of the spots
+    int32  min_x;
+    int32  min_y;
+    int32  max_x;
+    int32  max_y;
+    uint32 reserved;
+    uint64 section_offset[STORE_SECTION_NUM];
+    uint64 section_count[STORE_SECTION_NUM];
+};
+
+struct StoreGene
+{
+    uint32 name_offset;
+    uint32 name_length;
+    uint32 posting_begin;
+    uint32 posting_end;
+};
+
+// Records [begin, begin + count) are of the same gene in one tile
+struct StorePosting
+{
+    uint32 tile;
+    uint32 count;
+    uint64 begin;
+};
+
+// One gene on one spot, the input of ExpStore::write()
+struct StoreRecord
+{
+    int32  x;
+    int32  y;
+    uint32 gene;
+    uint32 umi;
+    uint32 reads;
+};
+
+class ExpStore
+{
+public:
+    ExpStore();
+
+    // Sort the records by tile and write the store, return 0 if success. The gene
+    // of a record is the index in genes.
+    static int write(const std::string& filename, const std::vector< std::string >& genes,
+                     std::vector< StoreRecord >& records, int threads = 1);
+
+    // Map a store file, return 0 if success. The checksum and the gene column are
+    // verified only if required, which reads the whole file.
+    int load(const std::string& filename, bool verify = false);
+
+    // Check the magic number without mapping the whole file
+    static bool isStoreFile(const std::string& filename);
+
+    // Append the records of spots in the closed rectangle [x0, x1] x [y0, y1]
+    void queryRect(int32 x0, int32 y0, int32 x1, int32 y1, std::vector< uint64 >& rows) const;
+    // Append the records of a gene, grouped by tile
+    void queryGene(uint32 gene, std::vector< uint64 >& rows) const;
+    // Same as above by the name, return false if the gene is not found
+    bool queryGene(const std::string& name, std::vector< uint64 >& rows) const;
+
+    size_t recordNum() const
+    {
+        return count(STORE_X);
+    }
+    size_t geneNum() const
+    {
+        return count(STORE_GENES);
+    }
+    std::string_view geneName(uint32 gene) const
+    {
+        return std::string_view(strings + genes[gene].name_offset, genes[gene].name_length);
+    }
+    const ExpStoreHeader* getHeader() const
+    {
+        return header;
+    }
+
+    // Columns of the record i
+    int32 x(uint64 i) const
+    {
+        return col_x[i];
+    }
+    int32 y(uint64 i) const
+    {
+        return col_y[i];
+    }
+    uint32 gene(uint64 i) const
+    {
+        return col_gene[i];
+    }
+    uint32 umi(uint64 i) const
+    {
+        return col_umi[i];
+    }
+    uint32 reads(uint64 i) const
+    {
+        return col_reads[i];
+    }
+
+private:
+    int attach(const char* base, size_t size, bool verify);
+
+    template < typename T > const T* section(ExpStoreSection s) const
+    {
+        return reinterpret_cast< const T* >(image + header->section_offset[s]);
+    }
+    size_t count(ExpStoreSection s) const
+    {
+        return header == nullptr ? 0 : header->section_count[s];
+    }
+
+private:
+    MappedFile mapped;
+
+    const char*           image;
+    const ExpStoreHeader* header;
+    const char*           strings;
+    const StoreGene*      genes;
+    const uint64*         tiles;
+    const StorePosting*   postings;
+    const int32*          col_x;
+    const int32*          col_y;
+    const uint32*         col_gene;
+    const uint32*         col_umi;
+    const uint32*         col_reads;
+
+    std::unordered_map< std::string, uint32 > name_ids;
+};
@@ -15,14 +15,21 @@
 #include "annotationException.h"
 #include "geneBuilder.h"
 
-std::vector< GeneFromGTF > GeneBuilder::makeGene(GTFIterator& iter)
+std::vector< GeneFromGTF > GeneBuilder::makeGene(std::vector< GTFRecord >&& gtfRecords)
 {
-    std::vector< GTFRecord > recordsForGene = iter->second;
+    std::vector< GTFRecord > recordsForGene = std::move(gtfRecords);
     return makeGeneFromMultiVersionGTFRecords(recordsForGene);
 }
 
 std::vector< GeneFromGTF > GeneBuilder::makeGeneFromMultiVersionGTFRecords(std::vector< GTFRecord >& gtfRecords)
 {
+    // Most genes have only one version, no need to gather them
+    bool singleVersion = std::all_of(gtfRecords.begin(), gtfRecords.end(), [&](GTFRecord& r) {
+        return r.getGeneVersion() == gtfRecords[0].getGeneVersion();
+    });
+    if (singleVersion)
+        return makeGenesWithTranscriptsFromGTFRecords(gtfRecords);
+
     GTFMapForGeneVersion gtfRecordsByGeneVersion = gatherByGeneVersion(gtfRecords);
     int                  maxVersion              = -1;
     for (auto& p : gtfRecordsByGeneVersion)
@@ -35,7 +42,7 @@ GTFMapForGeneVersion GeneBuilder::gatherByGeneVersion(std::vector< GTFRecord >&
     GTFMapForGeneVersion res;
     for (auto& record : gtfRecords)
     {
-        res[record.getGeneVersion()].push_back(record);
+        res[record.getGeneVersion()].push_back(std::move(record));
     }
     return res;
 }
@@ -53,7 +60,7 @@ GTFMapForTranscript GeneBuilder::gatherByTransciptID(std::vector< GTFRecord >& g
             std::string error = "GTFRecord does not have transcriptID: " + record.getGeneName();
             throw AnnotationException(error);
         }
-        res[record.getTranscriptID()].push_back(record);
+        res[record.getTranscriptID()].push_back(std::move(record));
     }
     return res;
 }
@@ -88,7 +95,7 @@ std::vector< GeneFromGTF > GeneBuilder::makeGenesWithTranscriptsFromGTFRecords(s
                 res.push_back(makeGeneWithTranscriptsFromGTFRecords(temp));
                 temp.clear();
             }
-            temp.push_back(r);
+            temp.push_back(std::move(r));
         }
         if (!temp.empty())
         {
@@ -103,6 +110,7 @@ GeneFromGTF GeneBuilder::makeGeneWithTranscriptsFromGTFRecords(std::vector< GTFR
 {
     GeneFromGTF gene = makeGeneFromGTFRecords(gtfRecords);
 
+    // The records are moved into transcripts, do not touch them afterwards
     GTFMapForTranscript gtfLinesByTranscript = gatherByTransciptID(gtfRecords);
     for (auto& p : gtfLinesByTranscript)
         addTranscriptToGeneFromGTFRecords(gene, p.second);
@@ -201,7 +209,7 @@ void GeneBuilder::addTranscriptToGeneFromGTFRecords(GeneFromGTF& gene, std::vect
     int                 codingEnd          = INT_MIN;
     for (auto& r : gtfRecords)
     {
-        std::string featureType = r.getFeatureType();
+        std::string& featureType = r.getFeatureType();
         int         start       = r.getStart();
         int         end         = r.getEnd();
         if (featureType == "exon")
@@ -241,5 +249,5 @@ void GeneBuilder::addTranscriptToGeneFromGTFRecords(GeneFromGTF& gene, std::vect
         }
     }
 
-    transcript->addExons(exons);
+    transcript->addExons(std::move(exons));
 }
@@ -16,14 +16,14 @@
 #include "geneFromGTF.h"
 #include "gtfRecord.h"
 
-typedef std::unordered_map< std::string, std::vector< GTFRecord > >::const_iterator GTFIterator;
-typedef std::unordered_map< int, std::vector< GTFRecord > >                         GTFMapForGeneVersion;
-typedef std::unordered_map< std::string, std::vector< GTFRecord > >                 GTFMapForTranscript;
+typedef std::unordered_map< int, std::vector< GTFRecord > >         GTFMapForGeneVersion;
+typedef std::unordered_map< std::string, std::vector< GTFRecord > > GTFMapForTranscript;
 class GeneBuilder
 {
 public:
     GeneBuilder() {}
-    std::vector< GeneFromGTF > makeGene(GTFIterator& iter);
+    // The records of the gene are consumed by move
+    std::vector< GeneFromGTF > makeGene(std::vector< GTFRecord >&& gtfRecords);
 
 private:
     std::vector< GeneFromGTF > makeGeneFromMultiVersionGTFRecords(std::vector< GTFRecord >& gtfRecords);
@@ -29,110 +29,19 @@ TranscriptFromGTF* GeneFromGTF::addTranscript(int transcriptionStart, int transc
     else
     {
         {
-            TranscriptFromGTF transcript(transcriptionStart, transcriptionEnd, codingStart, codingEnd, numExons,
-                                         transcriptName, transcriptID, transcriptType);
-            transcripts[transcriptName] = transcript;
-            return &(transcripts[transcriptName]);
+            auto res = transcripts.emplace(
+                transcriptName, TranscriptFromGTF(transcriptionStart, transcriptionEnd, codingStart, codingEnd,
+                                                  numExons, transcriptName, std::move(transcriptID),
+                                                  std::move(transcriptType)));
+            return &(res.first->second);
         }
     }
 }
 
-void TranscriptFromGTF::addExons(std::vector< Exon >& exons_)
+void TranscriptFromGTF::addExons(std::vector< Exon >&& exons_)
 {
-    // spdlog::debug("exons num:{} exons_ num:{}", exons.size(), exons_.size());
-    exons.assign(exons_.begin(), exons_.end());
-    // spdlog::debug("exons num:{} exons_ num:{}", exons.size(), exons_.size());
+    exons  = std::move(exons_);
+    length = 0;
     for (auto& e : exons)
         length += e.end - e.start + 1;
 }
-
-void TranscriptFromGTF::assignLocusFunction(int start, std::vector< LocusFunction >& locusFunctions) const
-{
-    int begin = std::max(start, transcriptionStart);
-    int end   = std::min(int(start + locusFunctions.size() - 1), transcriptionEnd);
-    // spdlog::debug("assignLocusFunction:{} {}", begin, end);
-    // spdlog::debug("exons num:{}", exons.size());
-    // for (auto& exon : exons)
-    //     spdlog::debug("exons :{} {}", exon.start, exon.end);
-    // spdlog::debug("start {} end {} coding {} {}", start, end, codingStart, codingEnd);
-    for (int i = begin; i <= end; ++i)
-    {
-        if (locusFunctions[i - start] >= LocusFunction::CODING)
-            break;
-
-        LocusFunction locusFunction;
-        if (inExon(i))
-        {
-            if (!inRange(codingStart, codingEnd, i))
-                locusFunction = LocusFunction::UTR;
-            else
-                locusFunction = LocusFunction::CODING;
-        }
-        else
-            locusFunction = LocusFunction::INTRONIC;
-        if (locusFunction > locusFunctions[i - start])
-            locusFunctions[i - start] = locusFunction;
-        // Exit early to reduce unnecessary calculations
-        if (locusFunction == LocusFunction::CODING)
-            break;
-    }
-}
-
-void TranscriptFromGTF::assignLocusFunction(int start, LocusFunction& l, int len) const
-{
-    int begin = std::max(start, transcriptionStart);
-    int end   = std::min(int(start + len - 1), transcriptionEnd);
-    for (int i = begin; i <= end; ++i)
-    {
-        LocusFunction locusFunction;
-        if (inExon(i))
-        {
-            if (!inRange(codingStart, codingEnd, i))
-                locusFunction = LocusFunction::UTR;
-            else
-                locusFunction = LocusFunction::CODING;
-        }
-        else
-            locusFunction = LocusFunction::INTRONIC;
-        if (locusFunction > l)
-            l = locusFunction;
-        // Exit early to reduce unnecessary calculations
-        if (l == LocusFunction::CODING)
-            break;
-    }
-}
-
-void TranscriptFromGTF::assignLocusFunction(int start, int len, pair< int, int >& max_cnts) const
-{
-    int begin     = std::max(start, transcriptionStart);
-    int end       = std::min(int(start + len - 1), transcriptionEnd);
-    int exon_cnts = 0, intro_cnts = 0;
-    for (int i = begin; i <= end; ++i)
-    {
-        if (inExon(i))
-            ++exon_cnts;
-        else
-            ++intro_cnts;
-    }
-    if (exon_cnts > max_cnts.first)
-        max_cnts = { exon_cnts, intro_cnts };
-    else if (exon_cnts == max_cnts.first)
-        max_cnts.second = max(max_cnts.second, intro_cnts);
-}
-
-bool TranscriptFromGTF::inExon(int locus) const
-{
-    for (auto& exon : exons)
-    {
-        if (exon.start > locus)
-            return false;
-        if (inRange(exon.start, exon.end, locus))
-            return true;
-    }
-    return false;
-}
-
-inline bool TranscriptFromGTF::inRange(int start, int end, int locus) const
-{
-    return locus >= start && locus <= end;
-}
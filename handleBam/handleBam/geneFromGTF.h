@@ -43,21 +43,21 @@ public:
     }
     TranscriptFromGTF() {}
 
-    void addExons(std::vector< Exon >& exons_);
+    void addExons(std::vector< Exon >&& exons_);
 
-    int getTranscriptionStart()
+    int getTranscriptionStart() const
     {
         return transcriptionStart;
     }
-    int getTranscriptionEnd()
+    int getTranscriptionEnd() const
     {
         return transcriptionEnd;
     }
-    int getCodingStart()
+    int getCodingStart() const
     {
         return codingStart;
     }
-    int getCodingEnd()
+    int getCodingEnd() const
     {
         return codingEnd;
     }
@@ -66,12 +66,6 @@ public:
         return exons;
     }
 
-    void assignLocusFunction(int start, std::vector< LocusFunction >& locusFunctions) const;
-    void assignLocusFunction(int start, LocusFunction& l, int len) const;
-    void assignLocusFunction(int start, int len, pair< int, int >& max_cnts) const;
-    bool inExon(int locus) const;
-    bool inRange(int start, int end, int locus) const;
-
 private:
     int transcriptionStart;
     int transcriptionEnd;
@@ -7,196 +7,361 @@
  * Copyright (c) 2020 BGI-Research
  */
 
+#include <algorithm>
+#include <charconv>
+#include <cstring>
 #include <filesystem>
-#include <fstream>
-#include <iostream>
-#include <sstream>
+#include <functional>
 
 #include <spdlog/spdlog.h>
+#include <zlib.h>
 
 #include "annotationException.h"
 #include "gtfReader.h"
+#include "mappedFile.h"
+#include "threadpool.h"
 
-void GTFReader::splitString(const std::string& str, char delim, bool skip_empty)
+// Inflate the whole gzip file into memory
+static void inflateFile(const std::string& filename, std::string& buffer)
 {
-    std::istringstream iss(str);
-    int                i = 0;
-    for (std::string item; getline(iss, item, delim);)
-        if (skip_empty && item.empty())
-            continue;
-        else
-            splitedLine[i++] = item;
+    gzFile f = gzopen(filename.c_str(), "rb");
+    if (f == NULL)
+        throw std::runtime_error("Failed open gzip file: " + filename);
+    gzbuffer(f, 1 << 20);
+
+    const size_t piece = 1 << 24;
+    size_t       size  = 0;
+    while (true)
+    {
+        buffer.resize(size + piece);
+        int ret = gzread(f, &buffer[size], piece);
+        if (ret < 0)
+        {
+            gzclose(f);
+            throw std::runtime_error("Failed inflate gzip file: " + filename);
+        }
+        size += ret;
+        if (ret == 0)
+            break;
+    }
+    buffer.resize(size);
+    gzclose(f);
 }
 
-// Read GTF file line by line, parse data what i want and gather by genename.
-int GTFReader::loadGTFFile(std::string gtf_file, std::unordered_map< std::string, std::vector< GTFRecord > >& gtfMap)
+// Read GTF file in chunks, tokenize and gather by genename on all threads.
+int GTFReader::loadGTFFile(std::string gtf_file, GTFMap& gtfMap)
 {
     std::filesystem::path temp_file(gtf_file);
+    bool                  compressed = temp_file.extension() == ".gz";
+    if (compressed)
+        temp_file = temp_file.stem();
     if (temp_file.extension() == ".gtf")
-        attrSep = ' ';
-    else if (temp_file.extension() == ".gff")
-        attrSep = '=';
+        isGFF = false;
+    else if (temp_file.extension() == ".gff" || temp_file.extension() == ".gff3")
+        isGFF = true;
     else
         throw AnnotationException("Invalid gtf/gff file format");
 
-    splitedLine.resize(GTF_TAB_NUM);
-    attrKeys.insert({ "gene_id", 0 });
-    attrKeys.insert({ "gene_name", 1 });
-    attrKeys.insert({ "transcript_id", 2 });
-    attrKeys.insert({ "transcript_name", 3 });
-    attrs.resize(attrKeys.size());
-    // Open gtf file.
-    std::ifstream input(gtf_file, std::ifstream::in);
-    // Travel the record by line.
-    std::string line;
-    int         num = 0;
-    while (std::getline(input, line))
+    // Plain file is mapped, compressed file is inflated into memory
+    MappedFile  mapped;
+    std::string inflated;
+    const char* data = nullptr;
+    size_t      size = 0;
+    if (compressed)
     {
-        GTFRecord gtfRecord;
-        // Parse data and construct instance of GTFRecord.
-        if (line[0] == '#')
-            continue;
-        if (attrSep == ' ')
-            parseTabbedLine(line, gtfRecord);
-        else
-            parseTabbedLineGFF(line, gtfRecord);
-        if (++num % 100000 == 0)
-            spdlog::get("gtf")->info("read {:10d} GTF records. Last read position: {}:{}", num, gtfRecord.getContig(),
-                                     gtfRecord.getStart());
-        // Gather gtfRecord by genename.
-        // Skip pseudo genes
-        if (!gtfRecord.getGeneName().empty())
-            gtfMap[gtfRecord.getGeneName()].push_back(std::move(gtfRecord));
+        inflateFile(gtf_file, inflated);
+        data = inflated.data();
+        size = inflated.size();
     }
-    return 0;
-}
-
-int GTFReader::parseTabbedLine(std::string& line, GTFRecord& gtfRecord)
-{
-    // Format:CHROMOSOME, SOURCE, FEATURE, START, END, SCORE, STRAND, FRAME, ATTRIBUTE
-    splitString(line, '\t', true);
-    // if (splitedLine.size() != GTF_TAB_NUM)
-    // 	throw AnnotationException("GTF file format error!");
-    gtfRecord.setInterval(stoi(splitedLine[GTF_COLUMNS::START]), stoi(splitedLine[GTF_COLUMNS::END]),
-                          splitedLine[GTF_COLUMNS::CHROMOSOME], splitedLine[GTF_COLUMNS::STRAND] == "-");
-
-    parseAttributes(splitedLine[GTF_COLUMNS::ATTRIBUTE]);
-    gtfRecord.setFeatureType(splitedLine[GTF_COLUMNS::FEATURE]);
-    gtfRecord.setGeneID(attrs.at(attrKeys["gene_id"]));
-    gtfRecord.setGeneName(attrs.at(attrKeys["gene_name"]));
-    if (gtfRecord.getFeatureType() != "gene")
+    else
     {
-        std::string transcript_id = attrs.at(attrKeys["transcript_id"]);
-        std::string transcript_name = attrs.at(attrKeys["transcript_name"]);
-        gtfRecord.setTranscriptID(transcript_id);
-        if (transcript_name.empty())
-            transcript_name = transcript_id;
-        gtfRecord.setTranscriptName(transcript_id);
-        // TODO(fxzhao): when to use transcriptType and geneVersion?
-        // gtfRecord.setTranscriptType();
+        if (!mapped.open(gtf_file, true))
+            throw std::runtime_error("Failed open gtf file: " + gtf_file);
+        data = mapped.data();
+        size = mapped.size();
     }
 
-    return 0;
-}
-
-int GTFReader::parseTabbedLineGFF(std::string& line, GTFRecord& gtfRecord)
-{
-    // Format:CHROMOSOME, SOURCE, FEATURE, START, END, SCORE, STRAND, FRAME, ATTRIBUTE
-    splitString(line, '\t', true);
-    // if (splitedLine.size() != GTF_TAB_NUM)
-    // 	throw AnnotationException("GTF file format error!");
-    gtfRecord.setInterval(stoi(splitedLine[GTF_COLUMNS::START]), stoi(splitedLine[GTF_COLUMNS::END]),
-                          splitedLine[GTF_COLUMNS::CHROMOSOME], splitedLine[GTF_COLUMNS::STRAND] == "-");
-
-    std::unordered_map< std::string, std::string > attrs;
-    parseAttributesGFF(splitedLine[GTF_COLUMNS::ATTRIBUTE], attrs);
-    gtfRecord.setFeatureType(splitedLine[GTF_COLUMNS::FEATURE]);
-    if (gtfRecord.getFeatureType() == "region")
-    {
-        geneID = geneName = transID = transName = "";
-        return 0;
-    }
-    else if (gtfRecord.getFeatureType() == "gene")
+    // Split the buffer at line boundaries, more chunks than threads for balance
+    int                   thread_num = std::max(1, threads);
+    size_t                chunk_num  = std::max(size_t(1), std::min(size / (1 << 20) + 1, size_t(thread_num) * 4));
+    std::vector< size_t > bounds{ 0 };
+    for (size_t i = 1; i < chunk_num; ++i)
     {
-        if (attrs.count("ID"))
-            geneID = attrs["ID"];
-        if (attrs.count("Name"))
-            geneName = attrs["Name"];
+        size_t pos = std::max(size * i / chunk_num, bounds.back());
+        auto   nl  = static_cast< const char* >(memchr(data + pos, '\n', size - pos));
+        pos        = nl == nullptr ? size : nl - data + 1;
+        if (pos > bounds.back() && pos < size)
+            bounds.push_back(pos);
     }
-    else if (gtfRecord.getFeatureType() == "mRNA")
+    bounds.push_back(size);
+    chunk_num = bounds.size() - 1;
+
+    std::vector< GTFChunk >         chunks(chunk_num);
+    std::threadpool                 tp(std::min(size_t(thread_num), chunk_num));
+    std::vector< std::future< void > > results;
+    for (size_t i = 0; i < chunk_num; ++i)
+        results.push_back(tp.commit(std::bind(&GTFReader::tokenizeChunk, this, data + bounds[i], data + bounds[i + 1],
+                                              std::ref(chunks[i]))));
+    for (auto& r : results)
+        r.get();
+    results.clear();
+
+    // The gff states are carried over lines, so each chunk starts with the
+    // states left by all the previous chunks
+    std::vector< std::vector< std::string_view > > entry(chunk_num,
+                                                         std::vector< std::string_view >(GFF_STATE_NUM));
+    for (size_t i = 1; i < chunk_num; ++i)
     {
-        if (attrs.count("ID"))
-            transID = attrs["ID"];
-        if (attrs.count("Name"))
-            transName = attrs["Name"];
+        entry[i] = entry[i - 1];
+        for (int s = 0; s < GFF_STATE_NUM; ++s)
+            if (chunks[i - 1].assigned[s])
+                entry[i][s] = chunks[i - 1].states[s];
     }
+    for (size_t i = 0; i < chunk_num; ++i)
+        results.push_back(
+            tp.commit(std::bind(&GTFReader::gatherChunk, this, std::ref(chunks[i]), entry[i].data())));
+    for (auto& r : results)
+        r.get();
 
-    gtfRecord.setGeneID(geneID);
-    gtfRecord.setGeneName(geneName);
-    if (gtfRecord.getFeatureType() != "gene")
+    // Merge in file order, so the records of each gene keep the order in file
+    size_t num = 0, skipped = 0;
+    for (auto& chunk : chunks)
     {
-        gtfRecord.setTranscriptID(transID);
-        gtfRecord.setTranscriptName(transName);
-        // TODO(fxzhao): when to use transcriptType and geneVersion?
-        // gtfRecord.setTranscriptType();
+        num += chunk.lines.size();
+        skipped += chunk.skipped;
+        for (auto& p : chunk.gatherByGeneName)
+        {
+            auto& records = gtfMap[p.first];
+            if (records.empty())
+                records = std::move(p.second);
+            else
+                records.insert(records.end(), std::make_move_iterator(p.second.begin()),
+                               std::make_move_iterator(p.second.end()));
+        }
+        GTFMap().swap(chunk.gatherByGeneName);
+        std::vector< GTFLine >().swap(chunk.lines);
     }
+    spdlog::get("gtf")->info("read {} GTF records in {} chunks, skip {} invalid lines, gather {} genes", num,
+                             chunk_num, skipped, gtfMap.size());
+    if (skipped != 0)
+        spdlog::get("gtf")->warn("skip {} lines without {} columns", skipped, GTF_TAB_NUM);
 
     return 0;
 }
 
-int GTFReader::parseAttributes(std::string& s)
+void GTFReader::tokenizeChunk(const char* begin, const char* end, GTFChunk& chunk)
 {
-    attrs.clear();
-    attrs.resize(attrKeys.size());
-
-    std::istringstream        iss(s);
-    int                       i     = 0;
-    decltype(attrKeys.size()) count = 0;
-    std::string               key, value;
-    for (std::string item; getline(iss, item, ' ');)
-        if (item.empty())
+    GTFLine gtfLine;
+    while (begin < end)
+    {
+        auto        nl   = static_cast< const char* >(memchr(begin, '\n', end - begin));
+        const char* stop = nl == nullptr ? end : nl;
+        std::string_view line(begin, stop - begin);
+        begin = stop + 1;
+
+        if (!line.empty() && line.back() == '\r')
+            line.remove_suffix(1);
+        // Skip comments and empty lines
+        if (line.empty() || line[0] == '#')
             continue;
-        else
+        if (!tokenizeLine(line, gtfLine))
         {
-            if ((i++) % 2 == 0)
-                key = item;
-            else
+            ++chunk.skipped;
+            continue;
+        }
+        if (isGFF)
+        {
+            if (gtfLine.feature == "region")
+            {
+                for (int s = 0; s < GFF_STATE_NUM; ++s)
+                    assignState(chunk, s, std::string_view());
+            }
+            else if (gtfLine.feature == "gene")
+            {
+                if (gtfLine.gene_id.data() != nullptr)
+                    assignState(chunk, GFF_GENE_ID, gtfLine.gene_id);
+                if (gtfLine.gene_name.data() != nullptr)
+                    assignState(chunk, GFF_GENE_NAME, gtfLine.gene_name);
+            }
+            else if (gtfLine.feature == "mRNA")
             {
-                if (attrKeys.find(key) == attrKeys.end())
-                    continue;
-                value = item;
-                // Remove the quotes in begin and end of the string,
-                // include comma in the end.
-                // e.g. gene_name "DDX11L1"; level 2;
-                if (value.size() > 3)
-                    value = value.substr(1, value.size() - 3);
-                else
-                    value = value.substr(0, value.size() - 1);
-                attrs[attrKeys[key]] = value;
-                ++count;
-                // When we get the information we want, return early.
-                if (count == attrKeys.size())
-                    return 0;
+                if (gtfLine.gene_id.data() != nullptr)
+                    assignState(chunk, GFF_TRANS_ID, gtfLine.gene_id);
+                if (gtfLine.gene_name.data() != nullptr)
+                    assignState(chunk, GFF_TRANS_NAME, gtfLine.gene_name);
             }
         }
-    return 0;
+        chunk.lines.push_back(gtfLine);
+    }
+}
+
+void GTFReader::assignState(GTFChunk& chunk, int state, std::string_view value)
+{
+    chunk.states[state]   = value;
+    chunk.assigned[state] = true;
+}
+
+bool GTFReader::tokenizeLine(std::string_view line, GTFLine& gtfLine)
+{
+    // Format:CHROMOSOME, SOURCE, FEATURE, START, END, SCORE, STRAND, FRAME, ATTRIBUTE
+    // Empty columns are skipped as before
+    std::string_view columns[GTF_TAB_NUM];
+    int              n   = 0;
+    size_t           pos = 0;
+    while (n < GTF_TAB_NUM && pos <= line.size())
+    {
+        size_t tab = line.find('\t', pos);
+        if (tab == std::string_view::npos)
+            tab = line.size();
+        if (tab > pos)
+            columns[n++] = line.substr(pos, tab - pos);
+        pos = tab + 1;
+    }
+    if (n != GTF_TAB_NUM)
+        return false;
+
+    auto toInt = [](std::string_view s, int& v) {
+        auto res = std::from_chars(s.data(), s.data() + s.size(), v);
+        return res.ec == std::errc();
+    };
+    if (!toInt(columns[GTF_COLUMNS::START], gtfLine.start) || !toInt(columns[GTF_COLUMNS::END], gtfLine.end))
+        return false;
+    gtfLine.contig   = columns[GTF_COLUMNS::CHROMOSOME];
+    gtfLine.feature  = columns[GTF_COLUMNS::FEATURE];
+    gtfLine.negative = columns[GTF_COLUMNS::STRAND] == "-";
+
+    gtfLine.gene_id = gtfLine.gene_name = gtfLine.transcript_id = std::string_view();
+    if (isGFF)
+        parseAttributesGFF(columns[GTF_COLUMNS::ATTRIBUTE], gtfLine);
+    else
+        parseAttributes(columns[GTF_COLUMNS::ATTRIBUTE], gtfLine);
+    return true;
 }
 
-int GTFReader::parseAttributesGFF(std::string& s, std::unordered_map< std::string, std::string >& attrs)
+void GTFReader::parseAttributes(std::string_view s, GTFLine& gtfLine)
 {
-    std::istringstream iss(s);
-    std::string        key, value;
-    for (std::string item; getline(iss, item, ';');)
+    // e.g. gene_id "ENSG00000223972"; gene_name "DDX11L1"; level 2;
+    std::string_view key;
+    int              i = 0, count = 0;
+    size_t           pos = 0;
+    while (pos < s.size())
+    {
+        size_t sp = s.find(' ', pos);
+        if (sp == std::string_view::npos)
+            sp = s.size();
+        std::string_view item = s.substr(pos, sp - pos);
+        pos                   = sp + 1;
         if (item.empty())
             continue;
+        if ((i++) % 2 == 0)
+        {
+            key = item;
+            continue;
+        }
+
+        std::string_view* target = nullptr;
+        if (key == "gene_id")
+            target = &gtfLine.gene_id;
+        else if (key == "gene_name")
+            target = &gtfLine.gene_name;
+        else if (key == "transcript_id")
+            target = &gtfLine.transcript_id;
+        else
+            continue;
+        // Remove the quotes in begin and end of the string,
+        // include comma in the end.
+        if (item.size() > 3)
+            item = item.substr(1, item.size() - 3);
         else
+            item = item.substr(0, item.size() - 1);
+        if (target->data() == nullptr)
+            ++count;
+        *target = item;
+        // When we get the information we want, return early.
+        if (count == 3)
+            return;
+    }
+}
+
+void GTFReader::parseAttributesGFF(std::string_view s, GTFLine& gtfLine)
+{
+    // e.g. ID=gene-DDX11L1;Name=DDX11L1;gbkey=Gene
+    size_t pos = 0;
+    while (pos < s.size())
+    {
+        size_t semi = s.find(';', pos);
+        if (semi == std::string_view::npos)
+            semi = s.size();
+        std::string_view item = s.substr(pos, semi - pos);
+        pos                   = semi + 1;
+
+        size_t eq = item.find('=');
+        if (eq == std::string_view::npos)
+            continue;
+        std::string_view key = item.substr(0, eq);
+        if (key == "ID")
+            gtfLine.gene_id = item.substr(eq + 1);
+        else if (key == "Name")
+            gtfLine.gene_name = item.substr(eq + 1);
+    }
+}
+
+void GTFReader::gatherChunk(GTFChunk& chunk, std::string_view* states)
+{
+    std::string_view geneID   = states[GFF_GENE_ID];
+    std::string_view geneName = states[GFF_GENE_NAME];
+    std::string_view transID  = states[GFF_TRANS_ID];
+    std::string_view transName = states[GFF_TRANS_NAME];
+
+    for (auto& line : chunk.lines)
+    {
+        if (isGFF)
         {
-            auto pos = item.find(attrSep);
-            if (pos == std::string::npos)
+            if (line.feature == "region")
+            {
+                geneID = geneName = transID = transName = std::string_view();
                 continue;
-            key        = item.substr(0, pos);
-            value      = item.substr(pos + 1);
-            attrs[key] = value;
+            }
+            else if (line.feature == "gene")
+            {
+                if (line.gene_id.data() != nullptr)
+                    geneID = line.gene_id;
+                if (line.gene_name.data() != nullptr)
+                    geneName = line.gene_name;
+            }
+            else if (line.feature == "mRNA")
+            {
+                if (line.gene_id.data() != nullptr)
+                    transID = line.gene_id;
+                if (line.gene_name.data() != nullptr)
+                    transName = line.gene_name;
+            }
         }
-    return 0;
-}
\ No newline at end of file
+        else
+        {
+            geneID   = line.gene_id;
+            geneName = line.gene_name;
+            // Use transcript_id as the transcript name
+            transID = transName = line.transcript_id;
+        }
+
+        // Skip pseudo genes
+        if (geneName.empty())
+            continue;
+
+        GTFRecord gtfRecord;
+        gtfRecord.setInterval(line.start, line.end, std::string(line.contig), line.negative);
+        gtfRecord.setFeatureType(std::string(line.feature));
+        gtfRecord.setGeneID(std::string(geneID));
+        gtfRecord.setGeneName(std::string(geneName));
+        if (line.feature != "gene")
+        {
+            gtfRecord.setTranscriptID(std::string(transID));
+            gtfRecord.setTranscriptName(std::string(transName));
+            // TODO(fxzhao): when to use transcriptType and geneVersion?
+            // gtfRecord.setTranscriptType();
+        }
+        // Gather gtfRecord by genename.
+        chunk.gatherByGeneName[gtfRecord.getGeneName()].push_back(std::move(gtfRecord));
+    }
+}
@@ -11,7 +11,9 @@
 
 #include <set>
 #include <string>
+#include <string_view>
 #include <unordered_map>
+#include <vector>
 
 #include "gtfRecord.h"
 
@@ -28,31 +30,67 @@ enum GTF_COLUMNS
     ATTRIBUTE
 };
 
+// The gene and transcript fields carried from line to line in gff file
+enum GFF_STATES
+{
+    GFF_GENE_ID,
+    GFF_GENE_NAME,
+    GFF_TRANS_ID,
+    GFF_TRANS_NAME,
+    GFF_STATE_NUM
+};
+
+using GTFMap = std::unordered_map< std::string, std::vector< GTFRecord > >;
+
 class GTFReader
 {
 public:
-    GTFReader() {}
-    int loadGTFFile(std::string gtf_file_, std::unordered_map< std::string, std::vector< GTFRecord > >& gtfMap);
+    GTFReader(int threads_ = 1) : threads(threads_) {}
+    // Support gtf/gff/gff3 file and the gzip compressed ones
+    int loadGTFFile(std::string gtf_file_, GTFMap& gtfMap);
     std::unordered_map< std::string, int >& getContigs()
     {
         return contigs;
     }
 
 private:
-    int  parseTabbedLine(std::string& line, GTFRecord& gtfRecord);
-    int  parseAttributes(std::string& s);
-    void splitString(const std::string& str, char delim, bool skip_empty);
+    // One tokenized line, the views point into the input buffer.
+    // For gtf the attributes are gene_id/gene_name/transcript_id,
+    // for gff they are ID/Name.
+    struct GTFLine
+    {
+        std::string_view contig;
+        std::string_view feature;
+        int              start;
+        int              end;
+        bool             negative;
+        std::string_view gene_id;
+        std::string_view gene_name;
+        std::string_view transcript_id;
+    };
+
+    struct GTFChunk
+    {
+        std::vector< GTFLine > lines;
+        size_t                 skipped = 0;
+        // The last value assigned to each gff state in this chunk
+        std::string_view states[GFF_STATE_NUM];
+        bool             assigned[GFF_STATE_NUM] = { false, false, false, false };
+        GTFMap           gatherByGeneName;
+    };
+
+    void tokenizeChunk(const char* begin, const char* end, GTFChunk& chunk);
+    bool tokenizeLine(std::string_view line, GTFLine& gtfLine);
+    void parseAttributes(std::string_view s, GTFLine& gtfLine);
+    void parseAttributesGFF(std::string_view s, GTFLine& gtfLine);
+    void assignState(GTFChunk& chunk, int state, std::string_view value);
 
-    int parseTabbedLineGFF(std::string& line, GTFRecord& gtfRecord);
-    int parseAttributesGFF(std::string& s, std::unordered_map< std::string, std::string >& attrs);
+    void gatherChunk(GTFChunk& chunk, std::string_view* states);
 
 private:
     static const int                       GTF_TAB_NUM = 9;
     std::unordered_map< std::string, int > contigs;
 
-    std::vector< std::string >             splitedLine;
-    std::vector< std::string >             attrs;
-    std::unordered_map< std::string, int > attrKeys;
-    char                                   attrSep;
-    std::string                            geneID, geneName, transID, transName;
+    int  threads;
+    bool isGFF;
 };
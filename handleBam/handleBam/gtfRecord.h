@@ -10,6 +10,7 @@
 #pragma once
 
 #include <string>
+#include <utility>
 
 #include "interval.h"
 
@@ -63,36 +64,36 @@ public:
         return transcriptName;
     }
 
-    void setGeneName(std::string& geneName_)
+    void setGeneName(std::string geneName_)
     {
-        geneName = geneName_;
+        geneName = std::move(geneName_);
     }
-    void setGeneID(std::string& geneID_)
+    void setGeneID(std::string geneID_)
     {
-        geneID = geneID_;
+        geneID = std::move(geneID_);
     }
-    void setTranscriptName(std::string& transcriptName_)
+    void setTranscriptName(std::string transcriptName_)
     {
-        transcriptName = transcriptName_;
+        transcriptName = std::move(transcriptName_);
     }
-    void setTranscriptID(std::string& transcriptID_)
+    void setTranscriptID(std::string transcriptID_)
     {
-        transcriptID = transcriptID_;
+        transcriptID = std::move(transcriptID_);
     }
-    void setTranscriptType(std::string& transcriptType_)
+    void setTranscriptType(std::string transcriptType_)
     {
-        transcriptType = transcriptType_;
+        transcriptType = std::move(transcriptType_);
     }
-    void setFeatureType(std::string& featureType_)
+    void setFeatureType(std::string featureType_)
     {
-        featureType = featureType_;
+        featureType = std::move(featureType_);
     }
-    void setInterval(int start, int end, std::string& contig, bool negativeStrand,
+    void setInterval(int start, int end, std::string contig, bool negativeStrand,
                      [[maybe_unused]] std::string name = "")
     {
         interval.setStart(start);
         interval.setEnd(end);
-        interval.setContig(contig);
+        interval.setContig(std::move(contig));
         interval.setNegativeStrand(negativeStrand);
     }
 
@@ -12,11 +12,6 @@
 #include <zlib.h>
 //#include <gzguts.h>
 
-#define cmpFile gzFile
-#define cmpOpen(x) gzopen(x, "wb")
-#define cmpClose(x) gzclose(x)
-#define cmpFunc(x, y) gzputs(x, y)
-
 #include <string>
 using namespace std;
 
@@ -23,9 +23,9 @@
 #include "bamCat.h"
 #include "bamRecord.h"
 #include "density/kde.hpp"
+#include "expMatrix.h"
 #include "geneBuilder.h"
 #include "gtfReader.h"
-#include "gzIO.h"
 #include "handleBam.h"
 #include "intervalTree.h"
 #include "samReader.h"
@@ -51,26 +51,148 @@ static const char BASES_DECODE[] = "ACGT";
 
 constexpr int EXCESS_CONTIGS_NUM = 10000;
 
-std::tuple< int, int, int, int > HandleBam::processChromosome(std::string           ctg,
-                                                              TagReadsWithGeneExon* tagReadsWithGeneExon)
+// Number of reads annotated together
+constexpr size_t ANNOTATION_BATCH_SIZE = 256;
+
+// Reads waiting for the batch annotation. They are kept in input order, the ones
+// filtered before annotation are only carried through to keep the output order.
+struct ReadBatch
+{
+    explicit ReadBatch(size_t capacity_)
+        : capacity(capacity_), size(0), records(capacity_), barcodes(capacity_), umis(capacity_),
+          to_annotate(capacity_), splice(capacity_), pending_splice(capacity_)
+    {
+        for (auto& record : records)
+            record = createBamRecord();
+        pending.reserve(capacity);
+    }
+    ~ReadBatch()
+    {
+        for (auto& record : records)
+            bam_destroy1(record);
+    }
+
+    bool full() const
+    {
+        return size == capacity;
+    }
+    bool empty() const
+    {
+        return size == 0;
+    }
+
+    // Take over the record by swapping it with a free one, so no copy is needed
+    void add(BamRecord& record, std::string& barcode, std::string& umi, bool annotate)
+    {
+        std::swap(records[size], record);
+        barcodes[size].swap(barcode);
+        umis[size].swap(umi);
+        to_annotate[size] = annotate;
+        ++size;
+    }
+
+    // The SpliceType of the annotated reads are kept in splice if with_splice
+    void annotate(TagReadsWithGeneExon* tagReadsWithGeneExon, const std::string& contig, AnnotationCounters& counters,
+                  bool with_splice = false)
+    {
+        pending.clear();
+        for (size_t i = 0; i < size; ++i)
+            if (to_annotate[i])
+                pending.push_back(records[i]);
+        if (pending.empty())
+            return;
+        tagReadsWithGeneExon->setAnnotationBatch(pending.data(), pending.size(), contig, counters,
+                                                 with_splice ? pending_splice.data() : nullptr);
+        if (!with_splice)
+            return;
+        for (size_t i = 0, j = 0; i < size; ++i)
+            splice[i] = to_annotate[i] ? pending_splice[j++] : uint8(SPLICE_NONE);
+    }
+
+    void clear()
+    {
+        size = 0;
+    }
+
+    size_t                     capacity;
+    size_t                     size;
+    std::vector< BamRecord >   records;
+    std::vector< std::string > barcodes;
+    std::vector< std::string > umis;
+    std::vector< char >        to_annotate;
+    std::vector< uint8 >       splice;
+    std::vector< BamRecord >   pending;
+    std::vector< uint8 >       pending_splice;
+};
+
+TaskCounts HandleBam::processChromosome(std::string ctg, TagReadsWithGeneExon* tagReadsWithGeneExon)
 {
     Timer t;
 
-    int       total = 0, filtered = 0, annotated = 0, unique = 0;
-    BamRecord bamRecord = createBamRecord();
+    uint64     total = 0, filtered = 0, annotated = 0, unique = 0;
+    MaskCounts masked;
+    BamRecord  bamRecord = createBamRecord();
+
+    // Annotation statistics of this task
+    AnnotationCounters* counters = tagReadsWithGeneExon->registerCounters();
 
     std::unordered_set< std::string > read_set;
     // read_set.reserve(10*1000*1000);
-    std::string                            marker;
-    std::unordered_map< std::string, int > barcode_gene_exp;
-    std::string                            ge_value, qname;
-    int      hi_index;  // Query hit index, indicating the alignment record is the i-th one stored in SAM
-    fs::path tmp_exp_file = tmp_exp_path / (ctg + ".txt");
+    std::string     marker;
+    ExpCounter      barcode_gene_exp;
+    QcCounter       qc_counter;
+    VelocityCounter velocity_counter;
+    std::string     ge_value, qname;
+    int             hi_index;  // Query hit index, indicating the alignment record is the i-th one stored in SAM
+
+    std::unique_ptr< SamReader > sr        = SamReader::FromFile(input_bam_filenames[0]);
+    std::unique_ptr< SamWriter > samWriter = createPartWriter(tmp_bam_path / (ctg + ".bam"), sr->getHeader(), true);
+
+    // Annotate the batch, then deduplicate and write the reads in input order
+    ReadBatch batch(ANNOTATION_BATCH_SIZE);
+    auto      annotateBatch = [&]() {
+        batch.annotate(tagReadsWithGeneExon, ctg, *counters, velocity);
+        for (size_t i = 0; i < batch.size; ++i)
+        {
+            BamRecord&         record  = batch.records[i];
+            const std::string& barcode = batch.barcodes[i];
+            if (qc && batch.to_annotate[i])
+                qc_counter.add(barcode, record);
+            if (!batch.to_annotate[i] || !getTag(record, GE_TAG, ge_value))
+            {
+                if (samWriter)
+                    samWriter->write(record);
+                continue;
+            }
+            ++annotated;
+
+            getMarker(record, marker);
+            marker += barcode;
+            if (read_set.count(marker) != 0)
+            {
+                // Save the reads that duplicate
+                if (bam_config.save_dup)
+                {
+                    setDuplication(record);
+                    if (samWriter)
+                        samWriter->write(record);
+                }
+                continue;
+            }
+            read_set.insert(marker);
+            ++unique;
 
-    fs::path                     tmp_bam_file = tmp_bam_path / (ctg + ".bam");
-    SamWriter                    samWriter(tmp_bam_file.string());
-    std::unique_ptr< SamReader > sr = SamReader::FromFile(input_bam_filenames[0]);
-    samWriter.init(sr->getHeader());
+            // Calculate barcode gene expression
+            barcode_gene_exp.add(barcode, ge_value, 1, 0);
+            if (velocity)
+                velocity_counter.add(barcode, ge_value, batch.splice[i]);
+
+            // Write disk of output bam data
+            if (samWriter)
+                samWriter->write(record);
+        }
+        batch.clear();
+    };
 
     for (auto& input_bam : input_bam_filenames)
     {
@@ -168,6 +290,27 @@ std::tuple< int, int, int, int > HandleBam::processChromosome(std::string
             }
 #endif
 
+            // Reject the reads whose barcodes are not on the chip before any annotation
+            if (chip_mask && !chip_mask->contains(barcode))
+            {
+                ++masked.invalid_barcode;
+                continue;
+            }
+            // Off tissue reads skip the annotation, umi and saturation
+            if (tissue_mask && !tissue_mask->contains(barcode))
+            {
+                ++masked.off_tissue;
+                if (getQual(bamRecord) >= mapping_quality_threshold)
+                    ++masked.off_tissue_pass;
+                if (save_off_tissue)
+                {
+                    batch.add(bamRecord, barcode, umi, false);
+                    if (batch.full())
+                        annotateBatch();
+                }
+                continue;
+            }
+
             // Filter mapping quality.
             int score = getQual(bamRecord);
             if (score < mapping_quality_threshold)
@@ -176,29 +319,87 @@ std::tuple< int, int, int, int > HandleBam::processChromosome(std::string
                 if (bam_config.save_lq)
                 {
                     setQcFail(bamRecord);
-                    samWriter.write(bamRecord);
+                    batch.add(bamRecord, barcode, umi, false);
+                    if (batch.full())
+                        annotateBatch();
                 }
                 continue;
             }
             ++filtered;
 
-            tagReadsWithGeneExon->setAnnotation(bamRecord, ctg);
-            if (!getTag(bamRecord, GE_TAG, ge_value))
+            batch.add(bamRecord, barcode, umi, true);
+            if (batch.full())
+                annotateBatch();
+        }
+    }
+    annotateBatch();
+    if (samWriter)
+        samWriter->close();
+    keepPartOutput(ctg, samWriter.get(), barcode_gene_exp);
+
+    bam_destroy1(bamRecord);
+
+    spdlog::info("chr:{} total:{} filtered:{} annotated:{} unique:{} time(s):{:.2f}", ctg, total, filtered, annotated,
+                 unique, t.toc(1000));
+    addMaskCounts(masked);
+    addQcCounter(qc_counter);
+    addVelocityCounter(velocity_counter);
+    return make_tuple(total, filtered, annotated, unique);
+}
+
+TaskCounts HandleBam::processChromosomeWhole(std::string ctg, TagReadsWithGeneExon* tagReadsWithGeneExon)
+{
+    Timer t;
+
+    uint64     total = 0, filtered = 0, annotated = 0, unique = 0;
+    MaskCounts masked;
+    BamRecord  bamRecord = createBamRecord();
+
+    // Annotation statistics of this task
+    AnnotationCounters* counters = tagReadsWithGeneExon->registerCounters();
+
+    std::unordered_set< std::string > read_set;
+    // read_set.reserve(10*1000*1000);
+    std::string     marker;
+    ExpCounter      barcode_gene_exp;
+    QcCounter       qc_counter;
+    VelocityCounter velocity_counter;
+    std::string     ge_value, qname;
+    int             hi_index;  // Query hit index, indicating the alignment record is the i-th one stored in SAM
+
+    std::unique_ptr< SamReader > sr        = SamReader::FromFile(input_bam_filenames[0]);
+    std::unique_ptr< SamWriter > samWriter = createPartWriter(tmp_bam_path / (ctg + ".bam"), sr->getHeader(), true);
+
+    // The batch holds reads of one contig
+    std::string batch_contig;
+    // Annotate the batch, then deduplicate and write the reads in input order
+    ReadBatch batch(ANNOTATION_BATCH_SIZE);
+    auto      annotateBatch = [&]() {
+        batch.annotate(tagReadsWithGeneExon, batch_contig, *counters, velocity);
+        for (size_t i = 0; i < batch.size; ++i)
+        {
+            BamRecord&         record  = batch.records[i];
+            const std::string& barcode = batch.barcodes[i];
+            if (qc && batch.to_annotate[i])
+                qc_counter.add(barcode, record);
+            if (!batch.to_annotate[i] || !getTag(record, GE_TAG, ge_value))
             {
-                samWriter.write(bamRecord);
+                if (samWriter)
+                    samWriter->write(record);
                 continue;
             }
             ++annotated;
 
-            getMarker(bamRecord, marker);
+            getMarker(record, marker);
             marker += barcode;
             if (read_set.count(marker) != 0)
             {
                 // Save the reads that duplicate
                 if (bam_config.save_dup)
                 {
-                    setDuplication(bamRecord);
-                    samWriter.write(bamRecord);
+                    setDuplication(record);
+                    if (samWriter)
+                        samWriter->write(record);
                 }
                 continue;
             }
@@ -206,55 +407,16 @@ std::tuple< int, int, int, int > HandleBam::processChromosome(std::string
             ++unique;
 
             // Calculate barcode gene expression
-            barcode_gene_exp[barcode + "\t" + ge_value]++;
+            barcode_gene_exp.add(barcode, ge_value, 1, 0);
+            if (velocity)
+                velocity_counter.add(barcode, ge_value, batch.splice[i]);
 
             // Write disk of output bam data
-            samWriter.write(bamRecord);
-        }
-    }
-    samWriter.close();
-
-    if (!barcode_gene_exp.empty())
-    {
-        std::ofstream exp_handle(tmp_exp_file, std::ofstream::out);
-        if (!exp_handle.is_open())
-        {
-            std::string error = "Error opening file: " + tmp_exp_file.string();
-            spdlog::error(error);
-            throw std::runtime_error(error);
+            if (samWriter)
+                samWriter->write(record);
         }
-        for (auto& p : barcode_gene_exp)
-            exp_handle << p.first << "\t" << p.second << std::endl;
-        exp_handle.close();
-    }
-
-    bam_destroy1(bamRecord);
-
-    spdlog::info("chr:{} total:{} filtered:{} annotated:{} unique:{} time(s):{:.2f}", ctg, total, filtered, annotated,
-                 unique, t.toc(1000));
-    return make_tuple(total, filtered, annotated, unique);
-}
-
-std::tuple< int, int, int, int > HandleBam::processChromosomeWhole(std::string           ctg,
-                                                                   TagReadsWithGeneExon* tagReadsWithGeneExon)
-{
-    Timer t;
-
-    int       total = 0, filtered = 0, annotated = 0, unique = 0;
-    BamRecord bamRecord = createBamRecord();
-
-    std::unordered_set< std::string > read_set;
-    // read_set.reserve(10*1000*1000);
-    std::string                            marker;
-    std::unordered_map< std::string, int > barcode_gene_exp;
-    std::string                            ge_value, qname;
-    int      hi_index;  // Query hit index, indicating the alignment record is the i-th one stored in SAM
-    fs::path tmp_exp_file = tmp_exp_path / (ctg + ".txt");
-
-    fs::path                     tmp_bam_file = tmp_bam_path / (ctg + ".bam");
-    SamWriter                    samWriter(tmp_bam_file.string());
-    std::unique_ptr< SamReader > sr = SamReader::FromFile(input_bam_filenames[0]);
-    samWriter.init(sr->getHeader());
+        batch.clear();
+    };
 
     for (auto& input_bam : input_bam_filenames)
     {
@@ -341,6 +503,27 @@ std::tuple< int, int, int, int > HandleBam::processChromosomeWhole(std::string
             }
 #endif
 
+            // Reject the reads whose barcodes are not on the chip before any annotation
+            if (chip_mask && !chip_mask->contains(barcode))
+            {
+                ++masked.invalid_barcode;
+                continue;
+            }
+            // Off tissue reads skip the annotation, umi and saturation
+            if (tissue_mask && !tissue_mask->contains(barcode))
+            {
+                ++masked.off_tissue;
+                if (getQual(bamRecord) >= mapping_quality_threshold)
+                    ++masked.off_tissue_pass;
+                if (save_off_tissue)
+                {
+                    batch.add(bamRecord, barcode, umi, false);
+                    if (batch.full())
+                        annotateBatch();
+                }
+                continue;
+            }
+
             // Filter mapping quality.
             int score = getQual(bamRecord);
             if (score < mapping_quality_threshold)
@@ -349,83 +532,59 @@ std::tuple< int, int, int, int > HandleBam::processChromosomeWhole(std::string
                 if (bam_config.save_lq)
                 {
                     setQcFail(bamRecord);
-                    samWriter.write(bamRecord);
+                    batch.add(bamRecord, barcode, umi, false);
+                    if (batch.full())
+                        annotateBatch();
                 }
                 continue;
             }
             ++filtered;
 
             string ctg = sr->refName(bamRecord);
-            tagReadsWithGeneExon->setAnnotation(bamRecord, ctg);
-            if (!getTag(bamRecord, GE_TAG, ge_value))
-            {
-                samWriter.write(bamRecord);
-                continue;
-            }
-            ++annotated;
-
-            getMarker(bamRecord, marker);
-            marker += barcode;
-
-            if (read_set.count(marker) != 0)
+            if (ctg != batch_contig)
             {
-                // Save the reads that duplicate
-                if (bam_config.save_dup)
-                {
-                    setDuplication(bamRecord);
-                    samWriter.write(bamRecord);
-                }
-                continue;
+                annotateBatch();
+                batch_contig = ctg;
             }
-            read_set.insert(marker);
-            ++unique;
-
-            // Calculate barcode gene expression
-            barcode_gene_exp[barcode + "\t" + ge_value]++;
-
-            // Write disk of output bam data
-            samWriter.write(bamRecord);
-        }
-    }
-    samWriter.close();
-
-    if (!barcode_gene_exp.empty())
-    {
-        std::ofstream exp_handle(tmp_exp_file, std::ofstream::out);
-        if (!exp_handle.is_open())
-        {
-            std::string error = "Error opening file: " + tmp_exp_file.string();
-            spdlog::error(error);
-            throw std::runtime_error(error);
+            batch.add(bamRecord, barcode, umi, true);
+            if (batch.full())
+                annotateBatch();
         }
-        for (auto& p : barcode_gene_exp)
-            exp_handle << p.first << "\t" << p.second << std::endl;
-        exp_handle.close();
     }
+    annotateBatch();
+    if (samWriter)
+        samWriter->close();
+    keepPartOutput(ctg, samWriter.get(), barcode_gene_exp);
 
     bam_destroy1(bamRecord);
 
     spdlog::info("chr:{} total:{} filtered:{} annotated:{} unique:{} time(s):{:.2f}", ctg, total, filtered, annotated,
                  unique, t.toc(1000));
+    addMaskCounts(masked);
+    addQcCounter(qc_counter);
+    addVelocityCounter(velocity_counter);
     return make_tuple(total, filtered, annotated, unique);
 }
 
-std::tuple< int, int, int, int > HandleBam::processChromosomeUmi(std::string           ctg,
-                                                                 TagReadsWithGeneExon* tagReadsWithGeneExon)
+TaskCounts HandleBam::processChromosomeUmi(std::string ctg, TagReadsWithGeneExon* tagReadsWithGeneExon)
 {
-    Timer t;
-    int   total = 0, filtered = 0, annotated = 0, unique = 0;
+    Timer      t;
+    uint64     total = 0, filtered = 0, annotated = 0, unique = 0;
+    MaskCounts masked;
+
+    // Annotation statistics of this task
+    AnnotationCounters* counters = tagReadsWithGeneExon->registerCounters();
 
     BamRecord                                                                 bamRecord = createBamRecord();
     std::unordered_map< std::string, std::unordered_map< std::string, int > > umi_mismatch;
+    std::vector< UmiRead >                                                    umi_reads;
 
-    std::string                                              marker;
-    std::unordered_map< std::string, std::pair< int, int > > barcode_gene_exp;
-    std::string                                              ge_value, qname;
-    int hi_index;  // Query hit index, indicating the alignment record is the i-th one stored in SAM
-
-    fs::path tmp_exp_file = tmp_exp_path / ctg;
-    tmp_exp_file += ".txt";
+    std::string     marker;
+    ExpCounter      barcode_gene_exp;
+    QcCounter       qc_counter;
+    VelocityCounter velocity_counter;
+    std::string     ge_value, qname;
+    int             hi_index;  // Query hit index, indicating the alignment record is the i-th one stored in SAM
 
     int index = 0;
     for (auto& input_bam : input_bam_filenames)
@@ -444,9 +603,74 @@ std::tuple< int, int, int, int > HandleBam::processChromosomeUmi(std::string
         if (chr_id == -1 || !sr->QueryByContig(chr_id))
             continue;
 
-        fs::path  tmp_bam_file = tmp_bam_path / (ctg + "_" + to_string(index) + ".bam");
-        SamWriter samWriter(tmp_bam_file.string());
-        samWriter.init(sr->getHeader());
+        fs::path                     tmp_bam_file = tmp_bam_path / (ctg + "_" + to_string(index) + ".bam");
+        std::unique_ptr< SamWriter > samWriter    = createPartWriter(tmp_bam_file, sr->getHeader(), false);
+
+        // Annotate the batch, then count the umis and write the reads in input order
+        ReadBatch batch(ANNOTATION_BATCH_SIZE);
+        auto      annotateBatch = [&]() {
+            batch.annotate(tagReadsWithGeneExon, ctg, *counters, velocity);
+            for (size_t i = 0; i < batch.size; ++i)
+            {
+                BamRecord&         record  = batch.records[i];
+                const std::string& barcode = batch.barcodes[i];
+                const std::string& umi     = batch.umis[i];
+                if (qc && batch.to_annotate[i])
+                    qc_counter.add(barcode, record);
+                if (!batch.to_annotate[i])
+                {
+                    if (samWriter)
+                        samWriter->write(record);
+                    continue;
+                }
+
+                // Calculate barcode gene expression
+                if (getTag(record, GE_TAG, ge_value))
+                {
+                    ++annotated;
+                    std::string key = barcode + "|" + ge_value;
+                    if (umi_mismatch.count(key) == 0)
+                        umi_mismatch[key] = {};
+                    umi_mismatch[key][umi]++;
+                    if (velocity)
+                        velocity_counter.addRead(key, umi, batch.splice[i]);
+                    if (umi_mismatch[key][umi] > 1)
+                    {
+                        // Save the reads that duplicate
+                        if (bam_config.save_dup)
+                            setDuplication(record);
+                        else
+                            continue;
+                    }
+                    else
+                    {
+                        ++unique;
+                        if (bam_config.no_bam && !passThrough(record))
+                        {
+                            auto it = umi_mismatch.find(key);
+                            umi_reads.push_back({ &it->first, &it->second[umi], uint32(barcode.size()) });
+                        }
+                    }
+                }
+                else
+                {
+                    // For total reads in sequencing saturation
+                    ge_value        = "NOGENE";
+                    std::string key = barcode + "|" + ge_value;
+                    if (umi_mismatch.count(key) == 0)
+                        umi_mismatch[key] = {};
+                    umi_mismatch[key][umi]++;
+
+                    // Do not save the reads with no gene name
+                    // continue;
+                }
+
+                // Write disk of output bam data
+                if (samWriter)
+                    samWriter->write(record);
+            }
+            batch.clear();
+        };
 
         // First read bam: fitler, set annotations, stat {barcode_gene: {umi: cnt}},
         // deduplication the first time, and write disk
@@ -527,6 +751,28 @@ std::tuple< int, int, int, int > HandleBam::processChromosomeUmi(std::string
                 bamRecord->core.l_extranul += qname_view.size() - pos;
             }
 #endif
+
+            // Reject the reads whose barcodes are not on the chip before any annotation
+            if (chip_mask && !chip_mask->contains(barcode))
+            {
+                ++masked.invalid_barcode;
+                continue;
+            }
+            // Off tissue reads skip the annotation, umi and saturation
+            if (tissue_mask && !tissue_mask->contains(barcode))
+            {
+                ++masked.off_tissue;
+                if (getQual(bamRecord) >= mapping_quality_threshold)
+                    ++masked.off_tissue_pass;
+                if (save_off_tissue)
+                {
+                    batch.add(bamRecord, barcode, umi, false);
+                    if (batch.full())
+                        annotateBatch();
+                }
+                continue;
+            }
+
             // Filter mapping quality.
             int score = getQual(bamRecord);
             if (score < mapping_quality_threshold)
@@ -542,7 +788,9 @@ std::tuple< int, int, int, int > HandleBam::processChromosomeUmi(std::string
                 if (bam_config.save_lq)
                 {
                     setQcFail(bamRecord);
-                    samWriter.write(bamRecord);
+                    batch.add(bamRecord, barcode, umi, false);
+                    if (batch.full())
+                        annotateBatch();
                 }
                 continue;
             }
@@ -552,45 +800,13 @@ std::tuple< int, int, int, int > HandleBam::processChromosomeUmi(std::string
             if (umi.find('N') != std::string::npos)
                 continue;
 
-            // Set annotations, need the gene name for the next step
-            tagReadsWithGeneExon->setAnnotation(bamRecord, ctg);
-
-            // Calculate barcode gene expression
-            if (getTag(bamRecord, GE_TAG, ge_value))
-            {
-                ++annotated;
-                std::string key = barcode + "|" + ge_value;
-                if (umi_mismatch.count(key) == 0)
-                    umi_mismatch[key] = {};
-                umi_mismatch[key][umi]++;
-                if (umi_mismatch[key][umi] > 1)
-                {
-                    // Save the reads that duplicate
-                    if (bam_config.save_dup)
-                        setDuplication(bamRecord);
-                    else
-                        continue;
-                }
-                else
-                    ++unique;
-            }
-            else
-            {
-                // For total reads in sequencing saturation
-                ge_value        = "NOGENE";
-                std::string key = barcode + "|" + ge_value;
-                if (umi_mismatch.count(key) == 0)
-                    umi_mismatch[key] = {};
-                umi_mismatch[key][umi]++;
-
-                // Do not save the reads with no gene name
-                // continue;
-            }
-
-            // Write disk of output bam data
-            samWriter.write(bamRecord);
+            batch.add(bamRecord, barcode, umi, true);
+            if (batch.full())
+                annotateBatch();
         }
-        samWriter.close();
+        annotateBatch();
+        if (samWriter)
+            samWriter->close();
     }
 
     if (total == 0)
@@ -600,112 +816,102 @@ std::tuple< int, int, int, int > HandleBam::processChromosomeUmi(std::string
 
         spdlog::info("chr:{} total:{} filtered:{} annotated:{} unique:{} time(s):{:.2f}", ctg, total, filtered,
                      annotated, unique, t.toc(1000));
+        addMaskCounts(masked);
+        addQcCounter(qc_counter);
+        addVelocityCounter(velocity_counter);
         return make_tuple(total, filtered, annotated, unique);
     }
 
     // Calcluate which pattern of barcode_gene_umi should be duplicated
     std::unordered_map< std::string, std::unordered_map< std::string, std::string > > umi_correct;
     deDupUmi(umi_mismatch, umi_correct);
+    if (velocity)
+        velocity_counter.collapse(umi_correct);
 
-    fs::path                     inter_bam_file = tmp_bam_path / (ctg + ".bam");
-    SamWriter                    samWriter2(inter_bam_file.string());
-    std::unique_ptr< SamReader > sr2 = SamReader::FromFile(input_bam_filenames[0]);
-    samWriter2.init(sr2->getHeader());
-    for (size_t index = 1; index <= input_bam_filenames.size(); ++index)
+    if (bam_config.no_bam)
     {
-        fs::path tmp_bam_file = tmp_bam_path / (ctg + "_" + to_string(index) + ".bam");
-        if (!fs::exists(tmp_bam_file))
-            continue;  // maybe not exists
-
-        std::unique_ptr< SamReader > sr2     = SamReader::FromFile(tmp_bam_file.string());
-        auto                         contigs = sr2->getContigs();
-        // Find index of contig
-        int chr_id = -1;
-        for (size_t i = 0; i < contigs.size(); ++i)
-            if (contigs[i].first == ctg)
-            {
-                chr_id = i;
-                break;
-            }
-
-        if (chr_id == -1 || !sr2->QueryByContig(chr_id))
-            continue;
-
-        // Second read bam: deduplication the second time, stat gene expression and write disk
-        while (true)
+        replayUmiReads(umi_reads, unique, barcode_gene_exp);
+        keepPartOutput(ctg, nullptr, barcode_gene_exp);
+    }
+    else
+    {
+        fs::path                     inter_bam_file = tmp_bam_path / (ctg + ".bam");
+        SamWriter                    samWriter2(inter_bam_file.string());
+        std::unique_ptr< SamReader > sr2 = SamReader::FromFile(input_bam_filenames[0]);
+        samWriter2.init(sr2->getHeader(), true, bam_config.tag_index);
+        for (size_t index = 1; index <= input_bam_filenames.size(); ++index)
         {
-            if (!sr2->next(bamRecord))
-                break;
+            fs::path tmp_bam_file = tmp_bam_path / (ctg + "_" + to_string(index) + ".bam");
+            if (!fs::exists(tmp_bam_file))
+                continue;  // maybe not exists
+
+            std::unique_ptr< SamReader > sr2     = SamReader::FromFile(tmp_bam_file.string());
+            auto                         contigs = sr2->getContigs();
+            // Find index of contig
+            int chr_id = -1;
+            for (size_t i = 0; i < contigs.size(); ++i)
+                if (contigs[i].first == ctg)
+                {
+                    chr_id = i;
+                    break;
+                }
 
-            if ((bam_config.save_lq && getQcFail(bamRecord)) || (bam_config.save_dup && getDuplication(bamRecord)))
-            {
-                samWriter2.write(bamRecord);
+            if (chr_id == -1 || !sr2->QueryByContig(chr_id))
                 continue;
-            }
-
-            // Barcode length may be changed, e.g. 41_16_61982_24418 / 0_0_0_0
-            // if (qname.size() <= barcode_len || qname[barcode_len] != QNAME_SEP)
-            std::string barcode = "";
-            std::string umi     = "";
-            getTag(bamRecord, CB_TAG, barcode);
-            getTag(bamRecord, UR_TAG, umi);
 
-            // Calculate barcode gene expression
-            if (getTag(bamRecord, GE_TAG, ge_value))
+            // Second read bam: deduplication the second time, stat gene expression and write disk
+            while (true)
             {
-                std::string key = barcode + "|" + ge_value;
+                if (!sr2->next(bamRecord))
+                    break;
+
+                if (passThrough(bamRecord))
+                {
+                    samWriter2.write(bamRecord);
+                    continue;
+                }
 
-                if (umi_mismatch[key][umi] == 0)
+                // Barcode length may be changed, e.g. 41_16_61982_24418 / 0_0_0_0
+                // if (qname.size() <= barcode_len || qname[barcode_len] != QNAME_SEP)
+                std::string barcode = "";
+                std::string umi     = "";
+                getTag(bamRecord, CB_TAG, barcode);
+                getTag(bamRecord, UR_TAG, umi);
+
+                // Calculate barcode gene expression
+                if (getTag(bamRecord, GE_TAG, ge_value))
                 {
-                    --unique;
-                    // Save the reads that duplicate
-                    if (bam_config.save_dup)
+                    std::string key = barcode + "|" + ge_value;
+
+                    if (umi_mismatch[key][umi] == 0)
                     {
-                        int         ret     = 0;
-                        std::string correct = umi_correct[key][umi];
-                        ret = bam_aux_append(bamRecord, "UB", 'Z', correct.size() + 1, ( uint8_t* )correct.c_str());
-                        if (ret != 0)
-                            spdlog::warn("bam_aux_append UB failed:{}", strerror(errno));
-                        setDuplication(bamRecord);
+                        --unique;
+                        // Save the reads that duplicate
+                        if (bam_config.save_dup)
+                        {
+                            int         ret     = 0;
+                            std::string correct = umi_correct[key][umi];
+                            ret = bam_aux_append(bamRecord, "UB", 'Z', correct.size() + 1, ( uint8_t* )correct.c_str());
+                            if (ret != 0)
+                                spdlog::warn("bam_aux_append UB failed:{}", strerror(errno));
+                            setDuplication(bamRecord);
+                        }
+                        else
+                            continue;
                     }
                     else
-                        continue;
-                }
-                else
-                {
-                    // Calculate barcode gene expression
-                    barcode_gene_exp[barcode + "\t" + ge_value].first++;
-                    barcode_gene_exp[barcode + "\t" + ge_value].second += umi_mismatch[key][umi];
+                    {
+                        // Calculate barcode gene expression
+                        barcode_gene_exp.add(barcode, ge_value, 1, umi_mismatch[key][umi]);
+                    }
                 }
-            }
 
-            // Write disk of output bam data
-            samWriter2.write(bamRecord);
-        }
-    }
-    samWriter2.close();
-
-    if (!barcode_gene_exp.empty())
-    {
-        std::ofstream exp_handle(tmp_exp_file, std::ofstream::out);
-        if (!exp_handle.is_open())
-        {
-            std::string error = "Error opening file: " + tmp_exp_file.string();
-            spdlog::error(error);
-            throw std::runtime_error(error);
-        }
-        if (scrna)
-        {
-            for (auto& p : barcode_gene_exp)
-                exp_handle << p.first << "\t" << p.second.first << "\t" << p.second.second << std::endl;
-        }
-        else
-        {
-            for (auto& p : barcode_gene_exp)
-                exp_handle << p.first << "\t" << p.second.first << std::endl;
+                // Write disk of output bam data
+                samWriter2.write(bamRecord);
+            }
         }
-
-        exp_handle.close();
+        samWriter2.close();
+        keepPartOutput(ctg, &samWriter2, barcode_gene_exp);
     }
 
     // std::unordered_map< std::string, int > tmp_map;
@@ -721,25 +927,31 @@ std::tuple< int, int, int, int > HandleBam::processChromosomeUmi(std::string
 
     spdlog::info("chr:{} total:{} filtered:{} annotated:{} unique:{} time(s):{:.2f}", ctg, total, filtered, annotated,
                  unique, t.toc(1000));
+    addMaskCounts(masked);
+    addQcCounter(qc_counter);
+    addVelocityCounter(velocity_counter);
     return make_tuple(total, filtered, annotated, unique);
 }
 
-std::tuple< int, int, int, int > HandleBam::processChromosomeUmiWhole(std::string           ctg,
-                                                                      TagReadsWithGeneExon* tagReadsWithGeneExon)
+TaskCounts HandleBam::processChromosomeUmiWhole(std::string ctg, TagReadsWithGeneExon* tagReadsWithGeneExon)
 {
-    Timer t;
-    int   total = 0, filtered = 0, annotated = 0, unique = 0;
+    Timer      t;
+    uint64     total = 0, filtered = 0, annotated = 0, unique = 0;
+    MaskCounts masked;
+
+    // Annotation statistics of this task
+    AnnotationCounters* counters = tagReadsWithGeneExon->registerCounters();
 
     BamRecord                                                                 bamRecord = createBamRecord();
     std::unordered_map< std::string, std::unordered_map< std::string, int > > umi_mismatch;
+    std::vector< UmiRead >                                                    umi_reads;
 
-    std::string                                              marker;
-    std::unordered_map< std::string, std::pair< int, int > > barcode_gene_exp;
-    std::string                                              ge_value, qname;
-    int hi_index;  // Query hit index, indicating the alignment record is the i-th one stored in SAM
-
-    fs::path tmp_exp_file = tmp_exp_path / ctg;
-    tmp_exp_file += ".txt";
+    std::string     marker;
+    ExpCounter      barcode_gene_exp;
+    QcCounter       qc_counter;
+    VelocityCounter velocity_counter;
+    std::string     ge_value, qname;
+    int             hi_index;  // Query hit index, indicating the alignment record is the i-th one stored in SAM
 
     int index = 0;
     for (auto& input_bam : input_bam_filenames)
@@ -747,9 +959,76 @@ std::tuple< int, int, int, int > HandleBam::processChromosomeUmiWhole(std::strin
         ++index;
         std::unique_ptr< SamReader > sr = SamReader::FromFile(input_bam);
 
-        fs::path  tmp_bam_file = tmp_bam_path / (ctg + "_" + to_string(index) + ".bam");
-        SamWriter samWriter(tmp_bam_file.string());
-        samWriter.init(sr->getHeader());
+        fs::path                     tmp_bam_file = tmp_bam_path / (ctg + "_" + to_string(index) + ".bam");
+        std::unique_ptr< SamWriter > samWriter    = createPartWriter(tmp_bam_file, sr->getHeader(), false);
+
+        // The batch holds reads of one contig
+        std::string batch_contig;
+        // Annotate the batch, then count the umis and write the reads in input order
+        ReadBatch batch(ANNOTATION_BATCH_SIZE);
+        auto      annotateBatch = [&]() {
+            batch.annotate(tagReadsWithGeneExon, batch_contig, *counters, velocity);
+            for (size_t i = 0; i < batch.size; ++i)
+            {
+                BamRecord&         record  = batch.records[i];
+                const std::string& barcode = batch.barcodes[i];
+                const std::string& umi     = batch.umis[i];
+                if (qc && batch.to_annotate[i])
+                    qc_counter.add(barcode, record);
+                if (!batch.to_annotate[i])
+                {
+                    if (samWriter)
+                        samWriter->write(record);
+                    continue;
+                }
+
+                // Calculate barcode gene expression
+                if (getTag(record, GE_TAG, ge_value))
+                {
+                    ++annotated;
+                    std::string key = barcode + "|" + ge_value;
+                    if (umi_mismatch.count(key) == 0)
+                        umi_mismatch[key] = {};
+                    umi_mismatch[key][umi]++;
+                    if (velocity)
+                        velocity_counter.addRead(key, umi, batch.splice[i]);
+                    if (umi_mismatch[key][umi] > 1)
+                    {
+                        // Save the reads that duplicate
+                        if (bam_config.save_dup)
+                            setDuplication(record);
+                        else
+                            continue;
+                    }
+                    else
+                    {
+                        ++unique;
+                        if (bam_config.no_bam && !passThrough(record))
+                        {
+                            auto it = umi_mismatch.find(key);
+                            umi_reads.push_back({ &it->first, &it->second[umi], uint32(barcode.size()) });
+                        }
+                    }
+                }
+                else
+                {
+                    // For total reads in sequencing saturation
+                    ge_value        = "NOGENE";
+                    std::string key = barcode + "|" + ge_value;
+                    if (umi_mismatch.count(key) == 0)
+                        umi_mismatch[key] = {};
+                    umi_mismatch[key][umi]++;
+
+                    // Do not save the reads with no gene name
+                    // continue;
+                }
+
+                // Write disk of output bam data
+                if (samWriter)
+                    samWriter->write(record);
+            }
+            batch.clear();
+        };
 
         // First read bam: fitler, set annotations, stat {barcode_gene: {umi: cnt}},
         // deduplication the first time, and write disk
@@ -830,6 +1109,28 @@ std::tuple< int, int, int, int > HandleBam::processChromosomeUmiWhole(std::strin
                 bamRecord->core.l_extranul += qname_view.size() - pos;
             }
 #endif
+
+            // Reject the reads whose barcodes are not on the chip before any annotation
+            if (chip_mask && !chip_mask->contains(barcode))
+            {
+                ++masked.invalid_barcode;
+                continue;
+            }
+            // Off tissue reads skip the annotation, umi and saturation
+            if (tissue_mask && !tissue_mask->contains(barcode))
+            {
+                ++masked.off_tissue;
+                if (getQual(bamRecord) >= mapping_quality_threshold)
+                    ++masked.off_tissue_pass;
+                if (save_off_tissue)
+                {
+                    batch.add(bamRecord, barcode, umi, false);
+                    if (batch.full())
+                        annotateBatch();
+                }
+                continue;
+            }
+
             // Filter mapping quality.
             int score = getQual(bamRecord);
             if (score < mapping_quality_threshold)
@@ -845,7 +1146,9 @@ std::tuple< int, int, int, int > HandleBam::processChromosomeUmiWhole(std::strin
                 if (bam_config.save_lq)
                 {
                     setQcFail(bamRecord);
-                    samWriter.write(bamRecord);
+                    batch.add(bamRecord, barcode, umi, false);
+                    if (batch.full())
+                        annotateBatch();
                 }
                 continue;
             }
@@ -856,45 +1159,18 @@ std::tuple< int, int, int, int > HandleBam::processChromosomeUmiWhole(std::strin
                 continue;
 
             string ctg = sr->refName(bamRecord);
-            // Set annotations, need the gene name for the next step
-            tagReadsWithGeneExon->setAnnotation(bamRecord, ctg);
-
-            // Calculate barcode gene expression
-            if (getTag(bamRecord, GE_TAG, ge_value))
+            if (ctg != batch_contig)
             {
-                ++annotated;
-                std::string key = barcode + "|" + ge_value;
-                if (umi_mismatch.count(key) == 0)
-                    umi_mismatch[key] = {};
-                umi_mismatch[key][umi]++;
-                if (umi_mismatch[key][umi] > 1)
-                {
-                    // Save the reads that duplicate
-                    if (bam_config.save_dup)
-                        setDuplication(bamRecord);
-                    else
-                        continue;
-                }
-                else
-                    ++unique;
-            }
-            else
-            {
-                // For total reads in sequencing saturation
-                ge_value        = "NOGENE";
-                std::string key = barcode + "|" + ge_value;
-                if (umi_mismatch.count(key) == 0)
-                    umi_mismatch[key] = {};
-                umi_mismatch[key][umi]++;
-
-                // Do not save the reads with no gene name
-                // continue;
+                annotateBatch();
+                batch_contig = ctg;
             }
-
-            // Write disk of output bam data
-            samWriter.write(bamRecord);
+            batch.add(bamRecord, barcode, umi, true);
+            if (batch.full())
+                annotateBatch();
         }
-        samWriter.close();
+        annotateBatch();
+        if (samWriter)
+            samWriter->close();
     }
 
     if (total == 0)
@@ -904,99 +1180,90 @@ std::tuple< int, int, int, int > HandleBam::processChromosomeUmiWhole(std::strin
 
         spdlog::info("total:{} filtered:{} annotated:{} unique:{} time(s):{:.2f}", ctg, total, filtered, annotated,
                      unique, t.toc(1000));
+        addMaskCounts(masked);
+        addQcCounter(qc_counter);
+        addVelocityCounter(velocity_counter);
         return make_tuple(total, filtered, annotated, unique);
     }
 
     // Calcluate which pattern of barcode_gene_umi should be duplicated
     std::unordered_map< std::string, std::unordered_map< std::string, std::string > > umi_correct;
     deDupUmi(umi_mismatch, umi_correct);
+    if (velocity)
+        velocity_counter.collapse(umi_correct);
 
-    fs::path                     inter_bam_file = tmp_bam_path / (ctg + ".bam");
-    SamWriter                    samWriter2(inter_bam_file.string());
-    std::unique_ptr< SamReader > sr2 = SamReader::FromFile(input_bam_filenames[0]);
-    samWriter2.init(sr2->getHeader());
-    for (size_t index = 1; index <= input_bam_filenames.size(); ++index)
+    if (bam_config.no_bam)
     {
-        fs::path tmp_bam_file = tmp_bam_path / (ctg + "_" + to_string(index) + ".bam");
-        if (!fs::exists(tmp_bam_file))
-            continue;  // maybe not exists
-
-        std::unique_ptr< SamReader > sr2 = SamReader::FromFile(tmp_bam_file.string());
-
-        // Second read bam: deduplication the second time, stat gene expression and write disk
-        while (true)
+        replayUmiReads(umi_reads, unique, barcode_gene_exp);
+        keepPartOutput(ctg, nullptr, barcode_gene_exp);
+    }
+    else
+    {
+        fs::path                     inter_bam_file = tmp_bam_path / (ctg + ".bam");
+        SamWriter                    samWriter2(inter_bam_file.string());
+        std::unique_ptr< SamReader > sr2 = SamReader::FromFile(input_bam_filenames[0]);
+        samWriter2.init(sr2->getHeader(), true, bam_config.tag_index);
+        for (size_t index = 1; index <= input_bam_filenames.size(); ++index)
         {
-            if (!sr2->QueryAll(bamRecord))
-                break;
+            fs::path tmp_bam_file = tmp_bam_path / (ctg + "_" + to_string(index) + ".bam");
+            if (!fs::exists(tmp_bam_file))
+                continue;  // maybe not exists
+
+            std::unique_ptr< SamReader > sr2 = SamReader::FromFile(tmp_bam_file.string());
 
-            if ((bam_config.save_lq && getQcFail(bamRecord)) || (bam_config.save_dup && getDuplication(bamRecord)))
+            // Second read bam: deduplication the second time, stat gene expression and write disk
+            while (true)
             {
-                samWriter2.write(bamRecord);
-                continue;
-            }
+                if (!sr2->QueryAll(bamRecord))
+                    break;
 
-            // Barcode length may be changed, e.g. 41_16_61982_24418 / 0_0_0_0
-            // if (qname.size() <= barcode_len || qname[barcode_len] != QNAME_SEP)
-            std::string barcode = "";
-            std::string umi     = "";
-            getTag(bamRecord, CB_TAG, barcode);
-            getTag(bamRecord, UR_TAG, umi);
+                if (passThrough(bamRecord))
+                {
+                    samWriter2.write(bamRecord);
+                    continue;
+                }
 
-            // Calculate barcode gene expression
-            if (getTag(bamRecord, GE_TAG, ge_value))
-            {
-                std::string key = barcode + "|" + ge_value;
+                // Barcode length may be changed, e.g. 41_16_61982_24418 / 0_0_0_0
+                // if (qname.size() <= barcode_len || qname[barcode_len] != QNAME_SEP)
+                std::string barcode = "";
+                std::string umi     = "";
+                getTag(bamRecord, CB_TAG, barcode);
+                getTag(bamRecord, UR_TAG, umi);
 
-                if (umi_mismatch[key][umi] == 0)
+                // Calculate barcode gene expression
+                if (getTag(bamRecord, GE_TAG, ge_value))
                 {
-                    --unique;
-                    // Save the reads that duplicate
-                    if (bam_config.save_dup)
+                    std::string key = barcode + "|" + ge_value;
+
+                    if (umi_mismatch[key][umi] == 0)
                     {
-                        int         ret     = 0;
-                        std::string correct = umi_correct[key][umi];
-                        ret = bam_aux_append(bamRecord, "UB", 'Z', correct.size() + 1, ( uint8_t* )correct.c_str());
-                        if (ret != 0)
-                            spdlog::warn("bam_aux_append UB failed:{}", strerror(errno));
-                        setDuplication(bamRecord);
+                        --unique;
+                        // Save the reads that duplicate
+                        if (bam_config.save_dup)
+                        {
+                            int         ret     = 0;
+                            std::string correct = umi_correct[key][umi];
+                            ret = bam_aux_append(bamRecord, "UB", 'Z', correct.size() + 1, ( uint8_t* )correct.c_str());
+                            if (ret != 0)
+                                spdlog::warn("bam_aux_append UB failed:{}", strerror(errno));
+                            setDuplication(bamRecord);
+                        }
+                        else
+                            continue;
                     }
                     else
-                        continue;
-                }
-                else
-                {
-                    // Calculate barcode gene expression
-                    barcode_gene_exp[barcode + "\t" + ge_value].first++;
-                    barcode_gene_exp[barcode + "\t" + ge_value].second += umi_mismatch[key][umi];
+                    {
+                        // Calculate barcode gene expression
+                        barcode_gene_exp.add(barcode, ge_value, 1, umi_mismatch[key][umi]);
+                    }
                 }
-            }
-
-            // Write disk of output bam data
-            samWriter2.write(bamRecord);
-        }
-    }
-    samWriter2.close();
 
-    if (!barcode_gene_exp.empty())
-    {
-        std::ofstream exp_handle(tmp_exp_file, std::ofstream::out);
-        if (!exp_handle.is_open())
-        {
-            std::string error = "Error opening file: " + tmp_exp_file.string();
-            spdlog::error(error);
-            throw std::runtime_error(error);
-        }
-        if (scrna)
-        {
-            for (auto& p : barcode_gene_exp)
-                exp_handle << p.first << "\t" << p.second.first << "\t" << p.second.second << std::endl;
-        }
-        else
-        {
-            for (auto& p : barcode_gene_exp)
-                exp_handle << p.first << "\t" << p.second.first << std::endl;
+                // Write disk of output bam data
+                samWriter2.write(bamRecord);
+            }
         }
-        exp_handle.close();
+        samWriter2.close();
+        keepPartOutput(ctg, &samWriter2, barcode_gene_exp);
     }
 
     // std::unordered_map< std::string, int > tmp_map;
@@ -1012,6 +1279,9 @@ std::tuple< int, int, int, int > HandleBam::processChromosomeUmiWhole(std::strin
 
     spdlog::info("chr:{} total:{} filtered:{} annotated:{} unique:{} time(s):{:.2f}", ctg, total, filtered, annotated,
                  unique, t.toc(1000));
+    addMaskCounts(masked);
+    addQcCounter(qc_counter);
+    addVelocityCounter(velocity_counter);
     return make_tuple(total, filtered, annotated, unique);
 }
 
@@ -1046,9 +1316,9 @@ int HandleBam::deDupUmi(std::unordered_map< std::string, std::unordered_map< std
         return 0;
 
     vector< pair< std::string, int > > array;
-    int                                umi_total_nums = 0, umi_dedup_nums = 0;
-    int                                umi_mis_types[64]    = { 0 };
-    int                                umi_mis_postions[64] = { 0 };
+    size_t                             umi_total_nums = 0, umi_dedup_nums = 0;
+    size_t                             umi_mis_types[64]    = { 0 };
+    size_t                             umi_mis_postions[64] = { 0 };
     std::vector< int >                 types;
     std::vector< int >                 positions;
 
@@ -1144,13 +1414,25 @@ int HandleBam::doWork()
 
     // Load annotations.
     TagReadsWithGeneExon tagReadsWithGeneExon(annotation_filename);
-    if (tagReadsWithGeneExon.makeOverlapDetectorV2() != 0)
+    if (tagReadsWithGeneExon.makeOverlapDetectorV2(cpu_cores) != 0)
     {
         spdlog::error("Failed makeOverlapDetector!");
         return -1;
     }
     tagReadsWithGeneExon.setAnnoVersion(bam_config.anno_ver);
 
+    if (loadMasks() != 0)
+        return -5;
+    if (!cell_label_file.empty())
+    {
+        cell_labels = std::make_unique< CellLabels >();
+        if (cell_labels->load(cell_label_file, cell_x, cell_y, cell_raw_width) != 0)
+        {
+            spdlog::error("Failed load cell label image: {}", cell_label_file);
+            return -6;
+        }
+    }
+
     // Open input bam file
     // There maybe more than one bam file, check they have same header
     samReader                                                     = SamReader::FromFile(input_bam_filenames[0]);
@@ -1188,7 +1470,8 @@ int HandleBam::doWork()
     // Using theadpool to accelerate process
     std::threadpool executor{ static_cast< unsigned short >(cpu_cores) };
 
-    std::vector< std::future< std::tuple< int, int, int, int > > > results;
+    std::vector< std::future< TaskCounts > > results;
+    std::vector< std::string >               result_contigs;
     // Iterate over each contig.
     if (cpu_cores == 1 || contigs.size() > EXCESS_CONTIGS_NUM)
     {
@@ -1201,6 +1484,7 @@ int HandleBam::doWork()
         else
             results.emplace_back(
                 executor.commit(std::bind(&HandleBam::processChromosomeWhole, this, ctg, &tagReadsWithGeneExon)));
+        result_contigs.push_back(ctg);
     }
     else
     {
@@ -1219,55 +1503,65 @@ int HandleBam::doWork()
             else
                 results.emplace_back(
                     executor.commit(std::bind(&HandleBam::processChromosome, this, ctg, &tagReadsWithGeneExon)));
+            result_contigs.push_back(ctg);
         }
     }
 
-    for (auto&& result : results)
+    // Commit the results in contig order. The bam and gene expression of a contig are
+    // merged into the output as soon as it and all the earlier contigs are finished,
+    // while the later contigs are still running.
+    BamCat bamCat(output_bam_filename, nullptr, true, bam_config.tag_index, cpu_cores);
+    int    cmd_rtn = bam_config.sharded_output || bam_config.no_bam ? 0 : bamCat.open();
+    for (size_t i = 0; i < results.size(); ++i)
     {
-        int n1, n2, n3, n4;
-        std::tie(n1, n2, n3, n4) = result.get();
+        uint64 n1, n2, n3, n4;
+        std::tie(n1, n2, n3, n4) = results[i].get();
         total += n1;
         filtered += n2;
         annotated += n3;
         unique += n4;
-    }
-    spdlog::debug("Process max memory(KB):{}", physical_memory_used_by_process());
-    spdlog::info("Process time(s):{:.2f}", total_timer.toc(1000));
 
-    // Merge bam files and gene expression files
-    // std::string                cat_exp_cmd = "cat > " + exp_file;
+        const std::string& ctg  = result_contigs[i];
+        PartOutput         part = takePartOutput(ctg);
+        exp_matrix.merge(part.exp);
 
-    std::ofstream              ofs_exp(exp_file, std::ofstream::out);
-    std::vector< std::string > bam_files;
-    for (auto& [ctg, _] : contigs)
-    {
-        fs::path tmp_bam_file = tmp_bam_path / ctg;
-        tmp_bam_file += ".bam";
-        if (fs::exists(tmp_bam_file))
+        fs::path tmp_bam_file = tmp_bam_path / (ctg + ".bam");
+        if (bam_config.no_bam || cmd_rtn != 0 || !fs::exists(tmp_bam_file))
+            continue;
+        if (bam_config.sharded_output)
         {
-            bam_files.push_back(tmp_bam_file.string());
+            // Skip the contigs without reads
+            if (n1 != 0)
+                cmd_rtn = commitShard(ctg, tmp_bam_file, part.index.get(), part.tag_index.get());
         }
-        fs::path tmp_exp_file = tmp_exp_path / ctg;
-        tmp_exp_file += ".txt";
-        if (fs::exists(tmp_exp_file))
+        else
         {
-            std::ifstream ifs(tmp_exp_file, std::ifstream::in);
-            ofs_exp << ifs.rdbuf();
-            ifs.close();
-            // cat_exp_cmd += " " + tmp_exp_file.string();
+            cmd_rtn = bamCat.append(tmp_bam_file.string(), part.index.get(), part.tag_index.get());
+            fs::remove(tmp_bam_file);
         }
     }
-    ofs_exp.close();
-    // cat_exp_cmd += " 2>&1";
-    int                        cmd_rtn;
-    std::vector< std::string > cmd_result;
-
-    cmd_rtn = bam_cat(bam_files, nullptr, output_bam_filename.c_str(), nullptr, 0);
-    if (cmd_rtn == 0)
-        spdlog::info("Merge bam file success");
+    spdlog::debug("Process max memory(KB):{}", physical_memory_used_by_process());
+
+    if (bam_config.no_bam)
+        spdlog::info("Skip writing bam file");
+    else if (bam_config.sharded_output)
+    {
+        if (cmd_rtn == 0)
+            spdlog::info("Write bam shards success:{}", shards_path.string());
+        else
+            spdlog::info("Write bam shards fail, rtn:{}", cmd_rtn);
+    }
     else
-        spdlog::info("Merge bam file fail, rtn:{}", cmd_rtn);
-    spdlog::info("Merge bam and gene expression file time(s):{:.2f}", total_timer.toc(1000));
+    {
+        int ret = bamCat.close();
+        if (cmd_rtn == 0)
+            cmd_rtn = ret;
+        if (cmd_rtn == 0)
+            spdlog::info("Merge bam file success");
+        else
+            spdlog::info("Merge bam file fail, rtn:{}", cmd_rtn);
+    }
+    spdlog::info("Process and merge bam and gene expression file time(s):{:.2f}", total_timer.toc(1000));
 
     // spdlog::debug("cat exp cmd: {}", cat_exp_cmd);
     // cmd_rtn = exec_shell(cat_exp_cmd.c_str(), cmd_result);
@@ -1289,6 +1583,33 @@ int HandleBam::doWork()
     spdlog::info("Failed filter rate:{:.2f}%", filter_rate);
     spdlog::info("Failed annotate rate:{:.2f}%", fail_annotate_rate);
     spdlog::info("Duplication rate:{:.2f}%", dup_rate);
+    uint64 invalid      = mask_counts.invalid_barcode;
+    float  invalid_rate = total != 0 ? float(invalid) * 100 / total : 0;
+    if (chip_mask)
+        spdlog::info("Invalid barcode reads:{} rate:{:.2f}%", invalid, invalid_rate);
+    uint64 on_tissue       = total - invalid - mask_counts.off_tissue;
+    float  off_tissue_rate = total != invalid ? float(mask_counts.off_tissue) * 100 / (total - invalid) : 0;
+    if (tissue_mask)
+        spdlog::info("In tissue reads:{} Off tissue reads:{} rate:{:.2f}%", on_tissue, mask_counts.off_tissue,
+                     off_tissue_rate);
+
+    // Calculate sequencing saturation, the extrapolation goes into the metrics file
+    if (saturation)
+    {
+        saturation->calculateSaturation(sat_file, cpu_cores);
+    }
+
+    // QC metrics of spots and bins from the finished expression matrix
+    std::string qc_metrics;
+    if (qc)
+    {
+        exp_matrix.finish();
+        fs::path output_path = fs::path(exp_file).parent_path();
+        if (qc_matrix.write(output_path.string(), exp_matrix, bin_sizes, qc_metrics, cpu_cores) != 0)
+            spdlog::warn("Failed dump QC metrics!");
+        else
+            spdlog::info("Success dump QC metrics");
+    }
 
     // Dump metrics information to disk.
     std::string   anno_metrics = tagReadsWithGeneExon.dumpMetrics();
@@ -1303,6 +1624,18 @@ int HandleBam::doWork()
                "RATE\tDUPLICATION_RATE\n";
         ofs << total << "\t" << filtered << "\t" << annotated << "\t" << unique << "\t" << filter_rate << "\t"
             << fail_annotate_rate << "\t" << dup_rate << std::endl;
+        if (chip_mask)
+        {
+            ofs << "## CHIP MASK METRICS\nVALID_BARCODE_READS\tINVALID_BARCODE_READS\tINVALID_BARCODE_RATE\n";
+            ofs << total - invalid << "\t" << invalid << "\t" << invalid_rate << std::endl;
+        }
+        if (tissue_mask)
+        {
+            ofs << "## TISSUE MASK METRICS\nIN_TISSUE_READS\tIN_TISSUE_PASS_FILTER\tOFF_TISSUE_READS\t"
+                   "OFF_TISSUE_PASS_FILTER\tOFF_TISSUE_RATE\n";
+            ofs << on_tissue << "\t" << filtered << "\t" << mask_counts.off_tissue << "\t"
+                << mask_counts.off_tissue_pass << "\t" << off_tissue_rate << std::endl;
+        }
         ofs << anno_metrics;
         if (umi_config.on)
         {
@@ -1341,6 +1674,19 @@ int HandleBam::doWork()
                 }
             }
         }
+        if (saturation)
+            ofs << saturation->extrapolation();
+        ofs << qc_metrics;
+        if (velocity)
+        {
+            uint64 spliced, unspliced, ambiguous;
+            velocity_matrix.totals(spliced, unspliced, ambiguous);
+            uint64 molecules = spliced + unspliced + ambiguous;
+            ofs << "## VELOCITY METRICS\nSPLICED\tUNSPLICED\tAMBIGUOUS\tUNSPLICED_RATE\tAMBIGUOUS_RATE\n";
+            ofs << spliced << "\t" << unspliced << "\t" << ambiguous << "\t"
+                << (molecules != 0 ? unspliced * 100.0 / molecules : 0) << "\t"
+                << (molecules != 0 ? ambiguous * 100.0 / molecules : 0) << std::endl;
+        }
         ofs.close();
 
         spdlog::info("Success dump metrics file:{}", metrics_filename);
@@ -1350,32 +1696,108 @@ int HandleBam::doWork()
         spdlog::error("Error opening file:{}", metrics_filename);
     }
 
-    // Calculate sequencing saturation
-    if (saturation)
+    // Dump gene expression file, and matrix market files for scRNA
+    if (dumpExpression() != 0)
+        spdlog::warn("Failed dump gene expression file!");
+    else
+        spdlog::info("Success dump gene expression file:{}", exp_file);
+
+    spdlog::debug("Finish doWork");
+    return 0;
+}
+
+void HandleBam::keepPartOutput(const std::string& ctg, SamWriter* writer, ExpCounter& exp)
+{
+    PartOutput part;
+    if (writer != nullptr)
     {
-        saturation->calculateSaturation(sat_file);
+        part.index     = writer->takeIndex();
+        part.tag_index = writer->takeTagIndex();
     }
+    std::swap(part.exp, exp);
+    std::lock_guard< std::mutex > lock(part_outputs_mutex);
+    part_outputs[ctg] = std::move(part);
+}
 
-    if (scrna)
+std::unique_ptr< SamWriter > HandleBam::createPartWriter(const fs::path& tmp_bam_file, BamHeader header,
+                                                         bool with_index)
+{
+    if (bam_config.no_bam)
+        return nullptr;
+    auto writer = std::make_unique< SamWriter >(tmp_bam_file.string());
+    writer->init(header, with_index, with_index && bam_config.tag_index);
+    return writer;
+}
+
+void HandleBam::replayUmiReads(const std::vector< UmiRead >& umi_reads, uint64& unique, ExpCounter& exp)
+{
+    // The reads are kept in input order, so the ids of barcodes and genes are
+    // numbered as the second pass does
+    for (auto& r : umi_reads)
     {
-        // Transform barcode gene expression file format to
-        // matrix markert file format
-        if (!transform_txt2mtx())
-        {
-            spdlog::warn("Failed transform txt to matrix market file!");
-        }
+        if (*r.cnt == 0)
+            --unique;
         else
-        {
-            spdlog::info("Success transform txt to matrix market file!");
-        }
+            exp.add(r.key->substr(0, r.barcode_len), r.key->substr(r.barcode_len + 1), 1, *r.cnt);
     }
+}
 
-    spdlog::debug("Finish doWork");
+HandleBam::PartOutput HandleBam::takePartOutput(const std::string& ctg)
+{
+    PartOutput                    part;
+    std::lock_guard< std::mutex > lock(part_outputs_mutex);
+    auto                          it = part_outputs.find(ctg);
+    if (it != part_outputs.end())
+    {
+        part = std::move(it->second);
+        part_outputs.erase(it);
+    }
+    return part;
+}
+
+// Move the bam of contig into the shards directory, index it and record it in the manifest
+int HandleBam::commitShard(const std::string& ctg, const fs::path& tmp_bam_file, const BamIndex* index,
+                           const TagIndex* tag_index)
+{
+    fs::path        shard_file = shards_path / (ctg + ".bam");
+    std::error_code ec;
+    fs::rename(tmp_bam_file, shard_file, ec);
+    if (ec)
+    {
+        spdlog::error("Failed move {} to {} error:{}", tmp_bam_file.string(), shard_file.string(), ec.message());
+        return -1;
+    }
+
+    // The shard is the part as written, so the index built along needs no rebasing
+    std::string index_file;
+    if (index != nullptr && index->save(shard_file.string() + index->suffix()) == 0)
+        index_file = shard_file.filename().string() + index->suffix();
+    else if (sam_index_build(shard_file.c_str(), 0) == 0)
+        index_file = shard_file.filename().string() + ".bai";
+    else
+    {
+        spdlog::warn("Failed index bam shard:{}", shard_file.string());
+        index_file = "-";
+    }
+    if (tag_index != nullptr && tag_index->isValid() && tag_index->save(shard_file.string() + TAG_INDEX_SUFFIX) != 0)
+        spdlog::warn("Failed write tag index of bam shard:{}", shard_file.string());
+
+    std::ofstream manifest(shards_path / "manifest.tsv", std::ofstream::out | std::ofstream::app);
+    if (!manifest.is_open())
+    {
+        spdlog::error("Error opening file:{}", (shards_path / "manifest.tsv").string());
+        return -1;
+    }
+    manifest << ctg << "\t" << shard_file.filename().string() << "\t" << index_file << std::endl;
     return 0;
 }
 
 int HandleBam::createPath()
 {
+    // Nothing is written into the temporary directory if no bam is written
+    if (bam_config.no_bam)
+        return 0;
+
     fs::path p = output_bam_filename;
     spdlog::debug("output_bam_filename:{}", p.string());
     p = p.parent_path();
@@ -1383,8 +1805,6 @@ int HandleBam::createPath()
     tmp_bam_path = p;
     tmp_bam_path += "/_bam";
     spdlog::debug("tmp_bam_path:{}", tmp_bam_path.string());
-    tmp_exp_path = p;
-    tmp_exp_path += "/_exp";
 
     std::error_code ec;
 
@@ -1393,19 +1813,36 @@ int HandleBam::createPath()
         spdlog::error("Failed create directories:{} error:{}", tmp_bam_path.string(), ec.message());
         return -1;
     }
-    if (!fs::exists(tmp_exp_path) && !fs::create_directories(tmp_exp_path, ec))
+
+    // Sharded output leaves the bam of each contig in <output>.shards/ instead of merging them
+    if (bam_config.sharded_output)
     {
-        spdlog::error("Failed create directories:{} error:{}", tmp_exp_path.string(), ec.message());
-        return -1;
+        shards_path = fs::path(output_bam_filename).replace_extension(".shards");
+        if (!fs::exists(shards_path) && !fs::create_directories(shards_path, ec))
+        {
+            spdlog::error("Failed create directories:{} error:{}", shards_path.string(), ec.message());
+            return -1;
+        }
+        std::ofstream manifest(shards_path / "manifest.tsv", std::ofstream::out);
+        if (!manifest.is_open())
+        {
+            spdlog::error("Error opening file:{}", (shards_path / "manifest.tsv").string());
+            return -1;
+        }
+        manifest << "#CONTIG\tBAM\tINDEX" << std::endl;
     }
     return 0;
 }
 
-void HandleBam::setBamConfig(bool save_lq, bool save_dup, int anno_mode)
+void HandleBam::setBamConfig(bool save_lq, bool save_dup, int anno_mode, bool sharded_output, bool no_bam,
+                             bool tag_index)
 {
-    bam_config.save_lq  = save_lq;
-    bam_config.save_dup = save_dup;
-    bam_config.anno_ver = AnnoVersion(anno_mode);
+    bam_config.save_lq        = save_lq;
+    bam_config.save_dup       = save_dup;
+    bam_config.anno_ver       = AnnoVersion(anno_mode);
+    bam_config.sharded_output = sharded_output;
+    bam_config.no_bam         = no_bam;
+    bam_config.tag_index      = tag_index;
 }
 
 void HandleBam::setUmiConfig(bool on, int min_num, int mismatch)
@@ -1496,184 +1933,208 @@ void HandleBam::setExtraConfig(std::string _sat_file, bool _filter_matrix, int _
     }
 }
 
-// Transform barcode gene expression file format to
-// matrix markert file format
-bool HandleBam::transform_txt2mtx()
+void HandleBam::setGemConfig(std::string _gem_file, GemOrder _gem_order)
+{
+    gem_file  = _gem_file;
+    gem_order = _gem_order;
+}
+
+void HandleBam::setBinSizes(std::vector< int > _bin_sizes)
+{
+    bin_sizes = _bin_sizes;
+}
+
+void HandleBam::setSaturationConfig(std::vector< float > sat_points, std::vector< int > sat_bins)
+{
+    if (saturation == nullptr)
+        return;
+    if (!sat_points.empty())
+        saturation->setSamples(sat_points);
+    if (!sat_bins.empty())
+        saturation->setBins(sat_bins);
+}
+
+void HandleBam::setStoreFile(std::string _store_file)
+{
+    store_file = _store_file;
+}
+
+void HandleBam::setMaskConfig(std::string _chip_mask_file, std::string _tissue_mask_file, int _tissue_x,
+                              int _tissue_y, int _tissue_bin, bool _save_off_tissue)
+{
+    chip_mask_file   = _chip_mask_file;
+    tissue_mask_file = _tissue_mask_file;
+    tissue_x         = _tissue_x;
+    tissue_y         = _tissue_y;
+    tissue_bin       = _tissue_bin;
+    save_off_tissue  = _save_off_tissue;
+}
+
+int HandleBam::loadMasks()
 {
-    if (!fs::exists(exp_file))
-        return false;
-    const char sep = ' ';
-    fs::path   output_path(exp_file);
-    output_path = output_path.parent_path();
-
-    // Load the raw data from disk
-    ifstream                                                           ifs(exp_file);
-    string                                                             line;
-    unordered_map< string, unordered_map< string, pair< int, int > > > raw_data;
-    while (std::getline(ifs, line))
+    Timer load_timer;
+    // The text list of chip coordinates is compiled in memory
+    if (!chip_mask_file.empty())
     {
-        vector< string > vec_s    = split_str(line, '\t');
-        string           barcode  = vec_s[0];
-        string           gene     = vec_s[1];
-        int              umi_cnt  = stoi(vec_s[2]);
-        int              read_cnt = vec_s.size() > 3 ? stoi(vec_s[3]) : 0;
-
-        if (raw_data.count(barcode) == 0)
-            raw_data[barcode] = {};
-        auto& p = raw_data[barcode][gene];
-        p.first += umi_cnt;
-        p.second += read_cnt;
+        chip_mask = std::make_unique< CoordMask >();
+        if (chip_mask->load(chip_mask_file) != 0)
+        {
+            spdlog::error("Failed load chip mask: {}", chip_mask_file);
+            return -1;
+        }
     }
-    ifs.close();
-
-    // Do the filter of low barcode count
-    unordered_set< string > discard_barcodes;
-    if (filter_matrix)
+    if (!tissue_mask_file.empty())
     {
-        unordered_map< string, int > times;
-        vector< double >             cnts;
-        for (auto& p : raw_data)
+        tissue_mask = std::make_unique< CoordMask >();
+        int ret     = CoordMask::isMaskFile(tissue_mask_file)
+                          ? tissue_mask->load(tissue_mask_file)
+                          : tissue_mask->buildImage(tissue_mask_file, tissue_x, tissue_y, tissue_bin);
+        if (ret != 0)
         {
-            int cnt = 0;
-            for (auto& pp : p.second)
-                cnt += pp.second.first;
-            times[p.first] = cnt;
-            cnts.push_back(cnt);
+            spdlog::error("Failed load tissue mask: {}", tissue_mask_file);
+            return -1;
         }
+    }
+    if (chip_mask || tissue_mask)
+        spdlog::info("load masks time(s):{:.2f}", load_timer.toc(1000));
+    return 0;
+}
+
+void HandleBam::setCellConfig(std::string _cell_label_file, int _cell_x, int _cell_y, int _cell_raw_width)
+{
+    cell_label_file = _cell_label_file;
+    cell_x          = _cell_x;
+    cell_y          = _cell_y;
+    cell_raw_width  = _cell_raw_width;
+}
+
+void HandleBam::setQcConfig(bool _qc)
+{
+    qc = _qc;
+}
+
+void HandleBam::addQcCounter(QcCounter& counter)
+{
+    if (!qc)
+        return;
+    std::lock_guard< std::mutex > lock(metrics_mutex);
+    qc_matrix.merge(counter);
+}
+
+void HandleBam::setVelocityConfig(bool _velocity)
+{
+    velocity = _velocity;
+}
+
+void HandleBam::addVelocityCounter(VelocityCounter& counter)
+{
+    if (!velocity)
+        return;
+    std::lock_guard< std::mutex > lock(metrics_mutex);
+    velocity_matrix.merge(counter);
+}
+
+void HandleBam::addMaskCounts(const MaskCounts& counts)
+{
+    std::lock_guard< std::mutex > lock(metrics_mutex);
+    mask_counts.invalid_barcode += counts.invalid_barcode;
+    mask_counts.off_tissue += counts.off_tissue;
+    mask_counts.off_tissue_pass += counts.off_tissue_pass;
+}
+
+// Write the gene expression file from the matrix gathered by the tasks. For scRNA
+// the barcodes under the threshold of KDE are filtered if required, and the matrix
+// is also written in matrix market format beside the expression file.
+int HandleBam::dumpExpression()
+{
+    exp_matrix.finish();
+
+    std::vector< bool > discard;
+    if (scrna && filter_matrix && exp_matrix.barcodeNum() != 0)
+    {
+        std::vector< uint64 > times = exp_matrix.barcodeCounts();
+        // The counts are integers, so the histogram of counts gives the same density
+        // with far fewer values than the barcodes
+        std::unordered_map< uint64, uint64 > count_nums;
+        for (auto t : times)
+            ++count_nums[t];
+        vector< pair< double, uint64_t > > hist(count_nums.begin(), count_nums.end());
+        std::sort(hist.begin(), hist.end());
 
         KDE    kde;
-        auto   paras             = kde.run(cnts, "bead");
+        auto   paras             = kde.run(hist, "bead");
         double min_barcode_frags = paras.first;
         // double call_threshold = paras.second;
         spdlog::info("Barcode threshold of filtering matrix: {}", min_barcode_frags);
 
-        for (auto& p : times)
-        {
-            if (p.second < min_barcode_frags)
-                discard_barcodes.insert(p.first);
-        }
-
-        if (!discard_barcodes.empty())
-        {
-            fs::path ofs_exp(exp_file);
-            if (ofs_exp.extension() == ".gz")
-            {
-                cmpFile out_exp;
-                out_exp = cmpOpen(ofs_exp.c_str());
-                for (auto& p : raw_data)
-                {
-                    if (discard_barcodes.count(p.first) != 0)
-                        continue;
-
-                    for (auto& pp : p.second)
-                    {
-                        string s = p.first + "\t" + pp.first + "\t" + to_string(pp.second.first);
-                        if (pp.second.second != 0)
-                            s += "\t" + to_string(pp.second.second);
-                        s += "\n";
-                        cmpFunc(out_exp, s.c_str());
-                    }
-                }
-                cmpClose(out_exp);
-            }
-            else
-            {
-                ofstream out_exp(ofs_exp, std::ofstream::out);
-                for (auto& p : raw_data)
-                {
-                    if (discard_barcodes.count(p.first) != 0)
-                        continue;
-
-                    for (auto& pp : p.second)
-                    {
-                        string s = p.first + "\t" + pp.first + "\t" + to_string(pp.second.first);
-                        if (pp.second.second != 0)
-                            s += "\t" + to_string(pp.second.second);
-                        s += "\n";
-                        out_exp << s;
-                    }
-                }
-                out_exp.close();
-            }
-            spdlog::info("Dump filtered gene expression file");
-        }
+        discard.resize(times.size(), false);
+        for (size_t i = 0; i < times.size(); ++i)
+            discard[i] = times[i] < min_barcode_frags;
     }
 
-    unordered_map< string, int >           map_barcodes, map_genes;
-    unordered_map< string, int >::iterator it;
-    vector< string >                       vec_barcodes, vec_genes, vec_matrix;
-    // Travel all barcode-gene-cnt, calculate the order of barcodes, genes,
-    // then the final matrix data
-    for (auto& p : raw_data)
+    if (exp_matrix.writeExp(exp_file, scrna && umi_config.on, discard, cpu_cores) != 0)
+        return -1;
+    if (scrna)
     {
-        string barcode = p.first;
-        if (discard_barcodes.count(barcode) != 0)
-            continue;
-
-        int i1, i2;
-        it = map_barcodes.find(barcode);
-        if (it == map_barcodes.end())
+        fs::path output_path = fs::path(exp_file).parent_path();
+        if (exp_matrix.writeMtx(output_path.string(), discard, cpu_cores) != 0)
         {
-            vec_barcodes.push_back(barcode);
-            i1                    = vec_barcodes.size();
-            map_barcodes[barcode] = i1;
+            spdlog::warn("Failed dump matrix market files!");
+            return -1;
         }
-        else
+        spdlog::info("Success dump matrix market files");
+    }
+    if (!gem_file.empty())
+    {
+        if (exp_matrix.writeGem(gem_file, gem_order, cpu_cores) != 0)
         {
-            i1 = it->second;
+            spdlog::warn("Failed dump gem file!");
+            return -1;
         }
-        for (auto& pp : p.second)
+        spdlog::info("Success dump gem file:{}", gem_file);
+    }
+    if (!bin_sizes.empty())
+    {
+        fs::path output_path = fs::path(exp_file).parent_path();
+        if (exp_matrix.writeBins(output_path.string(), bin_sizes, cpu_cores) != 0)
         {
-            string gene = pp.first;
-            int    cnt  = pp.second.first;
-
-            it = map_genes.find(gene);
-            if (it == map_genes.end())
-            {
-                vec_genes.push_back(gene);
-                i2              = vec_genes.size();
-                map_genes[gene] = i2;
-            }
-            else
-            {
-                i2 = it->second;
-            }
-            vec_matrix.push_back(to_string(i1) + sep + to_string(i2) + sep + to_string(cnt));
+            spdlog::warn("Failed dump bin matrices!");
+            return -1;
         }
+        spdlog::info("Success dump bin matrices");
     }
-
-    fs::path ofs_barcode(output_path / "barcodes.tsv.gz"), ofs_genes(output_path / "genes.tsv.gz"),
-        ofs_matrix(output_path / "matrix.mtx.gz");
-    cmpFile out_barcode;
-    out_barcode = cmpOpen(ofs_barcode.c_str());
-    for (auto& l : vec_barcodes)
+    if (cell_labels)
     {
-        string s = l + "\n";
-        cmpFunc(out_barcode, s.c_str());
+        fs::path        dir = fs::path(exp_file).parent_path() / "cellbin";
+        std::error_code ec;
+        fs::create_directories(dir, ec);
+        if (ec || exp_matrix.writeCells(dir.string(), *cell_labels, cpu_cores) != 0)
+        {
+            spdlog::warn("Failed dump cell matrix!");
+            return -1;
+        }
+        spdlog::info("Success dump cell matrix:{}", dir.string());
     }
-    cmpClose(out_barcode);
-
-    cmpFile out_genes;
-    out_genes = cmpOpen(ofs_genes.c_str());
-    for (auto& l : vec_genes)
+    if (velocity)
     {
-        string s = l + "\n";
-        cmpFunc(out_genes, s.c_str());
+        fs::path        dir = fs::path(exp_file).parent_path() / "velocity";
+        std::error_code ec;
+        fs::create_directories(dir, ec);
+        if (ec || velocity_matrix.write(dir.string(), cpu_cores) != 0)
+        {
+            spdlog::warn("Failed dump velocity matrices!");
+            return -1;
+        }
+        spdlog::info("Success dump velocity matrices:{}", dir.string());
     }
-    cmpClose(out_genes);
-
-    cmpFile out_matrix;
-    out_matrix = cmpOpen(ofs_matrix.c_str());
-    stringstream ss;
-    ss << "%%MatrixMarket matrix coordinate real general\n%\n";
-    ss << map_barcodes.size() << sep << map_genes.size() << sep << vec_matrix.size() << endl;
-    cmpFunc(out_matrix, ss.str().c_str());
-    for (auto& l : vec_matrix)
+    if (!store_file.empty())
     {
-        string s = l + "\n";
-        cmpFunc(out_matrix, s.c_str());
+        if (exp_matrix.writeStore(store_file, cpu_cores) != 0)
+        {
+            spdlog::warn("Failed dump expression store!");
+            return -1;
+        }
+        spdlog::info("Success dump expression store:{}", store_file);
     }
-    cmpClose(out_matrix);
-
-    return true;
-}
\ No newline at end of file
+    return 0;
+}
@@ -12,6 +12,8 @@
 #include <string>
 using std::string;
 #include <filesystem>  // C++17 only
+#include <map>
+#include <memory>
 #include <mutex>
 #include <queue>
 #include <tuple>
@@ -19,10 +21,19 @@ namespace fs = std::filesystem;
 
 #include <spdlog/spdlog.h>
 
+#include "bamIndex.h"
 #include "bamRecord.h"
+#include "cellLabels.h"
+#include "coordMask.h"
+#include "expMatrix.h"
+#include "qcMetrics.h"
 #include "samReader.h"
 #include "saturation.h"
+#include "tagIndex.h"
 #include "tagReadsWithGeneExon.h"
+#include "velocity.h"
+
+class SamWriter;
 
 struct UmiConfig
 {
@@ -33,10 +44,13 @@ struct UmiConfig
 
 struct BamConfig
 {
-    bool        save_lq;   // true means save low quality reads and set flag with BAM_FQCFAIL
-    bool        save_dup;  // true means save duplicate reads and set flag with BAM_FDUP
-    AnnoVersion anno_ver;  // choose annotation version
-    UmiConfig   umi;       // structure for umi correction
+    bool        save_lq;         // true means save low quality reads and set flag with BAM_FQCFAIL
+    bool        save_dup;        // true means save duplicate reads and set flag with BAM_FDUP
+    AnnoVersion anno_ver;        // choose annotation version
+    UmiConfig   umi;             // structure for umi correction
+    bool        sharded_output;  // true means keep indexed bam per contig instead of merging them
+    bool        no_bam;          // true means only count the reads, no bam is written
+    bool        tag_index;       // true means write the index of barcode and gene tags beside bam
 };
 
 struct UmiMetrics
@@ -49,6 +63,19 @@ struct UmiMetrics
     size_t umi_mis_postions[64];
 };
 
+// Reads rejected by the chip mask or out of the tissue mask, they are counted in the
+// total reads only
+struct MaskCounts
+{
+    MaskCounts() : invalid_barcode(0), off_tissue(0), off_tissue_pass(0) {}
+    uint64 invalid_barcode;
+    uint64 off_tissue;
+    uint64 off_tissue_pass;  // off tissue reads pass the mapping quality filter
+};
+
+// Reads of one task: total, pass filter, annotated and unique
+using TaskCounts = std::tuple< uint64, uint64, uint64, uint64 >;
+
 class HandleBam
 {
 public:
@@ -62,14 +89,14 @@ public:
         BASES_ENCODE['C'] = 1;
         BASES_ENCODE['G'] = 2;
         BASES_ENCODE['T'] = 3;
+
+        gem_order = GEM_UNSORTED;
     }
 
     ~HandleBam()
     {
         if (fs::exists(tmp_bam_path))
             fs::remove_all(tmp_bam_path);
-        if (fs::exists(tmp_exp_path))
-            fs::remove_all(tmp_exp_path);
 
         if (saturation)
         {
@@ -80,27 +107,79 @@ public:
 
     int doWork();
 
-    std::tuple< int, int, int, int > processChromosome(std::string ctg, TagReadsWithGeneExon* tagReadsWithGeneExon);
-    std::tuple< int, int, int, int > processChromosomeUmi(std::string ctg, TagReadsWithGeneExon* tagReadsWithGeneExon);
-    std::tuple< int, int, int, int > processChromosomeWhole(std::string           ctg,
-                                                            TagReadsWithGeneExon* tagReadsWithGeneExon);
-    std::tuple< int, int, int, int > processChromosomeUmiWhole(std::string           ctg,
-                                                               TagReadsWithGeneExon* tagReadsWithGeneExon);
+    TaskCounts processChromosome(std::string ctg, TagReadsWithGeneExon* tagReadsWithGeneExon);
+    TaskCounts processChromosomeUmi(std::string ctg, TagReadsWithGeneExon* tagReadsWithGeneExon);
+    TaskCounts processChromosomeWhole(std::string ctg, TagReadsWithGeneExon* tagReadsWithGeneExon);
+    TaskCounts processChromosomeUmiWhole(std::string ctg, TagReadsWithGeneExon* tagReadsWithGeneExon);
 
     int createPath();
 
-    void setBamConfig(bool save_lq, bool save_dup, int anno_mode);
+    void setBamConfig(bool save_lq, bool save_dup, int anno_mode, bool sharded_output = false, bool no_bam = false,
+                      bool tag_index = false);
     void setUmiConfig(bool on, int min_num, int mismatch);
     void setExtraConfig(std::string sat_file, bool filter_matrix, int cores, bool scrna);
+    void setGemConfig(std::string gem_file, GemOrder gem_order);
+    void setBinSizes(std::vector< int > bin_sizes);
+    // Sampling fractions and bin sizes of saturation, the defaults are kept if empty
+    void setSaturationConfig(std::vector< float > sat_points, std::vector< int > sat_bins);
+    void setStoreFile(std::string store_file);
+    // Coordinates of the valid spots, text list or compiled by index-mask. The tissue
+    // image is placed at (tissue_x, tissue_y) with a pixel of tissue_bin coordinates,
+    // and the reads out of it are written as is if save_off_tissue.
+    void setMaskConfig(std::string chip_mask_file, std::string tissue_mask_file = "", int tissue_x = 0,
+                       int tissue_y = 0, int tissue_bin = 1, bool save_off_tissue = false);
+    // Label image of cells placed at (cell_x, cell_y), a raw uint32 array needs its width
+    void setCellConfig(std::string cell_label_file, int cell_x = 0, int cell_y = 0, int cell_raw_width = 0);
+    // Count the QC metrics of spots and bins of bin_sizes
+    void setQcConfig(bool qc);
+    // Count the spliced, unspliced and ambiguous molecules, only in TENX annotation mode
+    void setVelocityConfig(bool velocity);
 
 private:
     int deDupUmi(std::unordered_map< std::string, std::unordered_map< std::string, int > >&         umi_mismatch,
                  std::unordered_map< std::string, std::unordered_map< std::string, std::string > >& umi_correct);
     int checkUmi();
+    int commitShard(const std::string& ctg, const fs::path& tmp_bam_file, const BamIndex* index,
+                    const TagIndex* tag_index);
+
+    // Outputs of a contig task waiting to be merged in contig order
+    struct PartOutput
+    {
+        std::unique_ptr< BamIndex > index;
+        std::unique_ptr< TagIndex > tag_index;
+        ExpCounter                  exp;
+    };
+    // The writer is nullptr if no bam is written
+    void       keepPartOutput(const std::string& ctg, SamWriter* writer, ExpCounter& exp);
+    PartOutput takePartOutput(const std::string& ctg);
+    // Open the bam of a task, nullptr if no bam is written
+    std::unique_ptr< SamWriter > createPartWriter(const fs::path& tmp_bam_file, BamHeader header, bool with_index);
+    // The reads flagged low quality or duplicate are written as is by the second pass of umi
+    bool passThrough(BamRecord record) const
+    {
+        return (bam_config.save_lq && getQcFail(record)) || (bam_config.save_dup && getDuplication(record));
+    }
+
+    // A read counted by the second pass of umi, see replayUmiReads()
+    struct UmiRead
+    {
+        const std::string* key;  // barcode|gene in umi_mismatch
+        const int*         cnt;  // count of the umi in umi_mismatch, 0 if corrected to another umi
+        uint32             barcode_len;
+    };
+    // Count the reads as the second pass of umi when no bam is written, the umi table
+    // gives the same result without reading the reads again
+    void replayUmiReads(const std::vector< UmiRead >& umi_reads, uint64& unique, ExpCounter& exp);
+
+    // Load the masks given, return 0 if success
+    int  loadMasks();
+    void addMaskCounts(const MaskCounts& counts);
+    void addQcCounter(QcCounter& counter);
+    void addVelocityCounter(VelocityCounter& counter);
+
     int umiDistance(const std::string& s1, const std::string& s2, vector< int >& types, vector< int >& positions);
-    // Transform barcode gene expression file format to
-    // matrix markert file format
-    bool transform_txt2mtx();
+    // Write gene expression file and matrix market files
+    int dumpExpression();
 
 private:
     std::vector< std::string > input_bam_filenames;
@@ -117,7 +196,12 @@ private:
 
     std::unique_ptr< SamReader > samReader;
 
-    fs::path tmp_bam_path, tmp_exp_path;
+    fs::path tmp_bam_path;
+    fs::path shards_path;
+
+    std::map< std::string, PartOutput > part_outputs;
+    std::mutex                          part_outputs_mutex;
+    ExpMatrix                           exp_matrix;
 
     BamConfig bam_config;
     UmiConfig umi_config;
@@ -135,7 +219,39 @@ private:
 
     bool filter_matrix;
 
+    std::string gem_file;
+    GemOrder    gem_order;
+
+    // Write a matrix of spatial bins for each size beside the expression file
+    std::vector< int > bin_sizes;
+
+    // Binary expression store for spatial and gene queries
+    std::string store_file;
+
     int cpu_cores;
 
     bool scrna;
+
+    // Reads are rejected if the barcodes are not on the chip mask, and only counted
+    // if out of the tissue mask
+    std::string                  chip_mask_file;
+    std::unique_ptr< CoordMask > chip_mask;
+    std::string                  tissue_mask_file;
+    int                          tissue_x, tissue_y, tissue_bin;
+    bool                         save_off_tissue;
+    std::unique_ptr< CoordMask > tissue_mask;
+    MaskCounts                   mask_counts;
+
+    // Write the matrix of cells beside the expression file
+    std::string                   cell_label_file;
+    int                           cell_x, cell_y, cell_raw_width;
+    std::unique_ptr< CellLabels > cell_labels;
+
+    // Reads of spots are counted by the tasks, then merged
+    bool     qc = false;
+    QcMatrix qc_matrix;
+
+    // Velocity matrices written beside the expression file
+    bool           velocity = false;
+    VelocityMatrix velocity_matrix;
 };
@@ -10,6 +10,7 @@
 #pragma once
 
 #include <string>
+#include <utility>
 
 class Interval
 {
@@ -32,9 +33,9 @@ public:
         return negativeStrand;
     }
 
-    void setContig(std::string& contig_)
+    void setContig(std::string contig_)
     {
-        contig = contig_;
+        contig = std::move(contig_);
     }
     void setStart(int start_)
     {
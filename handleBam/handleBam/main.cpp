@@ -12,6 +12,7 @@
 
 #include <ctime>
 
+#include <algorithm>
 #include <chrono>
 #include <filesystem>
 #include <iostream>
@@ -24,8 +25,197 @@ namespace fs = std::filesystem;
 
 static const std::string version = "1.0.1";
 
+// Set the default logger to file logger.
+static void initLogger()
+{
+    std::time_t        t = std::chrono::system_clock::to_time_t(std::chrono::system_clock::now());
+    std::ostringstream ostr;
+    ostr << "HandleBam_" << std::put_time(std::localtime(&t), "%Y%m%d_%H%M%S") << ".log";
+    try
+    {
+        // auto file_logger = spdlog::basic_logger_mt("main", "logs/" + ostr.str());
+        auto file_sink      = std::make_shared< spdlog::sinks::basic_file_sink_mt >("logs/" + ostr.str());
+        auto main_logger    = std::make_shared< spdlog::logger >("main", file_sink);
+        auto gtf_logger     = std::make_shared< spdlog::logger >("gtf", file_sink);
+        auto process_logger = std::make_shared< spdlog::logger >("process", file_sink);
+        spdlog::register_logger(main_logger);
+        spdlog::register_logger(gtf_logger);
+        spdlog::register_logger(process_logger);
+        spdlog::set_default_logger(process_logger);
+    }
+    catch (const spdlog::spdlog_ex& ex)
+    {
+        std::cerr << "Log init failed: " << ex.what() << std::endl;
+    }
+    spdlog::set_level(spdlog::level::info);  // Set global log level.
+    // spdlog::cfg::load_argv_levels(argc, argv); // Set log level from command line
+    spdlog::flush_on(spdlog::level::info);
+    spdlog::set_pattern("%Y-%m-%d %H:%M:%S.%e %L %n: %v");
+}
+
+// Parse positive sizes separated by comma, sorted and deduplicated
+static bool parseSizes(const std::string& str, vector< int >& sizes)
+{
+    for (auto& s : split_str(str, ','))
+    {
+        if (!std::all_of(s.begin(), s.end(), ::isdigit) || s.empty() || s.size() > 9 || std::stoi(s) <= 0)
+            return false;
+        sizes.push_back(std::stoi(s));
+    }
+    std::sort(sizes.begin(), sizes.end());
+    sizes.erase(std::unique(sizes.begin(), sizes.end()), sizes.end());
+    return true;
+}
+
+// Compile the annotation file into a binary index, which could be mapped by
+// all the following runs instead of parsing the annotation again
+static int indexGtf(int argc, char** argv)
+{
+    CLI::App app{ "HandleBam index-gtf: compile annotation file into binary index." };
+    app.footer("HandleBam version: " + version);
+    app.get_formatter()->column_width(40);
+
+    string annotation_file, index_file;
+    app.add_option("-A,-a", annotation_file, "Input annotation filename")->check(CLI::ExistingFile)->required();
+    app.add_option("-O,-o", index_file, "Output annotation index filename")->required();
+    int cpu_cores = std::thread::hardware_concurrency();
+    app.add_option("-C,-c", cpu_cores, "Set cpu cores, default detect")->check(CLI::PositiveNumber);
+
+    CLI11_PARSE(app, argc, argv);
+
+    initLogger();
+    spdlog::get("main")->info("{} index-gtf ANNOTATION_FILE={} INDEX_FILE={} CPU_CORES={}", argv[0], annotation_file,
+                              index_file, cpu_cores);
+
+    Timer                timer;
+    TagReadsWithGeneExon tagReadsWithGeneExon(annotation_file);
+    if (tagReadsWithGeneExon.makeOverlapDetectorV2(cpu_cores) != 0
+        || tagReadsWithGeneExon.saveOverlapDetector(index_file) != 0)
+    {
+        spdlog::error("Failed compile annotation index: {}", annotation_file);
+        return -1;
+    }
+    spdlog::get("main")->info("index-gtf done. Elapsed time(s):{:.2f}", timer.toc(1000));
+
+    return 0;
+}
+
+// Compile the list of chip coordinates or the tissue image into a bitmap, which
+// could be mapped by --chip_mask or --tissue_mask instead of parsing in every run
+static int indexMask(int argc, char** argv)
+{
+    CLI::App app{ "HandleBam index-mask: compile chip coordinates or tissue image into binary bitmap." };
+    app.footer("HandleBam version: " + version);
+    app.get_formatter()->column_width(40);
+
+    string mask_file, index_file;
+    app.add_option("-I,-i", mask_file, "Input coordinates, x_y or the last two columns per line, or PBM/PGM image")
+        ->check(CLI::ExistingFile)
+        ->required();
+    app.add_option("-O,-o", index_file, "Output mask bitmap filename")->required();
+    string offset_str = "0,0";
+    app.add_option("--offset", offset_str, "Coordinate x,y of the first pixel if input is PBM/PGM image, default 0,0");
+    int bin = 1;
+    app.add_option("--bin", bin, "Coordinates per pixel if input is PBM/PGM image, default 1")
+        ->check(CLI::PositiveNumber);
+
+    CLI11_PARSE(app, argc, argv);
+
+    int x0, y0;
+    if (!parse_coordinate(offset_str, x0, y0, ','))
+    {
+        std::cerr << "Invalid parameter of --offset: " << offset_str << std::endl;
+        return -1;
+    }
+
+    initLogger();
+    spdlog::get("main")->info("{} index-mask MASK_FILE={} INDEX_FILE={} OFFSET={} BIN={}", argv[0], mask_file,
+                              index_file, offset_str, bin);
+
+    Timer     timer;
+    CoordMask mask;
+    int       ret = CoordMask::isImageFile(mask_file) ? mask.buildImage(mask_file, x0, y0, bin) : mask.build(mask_file);
+    if (ret != 0 || mask.save(index_file) != 0)
+    {
+        spdlog::error("Failed compile chip mask: {}", mask_file);
+        return -1;
+    }
+    spdlog::get("main")->info("index-mask done. Elapsed time(s):{:.2f}", timer.toc(1000));
+
+    return 0;
+}
+
+// Write the records of a bam matching the barcode, gene or region, reading only
+// the blocks given by the tag index built with --tag_index
+static int fetch(int argc, char** argv)
+{
+    CLI::App app{ "HandleBam fetch: fetch records of barcode, gene or region by the tag index." };
+    app.footer("HandleBam version: " + version);
+    app.get_formatter()->column_width(40);
+
+    string bam_file, index_file, rect, out_file;
+    app.add_option("-I,-i", bam_file, "Input bam filename")->check(CLI::ExistingFile)->required();
+    app.add_option("--index", index_file, "Input tag index filename, default <input>" + string(TAG_INDEX_SUFFIX));
+    app.add_option("-O,-o", out_file, "Output filename, bam if ends with .bam, else sam")->required();
+    TagQuery query;
+    app.add_option("--gene", query.gene, "Gene name of the GE tag");
+    app.add_option("--barcode", query.barcode, "Barcode of the CB tag");
+    app.add_option("--rect", rect, "Closed rectangle of coordinates: x0,y0,x1,y1");
+
+    CLI11_PARSE(app, argc, argv);
+
+    if (!rect.empty())
+    {
+        vector< string > v = split_str(rect, ',');
+        try
+        {
+            if (v.size() != 4)
+                throw std::invalid_argument(rect);
+            query.x0 = std::stoi(v[0]);
+            query.y0 = std::stoi(v[1]);
+            query.x1 = std::stoi(v[2]);
+            query.y1 = std::stoi(v[3]);
+        }
+        catch (std::exception&)
+        {
+            std::cerr << "Invalid parameter of --rect: " << rect << std::endl;
+            return -1;
+        }
+        query.has_rect = true;
+    }
+    if (query.gene.empty() && query.barcode.empty() && !query.has_rect)
+    {
+        std::cerr << "At least one of --gene, --barcode and --rect is required" << std::endl;
+        return -1;
+    }
+    if (index_file.empty())
+        index_file = bam_file + TAG_INDEX_SUFFIX;
+
+    initLogger();
+    spdlog::get("main")->info("{} fetch INPUT={} INDEX={} OUTPUT={} GENE={} BARCODE={} RECT={}", argv[0], bam_file,
+                              index_file, out_file, query.gene, query.barcode, rect);
+
+    Timer          timer;
+    TagIndexReader index;
+    if (index.load(index_file) != 0)
+        return -1;
+    int64 n = fetchRecords(bam_file, index, query, out_file);
+    if (n < 0)
+        return -1;
+    spdlog::get("main")->info("fetch done. Records:{} Elapsed time(s):{:.2f}", n, timer.toc(1000));
+
+    return 0;
+}
+
 int main(int argc, char** argv)
 {
+    if (argc > 1 && string(argv[1]) == "index-gtf")
+        return indexGtf(argc - 1, argv + 1);
+    if (argc > 1 && string(argv[1]) == "index-mask")
+        return indexMask(argc - 1, argv + 1);
+    if (argc > 1 && string(argv[1]) == "fetch")
+        return fetch(argc - 1, argv + 1);
+
     Timer timer;
     // Parse the command line parameters.
     CLI::App app{ "HandleBam: mapping quality filter, deduplication, "
@@ -36,8 +226,10 @@ int main(int argc, char** argv)
     string input_bam, output_bam, annotation_file, metrics_file, exp_file;
     // Required parameters
     app.add_option("-I,-i", input_bam, "Input bam filename or file list separated by comma")->required();
-    app.add_option("-O,-o", output_bam, "Output bam filename")->required();
-    app.add_option("-A,-a", annotation_file, "Input annotation filename")->check(CLI::ExistingFile)->required();
+    auto output_option = app.add_option("-O,-o", output_bam, "Output bam filename, required unless --no_bam");
+    app.add_option("-A,-a", annotation_file, "Input annotation filename, gtf/gff or index built by index-gtf")
+        ->check(CLI::ExistingFile)
+        ->required();
     app.add_option("-S,-s", metrics_file, "Output summary filename")->required();
     app.add_option("-E,-e", exp_file, "Output barcode gene expression filename")->required();
     // Optional parameters
@@ -65,12 +257,85 @@ int main(int argc, char** argv)
     app.add_option("--umi_mismatch", umi_mismatch, "Maximum mismatch for umi correction, default 1")
         ->check(CLI::PositiveNumber);
     std::string saturation_file = "";
-    app.add_option("--sat_file", saturation_file, "Output sequencing saturation file, default None")->needs(umi_option);
+    auto sat_option = app.add_option("--sat_file", saturation_file, "Output sequencing saturation file, default None");
+    sat_option->needs(umi_option);
+    std::string sat_points_str = "";
+    app.add_option("--sat_points", sat_points_str,
+                   "Sampling fractions of saturation separated by comma, default 0.05,0.1,0.2,...,0.9,1")
+        ->needs(sat_option);
+    std::string sat_bins_str = "";
+    app.add_option("--sat_bins", sat_bins_str, "Bin sizes of saturation separated by comma, default 150")
+        ->needs(sat_option);
     bool scrna            = false;
     auto scrna_option     = app.add_flag("--scrna,--scRNA,--SCRNA", scrna, "Set scRNA mode, default false");
     bool no_filter_matrix = false;
     app.add_flag("--no_filter_matrix", no_filter_matrix, "Not filter the gene expression matrix, default false")
         ->needs(scrna_option);
+    bool sharded_output = false;
+    auto sharded_option = app.add_flag(
+        "--sharded_output", sharded_output,
+        "Keep indexed bam per contig in <output>.shards/ instead of merging them, default false");
+    bool no_bam = false;
+    auto no_bam_option = app.add_flag("--no_bam", no_bam,
+                                      "Only output the summary, gene expression and saturation, no bam, default false");
+    no_bam_option->excludes(sharded_option)->excludes(output_option);
+    bool tag_index = false;
+    app.add_flag("--tag_index", tag_index,
+                 "Write the index of barcode and gene tags beside bam for the fetch command, default false")
+        ->excludes(no_bam_option);
+    std::string gem_file = "";
+    auto        gem_option =
+        app.add_option("--gem", gem_file, "Output gene expression in GEM format, gzip compressed if ends with .gz");
+    std::string gem_sort = "none";
+    app.add_option("--gem_sort", gem_sort, "Sort GEM lines by gene or spatial tile, default none")
+        ->check(CLI::IsMember({ "none", "gene", "tile" }))
+        ->needs(gem_option);
+    std::string bin_sizes_str = "";
+    app.add_option("--bin_sizes", bin_sizes_str,
+                   "Output a matrix of spatial bins for each size separated by comma, e.g. 1,20,50,100,200");
+    std::string store_file = "";
+    app.add_option("--exp_store", store_file,
+                   "Output tile-indexed binary expression store for rectangle and gene queries");
+    std::string chip_mask_file = "";
+    app.add_option("--chip_mask", chip_mask_file,
+                   "Reject the reads whose barcodes are not in the chip coordinates, text or index-mask bitmap")
+        ->check(CLI::ExistingFile);
+    std::string tissue_mask_file = "";
+    auto        tissue_option    = app.add_option(
+        "--tissue_mask", tissue_mask_file,
+        "Tissue region as PBM/PGM image or index-mask bitmap, the off tissue reads are counted in the summary and skip "
+        "annotation, umi and saturation");
+    tissue_option->check(CLI::ExistingFile);
+    std::string tissue_offset_str = "0,0";
+    app.add_option("--tissue_offset", tissue_offset_str,
+                   "Coordinate x,y of the first pixel of tissue image, default 0,0")
+        ->needs(tissue_option);
+    int tissue_bin = 1;
+    app.add_option("--tissue_bin", tissue_bin, "Coordinates per pixel of tissue image, default 1")
+        ->check(CLI::PositiveNumber)
+        ->needs(tissue_option);
+    bool save_off_tissue = false;
+    app.add_flag("--save_off_tissue", save_off_tissue, "Save off tissue reads without annotation, default false")
+        ->needs(tissue_option);
+
+    std::string cell_label_file = "";
+    auto        cell_option     = app.add_option("--cell_labels", cell_label_file,
+                                          "Output the cell matrix by the cell label image, .npy or raw uint32");
+    cell_option->check(CLI::ExistingFile);
+    std::string cell_offset_str = "0,0";
+    app.add_option("--cell_offset", cell_offset_str, "Coordinate x,y of the first pixel of label image, default 0,0")
+        ->needs(cell_option);
+    int cell_raw_width = 0;
+    app.add_option("--cell_raw_width", cell_raw_width, "Width of the raw uint32 label image, not needed by npy")
+        ->check(CLI::PositiveNumber)
+        ->needs(cell_option);
+
+    bool qc = false;
+    app.add_flag("--qc", qc,
+                 "Output QC metrics of spots and bins of --bin_sizes beside expression file, default false");
+    bool velocity = false;
+    app.add_flag("--velocity", velocity,
+                 "Output spliced, unspliced and ambiguous matrices beside expression file, default false");
 
     CLI11_PARSE(app, argc, argv);
 
@@ -93,41 +358,93 @@ int main(int argc, char** argv)
         }
     }
 
-    // Set the default logger to file logger.
-    std::time_t        t = std::chrono::system_clock::to_time_t(std::chrono::system_clock::now());
-    std::ostringstream ostr;
-    ostr << "HandleBam_" << std::put_time(std::localtime(&t), "%Y%m%d_%H%M%S") << ".log";
-    try
+    if (output_bam.empty() && !no_bam)
     {
-        // auto file_logger = spdlog::basic_logger_mt("main", "logs/" + ostr.str());
-        auto file_sink      = std::make_shared< spdlog::sinks::basic_file_sink_mt >("logs/" + ostr.str());
-        auto main_logger    = std::make_shared< spdlog::logger >("main", file_sink);
-        auto gtf_logger     = std::make_shared< spdlog::logger >("gtf", file_sink);
-        auto process_logger = std::make_shared< spdlog::logger >("process", file_sink);
-        spdlog::register_logger(main_logger);
-        spdlog::register_logger(gtf_logger);
-        spdlog::register_logger(process_logger);
-        spdlog::set_default_logger(process_logger);
+        std::cerr << "-O is required unless --no_bam" << std::endl;
+        exit(-1);
     }
-    catch (const spdlog::spdlog_ex& ex)
+
+    // Check the bin sizes
+    vector< int > bin_sizes, sat_bins;
+    if (!parseSizes(bin_sizes_str, bin_sizes))
     {
-        std::cerr << "Log init failed: " << ex.what() << std::endl;
+        std::cerr << "Invalid parameter of --bin_sizes: " << bin_sizes_str << std::endl;
+        exit(-1);
     }
-    spdlog::set_level(spdlog::level::info);  // Set global log level.
-    // spdlog::cfg::load_argv_levels(argc, argv); // Set log level from command line
-    spdlog::flush_on(spdlog::level::info);
-    spdlog::set_pattern("%Y-%m-%d %H:%M:%S.%e %L %n: %v");
+    if (!parseSizes(sat_bins_str, sat_bins))
+    {
+        std::cerr << "Invalid parameter of --sat_bins: " << sat_bins_str << std::endl;
+        exit(-1);
+    }
+    // Check the sampling fractions of saturation
+    vector< float > sat_points;
+    for (auto& s : split_str(sat_points_str, ','))
+    {
+        size_t pos = 0;
+        float  f   = 0;
+        try
+        {
+            f = std::stof(s, &pos);
+        }
+        catch (std::exception&)
+        {
+        }
+        if (pos != s.size() || !(f > 0 && f <= 1))
+        {
+            std::cerr << "Invalid parameter of --sat_points: " << sat_points_str << std::endl;
+            exit(-1);
+        }
+        sat_points.push_back(f);
+    }
+
+    int tissue_x, tissue_y;
+    if (!parse_coordinate(tissue_offset_str, tissue_x, tissue_y, ','))
+    {
+        std::cerr << "Invalid parameter of --tissue_offset: " << tissue_offset_str << std::endl;
+        exit(-1);
+    }
+
+    int cell_x, cell_y;
+    if (!parse_coordinate(cell_offset_str, cell_x, cell_y, ','))
+    {
+        std::cerr << "Invalid parameter of --cell_offset: " << cell_offset_str << std::endl;
+        exit(-1);
+    }
+
+    // The splicing state comes from the exon and intron bases of TENX annotation
+    if (velocity && annotation_mode != 2)
+    {
+        std::cerr << "--velocity needs --anno_mode 2" << std::endl;
+        exit(-1);
+    }
+
+    initLogger();
 
     spdlog::get("main")->info("{} INPUT={} OUTPUT={} SUMMARY={} TAG={} ANNOTATION_FILE={} SAVE_LOW_QUALITY={} "
                               "SAVE_DUPLICATE={} ANNOTATION_MODE={} UMI_ON={} UMI_MIN_NUM={} UMI_MISMATCH={} "
-                              "SAT_FILE={} NO_FILTER_MATRIX={} CPU_CORES={} SCRNA={}",
+                              "SAT_FILE={} NO_FILTER_MATRIX={} CPU_CORES={} SCRNA={} SHARDED_OUTPUT={} GEM={} "
+                              "GEM_SORT={} BIN_SIZES={} EXP_STORE={} NO_BAM={} TAG_INDEX={} SAT_POINTS={} SAT_BINS={} "
+                              "CHIP_MASK={} TISSUE_MASK={} TISSUE_OFFSET={} TISSUE_BIN={} SAVE_OFF_TISSUE={} "
+                              "CELL_LABELS={} CELL_OFFSET={} CELL_RAW_WIDTH={} QC={} VELOCITY={}",
                               argv[0], input_bam, output_bam, metrics_file, "GE", annotation_file, save_low_quality,
                               save_duplicate, annotation_mode, umi_on, umi_min_num, umi_mismatch, saturation_file,
-                              no_filter_matrix, cpu_cores, scrna);
+                              no_filter_matrix, cpu_cores, scrna, sharded_output, gem_file, gem_sort,
+                              bin_sizes_str, store_file, no_bam, tag_index, sat_points_str, sat_bins_str,
+                              chip_mask_file, tissue_mask_file, tissue_offset_str, tissue_bin, save_off_tissue,
+                              cell_label_file, cell_offset_str, cell_raw_width, qc, velocity);
     HandleBam handleBam(bam_lists, output_bam, annotation_file, metrics_file, mapping_quality_threshold, exp_file);
-    handleBam.setBamConfig(save_low_quality, save_duplicate, annotation_mode);
+    handleBam.setBamConfig(save_low_quality, save_duplicate, annotation_mode, sharded_output, no_bam, tag_index);
     handleBam.setUmiConfig(umi_on, umi_min_num, umi_mismatch);
     handleBam.setExtraConfig(saturation_file, !no_filter_matrix, cpu_cores, scrna);
+    handleBam.setSaturationConfig(sat_points, sat_bins);
+    GemOrder gem_order = gem_sort == "gene" ? GEM_BY_GENE : (gem_sort == "tile" ? GEM_BY_TILE : GEM_UNSORTED);
+    handleBam.setGemConfig(gem_file, gem_order);
+    handleBam.setBinSizes(bin_sizes);
+    handleBam.setStoreFile(store_file);
+    handleBam.setMaskConfig(chip_mask_file, tissue_mask_file, tissue_x, tissue_y, tissue_bin, save_off_tissue);
+    handleBam.setCellConfig(cell_label_file, cell_x, cell_y, cell_raw_width);
+    handleBam.setQcConfig(qc);
+    handleBam.setVelocityConfig(velocity);
     try
     {
         handleBam.doWork();
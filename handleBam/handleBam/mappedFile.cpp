@@ -0,0 +1,116 @@
+/*
+ * File: mappedFile.cpp
+ * Created Data: 2026-10-18
+ * Author: fxzhao
+ * Contact: <zhaofuxiang@genomics.cn>
+ *
+ * Copyright (c) 2026 BGI-Research
+ */
+
+#include <algorithm>
+#include <filesystem>
+namespace fs = std::filesystem;
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <spdlog/spdlog.h>
+#include <zlib.h>
+
+#include "mappedFile.h"
+
+bool MappedFile::open(const std::string& filename, bool sequential)
+{
+    close();
+
+    int fd = ::open(filename.c_str(), O_RDONLY);
+    if (fd < 0)
+    {
+        spdlog::error("Failed open file: {}", filename);
+        return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0)
+    {
+        spdlog::error("Failed stat file: {}", filename);
+        ::close(fd);
+        return false;
+    }
+    if (st.st_size == 0)
+    {
+        // mmap refuses zero length, treat it as an empty mapping
+        ::close(fd);
+        return true;
+    }
+
+    void* p = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    // The mapping keeps its own reference of the file
+    ::close(fd);
+    if (p == MAP_FAILED)
+    {
+        spdlog::error("Failed mmap file: {}", filename);
+        return false;
+    }
+    addr   = p;
+    length = st.st_size;
+    if (sequential)
+        madvise(addr, length, MADV_SEQUENTIAL);
+
+    return true;
+}
+
+void MappedFile::close()
+{
+    if (addr != nullptr)
+    {
+        munmap(addr, length);
+        addr   = nullptr;
+        length = 0;
+    }
+}
+
+uint32 checksum(const void* data, size_t size, uint32 crc)
+{
+    // crc32() takes 32 bits length, feed large data piece by piece
+    const Bytef* p     = static_cast< const Bytef* >(data);
+    const size_t piece = 1UL << 30;
+    uLong        c     = crc;
+    for (size_t i = 0; i < size; i += piece)
+        c = crc32(c, p + i, uInt(std::min(piece, size - i)));
+    return uint32(c);
+}
+
+int writeFileAtomic(const std::string& filename, const std::function< bool(std::ofstream&) >& write)
+{
+    std::string   tmp_file = filename + ".tmp";
+    std::ofstream ofs(tmp_file, std::ios::binary | std::ios::trunc);
+    if (!ofs.is_open())
+    {
+        spdlog::error("Failed open file: {}", tmp_file);
+        return -1;
+    }
+    bool written = write(ofs);
+    ofs.close();
+    if (!written || !ofs)
+    {
+        spdlog::error("Failed write file: {}", tmp_file);
+        fs::remove(tmp_file);
+        return -1;
+    }
+    std::error_code ec;
+    fs::rename(tmp_file, filename, ec);
+    if (ec)
+    {
+        spdlog::error("Failed rename {} to {}: {}", tmp_file, filename, ec.message());
+        fs::remove(tmp_file);
+        return -1;
+    }
+    return 0;
+}
+
+int writeFileAtomic(const std::string& filename, const char* data, size_t size)
+{
+    return writeFileAtomic(filename, [&](std::ofstream& ofs) { return bool(ofs.write(data, size)); });
+}
@@ -0,0 +1,69 @@
+/*
+ * File: mappedFile.h
+ * Created Data: 2026-10-18
+ * Author: fxzhao
+ * Contact: <zhaofuxiang@genomics.cn>
+ *
+ * Copyright (c) 2026 BGI-Research
+ */
+
+#pragma once
+
+#include <fstream>
+#include <functional>
+#include <string>
+
+#include "types.h"
+
+// Read-only memory mapping of a whole file, the pages are shared
+// between all processes which map the same file.
+class MappedFile
+{
+public:
+    MappedFile() : addr(nullptr), length(0) {}
+    ~MappedFile()
+    {
+        close();
+    }
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    // Return false if the file can not be mapped
+    bool open(const std::string& filename, bool sequential = false);
+    void close();
+
+    const char* data() const
+    {
+        return static_cast< const char* >(addr);
+    }
+    size_t size() const
+    {
+        return length;
+    }
+
+private:
+    void*  addr;
+    size_t length;
+};
+
+// Helpers shared by the binary formats mapped with MappedFile
+
+// crc32 of data continued from crc, the crc of no data is 0
+uint32 checksum(const void* data, size_t size, uint32 crc = 0);
+
+// Write the file through a temporary one and rename it, so readers never map a half
+// written file. write fills the stream and returns false if failed. Return 0 if success.
+int writeFileAtomic(const std::string& filename, const std::function< bool(std::ofstream&) >& write);
+int writeFileAtomic(const std::string& filename, const char* data, size_t size);
+
+// Sections of the binary formats begin at multiples of 8 bytes
+inline size_t align8(size_t offset)
+{
+    return (offset + 7) & ~size_t(7);
+}
+
+// Division rounded toward negative infinity, n is positive
+inline int64 floorDiv(int64 v, int64 n)
+{
+    return v >= 0 ? v / n : -((-v + n - 1) / n);
+}
@@ -0,0 +1,274 @@
+/*
+ * File: qcMetrics.cpp
+ * Created Data: 2026-10-18
+ * Author: fxzhao
+ * Contact: <zhaofuxiang@genomics.cn>
+ *
+ * Copyright (c) 2026 BGI-Research
+ */
+
+#include <algorithm>
+#include <cctype>
+#include <cstring>
+#include <filesystem>
+#include <parallel/algorithm>
+namespace fs = std::filesystem;
+
+#include <omp.h>
+#include <spdlog/spdlog.h>
+
+#include "qcMetrics.h"
+#include "textWriter.h"
+#include "utils.h"
+
+static const char XF_TAG[] = "XF";
+
+bool isRibosomal(const std::string& gene)
+{
+    bool human = gene.compare(0, 3, "RPL") == 0 || gene.compare(0, 3, "RPS") == 0;
+    bool mouse = gene.compare(0, 3, "Rpl") == 0 || gene.compare(0, 3, "Rps") == 0;
+    if (!human && !mouse)
+        return false;
+    bool        large = gene[2] == 'L' || gene[2] == 'l';
+    const char* p     = gene.c_str() + 3;
+    if (*p == (human ? 'A' : 'a'))
+        return !large && p[1] == '\0';
+    if (*p == (human ? 'P' : 'p'))
+    {
+        if (!large || !isdigit(p[1]))
+            return false;
+        for (++p; isdigit(*p); ++p)
+            ;
+        return *p == '\0';
+    }
+    if (!isdigit(*p))
+        return false;
+    for (; isdigit(*p); ++p)
+        ;
+    // The paralog suffix is letters and digits, the kinases go on with a K and
+    // the pseudogenes with a P
+    for (; *p != '\0'; ++p)
+        if (!isalnum(*p) || toupper(*p) == 'K' || toupper(*p) == 'P')
+            return false;
+    return true;
+}
+
+char geneClass(const std::string& gene)
+{
+    if (gene.compare(0, 3, "MT-") == 0 || gene.compare(0, 3, "mt-") == 0)
+        return GENE_MITO;
+    if (isRibosomal(gene))
+        return GENE_RIBO;
+    return GENE_OTHER;
+}
+
+void QcCounter::add(std::string_view barcode, const bam1_t* b)
+{
+    int x, y;
+    if (!parse_coordinate(barcode, x, y))
+    {
+        ++skipped;
+        return;
+    }
+
+    uint64 tile = (uint64(uint32(y >> QC_TILE_SHIFT)) << 32) | uint32(x >> QC_TILE_SHIFT);
+    if (tile != last_tile)
+    {
+        auto it = tile_ids.find(tile);
+        if (it == tile_ids.end())
+        {
+            it = tile_ids.emplace(tile, uint32(tile_keys.size())).first;
+            tile_keys.push_back(tile);
+            spots.resize(spots.size() + QC_TILE_SPOTS, ReadQc{});
+        }
+        last_tile = tile;
+        last_id   = it->second;
+    }
+    size_t  pos = ((y & (QC_TILE_SIZE - 1)) << QC_TILE_SHIFT) | (x & (QC_TILE_SIZE - 1));
+    ReadQc& qc  = spots[last_id * QC_TILE_SPOTS + pos];
+    ++qc.reads;
+
+    const uint8_t* p  = bam_aux_get(b, XF_TAG);
+    const char*    xf = p != nullptr ? bam_aux2Z(p) : nullptr;
+    if (xf == nullptr)
+        ++qc.intergenic;
+    else if (strcmp(xf, "EXONIC") == 0 || strcmp(xf, "UTR") == 0)
+        ++qc.exonic;
+    else if (strcmp(xf, "INTRONIC") == 0)
+        ++qc.intronic;
+    else
+        ++qc.intergenic;
+}
+
+void QcMatrix::merge(QcCounter& counter)
+{
+    for (size_t t = 0; t < counter.tile_keys.size(); ++t)
+    {
+        int32 x0 = int32(uint32(counter.tile_keys[t])) << QC_TILE_SHIFT;
+        int32 y0 = int32(uint32(counter.tile_keys[t] >> 32)) << QC_TILE_SHIFT;
+        for (size_t pos = 0; pos < QC_TILE_SPOTS; ++pos)
+        {
+            const ReadQc& qc = counter.spots[t * QC_TILE_SPOTS + pos];
+            if (qc.reads == 0)
+                continue;
+            int32 x = x0 + int32(pos & (QC_TILE_SIZE - 1));
+            int32 y = y0 + int32(pos >> QC_TILE_SHIFT);
+            spots.push_back({ binKey(x, y, 1), qc });
+        }
+    }
+    skipped += counter.skipped;
+
+    std::unordered_map< uint64, uint32 >().swap(counter.tile_ids);
+    std::vector< uint64 >().swap(counter.tile_keys);
+    std::vector< ReadQc >().swap(counter.spots);
+    counter.last_tile = UINT64_MAX;
+    counter.skipped   = 0;
+}
+
+std::vector< QcMatrix::BinQc > QcMatrix::aggregate(const ExpMatrix& exp, const std::vector< char >& gene_class,
+                                                   int32 n, int threads) const
+{
+    omp_set_num_threads(threads);
+
+    // Reads of the bins
+    std::vector< SpotReads > reads(spots.size());
+    for (size_t i = 0; i < spots.size(); ++i)
+    {
+        int32 x  = int32(uint32(spots[i].key)), y = int32(uint32(spots[i].key >> 32));
+        reads[i] = { binKey(x, y, n), spots[i].qc };
+    }
+    __gnu_parallel::sort(reads.begin(), reads.end(),
+                         [](const SpotReads& a, const SpotReads& b) { return a.key < b.key; });
+
+    // Umis of the genes in bins
+    struct GeneUmi
+    {
+        uint64 key;
+        uint32 gene;
+        uint32 umi;
+    };
+    std::vector< GeneUmi > umis;
+    exp.forEachEntry([&](const Coordinate& c, uint32 gene, const ExpCount& count) {
+        if (c.x != INVALID_COORD)
+            umis.push_back({ binKey(c.x, c.y, n), gene, count.umi });
+    });
+    __gnu_parallel::sort(umis.begin(), umis.end(), [](const GeneUmi& a, const GeneUmi& b) {
+        return a.key != b.key ? a.key < b.key : a.gene < b.gene;
+    });
+
+    // Join the two lists sorted by bin
+    std::vector< BinQc > bins;
+    size_t               i = 0, j = 0;
+    while (i < reads.size() || j < umis.size())
+    {
+        uint64 key = j == umis.size() || (i < reads.size() && reads[i].key < umis[j].key) ? reads[i].key : umis[j].key;
+        BinQc  b{};
+        b.key = key;
+        for (; i < reads.size() && reads[i].key == key; ++i)
+        {
+            b.reads += reads[i].qc.reads;
+            b.exonic += reads[i].qc.exonic;
+            b.intronic += reads[i].qc.intronic;
+            b.intergenic += reads[i].qc.intergenic;
+        }
+        for (size_t beg = j; j < umis.size() && umis[j].key == key; ++j)
+        {
+            if (j == beg || umis[j].gene != umis[j - 1].gene)
+                ++b.genes;
+            b.umis += umis[j].umi;
+            if (gene_class[umis[j].gene] == GENE_MITO)
+                b.mt_umis += umis[j].umi;
+            else if (gene_class[umis[j].gene] == GENE_RIBO)
+                b.ribo_umis += umis[j].umi;
+        }
+        bins.push_back(b);
+    }
+    return bins;
+}
+
+// A row of the distribution of values in summary
+static std::string distribution(int bin_size, const char* metric, std::vector< double >& values)
+{
+    if (values.empty())
+        return fmt::format("{}\t{}\t0\t0\t0\t0\t0\t0\t0\n", bin_size, metric);
+    double sum = 0;
+    for (double v : values)
+        sum += v;
+    auto quantile = [&](double q) {
+        auto it = values.begin() + size_t(q * (values.size() - 1));
+        std::nth_element(values.begin(), it, values.end());
+        return *it;
+    };
+    double q25 = quantile(0.25), q50 = quantile(0.5), q75 = quantile(0.75);
+    double min = *std::min_element(values.begin(), values.end()), max = *std::max_element(values.begin(), values.end());
+    return fmt::format("{}\t{}\t{}\t{:.2f}\t{:.2f}\t{:.2f}\t{:.2f}\t{:.2f}\t{:.2f}\n", bin_size, metric, values.size(),
+                       sum / values.size(), min, q25, q50, q75, max);
+}
+
+int QcMatrix::write(const std::string& path, const ExpMatrix& exp, const std::vector< int >& bin_sizes,
+                    std::string& summary, int threads) const
+{
+    if (skipped != 0)
+        spdlog::warn("Skip {} reads in QC metrics, the barcodes are not coordinates", skipped);
+
+    std::vector< char > gene_class;
+    for (auto& gene : exp.geneNames())
+        gene_class.push_back(geneClass(gene));
+
+    std::vector< int > sizes{ 1 };
+    for (int n : bin_sizes)
+        if (n != 1)
+            sizes.push_back(n);
+
+    summary += "## SPOT AND BIN QC METRICS\nBIN_SIZE\tMETRIC\tNUM\tMEAN\tMIN\tQ25\tMEDIAN\tQ75\tMAX\n";
+    for (int n : sizes)
+    {
+        std::vector< BinQc > bins = aggregate(exp, gene_class, n, threads);
+
+        fs::path   file = fs::path(path) / ("bin" + std::to_string(n) + ".qc.tsv.gz");
+        TextWriter out(file.string(), threads);
+        out << "#x\ty\treads\texonic\tintronic\tintergenic\tumis\tgenes\tmt_umis\tribo_umis\n";
+        for (auto& b : bins)
+        {
+            out << uint32(b.key) << '\t' << uint32(b.key >> 32) << '\t' << b.reads << '\t' << b.exonic << '\t'
+                << b.intronic << '\t' << b.intergenic << '\t' << b.umis << '\t' << b.genes << '\t' << b.mt_umis
+                << '\t' << b.ribo_umis << '\n';
+        }
+        if (out.close() != 0)
+        {
+            spdlog::error("Failed write file: {}", file.string());
+            return -1;
+        }
+
+        // The fractions are of the reads or umis of each bin, in percentage
+        auto values = [&](auto f) {
+            std::vector< double > v;
+            v.reserve(bins.size());
+            for (auto& b : bins)
+                f(b, v);
+            return v;
+        };
+        auto rate = [](uint64 part, uint64 total, std::vector< double >& v) {
+            if (total != 0)
+                v.push_back(part * 100.0 / total);
+        };
+        std::vector< double > v;
+        v = values([](const BinQc& b, std::vector< double >& v) { v.push_back(b.reads); });
+        summary += distribution(n, "READS", v);
+        v = values([](const BinQc& b, std::vector< double >& v) { v.push_back(b.umis); });
+        summary += distribution(n, "UMIS", v);
+        v = values([](const BinQc& b, std::vector< double >& v) { v.push_back(b.genes); });
+        summary += distribution(n, "GENES", v);
+        v = values([&](const BinQc& b, std::vector< double >& v) { rate(b.exonic, b.reads, v); });
+        summary += distribution(n, "EXONIC_RATE", v);
+        v = values([&](const BinQc& b, std::vector< double >& v) { rate(b.intronic, b.reads, v); });
+        summary += distribution(n, "INTRONIC_RATE", v);
+        v = values([&](const BinQc& b, std::vector< double >& v) { rate(b.intergenic, b.reads, v); });
+        summary += distribution(n, "INTERGENIC_RATE", v);
+        v = values([&](const BinQc& b, std::vector< double >& v) { rate(b.mt_umis, b.umis, v); });
+        summary += distribution(n, "MT_RATE", v);
+        v = values([&](const BinQc& b, std::vector< double >& v) { rate(b.ribo_umis, b.umis, v); });
+        summary += distribution(n, "RIBO_RATE", v);
+    }
+    return 0;
+}
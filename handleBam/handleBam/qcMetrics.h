@@ -0,0 +1,114 @@
+/*
+ * File: qcMetrics.h
+ * Created Data: 2026-10-18
+ * Author: fxzhao
+ * Contact: <zhaofuxiang@genomics.cn>
+ *
+ * Copyright (c) 2026 BGI-Research
+ */
+
+#pragma once
+
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include "expMatrix.h"
+#include "htslib/sam.h"
+#include "types.h"
+
+// Classes of genes counted apart
+enum GeneClass
+{
+    GENE_OTHER,
+    GENE_MITO,  // MT-/mt- genes of mitochondrial genome
+    GENE_RIBO,  // ribosomal protein genes, see isRibosomal()
+};
+
+// Ribosomal protein genes are RPL/RPS followed by a number, such as RPL10A and RPS4X, and
+// RPLP0-2 and RPSA, or the same in mouse case. RPS6KA1 and the pseudogenes RPL13AP5 or
+// Rpl10-ps3 share the prefix but are not counted.
+bool isRibosomal(const std::string& gene);
+
+// GeneClass of a gene name
+char geneClass(const std::string& gene);
+
+// Spots are counted in square tiles of 64, each tile is a flat array of the spots
+static const int    QC_TILE_SHIFT = 6;
+static const int32  QC_TILE_SIZE  = 1 << QC_TILE_SHIFT;
+static const size_t QC_TILE_SPOTS = size_t(QC_TILE_SIZE) * QC_TILE_SIZE;
+
+// Annotated reads of a spot by the locus function
+struct ReadQc
+{
+    uint32 reads;
+    uint32 exonic;  // EXONIC and UTR
+    uint32 intronic;
+    uint32 intergenic;  // INTERGENIC and the reads without locus function
+};
+
+// QC counts of the reads of one task, the spots are found by the coordinates of
+// barcodes without hashing the barcode strings
+class QcCounter
+{
+public:
+    QcCounter() : last_tile(UINT64_MAX), last_id(0), skipped(0) {}
+
+    // Count an annotated read by its XF tag, the barcodes not coordinates are skipped
+    void add(std::string_view barcode, const bam1_t* b);
+
+private:
+    friend class QcMatrix;
+
+    std::unordered_map< uint64, uint32 > tile_ids;  // tile key to the index of tile
+    std::vector< uint64 >                tile_keys;
+    std::vector< ReadQc >                spots;  // QC_TILE_SPOTS of each tile, row by row
+    // Neighbouring reads often hit the same tile
+    uint64 last_tile;
+    uint32 last_id;
+    uint64 skipped;
+};
+
+// QC metrics of spots and square bins gathered from all the tasks. The read
+// counts come from the annotation, the umis and genes from the expression matrix.
+class QcMatrix
+{
+public:
+    QcMatrix() : skipped(0) {}
+
+    // Move the counts of a task into the matrix
+    void merge(QcCounter& counter);
+
+    // Write "x y reads exonic intronic intergenic umis genes mt_umis ribo_umis" per
+    // line into path/bin<n>.qc.tsv.gz for spots as bin1 and each bin size, x and y
+    // of bins are x / n and y / n. The distributions of the metrics are appended to
+    // summary. Return 0 if success.
+    int write(const std::string& path, const ExpMatrix& exp, const std::vector< int >& bin_sizes, std::string& summary,
+              int threads = 1) const;
+
+private:
+    struct SpotReads
+    {
+        uint64 key;  // see binKey()
+        ReadQc qc;
+    };
+    struct BinQc
+    {
+        uint64 key;
+        uint64 reads, exonic, intronic, intergenic;
+        uint64 umis, genes, mt_umis, ribo_umis;
+    };
+
+    // Bins sorted by y and x, the coordinates are assumed not negative
+    static uint64 binKey(int32 x, int32 y, int32 n)
+    {
+        return (uint64(uint32(y / n)) << 32) | uint32(x / n);
+    }
+    std::vector< BinQc > aggregate(const ExpMatrix& exp, const std::vector< char >& gene_class, int32 n,
+                                   int threads) const;
+
+private:
+    std::vector< SpotReads > spots;
+    uint64                   skipped;
+};
@@ -10,10 +10,13 @@
 #pragma once
 
 #include <fstream>
+#include <memory>
 
 #include <spdlog/spdlog.h>
 
+#include "bamIndex.h"
 #include "samReader.h"
+#include "tagIndex.h"
 
 class SamWriter
 {
@@ -42,11 +45,17 @@ public:
         return 0;
     }
 
-    int init(BamHeader header)
+    // Build the index of the records while writing if with_index is true, and the
+    // index of barcode and gene tags if with_tag_index is true
+    int init(BamHeader header, bool with_index = false, bool with_tag_index = false)
     {
         out                      = hts_open(filename.c_str(), "wb");
         header_                  = header;
         [[maybe_unused]] int ret = sam_hdr_write(out, header_);
+        if (with_index)
+            index = std::make_unique< BamIndex >(header_);
+        if (with_tag_index)
+            tag_index = std::make_unique< TagIndex >();
 
         spdlog::debug("SamWriter init.");
         return 0;
@@ -54,6 +63,38 @@ public:
 
     int write(BamRecord& record)
     {
+        if (index || tag_index)
+        {
+            // bam_write1() flushes the block first if the record doesn't fit in it, flush
+            // it here with the same size so the offset is where the record really begins
+            BGZF* fp = out->fp.bgzf;
+            if (bgzf_flush_try(fp, 4 + 32 + record->l_data - record->core.l_extranul) < 0)
+            {
+                if (index)
+                    index->invalidate();
+                if (tag_index)
+                    tag_index->invalidate();
+                return 0;
+            }
+            // The virtual offsets before and after the record
+            uint64 voff_beg = bgzf_tell(fp);
+            bool   written  = sam_write1(out, header_, record) >= 0;
+            if (index)
+            {
+                if (written)
+                    index->push(record, voff_beg, bgzf_tell(fp));
+                else
+                    index->invalidate();
+            }
+            if (tag_index)
+            {
+                if (written)
+                    tag_index->push(record, voff_beg);
+                else
+                    tag_index->invalidate();
+            }
+            return 0;
+        }
         [[maybe_unused]] int ret = sam_write1(out, header_, record);
 
         return 0;
@@ -62,6 +103,21 @@ public:
     void setThreadPool(htsThreadPool* p)
     {
         hts_set_opt(out, HTS_OPT_THREAD_POOL, p);
+        // The blocks compressed by the pool get their offsets only when written out
+        if (index)
+            index->invalidate();
+        if (tag_index)
+            tag_index->invalidate();
+    }
+
+    // Return the index of the written records, nullptr if not requested
+    std::unique_ptr< BamIndex > takeIndex()
+    {
+        return std::move(index);
+    }
+    std::unique_ptr< TagIndex > takeTagIndex()
+    {
+        return std::move(tag_index);
     }
 
 private:
@@ -72,4 +128,7 @@ private:
 
     // A htslib header data structure obtained by parsing the header of this BAM.
     bam_hdr_t* header_;
+
+    std::unique_ptr< BamIndex > index;
+    std::unique_ptr< TagIndex > tag_index;
 };
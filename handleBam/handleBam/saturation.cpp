@@ -12,11 +12,17 @@
 #include <spdlog/spdlog.h>
 
 #include <algorithm>
+#include <cmath>
 #include <fstream>
+#include <iterator>
 #include <limits>
+#include <numeric>
+#include <parallel/algorithm>
 #include <random>
-#include <set>
 #include <sstream>
+#include <tuple>
+
+#include <omp.h>
 
 #include "utils.h"
 
@@ -27,9 +33,10 @@ Saturation::Saturation()
 
     _sep         = '|';
     _barcode_sep = '_';
-    _bin         = 150;
+    _bins        = { 150 };
 
-    _nreads = 0;
+    _nreads  = 0;
+    _threads = 1;
 
     _samples = { 0, 0.05, 0.1, 0.2, 0.3, 0.4, 0.5, 0.6, 0.7, 0.8, 0.9, 1 };
 
@@ -41,9 +48,28 @@ Saturation::Saturation()
 
 Saturation::~Saturation() {}
 
-int Saturation::calculateSaturation(string& out_file)
+void Saturation::setSamples(vector< float > samples)
+{
+    samples.push_back(1);
+    std::sort(samples.begin(), samples.end());
+    samples.erase(std::unique(samples.begin(), samples.end()), samples.end());
+    _samples = { 0 };
+    for (auto f : samples)
+        if (f > 0 && f <= 1)
+            _samples.push_back(f);
+}
+
+void Saturation::setBins(vector< int > bins)
+{
+    std::sort(bins.begin(), bins.end());
+    bins.erase(std::unique(bins.begin(), bins.end()), bins.end());
+    _bins = bins;
+}
+
+int Saturation::calculateSaturation(string& out_file, int threads)
 {
     std::lock_guard< std::mutex > guard(_mutex);
+    _threads = threads;
 
     // Get NOGENE index
     nogene_idx = std::numeric_limits< unsigned int >::max();
@@ -98,6 +124,467 @@ unsigned int Saturation::encodeGene(string& gene)
     return _ge2i[gene];
 }
 
+// Molecules per shard of sampling, a shard is extended to the end of its tile
+static const size_t SAT_SHARD_SIZE = 1 << 16;
+// Minimum size of the tiles of spots which shard the molecules
+static const unsigned long long SAT_TILE_SIZE = 1000;
+
+static bool moleculeLess(const Molecule& a, const Molecule& b)
+{
+    return std::tie(a.bin, a.barcode, a.ge, a.umi) < std::tie(b.bin, b.barcode, b.ge, b.umi);
+}
+
+void Saturation::mergeMolecules()
+{
+    omp_set_num_threads(_threads);
+    __gnu_parallel::sort(_molecules.begin(), _molecules.end(), moleculeLess);
+    size_t n = 0;
+    for (size_t i = 0; i < _molecules.size(); ++i)
+    {
+        if (n != 0 && !moleculeLess(_molecules[n - 1], _molecules[i]))
+            _molecules[n - 1].reads += _molecules[i].reads;
+        else
+            _molecules[n++] = _molecules[i];
+    }
+    _molecules.resize(n);
+    _molecules.shrink_to_fit();
+    spdlog::debug("Saturation molecules:{}", n);
+}
+
+vector< size_t > Saturation::shardBounds() const
+{
+    size_t           n = _molecules.size();
+    vector< size_t > bounds{ 0 };
+    while (bounds.back() < n)
+    {
+        size_t k = std::min(n, bounds.back() + SAT_SHARD_SIZE);
+        while (k < n && _molecules[k].bin == _molecules[k - 1].bin)
+            ++k;
+        bounds.push_back(k);
+    }
+    return bounds;
+}
+
+// The median is the element n / 2 of the sorted values, hist[v] is the number of
+// items of value v
+static size_t histogramMedian(const vector< size_t >& hist)
+{
+    size_t total = 0;
+    for (auto n : hist)
+        total += n;
+    size_t seen = 0;
+    for (size_t v = 0; v < hist.size(); ++v)
+    {
+        seen += hist[v];
+        if (seen > total / 2)
+            return v;
+    }
+    return 0;
+}
+
+// Count one more item of value v
+static void addToHistogram(vector< size_t >& hist, size_t v)
+{
+    if (hist.size() <= v)
+        hist.resize(v + 1, 0);
+    ++hist[v];
+}
+
+// Add the counts of other to hist
+static void mergeHistogram(vector< size_t >& hist, const vector< size_t >& other)
+{
+    if (hist.size() < other.size())
+        hist.resize(other.size(), 0);
+    for (size_t i = 0; i < other.size(); ++i)
+        hist[i] += other[i];
+}
+
+// Sums of one sampling fraction
+struct SampleCounts
+{
+    SampleCounts() : reads(0), reads_sat(0), uniq(0) {}
+
+    void merge(const SampleCounts& other)
+    {
+        reads += other.reads;
+        reads_sat += other.reads_sat;
+        uniq += other.uniq;
+        mergeHistogram(genes, other.genes);
+    }
+
+    Metrics metrics() const
+    {
+        Metrics metrics;
+        metrics.reads     = reads;
+        metrics.reads_sat = reads_sat;
+        metrics.uniq      = uniq;
+        for (auto n : genes)
+            metrics.barcodes += n;
+        metrics.median_genes = histogramMedian(genes);
+        return metrics;
+    }
+
+    size_t           reads;
+    size_t           reads_sat;
+    size_t           uniq;
+    vector< size_t > genes;  // number of barcodes by the genes detected
+};
+
+// Count the molecules of one barcode at each fraction. sampled[i * levels + l] is
+// the sampled reads of molecule i at fraction l, gene_of(i) is its gene and the
+// molecules of a gene are adjacent.
+template < typename GeneOf >
+static void countBarcode(size_t n, GeneOf gene_of, const unsigned int* sampled, unsigned int nogene,
+                         vector< SampleCounts >& counts)
+{
+    size_t levels = counts.size();
+    for (size_t l = 0; l < levels; ++l)
+    {
+        SampleCounts& c         = counts[l];
+        size_t        reads     = 0;
+        size_t        genes     = 0;
+        unsigned int  last_gene = nogene;
+        for (size_t i = 0; i < n; ++i)
+        {
+            unsigned int k = sampled[i * levels + l];
+            if (k == 0)
+                continue;
+            reads += k;
+            unsigned int gene = gene_of(i);
+            if (gene != nogene)
+            {
+                if (gene != last_gene)
+                    ++genes;
+                last_gene = gene;
+                ++c.uniq;
+                c.reads_sat += k;
+            }
+        }
+        if (reads == 0)
+            continue;
+        c.reads += reads;
+        if (c.genes.size() <= genes)
+            c.genes.resize(genes + 1, 0);
+        ++c.genes[genes];
+    }
+}
+
+void Saturation::sampleAll(vector< Metrics >& barcode_metrics, vector< vector< Metrics > >& bin_metrics,
+                           const vector< int >& bins)
+{
+    size_t           levels = _samples.size() - 1;
+    vector< size_t > bounds = shardBounds();
+
+    std::random_device               rd;
+    unsigned int                     seed[2] = { rd(), rd() };
+    vector< SampleCounts >           barcode_counts(levels);
+    vector< vector< SampleCounts > > bin_counts(bins.size(), vector< SampleCounts >(levels));
+#pragma omp parallel num_threads(_threads)
+    {
+        vector< SampleCounts >           barcode_local(levels);
+        vector< vector< SampleCounts > > bin_local(bins.size(), vector< SampleCounts >(levels));
+        vector< unsigned int >           sampled, bin_genes, bin_sampled;
+        vector< size_t >                 order;
+#pragma omp for schedule(dynamic)
+        for (size_t s = 0; s < bounds.size() - 1; ++s)
+        {
+            const Molecule* m     = _molecules.data() + bounds[s];
+            size_t          count = bounds[s + 1] - bounds[s];
+
+            // Seeded by shard, so the result doesn't depend on the number of threads.
+            // Each fraction keeps the reads of the previous one and samples the rest,
+            // so the samples are nested as the prefixes of shuffled reads.
+            std::seed_seq                            seq{ seed[0], seed[1], unsigned(s) };
+            std::mt19937                             gen(seq);
+            std::uniform_real_distribution< double > uniform(0, 1);
+            sampled.assign(count * levels, 0);
+            for (size_t i = 0; i < count; ++i)
+            {
+                unsigned int kept = 0;
+                double       prev = 0;
+                for (size_t l = 0; l < levels; ++l)
+                {
+                    unsigned int left = m[i].reads - kept;
+                    double       frac = _samples[l + 1];
+                    if (left != 0 && prev < 1)
+                    {
+                        double p = (frac - prev) / (1 - prev);
+                        if (p >= 1)
+                            kept += left;
+                        else if (left == 1)
+                            kept += uniform(gen) < p;
+                        else
+                            kept += std::binomial_distribution< unsigned int >(left, p)(gen);
+                    }
+                    sampled[i * levels + l] = kept;
+                    prev                    = frac;
+                }
+            }
+
+            for (size_t i = 0, j = 0; i < count; i = j)
+            {
+                for (j = i + 1; j < count && m[j].barcode == m[i].barcode; ++j)
+                    ;
+                countBarcode(
+                    j - i, [&](size_t x) { return m[i + x].ge; }, &sampled[i * levels], nogene_idx, barcode_local);
+            }
+
+            // Every bin size shares the draws above. The molecules of the same gene and
+            // umi in a bin are one molecule of the bin.
+            for (size_t b = 0; b < bins.size(); ++b)
+            {
+                unsigned int size  = bins[b];
+                auto         binOf = [size](const Molecule& x) {
+                    return std::make_pair(( unsigned int )x.barcode / size, ( unsigned int )(x.barcode >> 32) / size);
+                };
+                order.resize(count);
+                for (size_t x = 0; x < count; ++x)
+                    order[x] = x;
+                std::sort(order.begin(), order.end(), [&](size_t x, size_t y) {
+                    return std::make_tuple(binOf(m[x]), m[x].ge, m[x].umi)
+                           < std::make_tuple(binOf(m[y]), m[y].ge, m[y].umi);
+                });
+                bin_genes.clear();
+                bin_sampled.clear();
+                for (size_t x = 0; x < count; ++x)
+                {
+                    const Molecule& cur  = m[order[x]];
+                    const Molecule* last = x == 0 ? nullptr : &m[order[x - 1]];
+                    if (last != nullptr && binOf(cur) != binOf(*last))
+                    {
+                        countBarcode(
+                            bin_genes.size(), [&](size_t y) { return bin_genes[y]; }, bin_sampled.data(), nogene_idx,
+                            bin_local[b]);
+                        bin_genes.clear();
+                        bin_sampled.clear();
+                        last = nullptr;
+                    }
+                    if (last == nullptr || cur.ge != last->ge || cur.umi != last->umi)
+                    {
+                        bin_genes.push_back(cur.ge);
+                        bin_sampled.resize(bin_sampled.size() + levels, 0);
+                    }
+                    unsigned int* dst = &bin_sampled[bin_sampled.size() - levels];
+                    for (size_t l = 0; l < levels; ++l)
+                        dst[l] += sampled[order[x] * levels + l];
+                }
+                countBarcode(
+                    bin_genes.size(), [&](size_t y) { return bin_genes[y]; }, bin_sampled.data(), nogene_idx,
+                    bin_local[b]);
+            }
+        }
+#pragma omp critical
+        for (size_t l = 0; l < levels; ++l)
+        {
+            barcode_counts[l].merge(barcode_local[l]);
+            for (size_t b = 0; b < bins.size(); ++b)
+                bin_counts[b][l].merge(bin_local[b][l]);
+        }
+    }
+
+    barcode_metrics.clear();
+    bin_metrics.assign(bins.size(), {});
+    for (size_t l = 0; l < levels; ++l)
+    {
+        barcode_metrics.push_back(barcode_counts[l].metrics());
+        for (size_t b = 0; b < bins.size(); ++b)
+            bin_metrics[b].push_back(bin_counts[b][l].metrics());
+    }
+}
+
+// Expected number of the items unseen in n samples that are seen in depth times
+// of n samples. hist is the number of items seen exactly j times, sorted by j.
+// Good-Toulmin is unbiased to 2 times, beyond that its terms are smoothed by
+// the binomial tail of Orlitsky et al. (PNAS 2016).
+static double projectUnseen(const vector< std::pair< unsigned int, size_t > >& hist, double n, double depth)
+{
+    double r = depth - 1;
+    if (r <= 0 || n <= 0)
+        return 0;
+    // P(L >= j) for L ~ Bin(k, q), 1 without smoothing
+    vector< double > tail;
+    if (r > 1)
+    {
+        int    k = std::max(1, int(std::ceil(0.5 * std::log(n * r * r / (r - 1)) / std::log(3.0))));
+        double q = 2 / (r + 2);
+        tail.assign(k + 2, 0);
+        for (int i = k; i >= 0; --i)
+        {
+            double log_p = std::lgamma(k + 1) - std::lgamma(i + 1) - std::lgamma(k - i + 1) + i * std::log(q)
+                           + (k - i) * std::log(1 - q);
+            tail[i] = tail[i + 1] + std::exp(log_p);
+        }
+    }
+    double unseen = 0;
+    for (auto& [j, count] : hist)
+    {
+        if (!tail.empty() && j >= tail.size() - 1)
+            break;
+        double weight = tail.empty() ? 1 : tail[j];
+        unseen -= std::pow(-r, j) * weight * count;
+    }
+    return std::max(0.0, unseen);
+}
+
+// Histogram of reads per item, sorted by reads
+static vector< std::pair< unsigned int, size_t > > readsHistogram(vector< unsigned int >& reads)
+{
+    std::sort(reads.begin(), reads.end());
+    vector< std::pair< unsigned int, size_t > > hist;
+    for (auto r : reads)
+    {
+        if (!hist.empty() && hist.back().first == r)
+            ++hist.back().second;
+        else
+            hist.emplace_back(r, 1);
+    }
+    return hist;
+}
+
+void Saturation::extrapolate(const vector< int >& bins)
+{
+    const size_t     depths = std::size(SAT_EXTRAPOLATE_DEPTHS);
+    const size_t     kinds  = bins.size() + 1;  // spots, then the bins of each size
+    vector< size_t > bounds = shardBounds();
+
+    // Reads per molecule, and the number of spots or bins by the projected genes
+    // rounded to whole genes, so the memory is bounded by the genes not the spots
+    vector< unordered_map< unsigned int, size_t > > molecule_hist(kinds);
+    vector< vector< vector< size_t > > >            genes(kinds, vector< vector< size_t > >(depths));
+#pragma omp parallel num_threads(_threads)
+    {
+        vector< unordered_map< unsigned int, size_t > > hist_local(kinds);
+        vector< vector< vector< size_t > > >            genes_local(kinds, vector< vector< size_t > >(depths));
+        vector< unsigned int >                          gene_reads;
+        vector< std::pair< unsigned int, unsigned int > > group;  // gene and reads of the molecules of a spot
+        vector< size_t >                                order;
+
+        // The molecules of one spot or bin sorted by gene, NOGENE excluded
+        auto addGroup = [&](size_t kind) {
+            gene_reads.clear();
+            size_t reads = 0;
+            for (size_t i = 0; i < group.size(); ++i)
+            {
+                ++hist_local[kind][group[i].second];
+                reads += group[i].second;
+                if (i == 0 || group[i].first != group[i - 1].first)
+                    gene_reads.push_back(0);
+                gene_reads.back() += group[i].second;
+            }
+            if (group.empty())
+                return;
+            auto hist = readsHistogram(gene_reads);
+            for (size_t d = 0; d < depths; ++d)
+            {
+                double projected = gene_reads.size() + projectUnseen(hist, reads, SAT_EXTRAPOLATE_DEPTHS[d]);
+                addToHistogram(genes_local[kind][d], std::lround(projected));
+            }
+        };
+
+#pragma omp for schedule(dynamic)
+        for (size_t s = 0; s < bounds.size() - 1; ++s)
+        {
+            const Molecule* m     = _molecules.data() + bounds[s];
+            size_t          count = bounds[s + 1] - bounds[s];
+            for (size_t i = 0, j = 0; i < count; i = j)
+            {
+                group.clear();
+                for (j = i; j < count && m[j].barcode == m[i].barcode; ++j)
+                    if (m[j].ge != nogene_idx)
+                        group.emplace_back(m[j].ge, m[j].reads);
+                addGroup(0);
+            }
+
+            for (size_t b = 0; b < bins.size(); ++b)
+            {
+                unsigned int size  = bins[b];
+                auto         binOf = [size](const Molecule& x) {
+                    return std::make_pair(( unsigned int )x.barcode / size, ( unsigned int )(x.barcode >> 32) / size);
+                };
+                order.resize(count);
+                for (size_t x = 0; x < count; ++x)
+                    order[x] = x;
+                std::sort(order.begin(), order.end(), [&](size_t x, size_t y) {
+                    return std::make_tuple(binOf(m[x]), m[x].ge, m[x].umi)
+                           < std::make_tuple(binOf(m[y]), m[y].ge, m[y].umi);
+                });
+                group.clear();
+                for (size_t x = 0; x < count; ++x)
+                {
+                    const Molecule& cur  = m[order[x]];
+                    const Molecule* last = x == 0 ? nullptr : &m[order[x - 1]];
+                    if (last != nullptr && binOf(cur) != binOf(*last))
+                    {
+                        addGroup(b + 1);
+                        group.clear();
+                        last = nullptr;
+                    }
+                    if (cur.ge == nogene_idx)
+                        continue;
+                    // The molecules of the same gene and umi in a bin are one molecule
+                    if (last != nullptr && cur.ge == last->ge && cur.umi == last->umi && !group.empty())
+                        group.back().second += cur.reads;
+                    else
+                        group.emplace_back(cur.ge, cur.reads);
+                }
+                addGroup(b + 1);
+            }
+        }
+#pragma omp critical
+        for (size_t k = 0; k < kinds; ++k)
+        {
+            for (auto& [reads, n] : hist_local[k])
+                molecule_hist[k][reads] += n;
+            for (size_t d = 0; d < depths; ++d)
+                mergeHistogram(genes[k][d], genes_local[k][d]);
+        }
+    }
+
+    _projected_bins = bins;
+    _projections.assign(kinds, {});
+    for (size_t k = 0; k < kinds; ++k)
+    {
+        vector< std::pair< unsigned int, size_t > > hist(molecule_hist[k].begin(), molecule_hist[k].end());
+        std::sort(hist.begin(), hist.end());
+        double uniq = 0, reads = 0;
+        for (auto& [r, n] : hist)
+        {
+            uniq += n;
+            reads += double(r) * n;
+        }
+        for (size_t d = 0; d < depths; ++d)
+        {
+            double     depth = SAT_EXTRAPOLATE_DEPTHS[d];
+            Projection p{ 0, 0 };
+            if (reads > 0)
+                p.saturation = 1 - (uniq + projectUnseen(hist, reads, depth)) / (reads * depth);
+            p.median_genes = histogramMedian(genes[k][d]);
+            _projections[k].push_back(p);
+        }
+    }
+}
+
+string Saturation::extrapolation() const
+{
+    if (_projections.empty())
+        return "";
+    std::ostringstream ss;
+    ss.precision(4);
+    ss.setf(std::ios::fixed);
+    ss << "## SATURATION EXTRAPOLATION METRICS\nDEPTH\tSATURATION\tMEDIAN_GENES";
+    for (auto size : _projected_bins)
+        ss << "\tBIN" << size << "_SATURATION\tBIN" << size << "_MEDIAN_GENES";
+    ss << "\n";
+    for (size_t d = 0; d < std::size(SAT_EXTRAPOLATE_DEPTHS); ++d)
+    {
+        ss << SAT_EXTRAPOLATE_DEPTHS[d] << "X";
+        for (auto& p : _projections)
+            ss << "\t" << p[d].saturation << "\t" << p[d].median_genes;
+        ss << "\n";
+    }
+    return ss.str();
+}
+
 int CoordinateBarcode::addData(std::unordered_map< std::string, std::unordered_map< std::string, int > >& raw)
 {
     std::lock_guard< std::mutex > guard(_mutex);
@@ -120,12 +607,13 @@ int CoordinateBarcode::addData(std::unordered_map< std::string, std::unordered_m
             pos0            = t.find_last_of(_barcode_sep);
             int row         = stoi(string(t.substr(pos0 + 1)));
 
-            ST st;
-            st.b1  = col;
-            st.b2  = row;
-            st.umi = encodeUmi(string_view(umi));
-            st.ge  = encodeGene(gene);
-            _st.insert(_st.end(), count, st);
+            Molecule m;
+            m.barcode = (( unsigned long long )( unsigned int )col << 32) + ( unsigned int )row;
+            m.bin     = 0;
+            m.umi     = encodeUmi(string_view(umi));
+            m.ge      = encodeGene(gene);
+            m.reads   = count;
+            _molecules.push_back(m);
 
             _nreads += count;
         }
@@ -134,95 +622,58 @@ int CoordinateBarcode::addData(std::unordered_map< std::string, std::unordered_m
     return 0;
 }
 
-template < class T1, class T2 > Metrics Saturation::saturation(unordered_map< T1, unordered_map< T2, int > >& data)
+string CoordinateBarcode::sample()
 {
-    Metrics                  metrics;
-    size_t                   n_reads     = 0;
-    size_t                   n_reads_sat = 0;
-    size_t                   n_uniq      = 0;
-    vector< int >            n_genes;
-    std::set< unsigned int > genes;
-    for (auto& b : data)
+    // The columns of the default bin keep their names
+    std::stringstream ss;
+    ss << "#sample bar_x bar_y1 bar_y2";
+    for (auto size : _bins)
     {
-        genes.clear();
-        for (auto& p : b.second)
-        {
-            n_reads += p.second;
-            unsigned int gene = ( unsigned int )(p.first >> 32);
-            if (gene != nogene_idx)
-            {
-                genes.insert(gene);
-                ++n_uniq;
-                n_reads_sat += p.second;
-            }
-        }
-        n_genes.push_back(genes.size());
+        string name = _bins == vector< int >{ 150 } ? "bin" : "bin" + std::to_string(size);
+        ss << " " << name << "_x " << name << "_y1 " << name << "_y2";
     }
-    if (n_reads == 0)
+    ss << "\n";
+
+    // Shards are cut at square tiles whose size is a multiple of all the bin sizes,
+    // so the bins never cross shards
+    unsigned long long tile = 1;
+    for (auto size : _bins)
+        tile = std::lcm(tile, ( unsigned long long )size);
+    tile *= std::max(1ULL, SAT_TILE_SIZE / tile);
+    for (auto& m : _molecules)
     {
-        return metrics;
+        unsigned long long col = m.barcode >> 32, row = m.barcode & 0xffffffff;
+        m.bin                  = (row / tile << 16) + col / tile;
     }
+    mergeMolecules();
+    vector< Metrics >           barcode_metrics;
+    vector< vector< Metrics > > bin_metrics;
+    sampleAll(barcode_metrics, bin_metrics, _bins);
+    extrapolate(_bins);
 
-    std::nth_element(n_genes.begin(), n_genes.begin() + n_genes.size() / 2, n_genes.end());
-
-    metrics.reads        = n_reads;
-    metrics.reads_sat    = n_reads_sat;
-    metrics.uniq         = n_uniq;
-    metrics.median_genes = *(n_genes.begin() + n_genes.size() / 2);
-
-    return metrics;
-}
-
-string CoordinateBarcode::sample()
-{
-    std::stringstream ss;
-    ss << "#sample bar_x bar_y1 bar_y2 bin_x bin_y1 bin_y2\n";
-
-    std::random_device rd;
-    std::mt19937       gen(rd());
-    std::shuffle(_st.begin(), _st.end(), gen);
-
-    unordered_map< unsigned long long, unordered_map< unsigned long long, int > > data;
-    unordered_map< unsigned int, unordered_map< unsigned long long, int > >       data_bin;
-    size_t                                                                        p = 0;
     for (size_t i = 1; i < _samples.size(); ++i)
     {
         spdlog::info("Saturation sample:{}", _samples[i]);
         ss << _samples[i] << " ";
 
-        size_t size = size_t(_samples[i] * _nreads);
-        for (; p < size; ++p)
-        {
-            ST                 st      = _st[p];
-            unsigned long long barcode = (( unsigned long long )st.b1 << 32) + st.b2;
-            if (data.count(barcode) == 0)
-                data[barcode] = {};
-            unsigned long long value = (( unsigned long long )st.ge << 32) + st.umi;
-            ++data[barcode][value];
-
-            unsigned int col         = st.b1 / _bin;
-            unsigned int row         = st.b2 / _bin;
-            unsigned int new_barcode = (row << 16) + col;
-            if (data_bin.count(new_barcode) == 0)
-                data_bin[new_barcode] = {};
-            ++data_bin[new_barcode][value];
-        }
-
         // Barcode
-        Metrics metrics;
-        metrics = saturation(data);
+        Metrics metrics = barcode_metrics[i - 1];
         if (metrics.reads == 0)
         {
             spdlog::warn("Invalid data: n_reads == 0");
             continue;
         }
-        ss << metrics.reads / data.size() << " " << 1 - (metrics.uniq * 1.0 / metrics.reads_sat) << " "
-           << metrics.median_genes << " ";
+        ss << metrics.reads / metrics.barcodes << " " << 1 - (metrics.uniq * 1.0 / metrics.reads_sat) << " "
+           << metrics.median_genes;
 
         // Bin
-        metrics = saturation(data_bin);
-        ss << metrics.reads / data_bin.size() << " " << 1 - (metrics.uniq * 1.0 / metrics.reads_sat) << " "
-           << metrics.median_genes << std::endl;
+        for (auto& bin : bin_metrics)
+        {
+            metrics = bin[i - 1];
+            ss << " " << metrics.reads / metrics.barcodes << " " << 1 - (metrics.uniq * 1.0 / metrics.reads_sat) << " "
+               << metrics.median_genes;
+        }
+        ss << std::endl;
     }
 
     return ss.str();
@@ -244,11 +695,13 @@ int SequenceBarcode::addData(std::unordered_map< std::string, std::unordered_map
             string      barcode = string(tmp.substr(0, pos0));
             string      gene    = string(tmp.substr(pos0 + 1));
 
-            ST st;
-            st.bar = barcode;
-            st.umi = encodeUmi(string_view(umi));
-            st.ge  = encodeGene(gene);
-            _st.insert(_st.end(), count, st);
+            Molecule m;
+            m.barcode = _bar2i.emplace(barcode, _bar2i.size()).first->second;
+            m.bin     = m.barcode;
+            m.umi     = encodeUmi(string_view(umi));
+            m.ge      = encodeGene(gene);
+            m.reads   = count;
+            _molecules.push_back(m);
 
             _nreads += count;
         }
@@ -262,37 +715,25 @@ string SequenceBarcode::sample()
     std::stringstream ss;
     ss << "#sample bar_x bar_y1 bar_y2\n";
 
-    std::random_device rd;
-    std::mt19937       gen(rd());
-    std::shuffle(_st.begin(), _st.end(), gen);
+    mergeMolecules();
+    vector< Metrics >           barcode_metrics;
+    vector< vector< Metrics > > bin_metrics;
+    sampleAll(barcode_metrics, bin_metrics, {});
+    extrapolate({});
 
-    unordered_map< string, unordered_map< unsigned long long, int > > data;
-    size_t                                                            p = 0;
     for (size_t i = 1; i < _samples.size(); ++i)
     {
         spdlog::info("Saturation sample:{}", _samples[i]);
         ss << _samples[i] << " ";
 
-        size_t size = size_t(_samples[i] * _nreads);
-        for (; p < size; ++p)
-        {
-            ST     st      = _st[p];
-            string barcode = st.bar;
-            if (data.count(barcode) == 0)
-                data[barcode] = {};
-            unsigned long long value = (( unsigned long long )st.ge << 32) + st.umi;
-            ++data[barcode][value];
-        }
-
         // Barcode
-        Metrics metrics;
-        metrics = saturation(data);
+        Metrics metrics = barcode_metrics[i - 1];
         if (metrics.reads == 0)
         {
             spdlog::warn("Invalid data: n_reads == 0");
             continue;
         }
-        ss << metrics.reads / data.size() << " " << 1 - (metrics.uniq * 1.0 / metrics.reads_sat) << " "
+        ss << metrics.reads / metrics.barcodes << " " << 1 - (metrics.uniq * 1.0 / metrics.reads_sat) << " "
            << metrics.median_genes << endl;
     }
 
@@ -21,10 +21,34 @@ using std::vector;
 
 struct Metrics
 {
+    Metrics() : reads(0), reads_sat(0), uniq(0), median_genes(0), barcodes(0) {}
     size_t reads;
     size_t reads_sat;
     size_t uniq;
     size_t median_genes;
+    size_t barcodes;  // barcodes with sampled reads
+};
+
+// One unique barcode gene umi with its reads. Saturation keeps the molecules
+// instead of the reads, a sample keeps each read with the sampling fraction, so
+// the sampled reads of a molecule are drawn from the binomial distribution.
+struct Molecule
+{
+    unsigned long long barcode;
+    unsigned int       bin;  // tile of the spot which shards the molecules, or the barcode number
+    unsigned int       ge;
+    unsigned int       umi;
+    unsigned int       reads;
+};
+
+// Depths relative to the sequenced reads that saturation is extrapolated to
+static const int SAT_EXTRAPOLATE_DEPTHS[] = { 1, 2, 5, 10 };
+
+// Extrapolated metrics of spots or bins at one depth
+struct Projection
+{
+    double saturation;
+    size_t median_genes;  // of the projected genes rounded to whole genes
 };
 
 class Saturation
@@ -40,7 +64,7 @@ public:
     }
 
     // Calculate sequencing saturation
-    virtual int calculateSaturation(string& out_file);
+    virtual int calculateSaturation(string& out_file, int threads = 1);
 
     // Encode umi sequence to uint32
     unsigned int encodeUmi(string_view sv);
@@ -53,7 +77,26 @@ public:
         return "";
     }
 
-    template < class T1, class T2 > Metrics saturation(unordered_map< T1, unordered_map< T2, int > >& data);
+    // Sort the molecules by bin, barcode, gene and umi, and merge the same ones
+    // added from different tasks
+    void mergeMolecules();
+    // Metrics of barcodes, and of bins if binned, at each sampling fraction. The
+    // molecules are cut into shards of whole bins, and all the fractions of a shard
+    // are sampled in one pass on all cores.
+    void sampleAll(vector< Metrics >& barcode_metrics, vector< vector< Metrics > >& bin_metrics,
+                   const vector< int >& bins);
+
+    // Extrapolate the saturation and the median genes to the deeper sequencing from
+    // the histogram of reads per molecule with the smoothed Good-Toulmin estimator,
+    // without sampling. Spots and each size of bins are projected.
+    void extrapolate(const vector< int >& bins);
+    // Section of the summary file, empty if not extrapolated
+    string extrapolation() const;
+
+    // The sampling fractions in (0, 1], the full data is always sampled
+    void setSamples(vector< float > samples);
+    // Sizes of the square bins counted as spots, all of them in one sampling pass
+    void setBins(vector< int > bins);
 
 public:
     unordered_map< string, unsigned int > _ge2i;
@@ -65,11 +108,23 @@ public:
 
     char _sep;
     char _barcode_sep;
-    int  _bin;
+
+    vector< int > _bins;
 
     vector< float > _samples;
 
     unsigned int nogene_idx;
+
+    vector< Molecule > _molecules;
+    int                _threads;
+
+    // Projections of spots and the bins of each size, by depth
+    vector< vector< Projection > > _projections;
+    vector< int >                  _projected_bins;
+
+private:
+    // Shards of whole tiles, see Molecule::bin
+    vector< size_t > shardBounds() const;
 };
 
 class CoordinateBarcode : public Saturation
@@ -78,15 +133,6 @@ public:
     virtual int addData(std::unordered_map< std::string, std::unordered_map< std::string, int > >& raw);
 
     virtual string sample();
-
-    struct ST
-    {
-        unsigned int b1;
-        unsigned int b2;
-        unsigned int ge;
-        unsigned int umi;
-    };
-    vector< ST > _st;
 };
 
 class SequenceBarcode : public Saturation
@@ -96,11 +142,6 @@ public:
 
     virtual string sample();
 
-    struct ST
-    {
-        string       bar;
-        unsigned int ge;
-        unsigned int umi;
-    };
-    vector< ST > _st;
+    // Barcodes are numbered, the molecules keep the number
+    unordered_map< string, unsigned int > _bar2i;
 };
\ No newline at end of file
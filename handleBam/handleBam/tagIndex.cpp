@@ -0,0 +1,397 @@
+/*
+ * File: tagIndex.cpp
+ * Created Data: 2026-10-18
+ * Author: fxzhao
+ * Contact: <zhaofuxiang@genomics.cn>
+ *
+ * Copyright (c) 2026 BGI-Research
+ */
+
+#include <algorithm>
+#include <cstring>
+#include <filesystem>
+namespace fs = std::filesystem;
+
+#include <spdlog/spdlog.h>
+
+#include "htslib/bgzf.h"
+#include "tagIndex.h"
+#include "utils.h"
+
+static const char CB_TAG[] = "CB";
+static const char GE_TAG[] = "GE";
+
+static void putVarint(std::string& out, uint64 v)
+{
+    while (v >= 0x80)
+    {
+        out.push_back(char((v & 0x7f) | 0x80));
+        v >>= 7;
+    }
+    out.push_back(char(v));
+}
+
+static uint64 getVarint(const char*& p)
+{
+    uint64 v     = 0;
+    int    shift = 0;
+    while (true)
+    {
+        uint8 c = uint8(*p++);
+        v |= uint64(c & 0x7f) << shift;
+        if (c < 0x80)
+            return v;
+        shift += 7;
+    }
+}
+
+// The string of a Z type tag, nullptr if not found
+static const char* getTagZ(const bam1_t* b, const char tag[2])
+{
+    const uint8_t* aux = bam_aux_get(b, tag);
+    return aux == nullptr ? nullptr : bam_aux2Z(aux);
+}
+
+void TagIndex::add(Posting& p, uint64 voff)
+{
+    // Records of a key in the same block share the entry of the first one
+    if (p.num != 0 && p.last >> 16 == voff >> 16)
+        return;
+    putVarint(p.deltas, voff - p.last);
+    p.last = voff;
+    ++p.num;
+}
+
+void TagIndex::push(const bam1_t* b, uint64 voff)
+{
+    if (const char* barcode = getTagZ(b, CB_TAG))
+    {
+        int x, y;
+        if (parse_coordinate(barcode, x, y))
+            add(tiles[tileKey(floorDiv(x, TAG_INDEX_TILE_SIZE), floorDiv(y, TAG_INDEX_TILE_SIZE))], voff);
+        else
+            add(barcodes[barcode], voff);
+    }
+    if (const char* gene = getTagZ(b, GE_TAG))
+        add(genes[gene], voff);
+}
+
+void TagIndex::merge(const TagIndex& part, int64 delta)
+{
+    if (!part.valid)
+        valid = false;
+    if (!valid)
+        return;
+
+    // The blocks are moved, the offsets within them are kept
+    uint64 shift  = uint64(delta) << 16;
+    auto   append = [shift](Posting& p, const Posting& q) {
+        const char* s    = q.deltas.data();
+        uint64      voff = 0;
+        for (uint32 i = 0; i < q.num; ++i)
+        {
+            voff += getVarint(s);
+            add(p, voff + shift);
+        }
+    };
+    for (auto& [key, q] : part.tiles)
+        append(tiles[key], q);
+    for (auto& [key, q] : part.barcodes)
+        append(barcodes[key], q);
+    for (auto& [key, q] : part.genes)
+        append(genes[key], q);
+}
+
+int TagIndex::save(const std::string& filename) const
+{
+    TagIndexHeader h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, TAG_INDEX_MAGIC, sizeof(h.magic));
+    h.version   = TAG_INDEX_VERSION;
+    h.tile_size = TAG_INDEX_TILE_SIZE;
+
+    std::string                  pool, blocks;
+    std::vector< TagIndexKey >   keys[TAG_KEY_KIND_NUM];
+    std::vector< const uint64* > tile_order;
+    for (auto& p : tiles)
+        tile_order.push_back(&p.first);
+    // Tile keys are y << 32 | x, sort them as signed y and x
+    std::sort(tile_order.begin(), tile_order.end(), [](const uint64* a, const uint64* b) {
+        return std::make_pair(int32(*a >> 32), int32(*a)) < std::make_pair(int32(*b >> 32), int32(*b));
+    });
+    for (auto k : tile_order)
+    {
+        const Posting& p = tiles.at(*k);
+        keys[TAG_KEY_TILE].push_back({ int32(*k), int32(*k >> 32), blocks.size(), uint32(p.deltas.size()), p.num });
+        blocks += p.deltas;
+    }
+    auto addNames = [&](const std::unordered_map< std::string, Posting >& postings, TagKeyKind kind) {
+        std::vector< const std::string* > names;
+        for (auto& p : postings)
+            names.push_back(&p.first);
+        std::sort(names.begin(), names.end(), [](const std::string* a, const std::string* b) { return *a < *b; });
+        for (auto name : names)
+        {
+            const Posting& p = postings.at(*name);
+            keys[kind].push_back(
+                { int32(pool.size()), int32(name->size()), blocks.size(), uint32(p.deltas.size()), p.num });
+            pool += *name;
+            blocks += p.deltas;
+        }
+    };
+    addNames(barcodes, TAG_KEY_BARCODE);
+    addNames(genes, TAG_KEY_GENE);
+
+    size_t offset    = sizeof(h);
+    h.strings_offset = offset;
+    h.strings_size   = pool.size();
+    offset           = align8(offset + pool.size());
+    h.blocks_offset  = offset;
+    h.blocks_size    = blocks.size();
+    offset           = align8(offset + blocks.size());
+    for (int k = 0; k < TAG_KEY_KIND_NUM; ++k)
+    {
+        h.key_offset[k] = offset;
+        h.key_count[k]  = keys[k].size();
+        offset += keys[k].size() * sizeof(TagIndexKey);
+    }
+    h.file_size = offset;
+
+    std::vector< char > image(h.file_size, 0);
+    memcpy(image.data(), &h, sizeof(h));
+    memcpy(image.data() + h.strings_offset, pool.data(), pool.size());
+    memcpy(image.data() + h.blocks_offset, blocks.data(), blocks.size());
+    for (int k = 0; k < TAG_KEY_KIND_NUM; ++k)
+        if (!keys[k].empty())
+            memcpy(image.data() + h.key_offset[k], keys[k].data(), keys[k].size() * sizeof(TagIndexKey));
+
+    return writeFileAtomic(filename, image.data(), image.size());
+}
+
+int TagIndexReader::load(const std::string& filename)
+{
+    header = nullptr;
+    if (!mapped.open(filename))
+        return -1;
+
+    const char* base = mapped.data();
+    size_t      size = mapped.size();
+    const auto* h    = reinterpret_cast< const TagIndexHeader* >(base);
+    bool        valid =
+        size >= sizeof(TagIndexHeader) && memcmp(h->magic, TAG_INDEX_MAGIC, sizeof(h->magic)) == 0
+        && h->version == TAG_INDEX_VERSION && h->file_size == size && h->tile_size > 0
+        && h->strings_offset <= size && h->strings_size <= size - h->strings_offset && h->blocks_offset <= size
+        && h->blocks_size <= size - h->blocks_offset;
+    for (int k = 0; k < TAG_KEY_KIND_NUM && valid; ++k)
+        valid = h->key_offset[k] % 8 == 0 && h->key_offset[k] <= size
+                && h->key_count[k] <= (size - h->key_offset[k]) / sizeof(TagIndexKey);
+    // Check the references of keys once, then queries need no bound checking
+    for (int k = 0; k < TAG_KEY_KIND_NUM && valid; ++k)
+    {
+        const TagIndexKey* ks = reinterpret_cast< const TagIndexKey* >(base + h->key_offset[k]);
+        for (uint64 i = 0; i < h->key_count[k] && valid; ++i)
+        {
+            valid = ks[i].blocks_offset + ks[i].blocks_size <= h->blocks_size
+                    && ks[i].blocks_size <= uint64(ks[i].blocks_num) * 10;
+            if (k != TAG_KEY_TILE)
+                valid = valid && ks[i].a >= 0 && ks[i].b >= 0 && uint64(ks[i].a) + ks[i].b <= h->strings_size;
+        }
+    }
+    if (!valid)
+    {
+        spdlog::error("Invalid bam tag index: {}", filename);
+        mapped.close();
+        return -1;
+    }
+    header = h;
+    return 0;
+}
+
+const TagIndexKey* TagIndexReader::findName(TagKeyKind kind, std::string_view target) const
+{
+    const TagIndexKey* first = keys(kind);
+    const TagIndexKey* last  = first + header->key_count[kind];
+    const TagIndexKey* p =
+        std::lower_bound(first, last, target, [this](const TagIndexKey& k, std::string_view s) { return name(k) < s; });
+    return p != last && name(*p) == target ? p : nullptr;
+}
+
+const TagIndexKey* TagIndexReader::findTile(int32 tx, int32 ty) const
+{
+    const TagIndexKey* first = keys(TAG_KEY_TILE);
+    const TagIndexKey* last  = first + header->key_count[TAG_KEY_TILE];
+    auto               pos   = std::make_pair(ty, tx);
+    auto               less  = [](const TagIndexKey& k, std::pair< int32, int32 > v) {
+        return std::make_pair(k.b, k.a) < v;
+    };
+    const TagIndexKey* p = std::lower_bound(first, last, pos, less);
+    return p != last && p->a == tx && p->b == ty ? p : nullptr;
+}
+
+void TagIndexReader::decode(const TagIndexKey* key, std::vector< uint64 >& offsets) const
+{
+    if (key == nullptr)
+        return;
+    const char* p    = mapped.data() + header->blocks_offset + key->blocks_offset;
+    const char* end  = p + key->blocks_size;
+    uint64      voff = 0;
+    for (uint32 i = 0; i < key->blocks_num && p < end; ++i)
+    {
+        voff += getVarint(p);
+        offsets.push_back(voff);
+    }
+}
+
+void TagIndexReader::tileOffsets(int32 x0, int32 y0, int32 x1, int32 y1, std::vector< uint64 >& offsets) const
+{
+    int32 ts = header->tile_size;
+    for (int32 ty = floorDiv(y0, ts); ty <= floorDiv(y1, ts); ++ty)
+        for (int32 tx = floorDiv(x0, ts); tx <= floorDiv(x1, ts); ++tx)
+            decode(findTile(tx, ty), offsets);
+}
+
+// Sort the offsets and keep the first one of each block
+static void uniqueBlocks(std::vector< uint64 >& offsets)
+{
+    std::sort(offsets.begin(), offsets.end());
+    offsets.erase(std::unique(offsets.begin(), offsets.end(), [](uint64 a, uint64 b) { return a >> 16 == b >> 16; }),
+                  offsets.end());
+}
+
+// Keep the blocks in both of the lists. A record matching both begins after the
+// offsets of both in its block, so read from the later one.
+static void intersect(std::vector< uint64 >& offsets, const std::vector< uint64 >& other)
+{
+    std::vector< uint64 > result;
+    auto                  p = offsets.cbegin(), q = other.cbegin();
+    while (p != offsets.cend() && q != other.cend())
+    {
+        if (*p >> 16 < *q >> 16)
+            ++p;
+        else if (*q >> 16 < *p >> 16)
+            ++q;
+        else
+            result.push_back(std::max(*p++, *q++));
+    }
+    offsets.swap(result);
+}
+
+void TagIndexReader::queryOffsets(const TagQuery& query, std::vector< uint64 >& offsets) const
+{
+    offsets.clear();
+    if (header == nullptr)
+        return;
+
+    std::vector< std::vector< uint64 > > lists;
+    if (!query.gene.empty())
+    {
+        lists.emplace_back();
+        decode(findName(TAG_KEY_GENE, query.gene), lists.back());
+    }
+    if (!query.barcode.empty())
+    {
+        lists.emplace_back();
+        int x, y;
+        if (parse_coordinate(query.barcode, x, y))
+            tileOffsets(x, y, x, y, lists.back());
+        else
+            decode(findName(TAG_KEY_BARCODE, query.barcode), lists.back());
+    }
+    if (query.has_rect)
+    {
+        lists.emplace_back();
+        tileOffsets(query.x0, query.y0, query.x1, query.y1, lists.back());
+    }
+    if (lists.empty())
+        return;
+
+    for (auto& l : lists)
+        uniqueBlocks(l);
+    offsets.swap(lists[0]);
+    for (size_t i = 1; i < lists.size(); ++i)
+        intersect(offsets, lists[i]);
+}
+
+static bool matchRecord(const bam1_t* b, const TagQuery& query)
+{
+    if (!query.gene.empty())
+    {
+        const char* gene = getTagZ(b, GE_TAG);
+        if (gene == nullptr || query.gene != gene)
+            return false;
+    }
+    if (!query.barcode.empty() || query.has_rect)
+    {
+        const char* barcode = getTagZ(b, CB_TAG);
+        if (barcode == nullptr || (!query.barcode.empty() && query.barcode != barcode))
+            return false;
+        int x, y;
+        if (query.has_rect
+            && (!parse_coordinate(barcode, x, y) || x < query.x0 || x > query.x1 || y < query.y0 || y > query.y1))
+            return false;
+    }
+    return true;
+}
+
+int64 fetchRecords(const std::string& bam_file, const TagIndexReader& index, const TagQuery& query,
+                   const std::string& out_file)
+{
+    std::vector< uint64 > offsets;
+    index.queryOffsets(query, offsets);
+
+    htsFile* in = hts_open(bam_file.c_str(), "rb");
+    if (in == nullptr)
+    {
+        spdlog::error("Error opening file:{}", bam_file);
+        return -1;
+    }
+    sam_hdr_t* h    = sam_hdr_read(in);
+    bool       bam  = fs::path(out_file).extension() == ".bam";
+    htsFile*   out  = hts_open(out_file.c_str(), bam ? "wb" : "w");
+    bam1_t*    b    = bam_init1();
+    int64      n    = 0;
+    bool       fail = h == nullptr || out == nullptr || sam_hdr_write(out, h) < 0;
+    for (size_t i = 0; i < offsets.size() && !fail; ++i)
+    {
+        // A record may begin in the middle of a block after a record longer than
+        // a block, so seek to the offset itself unless the previous read stopped there
+        BGZF*  fp    = in->fp.bgzf;
+        uint64 block = offsets[i] >> 16;
+        if (uint64(bgzf_tell(fp)) != offsets[i] && bgzf_seek(fp, int64(offsets[i]), SEEK_SET) < 0)
+        {
+            spdlog::error("Failed seek bam:{} offset:{}", bam_file, offsets[i]);
+            fail = true;
+            break;
+        }
+        // Until the first record beginning in a later block
+        while (uint64(bgzf_tell(fp)) >> 16 == block)
+        {
+            int ret = sam_read1(in, h, b);
+            if (ret < -1)
+                fail = true;
+            if (ret < 0)
+                break;
+            if (!matchRecord(b, query))
+                continue;
+            if (sam_write1(out, h, b) < 0)
+            {
+                fail = true;
+                break;
+            }
+            ++n;
+        }
+    }
+
+    bam_destroy1(b);
+    if (h != nullptr)
+        bam_hdr_destroy(h);
+    if (out != nullptr && hts_close(out) != 0)
+        fail = true;
+    hts_close(in);
+    if (fail)
+    {
+        spdlog::error("Failed fetch records from bam:{} into:{}", bam_file, out_file);
+        return -1;
+    }
+    return n;
+}
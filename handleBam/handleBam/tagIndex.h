@@ -0,0 +1,155 @@
+/*
+ * File: tagIndex.h
+ * Created Data: 2026-10-18
+ * Author: fxzhao
+ * Contact: <zhaofuxiang@genomics.cn>
+ *
+ * Copyright (c) 2026 BGI-Research
+ */
+
+#pragma once
+
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include "htslib/sam.h"
+#include "mappedFile.h"
+#include "types.h"
+
+// Sidecar index of a bam by the barcode and gene tags. Each key holds the virtual
+// offset of its first record in each bgzf block where its records begin, so the
+// records of a spot region or a gene are read by seeking to a few blocks instead
+// of scanning the whole bam. Barcodes which are coordinates are keyed by the square
+// tiles of the chip, the others by name.
+static const char   TAG_INDEX_MAGIC[8]  = { 'H', 'B', 'T', 'A', 'G', 'I', 'D', 'X' };
+static const uint32 TAG_INDEX_VERSION   = 2;
+static const int32  TAG_INDEX_TILE_SIZE = 100;
+static const char   TAG_INDEX_SUFFIX[]  = ".tgi";
+
+enum TagKeyKind
+{
+    TAG_KEY_TILE,
+    TAG_KEY_BARCODE,
+    TAG_KEY_GENE,
+    TAG_KEY_KIND_NUM,
+};
+
+struct TagIndexHeader
+{
+    char   magic[8];
+    uint32 version;
+    int32  tile_size;
+    uint64 file_size;
+    uint64 strings_offset;
+    uint64 strings_size;
+    uint64 blocks_offset;
+    uint64 blocks_size;
+    // Keys of each kind, the tiles are sorted by y and x, the names by string
+    uint64 key_offset[TAG_KEY_KIND_NUM];
+    uint64 key_count[TAG_KEY_KIND_NUM];
+};
+
+struct TagIndexKey
+{
+    int32  a;              // tile x, or the offset of name in strings
+    int32  b;              // tile y, or the length of name
+    uint64 blocks_offset;  // varint deltas of the virtual offsets, the first is from 0
+    uint32 blocks_size;    // in bytes
+    uint32 blocks_num;
+};
+
+// Build the index while the bam is written, see SamWriter and BamCat
+class TagIndex
+{
+public:
+    TagIndex() : valid(true) {}
+
+    // Add the record beginning at the virtual offset voff
+    void push(const bam1_t* b, uint64 voff);
+    // Append the index of a part whose compressed data are moved by delta bytes
+    void merge(const TagIndex& part, int64 delta);
+
+    void invalidate()
+    {
+        valid = false;
+    }
+    bool isValid() const
+    {
+        return valid;
+    }
+
+    // Write the index to file, return 0 if success
+    int save(const std::string& filename) const;
+
+private:
+    struct Posting
+    {
+        Posting() : last(0), num(0) {}
+        uint64      last;  // the last virtual offset added
+        uint32      num;
+        std::string deltas;
+    };
+    static void add(Posting& p, uint64 voff);
+
+    static uint64 tileKey(int32 tx, int32 ty)
+    {
+        return (uint64(uint32(ty)) << 32) | uint32(tx);
+    }
+
+private:
+    bool valid;
+
+    std::unordered_map< uint64, Posting >      tiles;
+    std::unordered_map< std::string, Posting > barcodes, genes;
+};
+
+// Records to fetch, the criteria given are all required
+struct TagQuery
+{
+    TagQuery() : has_rect(false), x0(0), y0(0), x1(0), y1(0) {}
+    std::string gene;
+    std::string barcode;
+    // The closed rectangle of coordinates
+    bool  has_rect;
+    int32 x0, y0, x1, y1;
+};
+
+class TagIndexReader
+{
+public:
+    TagIndexReader() : header(nullptr) {}
+
+    // Map an index file, return 0 if success
+    int load(const std::string& filename);
+
+    // Sorted virtual offsets to read the records of query from, one per bgzf block.
+    // The records beginning in the block from the offset on may match the query.
+    void queryOffsets(const TagQuery& query, std::vector< uint64 >& offsets) const;
+
+private:
+    const TagIndexKey* findName(TagKeyKind kind, std::string_view name) const;
+    const TagIndexKey* findTile(int32 tx, int32 ty) const;
+    void               decode(const TagIndexKey* key, std::vector< uint64 >& offsets) const;
+    void               tileOffsets(int32 x0, int32 y0, int32 x1, int32 y1, std::vector< uint64 >& offsets) const;
+
+    const TagIndexKey* keys(TagKeyKind kind) const
+    {
+        return reinterpret_cast< const TagIndexKey* >(mapped.data() + header->key_offset[kind]);
+    }
+    std::string_view name(const TagIndexKey& k) const
+    {
+        return std::string_view(mapped.data() + header->strings_offset + k.a, k.b);
+    }
+
+private:
+    MappedFile            mapped;
+    const TagIndexHeader* header;
+};
+
+// Write the records of bam matching query into out_file, sam if it doesn't end
+// with .bam. Only the records from the offsets given by the index are read. Return the number of
+// records, or -1 if failed.
+int64 fetchRecords(const std::string& bam_file, const TagIndexReader& index, const TagQuery& query,
+                   const std::string& out_file);
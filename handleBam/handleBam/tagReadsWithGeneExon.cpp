@@ -16,6 +16,7 @@
 #include "annotationException.h"
 #include "bamRecord.h"
 #include "gtfReader.h"
+#include "threadpool.h"
 #include "timer.h"
 
 // Default use drop-seq V2
@@ -37,8 +38,9 @@ struct CmpLocus
 };
 
 std::unordered_map< int, LocusFunction >
-TagReadsWithGeneExon::getLocusFunctionForReadByGene(std::vector< const GeneFromGTF* >& result,
-                                                    std::vector< AlignmentBlock >&     alignmentBlock)
+TagReadsWithGeneExon::getLocusFunctionForReadByGene(std::vector< GeneView >&       result,
+                                                    std::vector< AlignmentBlock >& alignmentBlock,
+                                                    std::vector< uint8 >*          splice_types)
 {
     // Calculate LocusFunction for each overlapped Gene
     std::unordered_map< int, LocusFunction > locusMap;
@@ -46,21 +48,35 @@ TagReadsWithGeneExon::getLocusFunctionForReadByGene(std::vector< const GeneFromG
     if (anno_ver == AnnoVersion::TENX)
     {
         vector< pair< int, int > > total_cnts(result.size());
+        if (splice_types != nullptr)
+            splice_types->assign(result.size(), SPLICE_NONE);
         for (unsigned j = 0; j < result.size(); ++j)
         {
-            const GeneFromGTF* gene     = result[j];
-            pair< int, int >   max_cnts = { 0, 0 };  // <exon numbers, intron numbers>
+            const GeneView&  gene     = result[j];
+            pair< int, int > max_cnts = { 0, 0 };  // <exon numbers, intron numbers>
+            uint8            splice   = SPLICE_NONE;
+            bool             across   = false;  // a block across an exon-intron boundary
             // For every block, find the confidently result
             for (auto& b : alignmentBlock)
             {
                 pair< int, int > cnts = { 0, 0 };
-                for (auto& p : gene->getTranscripts())
+                for (size_t t = 0; t < gene.transcriptNum(); ++t)
                 {
-                    p.second.assignLocusFunction(b.getReferenceStart(), b.getLength(), cnts);
+                    gene.getTranscript(t).assignLocusFunction(b.getReferenceStart(), b.getLength(), cnts);
                 }
                 max_cnts.first += cnts.first;
                 max_cnts.second += cnts.second;
+
+                // The best transcript of the block is the one with most exon bases, if
+                // it still has intron bases no transcript holds the block within exons
+                if (cnts.first > 0)
+                    splice |= SPLICE_SPLICED;
+                if (cnts.second > 0)
+                    splice |= SPLICE_UNSPLICED;
+                across |= cnts.first > 0 && cnts.second > 0;
             }  // end Block
+            if (splice_types != nullptr)
+                (*splice_types)[j] = across ? uint8(SPLICE_UNSPLICED) : splice;
 
             int len = 0;
             for (auto& b : alignmentBlock)
@@ -115,13 +131,13 @@ TagReadsWithGeneExon::getLocusFunctionForReadByGene(std::vector< const GeneFromG
     {
         for (unsigned j = 0; j < result.size(); ++j)
         {
-            const GeneFromGTF* gene = result[j];
-            LocusFunction      locusFunction(LocusFunction::INTERGENIC);
+            const GeneView& gene = result[j];
+            LocusFunction   locusFunction(LocusFunction::INTERGENIC);
             for (auto& b : alignmentBlock)
             {
-                for (auto& p : gene->getTranscripts())
+                for (size_t t = 0; t < gene.transcriptNum(); ++t)
                 {
-                    p.second.assignLocusFunction(b.getReferenceStart(), locusFunction, b.getLength());
+                    gene.getTranscript(t).assignLocusFunction(b.getReferenceStart(), locusFunction, b.getLength());
                     // Exit early for reducing unnecessary calculations
                     if (locusFunction == LocusFunction::CODING)
                         break;
@@ -141,23 +157,26 @@ inline bool intersect(int s1, int e1, int s2, int e2)
     return (s1 <= s2 && s2 <= e1) || (s1 <= e2 && e2 <= e1) || (s2 <= s1 && e1 <= e2);
 }
 
-bool TagReadsWithGeneExon::getAlignmentBlockonGeneExon(AlignmentBlock& b, const GeneFromGTF* gene, std::string contig)
+bool TagReadsWithGeneExon::getAlignmentBlockonGeneExon(AlignmentBlock& b, const GeneView& gene,
+                                                       const std::string& contig)
 {
-    for (auto& p : gene->getTranscripts())
+    if (contig != gene.getContig())
+        return false;
+    for (size_t t = 0; t < gene.transcriptNum(); ++t)
     {
-        for (auto& e : p.second.getExons())
+        TranscriptView transcript = gene.getTranscript(t);
+        for (const IdxExon* e = transcript.exonsBegin(); e != transcript.exonsEnd(); ++e)
         {
-            if (contig == gene->getContig()
-                && intersect(b.getReferenceStart(), b.getReferenceStart() + b.getLength() - 1, e.start, e.end))
+            if (intersect(b.getReferenceStart(), b.getReferenceStart() + b.getLength() - 1, e->start, e->end))
                 return true;
         }
     }
     return false;
 }
 
-std::set< int > TagReadsWithGeneExon::getAlignmentBlockonGeneExon(std::vector< const GeneFromGTF* >&        result,
+std::set< int > TagReadsWithGeneExon::getAlignmentBlockonGeneExon(std::vector< GeneView >&                  result,
                                                                   std::unordered_map< int, LocusFunction >& locusMap,
-                                                                  AlignmentBlock& b, std::string contig)
+                                                                  AlignmentBlock& b, const std::string& contig)
 {
     std::set< int > geneSet;
 
@@ -175,8 +194,9 @@ inline bool readAnnotationMatchStrand(bool annoNegative, bool recordNegative)
     return annoNegative == recordNegative;
 }
 
-std::vector< int > TagReadsWithGeneExon::getGenesConsistentWithReadStrand(std::vector< const GeneFromGTF* >& result,
-                                                                          std::vector< int >& ids, bool recordNegative)
+std::vector< int > TagReadsWithGeneExon::getGenesConsistentWithReadStrand(std::vector< GeneView >& result,
+                                                                          std::vector< int >& ids, bool recordNegative,
+                                                                          AnnotationCounters& counters)
 {
     std::vector< int > sameStrand;
     std::vector< int > oppositeStrand;
@@ -187,7 +207,7 @@ std::vector< int > TagReadsWithGeneExon::getGenesConsistentWithReadStrand(std::v
 
     for (auto& id : ids)
     {
-        bool annoNegative = result[id]->isNegativeStrand();
+        bool annoNegative = result[id].isNegativeStrand();
         bool strandCheck  = readAnnotationMatchStrand(annoNegative, recordNegative);
         if (strandCheck)
             sameStrand.push_back(id);
@@ -197,13 +217,13 @@ std::vector< int > TagReadsWithGeneExon::getGenesConsistentWithReadStrand(std::v
 
     if (sameStrand.size() == 0 && oppositeStrand.size() > 0)
     {
-        reads_wrong_strand++;
+        counters.reads_wrong_strand++;
         // std::get<3>(lastCache) = 1;
         return {};
     }
     if (sameStrand.size() > 1)
     {
-        ambiguous_reads_rejected++;
+        counters.ambiguous_reads_rejected++;
         // std::get<4>(lastCache) = 1;
         return {};
     }
@@ -211,28 +231,28 @@ std::vector< int > TagReadsWithGeneExon::getGenesConsistentWithReadStrand(std::v
     // as it's not 0 and not > 1.
     if (oppositeStrand.size() > 0)
     {
-        read_ambiguous_gene_fixed++;
+        counters.read_ambiguous_gene_fixed++;
         // std::get<5>(lastCache) = 1;
     }
 
-    reads_right_strand++;
+    counters.reads_right_strand++;
     // std::get<6>(lastCache) = 1;
     return sameStrand;
 }
 
 std::pair< std::string, std::string >
-TagReadsWithGeneExon::getCompoundNameAndStrand(std::vector< const GeneFromGTF* >& result, std::vector< int >& ids)
+TagReadsWithGeneExon::getCompoundNameAndStrand(std::vector< GeneView >& result, std::vector< int >& ids)
 {
     std::string geneName, geneStrand;
     for (auto& id : ids)
     {
-        std::string name = result[id]->getName();
+        std::string name(result[id].getName());
         if (geneName.empty())
             geneName = name;
         else
             geneName += RECORD_SEP + name;
 
-        std::string strand = result[id]->isNegativeStrand() ? "-" : "+";
+        std::string strand = result[id].isNegativeStrand() ? "-" : "+";
         if (geneStrand.empty())
             geneStrand = strand;
         else
@@ -266,15 +286,15 @@ int TagReadsWithGeneExon::setAnnotation(BamRecord& record)
             updateStrTags(record, TAG, name);
             updateStrTags(record, STRAND_TAG, strand);
         }
-        ++total_reads;
+        ++default_counters->total_reads;
         if (i1 == 1)
-            ++reads_wrong_strand;
+            ++default_counters->reads_wrong_strand;
         if (i2 == 1)
-            ++ambiguous_reads_rejected;
+            ++default_counters->ambiguous_reads_rejected;
         if (i3 == 1)
-            ++read_ambiguous_gene_fixed;
+            ++default_counters->read_ambiguous_gene_fixed;
         if (i4 == 1)
-            ++reads_right_strand;
+            ++default_counters->reads_right_strand;
         return 0;
     }
     bam_copy1(lastRecord, record);
@@ -292,13 +312,8 @@ int TagReadsWithGeneExon::setAnnotation(BamRecord& record)
     int queryEnd   = queryBegin + getReferenceLength(cigars) - 1;
     // spdlog::debug("setAnnotation query:{} {} - {}", contig, queryBegin, queryEnd);
     // GTree::interval_vector overlapped = trees[contig].findOverlapping(queryBegin, queryEnd);
-    MyInterval                        query_range{ queryBegin, queryEnd };
-    std::vector< const GeneFromGTF* > result;
-    for (const auto& o : mytrees[contig].query(query_range))
-    {
-        // spdlog::debug("{} {}", o.lower, o.upper);
-        result.push_back(&(o.value));
-    }
+    std::vector< GeneView > result;
+    annoIndex.query(contig, queryBegin, queryEnd, result);
     // spdlog::debug("setAnnotation query results num:{}", overlapped.size());
 
     // std::vector<GeneFromGTF> result(overlapped.size());
@@ -360,14 +375,14 @@ int TagReadsWithGeneExon::setAnnotation(BamRecord& record)
     if (USE_STRAND_INFO)
     {
         // constrain gene exons to read strand.
-        genes = getGenesConsistentWithReadStrand(result, genes, getNegativeStrand(record));
+        genes = getGenesConsistentWithReadStrand(result, genes, getNegativeStrand(record), *default_counters);
         if (anno_ver == AnnoVersion::DROP_SEQ_V2)
         {
             // only retain functional map entries that are on the correct strand.
             for (auto& pair : locusMap)
             {
                 int  geneId       = pair.first;
-                bool annoNegative = result[geneId]->isNegativeStrand();
+                bool annoNegative = result[geneId].isNegativeStrand();
                 bool strandCheck  = readAnnotationMatchStrand(annoNegative, getNegativeStrand(record));
                 if (strandCheck)
                     allPassingFunction.push_back(pair.second);
@@ -431,52 +446,65 @@ int TagReadsWithGeneExon::setAnnotation(BamRecord& record)
     return 0;
 }
 
-int TagReadsWithGeneExon::setAnnotation(BamRecord& record, const std::string& contig)
+int TagReadsWithGeneExon::setAnnotation(BamRecord& record, const std::string& contig, AnnotationCounters& counters)
 {
-    total_reads++;
+    counters.total_reads++;
+    std::vector< std::pair< int, int > > cigars = getCigar(record);
+
+    // Change begin position from 0-based to 1-based
+    int                     beginPos   = getRefStart(record) + 1;
+    int                     queryBegin = beginPos;
+    int                     queryEnd   = queryBegin + getReferenceLength(cigars) - 1;
+    std::vector< GeneView > result;
+    annoIndex.query(contig, queryBegin, queryEnd, result);
+
     if (anno_ver != AnnoVersion::TENX)
-        return setAnnotationTS(record, contig);
+        return setAnnotationTS(record, cigars, beginPos, result, contig, counters);
     else
-        return setAnnotationTENX(record, contig);
+        return setAnnotationTENX(record, cigars, beginPos, result, counters);
 }
 
-// Thread safe version of Drop-seq
-int TagReadsWithGeneExon::setAnnotationTS(BamRecord& record, const std::string& contig)
+int TagReadsWithGeneExon::setAnnotationBatch(BamRecord* records, size_t n, const std::string& contig,
+                                             AnnotationCounters& counters, uint8* splice)
 {
-    // spdlog::debug("setAnnotation");
-    // std::string contig = currContig;
+    // Compute the query intervals of all reads
+    std::vector< std::vector< std::pair< int, int > > > cigars(n);
+    std::vector< std::pair< int, int > >                intervals(n);
+    for (size_t i = 0; i < n; ++i)
+    {
+        cigars[i] = getCigar(records[i]);
+        // Change begin position from 0-based to 1-based
+        int beginPos = getRefStart(records[i]) + 1;
+        intervals[i] = { beginPos, beginPos + getReferenceLength(cigars[i]) - 1 };
+    }
 
-    // spdlog::debug("setAnnotation contig:{}", contig);
-    std::vector< std::pair< int, int > > cigars = getCigar(record);
+    // Look up the genes of the whole batch
+    std::vector< std::vector< GeneView > > results;
+    annoIndex.queryBatch(contig, intervals, results);
 
-    // Change begin position from 0-based to 1-based
-    int beginPos = getRefStart(record) + 1;
-    // spdlog::debug("beginPos:{}", beginPos);
-    int queryBegin = beginPos;
-    int queryEnd   = queryBegin + getReferenceLength(cigars) - 1;
-    // spdlog::debug("setAnnotation query:{} {} - {}", contig, queryBegin, queryEnd);
-    // GTree::interval_vector overlapped = trees[contig].findOverlapping(queryBegin, queryEnd);
-    MyInterval                        query_range{ queryBegin, queryEnd };
-    std::vector< const GeneFromGTF* > result;
-
-    // query_mutex.lock();
-    // const auto& tree = mytrees[contig];
-    // if (mytrees.find(contig) != mytrees.end())
-    if (mytrees.count(contig) != 0)
-    {
-        const auto& tree = mytrees.at(contig);
-        // query_mutex.unlock();
-        const auto& res = tree.query(query_range);
-        for (const auto& o : res)
-        {
-            // spdlog::debug("{} {}", o.lower, o.upper);
-            result.push_back(&(o.value));
-        }
+    // Resolve the locus functions
+    counters.total_reads += n;
+    if (splice != nullptr)
+        std::fill(splice, splice + n, uint8(SPLICE_NONE));
+    for (size_t i = 0; i < n; ++i)
+    {
+        if (anno_ver != AnnoVersion::TENX)
+            setAnnotationTS(records[i], cigars[i], intervals[i].first, results[i], contig, counters);
+        else
+            setAnnotationTENX(records[i], cigars[i], intervals[i].first, results[i], counters,
+                              splice != nullptr ? splice + i : nullptr);
     }
+    return 0;
+}
 
+// Thread safe version of Drop-seq
+int TagReadsWithGeneExon::setAnnotationTS(BamRecord& record, std::vector< std::pair< int, int > >& cigars,
+                                          int beginPos, std::vector< GeneView >& result, const std::string& contig,
+                                          AnnotationCounters& counters)
+{
     if (result.empty())
     {
-        nogene_reads++;
+        counters.nogene_reads++;
         return 0;
     }
     // spdlog::debug("setAnnotation query results num:{}", overlapped.size());
@@ -539,14 +567,14 @@ int TagReadsWithGeneExon::setAnnotationTS(BamRecord& record, const std::string&
     if (USE_STRAND_INFO)
     {
         // constrain gene exons to read strand.
-        genes = getGenesConsistentWithReadStrand(result, genes, getNegativeStrand(record));
+        genes = getGenesConsistentWithReadStrand(result, genes, getNegativeStrand(record), counters);
         if (anno_ver == AnnoVersion::DROP_SEQ_V2)
         {
             // only retain functional map entries that are on the correct strand.
             for (auto& pair : locusMap)
             {
                 int  geneId       = pair.first;
-                bool annoNegative = result[geneId]->isNegativeStrand();
+                bool annoNegative = result[geneId].isNegativeStrand();
                 bool strandCheck  = readAnnotationMatchStrand(annoNegative, getNegativeStrand(record));
                 if (strandCheck)
                     allPassingFunction.push_back(pair.second);
@@ -611,36 +639,19 @@ int TagReadsWithGeneExon::setAnnotationTS(BamRecord& record, const std::string&
 }
 
 // TENX version
-int TagReadsWithGeneExon::setAnnotationTENX(BamRecord& record, const std::string& contig)
+int TagReadsWithGeneExon::setAnnotationTENX(BamRecord& record, std::vector< std::pair< int, int > >& cigars,
+                                            int beginPos, std::vector< GeneView >& result,
+                                            AnnotationCounters& counters, uint8* splice)
 {
     // if (record->core.flag == 0)
     //     return 0;
     bool confidently = getQual(record) >= 255;
     if (confidently)
-        map_reads++;
-
-    std::vector< std::pair< int, int > > cigars = getCigar(record);
-
-    // Change begin position from 0-based to 1-based
-    int                               beginPos   = getRefStart(record) + 1;
-    int                               queryBegin = beginPos;
-    int                               queryEnd   = queryBegin + getReferenceLength(cigars) - 1;
-    MyInterval                        query_range{ queryBegin, queryEnd };
-    std::vector< const GeneFromGTF* > result;
-
-    if (mytrees.count(contig) != 0)
-    {
-        const auto& tree = mytrees.at(contig);
-        const auto& res  = tree.query(query_range);
-        for (const auto& o : res)
-        {
-            result.push_back(&(o.value));
-        }
-    }
+        counters.map_reads++;
 
     if (result.empty())
     {
-        nogene_reads++;
+        counters.nogene_reads++;
         return 0;
     }
     // Ignore multi-genes
@@ -652,7 +663,9 @@ int TagReadsWithGeneExon::setAnnotationTENX(BamRecord& record, const std::string
 
     // Set annotations and record the metrics.
     std::vector< AlignmentBlock >            alignmentBlock = getAlignmentBlocks(cigars, beginPos);
-    std::unordered_map< int, LocusFunction > locusMap       = getLocusFunctionForReadByGene(result, alignmentBlock);
+    std::vector< uint8 >                     splice_types;
+    std::unordered_map< int, LocusFunction > locusMap =
+        getLocusFunctionForReadByGene(result, alignmentBlock, splice != nullptr ? &splice_types : nullptr);
 
     // Pick one gene from multi-genes
     std::vector< int > genes;
@@ -675,18 +688,18 @@ int TagReadsWithGeneExon::setAnnotationTENX(BamRecord& record, const std::string
     // }
     if (genes.empty())
     {
-        intergenic_reads++;
+        counters.intergenic_reads++;
         return 0;
     }
     // if (genes.size() > 1 && !ALLOW_MULTI_GENE_READS)
     //     genes.resize(1);
 
-    bool annoNegative = result[genes[0]]->isNegativeStrand();
+    bool annoNegative = result[genes[0]].isNegativeStrand();
     bool strandCheck  = readAnnotationMatchStrand(annoNegative, getNegativeStrand(record));
     if (strandCheck)
-        reads_right_strand++;
+        counters.reads_right_strand++;
     else
-        reads_wrong_strand++;
+        counters.reads_wrong_strand++;
 
     LocusFunction        f   = locusMap[genes[0]];
     [[maybe_unused]] int ret = updateStrTags(record, FUNCTION_TAG, LocusString[int(f)]);
@@ -695,19 +708,21 @@ int TagReadsWithGeneExon::setAnnotationTENX(BamRecord& record, const std::string
     {
         if (f == LocusFunction::CODING)
         {
-            exonic_reads++;
+            counters.exonic_reads++;
             if (strandCheck)
-                transcriptome_reads++;
+                counters.transcriptome_reads++;
         }
         else if (f == LocusFunction::INTERGENIC)
-            intergenic_reads++;
+            counters.intergenic_reads++;
         else if (f == LocusFunction::INTRONIC)
-            intronic_reads++;
+            counters.intronic_reads++;
     }
 
     // Only dump gene name when locus is Exon or Intro
     if (f == LocusFunction::INTERGENIC)
         genes.clear();
+    else if (splice != nullptr)
+        *splice = splice_types[genes[0]];
     std::pair< std::string, std::string > p = getCompoundNameAndStrand(result, genes);
     if (!p.first.empty() && !p.second.empty())
     {
@@ -774,62 +789,93 @@ int TagReadsWithGeneExon::setAnnotationTENX(BamRecord& record, const std::string
 // 	return 0;
 // }
 
-int TagReadsWithGeneExon::makeOverlapDetectorV2()
+// Build genes from every stride-th gene, the records are released once consumed
+static void makeGenes(std::vector< std::vector< GTFRecord >* >& recordsByGene, int first, int stride,
+                      std::vector< GeneFromGTF >& genes)
 {
-    spdlog::debug("Begin makeOverlapDetector");
-
-    Timer                                                       load_timer;
-    GTFReader                                                   gtfReader;
-    std::unordered_map< std::string, std::vector< GTFRecord > > gatherByGeneName;
-    try
-    {
-        gtfReader.loadGTFFile(annotation_filename, gatherByGeneName);
-    }
-    catch (AnnotationException& e)
-    {
-        spdlog::error(e.what());
-        return -1;
-    }
-    catch (std::exception& e)
+    GeneBuilder geneBuilder;
+    for (size_t i = first; i < recordsByGene.size(); i += stride)
     {
-        spdlog::error(e.what());
-        return -1;
+        try
+        {
+            std::vector< GeneFromGTF > res = geneBuilder.makeGene(std::move(*recordsByGene[i]));
+            std::move(res.begin(), res.end(), std::back_inserter(genes));
+        }
+        catch (AnnotationException& e)
+        {
+            spdlog::debug("{} {}", e.what(), "-- skipping");
+        }
+        std::vector< GTFRecord >().swap(*recordsByGene[i]);
     }
-    spdlog::info("loadGTFFile time(s):{:.2f}", load_timer.toc(1000));
+}
 
-    int         numGene = 0;
-    GeneBuilder geneBuilder;
-    GTFIterator gtfIterator = gatherByGeneName.begin();
+int TagReadsWithGeneExon::makeOverlapDetectorV2(int threads)
+{
+    spdlog::debug("Begin makeOverlapDetector");
 
-    for (; gtfIterator != gatherByGeneName.end(); ++gtfIterator)
+    Timer load_timer;
+    if (AnnotationIndex::isIndexFile(annotation_filename))
     {
+        // The compiled index is mapped directly, nothing to parse
+        if (annoIndex.load(annotation_filename) != 0)
+            return -1;
+        spdlog::info("load annotation index time(s):{:.2f}", load_timer.toc(1000));
+    }
+    else
+    {
+        GTFReader gtfReader(threads);
+        GTFMap    gatherByGeneName;
         try
         {
-            std::vector< GeneFromGTF > genes = geneBuilder.makeGene(gtfIterator);
-            for (auto& gene : genes)
-            {
-                Node node;
-                node.lower = gene.getStart();
-                node.upper = gene.getEnd();
-                node.value = gene;
-                nodes.push_back(std::move(node));
-                ++numGene;
-            }
+            gtfReader.loadGTFFile(annotation_filename, gatherByGeneName);
         }
         catch (AnnotationException& e)
         {
-            spdlog::debug("{} {}", e.what(), "-- skipping");
-            continue;
+            spdlog::error(e.what());
+            return -1;
+        }
+        catch (std::exception& e)
+        {
+            spdlog::error(e.what());
+            return -1;
+        }
+        spdlog::info("loadGTFFile time(s):{:.2f}", load_timer.toc(1000));
+
+        // Build genes on all threads, each thread owns a buffer of genes
+        std::vector< std::vector< GTFRecord >* > recordsByGene;
+        recordsByGene.reserve(gatherByGeneName.size());
+        for (auto& p : gatherByGeneName)
+            recordsByGene.push_back(&p.second);
+
+        int                                       thread_num = std::max(1, std::min(threads, int(recordsByGene.size())));
+        std::vector< std::vector< GeneFromGTF > > buffers(thread_num);
+        {
+            std::threadpool                    tp(thread_num);
+            std::vector< std::future< void > > results;
+            for (int t = 0; t < thread_num; ++t)
+                results.push_back(tp.commit(makeGenes, std::ref(recordsByGene), t, thread_num, std::ref(buffers[t])));
+            for (auto& r : results)
+                r.get();
         }
+        // All the records have been consumed
+        GTFMap().swap(gatherByGeneName);
+
+        size_t numGene = 0;
+        for (auto& b : buffers)
+            numGene += b.size();
+        std::vector< GeneFromGTF > geneModels;
+        geneModels.reserve(numGene);
+        for (auto& b : buffers)
+        {
+            std::move(b.begin(), b.end(), std::back_inserter(geneModels));
+            std::vector< GeneFromGTF >().swap(b);
+        }
+        annoIndex.build(geneModels);
+        std::vector< GeneFromGTF >().swap(geneModels);
+        spdlog::info("makeOverlapDetector time(s):{:.2f}", load_timer.toc(1000));
     }
-    // spdlog::debug("mytrees size:{}", mytrees.size());
-    // for (auto& p : mytrees)
-    // 	spdlog::debug("mytrees key:{}", p.first);
-    for (auto& node : nodes)
-        mytrees[node.value.getContig()].insert(node);
-    spdlog::info("makeOverlapDetector time(s):{:.2f}", load_timer.toc(1000));
 
-    spdlog::info("Gene count:{}", numGene);
+    spdlog::info("Gene count:{}", annoIndex.geneNum());
     spdlog::debug("End makeOverlapDetector");
 
     lastRecord = createBamRecord();
@@ -838,31 +884,70 @@ int TagReadsWithGeneExon::makeOverlapDetectorV2()
     return 0;
 }
 
+int TagReadsWithGeneExon::saveOverlapDetector(const std::string& index_filename)
+{
+    return annoIndex.save(index_filename);
+}
+
+AnnotationCounters& AnnotationCounters::operator+=(const AnnotationCounters& other)
+{
+    total_reads += other.total_reads;
+    reads_right_strand += other.reads_right_strand;
+    reads_wrong_strand += other.reads_wrong_strand;
+    ambiguous_reads_rejected += other.ambiguous_reads_rejected;
+    read_ambiguous_gene_fixed += other.read_ambiguous_gene_fixed;
+
+    map_reads += other.map_reads;
+    exonic_reads += other.exonic_reads;
+    intronic_reads += other.intronic_reads;
+    intergenic_reads += other.intergenic_reads;
+    transcriptome_reads += other.transcriptome_reads;
+    multigene_reads += other.multigene_reads;
+    nogene_reads += other.nogene_reads;
+    return *this;
+}
+
+AnnotationCounters* TagReadsWithGeneExon::registerCounters()
+{
+    std::lock_guard< std::mutex > lock(counters_mutex);
+    counters_blocks.emplace_back(new AnnotationCounters());
+    return counters_blocks.back().get();
+}
+
 std::string TagReadsWithGeneExon::dumpMetrics()
 {
+    // Sum up the blocks of all workers
+    AnnotationCounters c;
+    {
+        std::lock_guard< std::mutex > lock(counters_mutex);
+        for (auto& block : counters_blocks)
+            c += *block;
+    }
     spdlog::info("TOTAL READS [{}] CORRECT_STRAND [{}]  WRONG_STRAND [{}] AMBIGUOUS_STRAND_FIXED [{}] AMBIGUOUS "
                  "REJECTED READS [{}]",
-                 total_reads, reads_right_strand, reads_wrong_strand, read_ambiguous_gene_fixed,
-                 ambiguous_reads_rejected);
+                 c.total_reads, c.reads_right_strand, c.reads_wrong_strand, c.read_ambiguous_gene_fixed,
+                 c.ambiguous_reads_rejected);
     std::stringstream ss;
     ss << "## ANNOTATION METRICS\n";
     if (anno_ver != AnnoVersion::TENX)
     {
         ss << "TOTAL_READS\tREADS_WRONG_STRAND\tREADS_RIGHT_STRAND\tREAD_AMBIGUOUS_GENE_FIXED\tAMBIGUOUS_"
               "READS_REJECTED\n";
-        ss << total_reads << "\t" << reads_wrong_strand << "\t" << reads_right_strand << "\t"
-           << read_ambiguous_gene_fixed << "\t" << ambiguous_reads_rejected << std::endl;
+        ss << c.total_reads << "\t" << c.reads_wrong_strand << "\t" << c.reads_right_strand << "\t"
+           << c.read_ambiguous_gene_fixed << "\t" << c.ambiguous_reads_rejected << std::endl;
     }
     else
     {
         ss << "TOTAL_READS\tMAP\tEXONIC\tINTRONIC\tINTERGENIC\tTRANSCRIPTOME\tANTISENSE\n";
-        ss << total_reads << "\t" << map_reads << "\t" << exonic_reads << "\t" << intronic_reads << "\t"
-           << intergenic_reads + nogene_reads << "\t" << transcriptome_reads << "\t" << reads_wrong_strand << std::endl;
+        ss << c.total_reads << "\t" << c.map_reads << "\t" << c.exonic_reads << "\t" << c.intronic_reads << "\t"
+           << c.intergenic_reads + c.nogene_reads << "\t" << c.transcriptome_reads << "\t" << c.reads_wrong_strand
+           << std::endl;
         ss.flags(std::ios::fixed);
         ss.precision(1);
-        ss << 100.0 << "\t" << map_reads * 100.0 / total_reads << "\t" << exonic_reads * 100.0 / total_reads << "\t"
-           << intronic_reads * 100.0 / total_reads << "\t" << (intergenic_reads + nogene_reads) * 100.0 / total_reads
-           << "\t" << transcriptome_reads * 100.0 / total_reads << "\t" << reads_wrong_strand * 100.0 / total_reads
+        ss << 100.0 << "\t" << c.map_reads * 100.0 / c.total_reads << "\t"
+           << c.exonic_reads * 100.0 / c.total_reads << "\t" << c.intronic_reads * 100.0 / c.total_reads << "\t"
+           << (c.intergenic_reads + c.nogene_reads) * 100.0 / c.total_reads << "\t"
+           << c.transcriptome_reads * 100.0 / c.total_reads << "\t" << c.reads_wrong_strand * 100.0 / c.total_reads
            << "\t" << std::endl;
     }
 
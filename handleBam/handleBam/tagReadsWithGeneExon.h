@@ -10,23 +10,22 @@
 #pragma once
 
 #include <filesystem>
+#include <memory>
 #include <mutex>
 #include <set>
 #include <string>
 #include <tuple>
 using std::string;
-#include <atomic>
 // namespace fs = std::filesystem;
 
 #include <spdlog/spdlog.h>
 
-// Alternative interval tree implemented base on red-black tree.
-#include "ygg.hpp"
-
+#include "annotationIndex.h"
 #include "bamRecord.h"
 #include "bamUtils.h"
 #include "geneBuilder.h"
 #include "locusFunction.h"
+#include "types.h"
 
 enum AnnoVersion
 {
@@ -35,44 +34,41 @@ enum AnnoVersion
     TENX,
 };
 
-using MyInterval = std::pair< int, int >;
-template < class Node > class NodeTraits : public ygg::ITreeNodeTraits< Node >
+// Splicing state of a read on its gene for RNA velocity, only set in TENX mode.
+// The states of the reads of one molecule are or-ed, so a molecule with both
+// spliced and unspliced reads is ambiguous.
+enum SpliceType
 {
-public:
-    using key_type = int;
-    static int get_lower(const Node& node)
-    {
-        return node.lower;
-    }
-    static int get_upper(const Node& node)
-    {
-        return node.upper;
-    }
-    static int get_lower(const MyInterval& i)
-    {
-        return std::get< 0 >(i);
-    }
-    static int get_upper(const MyInterval& i)
-    {
-        return std::get< 1 >(i);
-    }
+    SPLICE_NONE      = 0,  // no gene
+    SPLICE_SPLICED   = 1,  // all the blocks on exons
+    SPLICE_UNSPLICED = 2,  // all the blocks on introns, or a block across an exon-intron boundary
+    SPLICE_AMBIGUOUS = 3,  // blocks on exons and blocks on introns
 };
 
-class Node : public ygg::ITreeNodeBase< Node, NodeTraits< Node > >
+// Annotation statistics of one worker. Each worker owns a block and updates it
+// without synchronization, the block is padded to a cache line so that the
+// blocks of different workers never share one.
+struct alignas(64) AnnotationCounters
 {
-public:
-    // Node(int upper_, int lower_, GeneFremGTF gene_)
-    // 	: upper(upper_),
-    // 	lower(lower_),
-    // 	value(gene_) {}
-
-    int         upper;
-    int         lower;
-    GeneFromGTF value;
+    // Statistics for Drop-seq
+    uint64 total_reads               = 0;
+    uint64 reads_right_strand        = 0;
+    uint64 reads_wrong_strand        = 0;
+    uint64 ambiguous_reads_rejected  = 0;
+    uint64 read_ambiguous_gene_fixed = 0;
+
+    // Statistics for TENX genomics
+    uint64 map_reads           = 0;
+    uint64 exonic_reads        = 0;
+    uint64 intronic_reads      = 0;
+    uint64 intergenic_reads    = 0;
+    uint64 transcriptome_reads = 0;
+    uint64 multigene_reads     = 0;
+    uint64 nogene_reads        = 0;
+
+    AnnotationCounters& operator+=(const AnnotationCounters& other);
 };
 
-using MyTree = ygg::IntervalTree< Node, NodeTraits< Node > >;
-
 class TagReadsWithGeneExon
 {
 public:
@@ -80,19 +76,8 @@ public:
     {
         currContig = "";
 
-        total_reads               = 0;
-        reads_wrong_strand        = 0;
-        ambiguous_reads_rejected  = 0;
-        read_ambiguous_gene_fixed = 0;
-        reads_right_strand        = 0;
-
-        map_reads           = 0;
-        exonic_reads        = 0;
-        intronic_reads      = 0;
-        intergenic_reads    = 0;
-        transcriptome_reads = 0;
-        multigene_reads     = 0;
-        nogene_reads        = 0;
+        // Used by the deprecated single thread interface
+        default_counters = registerCounters();
 
         ALLOW_MULTI_GENE_READS = false;
         USE_STRAND_INFO        = true;
@@ -109,10 +94,23 @@ public:
     }
 
     int makeOverlapDetector();
-    int makeOverlapDetectorV2();
+    // Load the gene models from gtf/gff file or compiled annotation index
+    int makeOverlapDetectorV2(int threads = 1);
+    // Save the compiled gene models, which can be mapped by makeOverlapDetectorV2()
+    int saveOverlapDetector(const std::string& index_filename);
+
+    // Get a counter block for one worker, the block lives as long as the annotator
+    // and is summed up in dumpMetrics()
+    AnnotationCounters* registerCounters();
 
     int setAnnotation(BamRecord& record);
-    int setAnnotation(BamRecord& record, const std::string& contig);
+    int setAnnotation(BamRecord& record, const std::string& contig, AnnotationCounters& counters);
+    // Annotate the reads of one contig at once, the reads should be sorted by coordinate.
+    // Index lookups of the whole batch are issued before resolving the locus functions,
+    // and neighbouring reads share the candidate genes. The SpliceType of each read is
+    // stored into splice if not null.
+    int setAnnotationBatch(BamRecord* records, size_t n, const std::string& contig, AnnotationCounters& counters,
+                           uint8* splice = nullptr);
 
     void setContig(std::string& contig);
 
@@ -125,46 +123,38 @@ public:
 
 private:
     std::unordered_map< int, LocusFunction >
-                       getLocusFunctionForReadByGene(std::vector< const GeneFromGTF* >& result,
-                                                     std::vector< AlignmentBlock >&     alignmentBlock);
-    bool               getAlignmentBlockonGeneExon(AlignmentBlock& b, const GeneFromGTF* gene, std::string contig);
-    std::set< int >    getAlignmentBlockonGeneExon(std::vector< const GeneFromGTF* >&        result,
+                       getLocusFunctionForReadByGene(std::vector< GeneView >&       result,
+                                                     std::vector< AlignmentBlock >& alignmentBlock,
+                                                     std::vector< uint8 >*          splice_types = nullptr);
+    bool               getAlignmentBlockonGeneExon(AlignmentBlock& b, const GeneView& gene, const std::string& contig);
+    std::set< int >    getAlignmentBlockonGeneExon(std::vector< GeneView >&                  result,
                                                    std::unordered_map< int, LocusFunction >& locusMap, AlignmentBlock& b,
-                                                   std::string contig);
-    std::vector< int > getGenesConsistentWithReadStrand(std::vector< const GeneFromGTF* >& result,
-                                                        std::vector< int >& ids, bool recordNegative);
-    std::pair< std::string, std::string > getCompoundNameAndStrand(std::vector< const GeneFromGTF* >& result,
-                                                                   std::vector< int >&                ids);
-
-    int setAnnotationTS(BamRecord& record, const std::string& contig);
-    int setAnnotationTENX(BamRecord& record, const std::string& contig);
+                                                   const std::string& contig);
+    std::vector< int > getGenesConsistentWithReadStrand(std::vector< GeneView >& result, std::vector< int >& ids,
+                                                        bool recordNegative, AnnotationCounters& counters);
+    std::pair< std::string, std::string > getCompoundNameAndStrand(std::vector< GeneView >& result,
+                                                                   std::vector< int >&      ids);
+
+    // Set annotations of one read from the genes overlapping it
+    int setAnnotationTS(BamRecord& record, std::vector< std::pair< int, int > >& cigars, int beginPos,
+                        std::vector< GeneView >& result, const std::string& contig, AnnotationCounters& counters);
+    int setAnnotationTENX(BamRecord& record, std::vector< std::pair< int, int > >& cigars, int beginPos,
+                          std::vector< GeneView >& result, AnnotationCounters& counters, uint8* splice = nullptr);
 
 private:
     // Only used in query bam by contig, so the contigs are continuous.
     std::string currContig;
 
-    std::unordered_map< std::string, MyTree > mytrees;
-    std::vector< Node >                       nodes;
+    AnnotationIndex annoIndex;
 
     std::unordered_map< std::string, int > contigs;
 
     string annotation_filename;
 
-    // Annotation statics for Drop-seq
-    std::atomic< int > total_reads;
-    std::atomic< int > reads_right_strand;
-    std::atomic< int > reads_wrong_strand;
-    std::atomic< int > ambiguous_reads_rejected;
-    std::atomic< int > read_ambiguous_gene_fixed;
-
-    // Add statics metrics for TENX genomics
-    std::atomic< int > map_reads;
-    std::atomic< int > exonic_reads;
-    std::atomic< int > intronic_reads;
-    std::atomic< int > intergenic_reads;
-    std::atomic< int > transcriptome_reads;
-    std::atomic< int > multigene_reads;
-    std::atomic< int > nogene_reads;
+    // Annotation statics, one block per worker
+    std::vector< std::unique_ptr< AnnotationCounters > > counters_blocks;
+    AnnotationCounters*                                   default_counters;
+    std::mutex                                            counters_mutex;
 
     // std::mutex stat_mutex;
     std::mutex query_mutex;
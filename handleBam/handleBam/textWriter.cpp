@@ -0,0 +1,178 @@
+/*
+ * File: textWriter.cpp
+ * Created Data: 2026-10-18
+ * Author: fxzhao
+ * Contact: <zhaofuxiang@genomics.cn>
+ *
+ * Copyright (c) 2026 BGI-Research
+ */
+
+#include "textWriter.h"
+
+#include <algorithm>
+#include <cstring>
+#include <filesystem>
+namespace fs = std::filesystem;
+
+#include <libdeflate.h>
+#include <spdlog/spdlog.h>
+
+#include "types.h"
+
+// Uncompressed size of the blocks handed to the pool
+static const size_t TEXT_BLOCK_SIZE = 4 << 20;
+
+// Limits of a bgzf block, the same as htslib
+static const size_t BGZF_BLOCK_SIZE     = 0xff00;
+static const size_t BGZF_MAX_BLOCK_SIZE = 0x10000;
+static const size_t BGZF_HEADER_SIZE    = 18;
+static const size_t BGZF_FOOTER_SIZE    = 8;
+
+static const uint8 BGZF_HEADER[BGZF_HEADER_SIZE] = { 31, 139, 8, 4, 0, 0, 0, 0, 0, 255, 6, 0, 'B', 'C', 2, 0, 0, 0 };
+
+static void putUint32(uint8* p, uint32 v)
+{
+    p[0] = v & 0xff;
+    p[1] = (v >> 8) & 0xff;
+    p[2] = (v >> 16) & 0xff;
+    p[3] = (v >> 24) & 0xff;
+}
+
+// Append one bgzf block of data to out, the data is split if it doesn't fit
+static void appendBgzfBlock(libdeflate_compressor* c, const char* data, size_t len, std::string& out)
+{
+    size_t base = out.size();
+    out.resize(base + BGZF_MAX_BLOCK_SIZE);
+    uint8* p = reinterpret_cast< uint8* >(&out[base]);
+    size_t n = libdeflate_deflate_compress(c, data, len, p + BGZF_HEADER_SIZE,
+                                           BGZF_MAX_BLOCK_SIZE - BGZF_HEADER_SIZE - BGZF_FOOTER_SIZE);
+    if (n == 0)
+    {
+        out.resize(base);
+        appendBgzfBlock(c, data, len / 2, out);
+        appendBgzfBlock(c, data + len / 2, len - len / 2, out);
+        return;
+    }
+
+    size_t total = BGZF_HEADER_SIZE + n + BGZF_FOOTER_SIZE;
+    memcpy(p, BGZF_HEADER, BGZF_HEADER_SIZE);
+    // The 'BC' subfield holds the block size minus 1
+    p[16] = (total - 1) & 0xff;
+    p[17] = (total - 1) >> 8;
+    putUint32(p + BGZF_HEADER_SIZE + n, libdeflate_crc32(0, data, len));
+    putUint32(p + BGZF_HEADER_SIZE + n + 4, len);
+    out.resize(base + total);
+}
+
+TextWriter::TextWriter(const std::string& filename_, int threads)
+    : TextWriter(filename_, fs::path(filename_).extension() == ".gz" ? GZIP : PLAIN, threads)
+{
+}
+
+TextWriter::TextWriter(const std::string& filename_, Format format_, int threads, int level_)
+    : filename(filename_), format(format_), level(level_), block_size(TEXT_BLOCK_SIZE), blocks(0), max_pending(0)
+{
+    ofs.open(filename, std::ofstream::out | std::ofstream::binary | std::ofstream::trunc);
+    if (!ofs.is_open())
+        spdlog::error("Error opening file:{}", filename);
+
+    // Compress on the pool only if there are cores to spare, keep a few blocks
+    // per thread in flight to bound the memory
+    if (format != PLAIN && threads > 1)
+    {
+        pool        = std::make_unique< std::threadpool >(threads);
+        max_pending = 2 * threads;
+    }
+    block.reserve(block_size + 1024);
+}
+
+TextWriter::~TextWriter()
+{
+    close();
+}
+
+std::string TextWriter::compress(Format format, int level, const std::string& data)
+{
+    // Compressors can't be shared between threads, keep one per thread
+    thread_local std::unique_ptr< libdeflate_compressor, decltype(&libdeflate_free_compressor) > c(
+        nullptr, libdeflate_free_compressor);
+    thread_local int c_level = -1;
+    if (!c || c_level != level)
+    {
+        c.reset(libdeflate_alloc_compressor(level));
+        c_level = level;
+    }
+
+    std::string out;
+    if (format == GZIP)
+    {
+        // Each block is a complete gzip member
+        out.resize(libdeflate_gzip_compress_bound(c.get(), data.size()));
+        out.resize(libdeflate_gzip_compress(c.get(), data.data(), data.size(), &out[0], out.size()));
+        return out;
+    }
+
+    // An empty input gives the empty block marking the end of bgzf file
+    size_t off = 0;
+    do
+    {
+        size_t len = std::min(BGZF_BLOCK_SIZE, data.size() - off);
+        appendBgzfBlock(c.get(), data.data() + off, len, out);
+        off += len;
+    } while (off < data.size());
+    return out;
+}
+
+void TextWriter::submit()
+{
+    ++blocks;
+    if (format == PLAIN)
+    {
+        ofs.write(block.data(), block.size());
+        block.clear();
+        return;
+    }
+    if (!pool)
+    {
+        std::string data = compress(format, level, block);
+        ofs.write(data.data(), data.size());
+        block.clear();
+        return;
+    }
+
+    pending.push_back(pool->commit(&TextWriter::compress, format, level, std::move(block)));
+    block = std::string();
+    block.reserve(block_size + 1024);
+    while (pending.size() > max_pending)
+        writeFront();
+}
+
+void TextWriter::writeFront()
+{
+    std::string data = pending.front().get();
+    pending.pop_front();
+    ofs.write(data.data(), data.size());
+}
+
+int TextWriter::close()
+{
+    if (!ofs.is_open())
+        return -1;
+
+    // An empty gzip file still needs one member
+    if (!block.empty() || (format == GZIP && blocks == 0))
+        submit();
+    if (format == BGZF)
+        submit();
+    while (!pending.empty())
+        writeFront();
+    pool.reset();
+
+    ofs.close();
+    if (ofs.fail())
+    {
+        spdlog::error("Error writing file:{}", filename);
+        return -1;
+    }
+    return 0;
+}
@@ -0,0 +1,95 @@
+/*
+ * File: textWriter.h
+ * Created Data: 2026-10-18
+ * Author: fxzhao
+ * Contact: <zhaofuxiang@genomics.cn>
+ *
+ * Copyright (c) 2026 BGI-Research
+ */
+
+#pragma once
+
+#include <deque>
+#include <fstream>
+#include <future>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <type_traits>
+
+#include <spdlog/fmt/fmt.h>
+
+#include "threadpool.h"
+
+// Writer of the large tabular outputs. The text is formatted into big blocks,
+// the blocks are compressed independently with libdeflate on a thread pool and
+// written in order, the output is a multi-member gzip file readable by zcat,
+// or bgzf which is gzip compatible and can be accessed randomly.
+class TextWriter
+{
+public:
+    enum Format
+    {
+        PLAIN,
+        GZIP,
+        BGZF
+    };
+
+    // Gzip compressed if filename ends with .gz, else plain text
+    TextWriter(const std::string& filename, int threads = 1);
+    TextWriter(const std::string& filename, Format format, int threads = 1, int level = DEFAULT_LEVEL);
+    ~TextWriter();
+
+    bool isOpen() const
+    {
+        return ofs.is_open();
+    }
+
+    TextWriter& operator<<(std::string_view s)
+    {
+        block.append(s.data(), s.size());
+        if (block.size() >= block_size)
+            submit();
+        return *this;
+    }
+    TextWriter& operator<<(char c)
+    {
+        block.push_back(c);
+        if (block.size() >= block_size)
+            submit();
+        return *this;
+    }
+    template < typename T, typename = std::enable_if_t< std::is_integral_v< T > > > TextWriter& operator<<(T n)
+    {
+        fmt::format_int f(n);
+        return *this << std::string_view(f.data(), f.size());
+    }
+
+    // Write all the blocks and close the file, return 0 if success. It's called
+    // by the destructor if not yet, check the result to catch the write errors.
+    int close();
+
+private:
+    // Compress the current block, or queue it if there is a thread pool
+    void submit();
+    // Wait for the oldest block in queue and write it
+    void writeFront();
+
+    static std::string compress(Format format, int level, const std::string& data);
+
+private:
+    static const int DEFAULT_LEVEL = 6;
+
+    std::string   filename;
+    Format        format;
+    int           level;
+    std::ofstream ofs;
+
+    std::string block;
+    size_t      block_size;
+    size_t      blocks;
+
+    std::unique_ptr< std::threadpool >        pool;
+    std::deque< std::future< std::string > > pending;
+    size_t                                    max_pending;
+};
@@ -20,6 +20,7 @@
 #include <sstream>
 #include <string.h>
 
+#include <charconv>
 #include <chrono>
 #include <filesystem>
 namespace fs = std::filesystem;
@@ -101,4 +102,18 @@ bool check_file_older(const std::string& first, const std::string& second)
     auto     t2 = fs::last_write_time(p2);
 
     return (std::chrono::duration_cast< std::chrono::seconds >(t1 - t2).count() <= 0);
-}
\ No newline at end of file
+}
+
+bool parse_coordinate(std::string_view barcode, int& x, int& y, char sep)
+{
+    size_t pos_y = barcode.rfind(sep);
+    if (pos_y == std::string_view::npos || pos_y == 0)
+        return false;
+    size_t pos_x = barcode.rfind(sep, pos_y - 1);
+    pos_x        = pos_x == std::string_view::npos ? 0 : pos_x + 1;
+
+    const char* end = barcode.data() + barcode.size();
+    auto        rx  = std::from_chars(barcode.data() + pos_x, barcode.data() + pos_y, x);
+    auto        ry  = std::from_chars(barcode.data() + pos_y + 1, end, y);
+    return rx.ec == std::errc() && rx.ptr == barcode.data() + pos_y && ry.ec == std::errc() && ry.ptr == end;
+}
@@ -10,6 +10,7 @@
 #pragma once
 
 #include <string>
+#include <string_view>
 #include <vector>
 using namespace std;
 
@@ -23,4 +24,8 @@ size_t physical_memory_used_by_process();
 vector< string > split_str(const std::string& str, char delim = ' ', bool skip_empty = true);
 
 // Return true: first file is older than second file
-bool check_file_older(const std::string& first, const std::string& second);
\ No newline at end of file
+bool check_file_older(const std::string& first, const std::string& second);
+
+// Parse the coordinate of Stereo-seq barcode, which ends with "x_y", e.g.
+// "41_16_61982_24418" gives x=61982 y=24418. Return false if not a coordinate.
+bool parse_coordinate(std::string_view barcode, int& x, int& y, char sep = '_');
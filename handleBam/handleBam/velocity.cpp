@@ -0,0 +1,205 @@
+/*
+ * File: velocity.cpp
+ * Created Data: 2026-10-18
+ * Author: fxzhao
+ * Contact: <zhaofuxiang@genomics.cn>
+ *
+ * Copyright (c) 2026 BGI-Research
+ */
+
+#include <algorithm>
+#include <filesystem>
+namespace fs = std::filesystem;
+
+#include "tagReadsWithGeneExon.h"
+#include "textWriter.h"
+#include "velocity.h"
+
+static const char* LAYER_NAMES[] = { "spliced", "unspliced", "ambiguous" };
+
+static uint32 nameId(std::unordered_map< std::string, uint32 >& ids, std::vector< std::string >& names,
+                     const std::string& name)
+{
+    auto it = ids.find(name);
+    if (it != ids.end())
+        return it->second;
+    uint32 id = names.size();
+    ids.emplace(name, id);
+    names.push_back(name);
+    return id;
+}
+
+static uint32 layer(const SpliceCount& c, int i)
+{
+    return i == 0 ? c.spliced : (i == 1 ? c.unspliced : c.ambiguous);
+}
+
+void VelocityCounter::count(const std::string& barcode, const std::string& gene, uint8 type)
+{
+    uint64       key = (uint64(nameId(barcode_ids, barcodes, barcode)) << 32) | nameId(gene_ids, genes, gene);
+    SpliceCount& c   = counts[key];
+    if (type == SPLICE_SPLICED)
+        ++c.spliced;
+    else if (type == SPLICE_UNSPLICED)
+        ++c.unspliced;
+    else
+        ++c.ambiguous;
+}
+
+void VelocityCounter::add(const std::string& barcode, const std::string& gene, uint8 type)
+{
+    if (type != SPLICE_NONE)
+        count(barcode, gene, type);
+}
+
+void VelocityCounter::addRead(const std::string& key, const std::string& umi, uint8 type)
+{
+    molecules[key][umi] |= type;
+}
+
+void VelocityCounter::collapse(
+    const std::unordered_map< std::string, std::unordered_map< std::string, std::string > >& umi_correct)
+{
+    for (auto& [key, umis] : molecules)
+    {
+        auto corrected = umi_correct.find(key);
+        if (corrected != umi_correct.end())
+        {
+            const auto& correct = corrected->second;
+            for (auto& [umi, to] : correct)
+            {
+                // Follow the corrections to the umi kept, so the reads never move into
+                // an umi moved already. The steps are bounded in case of a cycle.
+                const std::string* root = &to;
+                for (size_t step = 0; step < correct.size(); ++step)
+                {
+                    auto next = correct.find(*root);
+                    if (next == correct.end())
+                        break;
+                    root = &next->second;
+                }
+                auto from = umis.find(umi), target = umis.find(*root);
+                if (from == umis.end() || target == umis.end() || from == target)
+                    continue;
+                target->second |= from->second;
+                from->second = SPLICE_NONE;
+            }
+        }
+
+        size_t      pos     = key.find('|');
+        std::string barcode = key.substr(0, pos), gene = key.substr(pos + 1);
+        for (auto& [umi, type] : umis)
+            if (type != SPLICE_NONE)
+                count(barcode, gene, type);
+    }
+    std::unordered_map< std::string, std::unordered_map< std::string, uint8 > >().swap(molecules);
+}
+
+void VelocityMatrix::merge(VelocityCounter& counter)
+{
+    std::vector< uint32 > barcode_map, gene_map;
+    for (auto& name : counter.barcodes)
+        barcode_map.push_back(nameId(barcode_ids, barcodes, name));
+    for (auto& name : counter.genes)
+        gene_map.push_back(nameId(gene_ids, genes, name));
+
+    entries.reserve(entries.size() + counter.counts.size());
+    for (auto& [key, count] : counter.counts)
+    {
+        uint64 global_key = (uint64(barcode_map[key >> 32]) << 32) | gene_map[key & 0xFFFFFFFF];
+        entries.push_back({ global_key, count });
+    }
+
+    std::unordered_map< std::string, uint32 >().swap(counter.barcode_ids);
+    std::unordered_map< std::string, uint32 >().swap(counter.gene_ids);
+    std::vector< std::string >().swap(counter.barcodes);
+    std::vector< std::string >().swap(counter.genes);
+    std::unordered_map< uint64, SpliceCount >().swap(counter.counts);
+}
+
+void VelocityMatrix::totals(uint64& spliced, uint64& unspliced, uint64& ambiguous) const
+{
+    spliced = unspliced = ambiguous = 0;
+    for (auto& e : entries)
+    {
+        spliced += e.count.spliced;
+        unspliced += e.count.unspliced;
+        ambiguous += e.count.ambiguous;
+    }
+}
+
+int VelocityMatrix::write(const std::string& path, int threads)
+{
+    // The same gene name may come from several contigs
+    std::sort(entries.begin(), entries.end(),
+              [](const VelocityEntry& a, const VelocityEntry& b) { return a.key < b.key; });
+    size_t n = 0;
+    for (size_t i = 0; i < entries.size(); ++i)
+    {
+        if (n != 0 && entries[n - 1].key == entries[i].key)
+        {
+            entries[n - 1].count.spliced += entries[i].count.spliced;
+            entries[n - 1].count.unspliced += entries[i].count.unspliced;
+            entries[n - 1].count.ambiguous += entries[i].count.ambiguous;
+        }
+        else
+            entries[n++] = entries[i];
+    }
+    entries.resize(n);
+
+    // Number the barcodes and genes in the order they appear, shared by the layers
+    const uint32          UNSET = 0;
+    std::vector< uint32 > barcode_rank(barcodes.size(), UNSET), gene_rank(genes.size(), UNSET);
+    std::vector< uint32 > barcode_order, gene_order;
+    size_t                nnz[3] = { 0, 0, 0 };
+    for (auto& e : entries)
+    {
+        uint32 barcode = e.key >> 32, gene = e.key & 0xFFFFFFFF;
+        if (barcode_rank[barcode] == UNSET)
+        {
+            barcode_order.push_back(barcode);
+            barcode_rank[barcode] = barcode_order.size();
+        }
+        if (gene_rank[gene] == UNSET)
+        {
+            gene_order.push_back(gene);
+            gene_rank[gene] = gene_order.size();
+        }
+        for (int i = 0; i < 3; ++i)
+            nnz[i] += layer(e.count, i) != 0;
+    }
+
+    fs::path dir(path);
+    {
+        TextWriter out((dir / "barcodes.tsv.gz").string(), threads);
+        for (auto id : barcode_order)
+            out << barcodes[id] << '\n';
+        if (out.close() != 0)
+            return -1;
+    }
+    {
+        TextWriter out((dir / "genes.tsv.gz").string(), threads);
+        for (auto id : gene_order)
+            out << genes[id] << '\n';
+        if (out.close() != 0)
+            return -1;
+    }
+
+    const char sep = ' ';
+    for (int i = 0; i < 3; ++i)
+    {
+        TextWriter out((dir / (std::string(LAYER_NAMES[i]) + ".mtx.gz")).string(), threads);
+        out << "%%MatrixMarket matrix coordinate real general\n%\n";
+        out << barcode_order.size() << sep << gene_order.size() << sep << nnz[i] << '\n';
+        for (auto& e : entries)
+        {
+            uint32 value = layer(e.count, i);
+            if (value == 0)
+                continue;
+            out << barcode_rank[e.key >> 32] << sep << gene_rank[e.key & 0xFFFFFFFF] << sep << value << '\n';
+        }
+        if (out.close() != 0)
+            return -1;
+    }
+    return 0;
+}
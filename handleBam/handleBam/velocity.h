@@ -0,0 +1,80 @@
+/*
+ * File: velocity.h
+ * Created Data: 2026-10-18
+ * Author: fxzhao
+ * Contact: <zhaofuxiang@genomics.cn>
+ *
+ * Copyright (c) 2026 BGI-Research
+ */
+
+#pragma once
+
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "types.h"
+
+// Molecules of a gene on a barcode by the SpliceType
+struct SpliceCount
+{
+    uint32 spliced;
+    uint32 unspliced;
+    uint32 ambiguous;
+};
+
+// Spliced, unspliced and ambiguous molecules of one task for RNA velocity. The
+// molecules are the unique reads without umi, or the umis after correction.
+class VelocityCounter
+{
+public:
+    // Count a molecule of the type, for the deduplication by read position
+    void add(const std::string& barcode, const std::string& gene, uint8 type);
+    // Or the type of a read into its molecule, key is "barcode|gene" as in the umi
+    // correction. The molecules are counted by collapse().
+    void addRead(const std::string& key, const std::string& umi, uint8 type);
+    // Or the reads of the corrected umis into the umis they are corrected to, along
+    // the chain of corrections, then count the molecules
+    void collapse(const std::unordered_map< std::string, std::unordered_map< std::string, std::string > >& umi_correct);
+
+private:
+    friend class VelocityMatrix;
+
+    void count(const std::string& barcode, const std::string& gene, uint8 type);
+
+private:
+    std::unordered_map< std::string, uint32 > barcode_ids, gene_ids;
+    std::vector< std::string >                barcodes, genes;
+    // Key is barcode id << 32 | gene id
+    std::unordered_map< uint64, SpliceCount > counts;
+    // Types of the umis of "barcode|gene" waiting for collapse()
+    std::unordered_map< std::string, std::unordered_map< std::string, uint8 > > molecules;
+};
+
+// The three barcode x gene matrices of velocity gathered from all the tasks
+class VelocityMatrix
+{
+public:
+    // Move the counts of a task into the matrix
+    void merge(VelocityCounter& counter);
+
+    // Total molecules of each type
+    void totals(uint64& spliced, uint64& unspliced, uint64& ambiguous) const;
+
+    // Write barcodes.tsv.gz, genes.tsv.gz, spliced.mtx.gz, unspliced.mtx.gz and
+    // ambiguous.mtx.gz into path, the three matrices share the barcodes and genes.
+    // Return 0 if success.
+    int write(const std::string& path, int threads = 1);
+
+private:
+    struct VelocityEntry
+    {
+        uint64      key;  // barcode id << 32 | gene id
+        SpliceCount count;
+    };
+
+private:
+    std::unordered_map< std::string, uint32 > barcode_ids, gene_ids;
+    std::vector< std::string >                barcodes, genes;
+    std::vector< VelocityEntry >              entries;
+};
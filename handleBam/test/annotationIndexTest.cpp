@@ -0,0 +1,184 @@
+/*
+ * File: annotationIndexTest.cpp
+ * Created Data: 2026-10-18
+ * Author: fxzhao
+ * Contact: <zhaofuxiang@genomics.cn>
+ *
+ * Copyright (c) 2026 BGI-Research
+ */
+
+#include <algorithm>
+#include <filesystem>
+#include <random>
+#include <string>
+#include <tuple>
+#include <vector>
+namespace fs = std::filesystem;
+
+#include <doctest/doctest.h>
+
+#include "annotationIndex.h"
+
+struct TestGene
+{
+    std::string contig;
+    int         start, end;
+    std::string name;
+};
+
+static void addGene(std::vector< GeneFromGTF >& genes, std::vector< TestGene >& raw, std::string contig, int start,
+                    int end)
+{
+    std::string name = "g" + std::to_string(raw.size());
+    GeneFromGTF gene(contig, start, end, raw.size() % 2 == 1, name, "gene", name, "protein_coding", 1);
+    TranscriptFromGTF* t = gene.addTranscript(start, end, start, end, 1, name + ".1", name + ".1", "protein_coding");
+    t->addExons({ Exon(start, end) });
+    genes.push_back(gene);
+    raw.push_back({ contig, start, end, name });
+}
+
+// Names of the genes overlapping [begin, end] by scanning all, in the order of the index
+static std::vector< std::string > bruteForce(const std::vector< TestGene >& raw, const std::string& contig, int begin,
+                                             int end)
+{
+    std::vector< const TestGene* > hits;
+    for (auto& g : raw)
+        if (g.contig == contig && g.start <= end && g.end >= begin)
+            hits.push_back(&g);
+    std::sort(hits.begin(), hits.end(), [](const TestGene* a, const TestGene* b) {
+        return std::tie(a->start, a->end, a->name) < std::tie(b->start, b->end, b->name);
+    });
+    std::vector< std::string > names;
+    for (auto g : hits)
+        names.push_back(g->name);
+    return names;
+}
+
+static std::vector< std::string > names(const std::vector< GeneView >& result)
+{
+    std::vector< std::string > v;
+    for (auto& g : result)
+        v.push_back(std::string(g.getName()));
+    return v;
+}
+
+// Nested and overlapping genes, a long gene spanning many small ones and random genes
+static void makeGenes(std::vector< GeneFromGTF >& genes, std::vector< TestGene >& raw)
+{
+    addGene(genes, raw, "chr1", 1, 1000000);
+    addGene(genes, raw, "chr1", 100, 200);
+    addGene(genes, raw, "chr1", 150, 160);
+    addGene(genes, raw, "chr1", 150, 150);
+    addGene(genes, raw, "chr1", 150, 160);
+    addGene(genes, raw, "chr1", 300, 500);
+    addGene(genes, raw, "chr1", 400, 700);
+    addGene(genes, raw, "chr1", 650, 900);
+    for (int i = 0; i < 300; ++i)
+        addGene(genes, raw, "chr1", 2000 + i * 100, 2049 + i * 100);
+    addGene(genes, raw, "chr1", 40000, 1200000);
+
+    std::mt19937 rng(7);
+    for (int i = 0; i < 2000; ++i)
+    {
+        int start = rng() % 500000 + 1;
+        int len   = rng() % 20 == 0 ? rng() % 100000 : rng() % 3000;
+        addGene(genes, raw, "chr2", start, start + len);
+    }
+    addGene(genes, raw, "chr3", 5000, 6000);
+}
+
+static void checkQueries(const AnnotationIndex& index, const std::vector< TestGene >& raw)
+{
+    std::mt19937                              rng(11);
+    std::vector< std::pair< int, int > >      intervals;
+    std::vector< std::vector< GeneView > >    results;
+    std::vector< GeneView >                   result;
+    const std::vector< std::string >          contigs = { "chr1", "chr2", "chr3" };
+    const std::vector< std::pair< int, int > > fixed  = {
+        { 150, 150 },         { 151, 151 },         { 160, 161 },   { 201, 299 },         { 0, 0 },
+        { -10, 1 },           { 1000000, 1000000 }, { 1000001, 1000001 }, { 1200000, 1300000 },
+        { 1200001, 1300000 }, { 5000, 5000 },       { 6000, 6000 }, { 6001, 7000 },
+    };
+    for (auto& contig : contigs)
+    {
+        for (auto [begin, end] : fixed)
+        {
+            index.query(contig, begin, end, result);
+            CHECK(names(result) == bruteForce(raw, contig, begin, end));
+        }
+        for (int q = 0; q < 3000; ++q)
+        {
+            int begin = rng() % 1300000 - 100;
+            int end   = begin + (rng() % 4 == 0 ? 0 : rng() % 2000);
+            index.query(contig, begin, end, result);
+            CHECK(names(result) == bruteForce(raw, contig, begin, end));
+        }
+
+        // Sorted reads of a batch, some of them sharing the candidates
+        intervals.clear();
+        for (int q = 0; q < 2000; ++q)
+        {
+            int begin = rng() % 600000;
+            intervals.emplace_back(begin, begin + rng() % 150);
+            if (q % 5 == 0)
+                intervals.emplace_back(begin + 1, begin + 1);
+        }
+        intervals.insert(intervals.end(), fixed.begin(), fixed.end());
+        std::sort(intervals.begin(), intervals.end());
+        index.queryBatch(contig, intervals, results);
+        REQUIRE(results.size() == intervals.size());
+        for (size_t i = 0; i < intervals.size(); ++i)
+            CHECK(names(results[i]) == bruteForce(raw, contig, intervals[i].first, intervals[i].second));
+    }
+}
+
+TEST_CASE("query genes of the annotation index against a brute-force scan")
+{
+    std::vector< GeneFromGTF > genes;
+    std::vector< TestGene >    raw;
+    makeGenes(genes, raw);
+    AnnotationIndex index;
+    index.build(genes);
+    REQUIRE(index.geneNum() == raw.size());
+    checkQueries(index, raw);
+
+    // The same from the mapped file
+    fs::path dir = fs::temp_directory_path() / "handleBam_annotation_index_test";
+    fs::create_directories(dir);
+    std::string file = (dir / "genes.idx").string();
+    REQUIRE(index.save(file) == 0);
+    AnnotationIndex mapped;
+    REQUIRE(mapped.load(file, true) == 0);
+    checkQueries(mapped, raw);
+    fs::remove_all(dir);
+}
+
+TEST_CASE("query empty intervals and unknown contigs of the annotation index")
+{
+    std::vector< GeneFromGTF > genes;
+    std::vector< TestGene >    raw;
+    makeGenes(genes, raw);
+    AnnotationIndex index;
+    index.build(genes);
+
+    std::vector< GeneView > result;
+    // An empty interval overlaps nothing, even inside a gene
+    index.query("chr1", 151, 150, result);
+    CHECK(result.empty());
+    index.query("chrUn", 1, 1000000, result);
+    CHECK(result.empty());
+
+    std::vector< std::pair< int, int > >   intervals = { { 100, 99 }, { 100, 100 }, { 151, 150 }, { 151, 151 } };
+    std::vector< std::vector< GeneView > > results;
+    index.queryBatch("chr1", intervals, results);
+    REQUIRE(results.size() == intervals.size());
+    CHECK(results[0].empty());
+    CHECK(names(results[1]) == bruteForce(raw, "chr1", 100, 100));
+    CHECK(results[2].empty());
+    CHECK(names(results[3]) == bruteForce(raw, "chr1", 151, 151));
+
+    index.queryBatch("chrUn", intervals, results);
+    REQUIRE(results.size() == intervals.size());
+    for (auto& r : results)
+        CHECK(r.empty());
+}
@@ -0,0 +1,59 @@
+/*
+ * File: kdeTest.cpp
+ * Created Data: 2026-10-18
+ * Author: fxzhao
+ * Contact: <zhaofuxiang@genomics.cn>
+ *
+ * Copyright (c) 2026 BGI-Research
+ */
+
+#include <algorithm>
+#include <map>
+#include <random>
+#include <vector>
+
+#include <doctest/doctest.h>
+
+#include "density/kde.hpp"
+
+// Counts of barcodes, many empty droplets with a few reads and fewer cells with many
+static std::vector< double > barcodeCounts(unsigned seed, size_t background, size_t cells)
+{
+    std::mt19937                          rng(seed);
+    std::lognormal_distribution< double > low(1.0, 0.8), high(7.0, 0.5);
+    std::vector< double >                 counts;
+    for (size_t i = 0; i < background; ++i)
+        counts.push_back(std::max(1.0, std::round(low(rng))));
+    for (size_t i = 0; i < cells; ++i)
+        counts.push_back(std::max(1.0, std::round(high(rng))));
+    std::shuffle(counts.begin(), counts.end(), rng);
+    return counts;
+}
+
+TEST_CASE("the kde threshold of barcode counts is the same from the values and the histogram")
+{
+    for (unsigned seed = 1; seed <= 3; ++seed)
+    {
+        std::vector< double > counts = barcodeCounts(seed, 200000, 5000);
+
+        // The histogram as HandleBam makes it from the counts of barcodes
+        std::map< double, uint64_t > count_nums;
+        for (auto c : counts)
+            ++count_nums[c];
+        vector< pair< double, uint64_t > > hist(count_nums.begin(), count_nums.end());
+
+        KDE                    by_values;
+        pair< double, double > a = by_values.run(counts, "bead");
+        KDE                    by_hist;
+        pair< double, double > b = by_hist.run(hist, "bead");
+        CHECK(a.first == b.first);
+        CHECK(a.second == b.second);
+        // The threshold lies between the empty droplets and the cells
+        CHECK(a.first > 1);
+        CHECK(a.first < 1000);
+
+        // A histogram is reused by another run
+        pair< double, double > c = by_hist.run(hist, "bead");
+        CHECK(c.first == b.first);
+    }
+}
@@ -0,0 +1,53 @@
+/*
+ * File: qcMetricsTest.cpp
+ * Created Data: 2026-10-18
+ * Author: fxzhao
+ * Contact: <zhaofuxiang@genomics.cn>
+ *
+ * Copyright (c) 2026 BGI-Research
+ */
+
+#include <string>
+#include <vector>
+
+#include <doctest/doctest.h>
+
+#include "qcMetrics.h"
+
+TEST_CASE("count the ribosomal protein genes")
+{
+    const std::vector< std::string > ribo = { "RPL10A", "RPL3",  "RPL41",  "RPS4X", "RPS4Y1", "RPS27A", "RPLP0",
+                                              "RPLP2",  "RPSA",  "Rpl10a", "Rps4x", "Rplp1",  "Rpsa" };
+    for (auto& gene : ribo)
+    {
+        INFO(gene);
+        CHECK(isRibosomal(gene));
+        CHECK(geneClass(gene) == GENE_RIBO);
+    }
+}
+
+TEST_CASE("skip the genes sharing the ribosomal prefix")
+{
+    // Kinases, pseudogenes and the names only starting with the prefix
+    const std::vector< std::string > other = { "RPS6KA1",   "RPS6KB2",    "Rps6ka3", "Rps6kb1",     "RPL13AP5",
+                                               "RPS2P46",   "RPL21P28",   "RPSAP58", "Rpl10-ps3",   "Rpl13a-ps1",
+                                               "RPLP0P2",   "RPL",        "RPS",     "RPSAP",       "RPLP",
+                                               "RPSX",      "RPSA2",      "Rplp",    "RPA1",        "RP11-34P13.7",
+                                               "" };
+    for (auto& gene : other)
+    {
+        INFO(gene);
+        CHECK_FALSE(isRibosomal(gene));
+        CHECK(geneClass(gene) == GENE_OTHER);
+    }
+}
+
+TEST_CASE("count the mitochondrial rRNA as mitochondrial genes")
+{
+    for (auto gene : { "MT-RNR1", "MT-RNR2", "mt-Rnr1", "mt-Rnr2", "MT-CO1", "mt-Nd1" })
+    {
+        INFO(gene);
+        CHECK_FALSE(isRibosomal(gene));
+        CHECK(geneClass(gene) == GENE_MITO);
+    }
+}
@@ -0,0 +1,157 @@
+/*
+ * File: tagIndexTest.cpp
+ * Created Data: 2026-10-18
+ * Author: fxzhao
+ * Contact: <zhaofuxiang@genomics.cn>
+ *
+ * Copyright (c) 2026 BGI-Research
+ */
+
+#include <filesystem>
+#include <string>
+#include <vector>
+namespace fs = std::filesystem;
+
+#include <doctest/doctest.h>
+#include <htslib/kstring.h>
+#include <htslib/sam.h>
+
+#include "samWriter.h"
+#include "tagIndex.h"
+
+static const int GENE_NUM = 7;
+
+// Write n sorted records of 50bp, the i-th one has barcode B<i> and gene G<i % GENE_NUM>.
+// The record long_record is 70kb, longer than a bgzf block.
+static void writeBam(const std::string& bam_file, int n, int long_record = -1)
+{
+    const char text[] = "@HD\tVN:1.6\tSO:coordinate\n@SQ\tSN:chr1\tLN:100000000\n";
+    bam_hdr_t* h      = sam_hdr_parse(sizeof(text) - 1, text);
+    REQUIRE(h != nullptr);
+
+    SamWriter writer(bam_file);
+    writer.init(h, true, true);
+    kstring_t line = { 0, 0, nullptr };
+    bam1_t*   b    = bam_init1();
+    for (int i = 0; i < n; ++i)
+    {
+        int         len = i == long_record ? 70000 : 50;
+        std::string s   = "r" + std::to_string(i) + "\t0\tchr1\t" + std::to_string(1 + i * 10) + "\t60\t"
+                        + std::to_string(len) + "M\t*\t0\t0\t" + std::string(len, 'A') + "\t" + std::string(len, 'I')
+                        + "\tCB:Z:B" + std::to_string(i) + "\tGE:Z:G" + std::to_string(i % GENE_NUM);
+        line.l = 0;
+        kputs(s.c_str(), &line);
+        REQUIRE(sam_parse1(&line, h, b) >= 0);
+        writer.write(b);
+    }
+    writer.close();
+    std::unique_ptr< TagIndex > index = writer.takeTagIndex();
+    REQUIRE(index);
+    REQUIRE(index->isValid());
+    REQUIRE(index->save(bam_file + TAG_INDEX_SUFFIX) == 0);
+
+    bam_destroy1(b);
+    free(line.s);
+    bam_hdr_destroy(h);
+}
+
+// Virtual offsets of the records
+static std::vector< uint64 > recordOffsets(const std::string& bam_file)
+{
+    htsFile*              in = hts_open(bam_file.c_str(), "rb");
+    sam_hdr_t*            h  = sam_hdr_read(in);
+    bam1_t*               b  = bam_init1();
+    std::vector< uint64 > offsets;
+    while (true)
+    {
+        uint64 voff = bgzf_tell(in->fp.bgzf);
+        if (sam_read1(in, h, b) < 0)
+            break;
+        offsets.push_back(voff);
+    }
+    bam_destroy1(b);
+    bam_hdr_destroy(h);
+    hts_close(in);
+    return offsets;
+}
+
+// Number of the records beginning at the start of a bgzf block
+static int blockStarts(const std::string& bam_file)
+{
+    int n = 0;
+    for (uint64 voff : recordOffsets(bam_file))
+        if ((voff & 0xFFFF) == 0)
+            ++n;
+    return n;
+}
+
+TEST_CASE("fetch the records on bgzf block boundaries by tag index")
+{
+    fs::path dir = fs::temp_directory_path() / "handleBam_tag_index_test";
+    fs::create_directories(dir);
+    std::string bam_file = (dir / "test.bam").string();
+    std::string out_file = (dir / "fetch.sam").string();
+
+    const int n = 5000;
+    writeBam(bam_file, n);
+    // The records span several blocks, so some begin right at a block boundary
+    REQUIRE(blockStarts(bam_file) > 1);
+
+    TagIndexReader index;
+    REQUIRE(index.load(bam_file + TAG_INDEX_SUFFIX) == 0);
+
+    int64 total = 0;
+    for (int g = 0; g < GENE_NUM; ++g)
+    {
+        TagQuery query;
+        query.gene = "G" + std::to_string(g);
+        int64 expect = n / GENE_NUM + (g < n % GENE_NUM ? 1 : 0);
+        CHECK(fetchRecords(bam_file, index, query, out_file) == expect);
+        total += expect;
+    }
+    CHECK(total == n);
+
+    for (int i = 0; i < n; ++i)
+    {
+        TagQuery query;
+        query.barcode = "B" + std::to_string(i);
+        REQUIRE(fetchRecords(bam_file, index, query, out_file) == 1);
+    }
+
+    fs::remove_all(dir);
+}
+
+TEST_CASE("fetch the records after a record longer than a bgzf block by tag index")
+{
+    fs::path dir = fs::temp_directory_path() / "handleBam_tag_index_long_test";
+    fs::create_directories(dir);
+    std::string bam_file = (dir / "test.bam").string();
+    std::string out_file = (dir / "fetch.sam").string();
+
+    // The record after the long one begins in the middle of a block
+    const int n = 40;
+    writeBam(bam_file, n, n / 2);
+    std::vector< uint64 > offsets = recordOffsets(bam_file);
+    REQUIRE(offsets.size() == size_t(n));
+    REQUIRE((offsets[n / 2 + 1] & 0xFFFF) != 0);
+    REQUIRE(offsets[n / 2 + 1] >> 16 != offsets[n / 2] >> 16);
+
+    TagIndexReader index;
+    REQUIRE(index.load(bam_file + TAG_INDEX_SUFFIX) == 0);
+    for (int i = 0; i < n; ++i)
+    {
+        TagQuery query;
+        query.barcode = "B" + std::to_string(i);
+        CHECK(fetchRecords(bam_file, index, query, out_file) == 1);
+    }
+    // The gene and the barcode of a record have different first offsets in its block
+    for (int i = n / 2; i < n; ++i)
+    {
+        TagQuery query;
+        query.gene    = "G" + std::to_string(i % GENE_NUM);
+        query.barcode = "B" + std::to_string(i);
+        CHECK(fetchRecords(bam_file, index, query, out_file) == 1);
+    }
+
+    fs::remove_all(dir);
+}
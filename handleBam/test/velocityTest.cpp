@@ -0,0 +1,90 @@
+/*
+ * File: velocityTest.cpp
+ * Created Data: 2026-10-18
+ * Author: fxzhao
+ * Contact: <zhaofuxiang@genomics.cn>
+ *
+ * Copyright (c) 2026 BGI-Research
+ */
+
+#include <string>
+#include <unordered_map>
+
+#include <doctest/doctest.h>
+
+#include "tagReadsWithGeneExon.h"
+#include "velocity.h"
+
+using UmiCorrect = std::unordered_map< std::string, std::unordered_map< std::string, std::string > >;
+
+// Collapse the reads of the counter and return the total molecules of each type
+static void collapseTotals(VelocityCounter& counter, const UmiCorrect& umi_correct, uint64& spliced,
+                           uint64& unspliced, uint64& ambiguous)
+{
+    counter.collapse(umi_correct);
+    VelocityMatrix matrix;
+    matrix.merge(counter);
+    matrix.totals(spliced, unspliced, ambiguous);
+}
+
+TEST_CASE("count a molecule of spliced and unspliced reads as ambiguous")
+{
+    VelocityCounter counter;
+    counter.addRead("100_200|GeneA", "ACGTACGTAC", SPLICE_SPLICED);
+    counter.addRead("100_200|GeneA", "ACGTACGTAC", SPLICE_UNSPLICED);
+    counter.addRead("100_200|GeneA", "ACGTACGTAC", SPLICE_SPLICED);
+    counter.addRead("100_200|GeneA", "TTTTACGTAC", SPLICE_SPLICED);
+    counter.addRead("100_200|GeneB", "ACGTACGTAC", SPLICE_UNSPLICED);
+    counter.addRead("100_201|GeneA", "ACGTACGTAC", SPLICE_SPLICED);
+
+    uint64 spliced, unspliced, ambiguous;
+    collapseTotals(counter, {}, spliced, unspliced, ambiguous);
+    CHECK(spliced == 2);
+    CHECK(unspliced == 1);
+    CHECK(ambiguous == 1);
+}
+
+TEST_CASE("move the reads of corrected umis into the umi kept")
+{
+    VelocityCounter counter;
+    counter.addRead("100_200|GeneA", "ACGTACGTAC", SPLICE_SPLICED);
+    counter.addRead("100_200|GeneA", "ACGTACGTAA", SPLICE_UNSPLICED);
+    counter.addRead("100_200|GeneA", "GGGGGGGGGG", SPLICE_SPLICED);
+    UmiCorrect umi_correct = { { "100_200|GeneA", { { "ACGTACGTAA", "ACGTACGTAC" } } } };
+
+    uint64 spliced, unspliced, ambiguous;
+    collapseTotals(counter, umi_correct, spliced, unspliced, ambiguous);
+    CHECK(spliced == 1);
+    CHECK(unspliced == 0);
+    CHECK(ambiguous == 1);
+}
+
+TEST_CASE("follow the chain of umi corrections to its root")
+{
+    // Whichever of the corrections is moved first, all the reads end in the root
+    for (int order = 0; order < 2; ++order)
+    {
+        VelocityCounter counter;
+        counter.addRead("100_200|GeneA", "AAAAAAAAAA", SPLICE_SPLICED);
+        counter.addRead("100_200|GeneA", "AAAAAAAAAT", SPLICE_SPLICED);
+        counter.addRead("100_200|GeneA", "AAAAAAAATT", SPLICE_UNSPLICED);
+        UmiCorrect umi_correct;
+        auto&      correct = umi_correct["100_200|GeneA"];
+        if (order == 0)
+        {
+            correct["AAAAAAAATT"] = "AAAAAAAAAT";
+            correct["AAAAAAAAAT"] = "AAAAAAAAAA";
+        }
+        else
+        {
+            correct["AAAAAAAAAT"] = "AAAAAAAAAA";
+            correct["AAAAAAAATT"] = "AAAAAAAAAT";
+        }
+
+        uint64 spliced, unspliced, ambiguous;
+        collapseTotals(counter, umi_correct, spliced, unspliced, ambiguous);
+        CHECK(spliced == 0);
+        CHECK(unspliced == 0);
+        CHECK(ambiguous == 1);
+    }
+}